@@ -205,6 +205,218 @@ namespace Algebra
         return 4;
     }
 
+    int SolveQuadraticEquation(double a, double b, double c, double roots[2])
+    {
+        if (fabs(a) < TOLERANCE)
+        {
+            if (fabs(b) < TOLERANCE)
+            {
+                return 0;   // cannot divide by zero, so there is no solution.
+            }
+            // Simple linear equation: bx + c = 0, so x = -c/b.
+            roots[0] = -c / b;
+            return 1;
+        }
+
+        const double radicand = b*b - 4.0*a*c;
+        if (fabs(radicand) < TOLERANCE)
+        {
+            // Both roots have the same value: -b / 2a.
+            roots[0] = -b / (2.0 * a);
+            return 1;
+        }
+
+        if (radicand < 0.0)
+        {
+            // The roots are a complex conjugate pair.  The complex solver
+            // would still report them as real if their imaginary parts
+            // were too small to notice.
+            if (sqrt(-radicand) < 2.0 * TOLERANCE * fabs(a))
+            {
+                roots[0] = roots[1] = -b / (2.0 * a);
+                return 2;
+            }
+            return 0;
+        }
+
+        // The textbook formula (-b +/- r) / 2a loses most of its precision
+        // in whichever root subtracts two nearly equal numbers.  Instead
+        // find the root where b and r add in magnitude, and get the other
+        // from the product of the roots, which is c/a.
+        const double r = sqrt(radicand);
+        const double q = (b < 0.0) ? (r - b) / 2.0 : -(b + r) / 2.0;
+        roots[0] = q / a;
+        roots[1] = c / q;
+        return 2;
+    }
+
+    int SolveCubicEquation(double a, double b, double c, double d, double roots[3])
+    {
+        if (fabs(a) < TOLERANCE)
+        {
+            return SolveQuadraticEquation(b, c, d, roots);
+        }
+
+        b /= a;
+        c /= a;
+        d /= a;
+
+        // Substituting x = y - S removes the squared term, leaving
+        // y^3 - 3Qy + 2R = 0.
+        const double S = b / 3.0;
+        const double Q = (b*b - 3.0*c) / 9.0;
+        const double R = (2.0*b*b*b - 9.0*b*c + 27.0*d) / 54.0;
+        const double Q3 = Q*Q*Q;
+
+        if (R*R < Q3)
+        {
+            // Three distinct real roots, found with cosines
+            // rather than cube roots of complex numbers.
+            const double TWOPI = 2.0 * 3.141592653589793238462643383279502884;
+            const double theta = acos(R / sqrt(Q3));
+            const double m = -2.0 * sqrt(Q);
+            roots[0] = m * cos(theta / 3.0) - S;
+            roots[1] = m * cos((theta + TWOPI) / 3.0) - S;
+            roots[2] = m * cos((theta - TWOPI) / 3.0) - S;
+            return 3;
+        }
+
+        // One real root, plus a complex conjugate pair
+        // -(A+B)/2 - S +/- i(A-B)sqrt(3)/2 that is real only
+        // when A and B are (nearly) equal.  A takes the sign
+        // opposite R so that the sum inside the cube root
+        // never cancels.
+        double A = std::cbrt(fabs(R) + sqrt(R*R - Q3));
+        if (R > 0.0)
+        {
+            A = -A;
+        }
+        const double B = (A != 0.0) ? (Q / A) : 0.0;
+
+        roots[0] = (A + B) - S;
+        if (fabs(A - B) * (sqrt(3.0) / 2.0) < TOLERANCE)
+        {
+            roots[1] = roots[2] = -(A + B)/2.0 - S;
+            return 3;
+        }
+        return 1;
+    }
+
+    namespace
+    {
+        // Appends the real roots of x^2 + bx + c = 0 to 'roots' starting
+        // at 'count', and returns the new count.  A double root is
+        // appended twice, as the quartic solvers need.
+        int AppendMonicQuadraticRoots(double b, double c, double roots[], int count)
+        {
+            double radicand = b*b - 4.0*c;
+            if (radicand < 0.0)
+            {
+                if (radicand <= -TOLERANCE)
+                {
+                    return count;
+                }
+                radicand = 0.0;
+            }
+
+            const double r = sqrt(radicand);
+            const double q = (b < 0.0) ? (r - b) / 2.0 : -(b + r) / 2.0;
+            roots[count++] = q;
+            roots[count++] = (q != 0.0) ? (c / q) : 0.0;
+            return count;
+        }
+    }
+
+    int SolveQuarticEquation(double a, double b, double c, double d, double e, double roots[4])
+    {
+        if (fabs(a) < TOLERANCE)
+        {
+            return SolveCubicEquation(b, c, d, e, roots);
+        }
+
+        b /= a;
+        c /= a;
+        d /= a;
+        e /= a;
+
+        // Substituting x = y + t removes the cubed term, leaving
+        // y^4 + py^2 + qy + r = 0.
+        const double t  = -b / 4.0;
+        const double b2 = b * b;
+        const double p  = c - (3.0/8.0)*b2;
+        const double q  = b2*b/8.0 - b*c/2.0 + d;
+        const double r  = (-3.0/256.0)*b2*b2 + b2*c/16.0 - b*d/4.0 + e;
+
+        // Ferrari's method: for the largest root m of the resolvent
+        // cubic m^3 + pm^2 + (p^2/4 - r)m - q^2/8 = 0, which is positive
+        // whenever q is not zero, the quartic factors into
+        // (y^2 - sy + p/2 + m + q/2s) (y^2 + sy + p/2 + m - q/2s),
+        // where s = sqrt(2m).
+        double m = 0.0;
+        if (fabs(q) >= TOLERANCE)
+        {
+            double resolventRoots[3];
+            const int numResolventRoots = SolveCubicEquation(1.0, p, p*p/4.0 - r, -q*q/8.0, resolventRoots);
+            for (int i=0; i < numResolventRoots; ++i)
+            {
+                if (resolventRoots[i] > m)
+                {
+                    m = resolventRoots[i];
+                }
+            }
+        }
+
+        int numRoots = 0;
+        if (m > 0.0)
+        {
+            const double s = sqrt(2.0 * m);
+            const double h = p/2.0 + m;
+            const double k = q / (2.0 * s);
+            numRoots = AppendMonicQuadraticRoots(-s, h + k, roots, numRoots);
+            numRoots = AppendMonicQuadraticRoots(+s, h - k, roots, numRoots);
+        }
+        else
+        {
+            // With no odd power of y left, this is a quadratic
+            // equation in z = y^2.  Each root z >= 0 gives y = +/- sqrt(z).
+            double z[2];
+            const int numZ = AppendMonicQuadraticRoots(p, r, z, 0);
+            for (int i=0; i < numZ; ++i)
+            {
+                if (z[i] > -TOLERANCE)
+                {
+                    const double y = (z[i] > 0.0) ? sqrt(z[i]) : 0.0;
+                    roots[numRoots++] = +y;
+                    roots[numRoots++] = -y;
+                }
+            }
+        }
+
+        // Undo the substitution, then take one Newton step on the
+        // original polynomial to recover the precision lost in the
+        // resolvent and the substitution.  Near a double root the
+        // slope vanishes and the step can overshoot, so it is kept
+        // only if it brings the polynomial closer to zero.
+        for (int i=0; i < numRoots; ++i)
+        {
+            const double x = roots[i] + t;
+            const double f = (((x + b)*x + c)*x + d)*x + e;
+            const double slope = ((4.0*x + 3.0*b)*x + 2.0*c)*x + d;
+            roots[i] = x;
+            if (slope != 0.0)
+            {
+                const double polished = x - f/slope;
+                const double g = (((polished + b)*polished + c)*polished + d)*polished + e;
+                if (fabs(g) < fabs(f))
+                {
+                    roots[i] = polished;
+                }
+            }
+        }
+
+        return numRoots;
+    }
+
     void CheckRoots(int numRoots, const complex known[], const complex found[])
     {
         using namespace std;
@@ -9,6 +9,7 @@
 #define __DDC_ALGEBRA_H
 
 #include <complex>
+#include <cstddef>
 
 namespace Algebra
 {
@@ -83,62 +84,64 @@ namespace Algebra
         complex roots[4]);
 
 
-    inline int SolveQuadraticEquation(
+    // The real-coefficient solvers below find only the real roots,
+    // just as passing the coefficients to the complex solvers above and
+    // keeping the roots that FilterRealNumbers accepts would, but they
+    // never leave real arithmetic.  Each returns the number of roots it
+    // stored.  A root of multiplicity 2 is reported once by the quadratic
+    // solver and twice by the cubic and quartic solvers, as with the
+    // complex versions.  The roots are in no particular order.
+
+    int SolveQuadraticEquation(
         double a, 
         double b, 
         double c, 
-        double roots[2])
-    {
-        complex croots[2];
-
-        const int numComplexRoots = SolveQuadraticEquation(
-            complex(a), 
-            complex(b), 
-            complex(c), 
-            croots);
+        double roots[2]);
 
-        return FilterRealNumbers(numComplexRoots, croots, roots);
-    }
-
-    inline int SolveCubicEquation(
+    int SolveCubicEquation(
         double a, 
         double b, 
         double c, 
         double d, 
-        double roots[3])
-    {
-        complex croots[3];
+        double roots[3]);
 
-        const int numComplexRoots = SolveCubicEquation(
-            complex(a), 
-            complex(b), 
-            complex(c), 
-            complex(d), 
-            croots);
-
-        return FilterRealNumbers(numComplexRoots, croots, roots);
-    }
-
-    inline int SolveQuarticEquation(
+    int SolveQuarticEquation(
         double a, 
         double b, 
         double c, 
         double d, 
         double e, 
-        double roots[4])
-    {
-        complex croots[4];
-
-        const int numComplexRoots = SolveQuarticEquation(
-            complex(a), 
-            complex(b), 
-            complex(c), 
-            complex(d), 
-            complex(e), 
-            croots);
-
-        return FilterRealNumbers(numComplexRoots, croots, roots);
-    }
+        double roots[4]);
+
+    // Batch solvers for many equations at once, as when every ray in a
+    // packet meets the same curved surface.  Equation k has coefficients
+    // a[k], b[k], ... from the highest power down.  Its real roots are
+    // stored in ascending order at roots[3*k] (cubic) or roots[4*k]
+    // (quartic) onward, numRoots[k] of them, and the remaining entries
+    // for that equation are set to HUGE_VAL, so the first root past some
+    // minimum is the closest hit along a ray.  On processors with AVX2,
+    // four equations are solved together in vector registers; otherwise
+    // each is passed to the solvers above.  Either way the roots agree
+    // with the single-equation solvers to within rounding.
+
+    void SolveCubicEquations(
+        size_t count,
+        const double a[], 
+        const double b[], 
+        const double c[], 
+        const double d[], 
+        double roots[],
+        int numRoots[]);
+
+    void SolveQuarticEquations(
+        size_t count,
+        const double a[], 
+        const double b[], 
+        const double c[], 
+        const double d[], 
+        const double e[], 
+        double roots[],
+        int numRoots[]);
 
 }
 
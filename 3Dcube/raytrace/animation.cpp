@@ -0,0 +1,166 @@
+/*
+    animation.cpp
+
+    Implements class Animation, which renders keyframed
+    sequences of images from a single persistent Scene.
+*/
+
+#include <cstdio>
+#include "animation.h"
+#include "timer.h"
+
+namespace Imager
+{
+    void Animation::AddKeyframe(
+        SolidObject& solid,
+        size_t frame,
+        const Vector& center,
+        double angleX,
+        double angleY,
+        double angleZ)
+    {
+        // Find the track for this solid, creating it if necessary.
+        TrackList::iterator track = trackList.begin();
+        for (; track != trackList.end(); ++track)
+        {
+            if (track->solid == &solid)
+            {
+                break;
+            }
+        }
+
+        if (track == trackList.end())
+        {
+            trackList.push_back(Track(&solid));
+            track = trackList.end() - 1;
+        }
+
+        // Keep the keyframes sorted by frame number,
+        // replacing any existing keyframe at the same frame.
+        const Keyframe keyframe(frame, Pose(center, angleX, angleY, angleZ));
+        KeyframeList& list = track->keyframeList;
+        KeyframeList::iterator iter = list.begin();
+        while ((iter != list.end()) && (iter->frame < frame))
+        {
+            ++iter;
+        }
+
+        if ((iter != list.end()) && (iter->frame == frame))
+        {
+            *iter = keyframe;
+        }
+        else
+        {
+            list.insert(iter, keyframe);
+        }
+    }
+
+    Pose Animation::Track::Interpolate(size_t frame) const
+    {
+        if (frame <= keyframeList.front().frame)
+        {
+            return keyframeList.front().pose;
+        }
+
+        for (size_t k=1; k < keyframeList.size(); ++k)
+        {
+            const Keyframe& next = keyframeList[k];
+            if (frame <= next.frame)
+            {
+                const Keyframe& prev = keyframeList[k-1];
+                const double f =
+                    static_cast<double>(frame - prev.frame) /
+                    static_cast<double>(next.frame - prev.frame);
+
+                return Pose(
+                    prev.pose.center + f*(next.pose.center - prev.pose.center),
+                    prev.pose.angleX + f*(next.pose.angleX - prev.pose.angleX),
+                    prev.pose.angleY + f*(next.pose.angleY - prev.pose.angleY),
+                    prev.pose.angleZ + f*(next.pose.angleZ - prev.pose.angleZ));
+            }
+        }
+
+        return keyframeList.back().pose;
+    }
+
+    // Moves and rotates the solid from the applied pose to the requested one.
+    // Returns true if anything had to change.
+    bool Animation::Track::Apply(const Pose& pose)
+    {
+        bool changed = false;
+
+        if ((pose.angleX != applied.angleX) ||
+            (pose.angleY != applied.angleY) ||
+            (pose.angleZ != applied.angleZ))
+        {
+            // Rotations about different axes do not commute, so the
+            // previous rotations are undone in reverse order before
+            // the new ones are applied.  Each rotation is about the
+            // solid's own center, so translation is unaffected.
+            if (applied.angleZ != 0.0) solid->RotateZ(-applied.angleZ);
+            if (applied.angleY != 0.0) solid->RotateY(-applied.angleY);
+            if (applied.angleX != 0.0) solid->RotateX(-applied.angleX);
+
+            if (pose.angleX != 0.0) solid->RotateX(pose.angleX);
+            if (pose.angleY != 0.0) solid->RotateY(pose.angleY);
+            if (pose.angleZ != 0.0) solid->RotateZ(pose.angleZ);
+
+            changed = true;
+        }
+
+        if ((pose.center.x != applied.center.x) ||
+            (pose.center.y != applied.center.y) ||
+            (pose.center.z != applied.center.z))
+        {
+            solid->Move(pose.center);
+            changed = true;
+        }
+
+        applied = pose;
+        return changed;
+    }
+
+    size_t Animation::SetFrame(size_t frame)
+    {
+        size_t numChanged = 0;
+        TrackList::iterator iter = trackList.begin();
+        TrackList::iterator end  = trackList.end();
+        for (; iter != end; ++iter)
+        {
+            if (iter->Apply(iter->Interpolate(frame)))
+            {
+                ++numChanged;
+            }
+        }
+        return numChanged;
+    }
+
+    void Animation::Render(
+        const char *filenameFormat,
+        size_t numFrames,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        double zoom,
+        size_t antiAliasFactor)
+    {
+        poseSeconds  = 0.0;
+        traceSeconds = 0.0;
+
+        char filename[1024];
+        for (size_t frame=0; frame < numFrames; ++frame)
+        {
+            double start = WallClockSeconds();
+            SetFrame(frame);
+            poseSeconds += WallClockSeconds() - start;
+
+            snprintf(filename, sizeof(filename), filenameFormat, static_cast<unsigned>(frame));
+
+            // The scene keeps its image buffers between calls,
+            // so every frame after the first renders without
+            // reallocating them.
+            start = WallClockSeconds();
+            scene.SaveImage(filename, pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+            traceSeconds += WallClockSeconds() - start;
+        }
+    }
+}
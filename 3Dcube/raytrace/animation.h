@@ -0,0 +1,126 @@
+/*
+    animation.h
+
+    Renders a sequence of frames from one persistent Scene.
+    Solids are moved and rotated between frames according to
+    keyframes, and only solids whose pose actually changes from
+    one frame to the next are touched.
+*/
+
+#ifndef __DDC_ANIMATION_H
+#define __DDC_ANIMATION_H
+
+#include <vector>
+#include "imager.h"
+
+namespace Imager
+{
+    // The placement of a solid at some frame: where its center is, and
+    // how far it has been rotated about the x, y, and z axes (applied in
+    // that order) relative to its orientation when it was first animated.
+    struct Pose
+    {
+        Vector center;
+        double angleX;
+        double angleY;
+        double angleZ;
+
+        Pose()
+            : center()
+            , angleX(0.0)
+            , angleY(0.0)
+            , angleZ(0.0)
+        {
+        }
+
+        Pose(const Vector& _center, double _angleX, double _angleY, double _angleZ)
+            : center(_center)
+            , angleX(_angleX)
+            , angleY(_angleY)
+            , angleZ(_angleZ)
+        {
+        }
+    };
+
+    class Animation
+    {
+    public:
+        // The animation moves solids that belong to 'scene',
+        // which must outlive the Animation object.
+        explicit Animation(Scene& _scene)
+            : scene(_scene)
+            , poseSeconds(0.0)
+            , traceSeconds(0.0)
+        {
+        }
+
+        // Requests that 'solid' have the given pose at 'frame'.
+        // Between keyframes the pose is interpolated linearly;
+        // before the first and after the last keyframe it is held.
+        void AddKeyframe(
+            SolidObject& solid,
+            size_t frame,
+            const Vector& center,
+            double angleX,
+            double angleY,
+            double angleZ);
+
+        // Poses every animated solid for the given frame.
+        // Returns the number of solids that had to be updated.
+        size_t SetFrame(size_t frame);
+
+        // Renders frames 0 .. numFrames-1.  'filenameFormat' is a
+        // printf-style pattern with one unsigned conversion for the
+        // frame number, e.g. "../output/spin_%03u.png".
+        void Render(
+            const char *filenameFormat,
+            size_t numFrames,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            double zoom,
+            size_t antiAliasFactor);
+
+        // Seconds spent posing solids and tracing images by the most recent Render.
+        double PoseSeconds()  const { return poseSeconds;  }
+        double TraceSeconds() const { return traceSeconds; }
+
+    private:
+        struct Keyframe
+        {
+            size_t frame;
+            Pose   pose;
+
+            Keyframe(size_t _frame, const Pose& _pose)
+                : frame(_frame)
+                , pose(_pose)
+            {
+            }
+        };
+        typedef std::vector<Keyframe> KeyframeList;
+
+        struct Track
+        {
+            SolidObject* solid;
+            KeyframeList keyframeList;  // sorted by frame
+            Pose applied;               // pose the solid is currently in
+
+            explicit Track(SolidObject* _solid)
+                : solid(_solid)
+                , keyframeList()
+                , applied(_solid->Center(), 0.0, 0.0, 0.0)
+            {
+            }
+
+            Pose Interpolate(size_t frame) const;
+            bool Apply(const Pose& pose);
+        };
+        typedef std::vector<Track> TrackList;
+
+        Scene& scene;
+        TrackList trackList;
+        double poseSeconds;
+        double traceSeconds;
+    };
+}
+
+#endif // __DDC_ANIMATION_H
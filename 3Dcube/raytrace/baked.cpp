@@ -0,0 +1,546 @@
+/*
+    baked.cpp
+
+    Writes and memory-maps baked scene files (see baked.h).
+*/
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "baked.h"
+#include "fingerprint.h"
+
+namespace Imager
+{
+    MappedFile::MappedFile(const char *filename)
+        : data(NULL)
+        , size(0)
+    {
+        const int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            throw ImagerException("Cannot open baked scene file.");
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0)
+        {
+            close(fd);
+            throw ImagerException("Cannot determine size of baked scene file.");
+        }
+
+        size = static_cast<size_t>(info.st_size);
+        void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);      // the mapping stays valid after the descriptor is closed
+
+        if (address == MAP_FAILED)
+        {
+            throw ImagerException("Cannot map baked scene file into memory.");
+        }
+        data = static_cast<const unsigned char*>(address);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        munmap(const_cast<unsigned char*>(data), size);
+        data = NULL;
+        size = 0;
+    }
+
+    namespace
+    {
+        // Verifies that an array of 'count' records of 'recordSize' bytes
+        // starting at 'offset' lies entirely inside the mapped file.
+        bool IsValidSection(
+            const MappedFile& file,
+            uint64_t offset,
+            uint64_t count,
+            uint64_t recordSize)
+        {
+            if ((offset % 8) != 0 || offset > file.Size())
+            {
+                return false;
+            }
+            return count <= (file.Size() - offset) / recordSize;
+        }
+
+        inline Vector MakeVector(const double v[3])
+        {
+            return Vector(v[0], v[1], v[2]);
+        }
+
+        inline void StoreVector(double v[3], const Vector& vector)
+        {
+            v[0] = vector.x;
+            v[1] = vector.y;
+            v[2] = vector.z;
+        }
+
+        inline void StoreColor(double c[3], const Color& color)
+        {
+            c[0] = color.red;
+            c[1] = color.green;
+            c[2] = color.blue;
+        }
+
+        // Appends the entry and exit points of the ray through one cuboid,
+        // using the slab method in the cuboid's own coordinate system.
+        // 'vantage' is relative to the field's baked origin, which
+        // lies at 'fieldCenter' in camera space.
+        void AppendCuboidIntersections(
+            const BakedCuboid& cuboid,
+            const SolidObject* field,
+            const Vector& fieldCenter,
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList)
+        {
+            const Vector rDir = MakeVector(cuboid.rDir);
+            const Vector sDir = MakeVector(cuboid.sDir);
+            const Vector tDir = MakeVector(cuboid.tDir);
+
+            const Vector disp = vantage - MakeVector(cuboid.center);
+            const double origin[3] =
+            {
+                DotProduct(disp, rDir),
+                DotProduct(disp, sDir),
+                DotProduct(disp, tDir)
+            };
+            const double dir[3] =
+            {
+                DotProduct(direction, rDir),
+                DotProduct(direction, sDir),
+                DotProduct(direction, tDir)
+            };
+
+            double uNear = -1.0e+30;
+            double uFar  = +1.0e+30;
+            int nearAxis = -1;
+            int farAxis  = -1;
+            for (int k=0; k < 3; ++k)
+            {
+                if (fabs(dir[k]) > EPSILON)
+                {
+                    double u1 = (-cuboid.extent[k] - origin[k]) / dir[k];
+                    double u2 = (+cuboid.extent[k] - origin[k]) / dir[k];
+                    if (u1 > u2)
+                    {
+                        const double swap = u1;
+                        u1 = u2;
+                        u2 = swap;
+                    }
+                    if (u1 > uNear)
+                    {
+                        uNear = u1;
+                        nearAxis = k;
+                    }
+                    if (u2 < uFar)
+                    {
+                        uFar = u2;
+                        farAxis = k;
+                    }
+                    if (uNear > uFar)
+                    {
+                        return;
+                    }
+                }
+                else if (fabs(origin[k]) > cuboid.extent[k])
+                {
+                    // The ray runs parallel to this pair of faces, outside them.
+                    return;
+                }
+            }
+
+            const Vector* axes[3] = { &rDir, &sDir, &tDir };
+            Intersection intersection;
+            intersection.solid = field;
+            intersection.context = &cuboid;
+
+            if (nearAxis >= 0 && uNear > EPSILON)
+            {
+                // Entering: the normal opposes the ray along the struck axis.
+                const double sign = (dir[nearAxis] > 0.0) ? -1.0 : +1.0;
+                const Vector displacement = uNear * direction;
+                intersection.distanceSquared = displacement.MagnitudeSquared();
+                intersection.point = vantage + displacement + fieldCenter;
+                intersection.surfaceNormal = sign * (*axes[nearAxis]);
+                intersection.tag = "baked cuboid entry";
+                intersectionList.push_back(intersection);
+            }
+
+            if (farAxis >= 0 && uFar > EPSILON)
+            {
+                // Exiting: the normal agrees with the ray along the struck axis.
+                const double sign = (dir[farAxis] > 0.0) ? +1.0 : -1.0;
+                const Vector displacement = uFar * direction;
+                intersection.distanceSquared = displacement.MagnitudeSquared();
+                intersection.point = vantage + displacement + fieldCenter;
+                intersection.surfaceNormal = sign * (*axes[farAxis]);
+                intersection.tag = "baked cuboid exit";
+                intersectionList.push_back(intersection);
+            }
+        }
+
+        // Adds the intersections with every record in a leaf to the caller's list.
+        class LeafIntersector
+        {
+        public:
+            LeafIntersector(
+                const BakedCuboid* _cuboids,
+                const SolidObject* _field,
+                const Vector& _fieldCenter,
+                const Vector& _vantage,
+                const Vector& _direction,
+                IntersectionList& _intersectionList)
+                    : cuboids(_cuboids)
+                    , field(_field)
+                    , fieldCenter(_fieldCenter)
+                    , vantage(_vantage)
+                    , direction(_direction)
+                    , intersectionList(_intersectionList)
+            {
+            }
+
+            void operator() (uint32_t first, uint32_t count)
+            {
+                for (uint32_t k = first; k < first + count; ++k)
+                {
+                    AppendCuboidIntersections(
+                        cuboids[k],
+                        field,
+                        fieldCenter,
+                        vantage,
+                        direction,
+                        intersectionList);
+                }
+            }
+
+        private:
+            const BakedCuboid* cuboids;
+            const SolidObject* field;
+            const Vector& fieldCenter;
+            const Vector& vantage;
+            const Vector& direction;
+            IntersectionList& intersectionList;
+        };
+
+        inline bool CuboidContains(const BakedCuboid& cuboid, const Vector& point)
+        {
+            const Vector disp = point - MakeVector(cuboid.center);
+            return
+                (fabs(DotProduct(disp, MakeVector(cuboid.rDir))) <= cuboid.extent[0] + EPSILON) &&
+                (fabs(DotProduct(disp, MakeVector(cuboid.sDir))) <= cuboid.extent[1] + EPSILON) &&
+                (fabs(DotProduct(disp, MakeVector(cuboid.tDir))) <= cuboid.extent[2] + EPSILON);
+        }
+
+        class LeafContainment
+        {
+        public:
+            LeafContainment(const BakedCuboid* _cuboids, const Vector& _point)
+                : cuboids(_cuboids)
+                , point(_point)
+                , found(false)
+            {
+            }
+
+            bool operator() (uint32_t first, uint32_t count)
+            {
+                for (uint32_t k = first; k < first + count; ++k)
+                {
+                    if (CuboidContains(cuboids[k], point))
+                    {
+                        found = true;
+                        break;
+                    }
+                }
+                return found;
+            }
+
+            bool Found() const { return found; }
+
+        private:
+            const BakedCuboid* cuboids;
+            const Vector& point;
+            bool found;
+        };
+    }
+
+    BakedCuboidField::BakedCuboidField(const char *filename)
+        : SolidObject()
+        , file(filename)
+        , header(NULL)
+        , cuboids(NULL)
+        , nodes(NULL)
+        , lights(NULL)
+        , contentDigest()
+        , hasContentDigest(false)
+    {
+        SetTag("BakedCuboidField");
+
+        // Every record carries its own optics, found through the
+        // intersection context.
+        UseProceduralOptics();
+
+        if (file.Size() < sizeof(BakedSceneHeader))
+        {
+            throw ImagerException("Baked scene file is too small.");
+        }
+
+        header = reinterpret_cast<const BakedSceneHeader*>(file.Data());
+        if (memcmp(header->magic, BAKED_SCENE_MAGIC, sizeof(BAKED_SCENE_MAGIC)) != 0)
+        {
+            throw ImagerException("Not a baked scene file.");
+        }
+
+        if (header->version != BAKED_SCENE_VERSION ||
+            header->headerSize != sizeof(BakedSceneHeader))
+        {
+            throw ImagerException("Unsupported baked scene file version.");
+        }
+
+        if (!IsValidSection(file, header->cuboidOffset, header->cuboidCount, sizeof(BakedCuboid)) ||
+            !IsValidSection(file, header->nodeOffset,   header->nodeCount,   sizeof(BvhNode)) ||
+            !IsValidSection(file, header->lightOffset,  header->lightCount,  sizeof(BakedLight)) ||
+            (header->cuboidCount > 0 && header->nodeCount == 0))
+        {
+            throw ImagerException("Corrupt baked scene file.");
+        }
+
+        cuboids = reinterpret_cast<const BakedCuboid*>(file.Data() + header->cuboidOffset);
+        nodes   = reinterpret_cast<const BvhNode*>    (file.Data() + header->nodeOffset);
+        lights  = reinterpret_cast<const BakedLight*> (file.Data() + header->lightOffset);
+
+        // The hierarchy is walked without any bounds checks while
+        // rendering, so a damaged one must be rejected here.
+        if (header->cuboidCount > 0 &&
+            !IsValidBoundingVolumeHierarchy(nodes, header->nodeCount, header->cuboidCount))
+        {
+            throw ImagerException("Corrupt bounding volume hierarchy in baked scene file.");
+        }
+
+        SetRefraction(header->refractiveIndex);
+    }
+
+    BakedCuboidField::~BakedCuboidField()
+    {
+    }
+
+    void BakedCuboidField::AppendAllIntersections(
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList) const
+    {
+        if (header->cuboidCount > 0)
+        {
+            // The records were baked around the origin; moving the field
+            // is the same as moving the vantage point the opposite way.
+            const Vector localVantage = vantage - Center();
+            LeafIntersector visit(
+                cuboids,
+                this,
+                Center(),
+                localVantage,
+                direction,
+                intersectionList);
+
+            TraverseBvh(nodes, localVantage, direction, visit);
+        }
+    }
+
+    bool BakedCuboidField::Contains(const Vector& point) const
+    {
+        if (header->cuboidCount == 0)
+        {
+            return false;
+        }
+
+        LeafContainment visit(cuboids, point - Center());
+        QueryBvhPoint(nodes, point - Center(), visit);
+        return visit.Found();
+    }
+
+    Optics BakedCuboidField::SurfaceOptics(
+        const Vector& surfacePoint,
+        const void *context) const
+    {
+        const BakedCuboid& cuboid = *static_cast<const BakedCuboid*>(context);
+        return Optics(
+            Color(cuboid.matteColor[0], cuboid.matteColor[1], cuboid.matteColor[2]),
+            Color(cuboid.glossColor[0], cuboid.glossColor[1], cuboid.glossColor[2]),
+            cuboid.opacity);
+    }
+
+    bool BakedCuboidField::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        if (!hasContentDigest)
+        {
+            Fingerprint content;
+            content.AddBytes(file.Data(), file.Size());
+            contentDigest = content.Digest();
+            hasContentDigest = true;
+        }
+
+        AppendCommonFingerprint(fingerprint);
+        fingerprint.AddDigest(contentDigest);
+        return true;
+    }
+
+    SolidObject& BakedCuboidField::RotateX(double angleInDegrees)
+    {
+        throw ImagerException("Cannot rotate a baked cuboid field.");
+    }
+
+    SolidObject& BakedCuboidField::RotateY(double angleInDegrees)
+    {
+        throw ImagerException("Cannot rotate a baked cuboid field.");
+    }
+
+    SolidObject& BakedCuboidField::RotateZ(double angleInDegrees)
+    {
+        throw ImagerException("Cannot rotate a baked cuboid field.");
+    }
+
+    void Scene::SaveBakedScene(const char *filename) const
+    {
+        // Collect the cuboids and their camera-space bounding boxes.
+        std::vector<const Cuboid*> cuboidList;
+        std::vector<BoundingBox> boxes;
+        double refractiveIndex = REFRACTION_GLASS;
+
+        SolidObjectList::const_iterator iter = solidObjectList.begin();
+        SolidObjectList::const_iterator end  = solidObjectList.end();
+        for (; iter != end; ++iter)
+        {
+            const Cuboid* cuboid = dynamic_cast<const Cuboid*>(*iter);
+            if (cuboid == NULL)
+            {
+                throw ImagerException("Only Cuboid solids can be baked.");
+            }
+
+            if (cuboidList.empty())
+            {
+                refractiveIndex = cuboid->GetRefractiveIndex();
+            }
+            else if (cuboid->GetRefractiveIndex() != refractiveIndex)
+            {
+                throw ImagerException("Baked cuboids must share one refractive index.");
+            }
+
+            Vector rDir, sDir, tDir;
+            cuboid->GetOrientation(rDir, sDir, tDir);
+
+            // The object's r, s, t axes expressed in camera space are the
+            // columns of the rotation, so each camera axis sees the sum of
+            // the projected half-extents.
+            const double a = cuboid->GetHalfWidth();
+            const double b = cuboid->GetHalfLength();
+            const double c = cuboid->GetHalfHeight();
+            const Vector halfSize(
+                a*fabs(rDir.x) + b*fabs(sDir.x) + c*fabs(tDir.x) + EPSILON,
+                a*fabs(rDir.y) + b*fabs(sDir.y) + c*fabs(tDir.y) + EPSILON,
+                a*fabs(rDir.z) + b*fabs(sDir.z) + c*fabs(tDir.z) + EPSILON);
+
+            cuboidList.push_back(cuboid);
+            boxes.push_back(BoundingBox(
+                cuboid->Center() - halfSize,
+                cuboid->Center() + halfSize));
+        }
+
+        std::vector<size_t> order;
+        std::vector<BvhNode> nodes;
+        BuildBoundingVolumeHierarchy(boxes, order, nodes);
+
+        BakedSceneHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BAKED_SCENE_MAGIC, sizeof(BAKED_SCENE_MAGIC));
+        header.version      = BAKED_SCENE_VERSION;
+        header.headerSize   = sizeof(BakedSceneHeader);
+        header.cuboidCount  = cuboidList.size();
+        header.cuboidOffset = sizeof(BakedSceneHeader);
+        header.nodeCount    = nodes.size();
+        header.nodeOffset   = header.cuboidOffset + header.cuboidCount * sizeof(BakedCuboid);
+        header.lightCount   = lightSourceList.size();
+        header.lightOffset  = header.nodeOffset + header.nodeCount * sizeof(BvhNode);
+        StoreColor(header.backgroundColor, backgroundColor);
+        header.ambientRefraction = ambientRefraction;
+        header.refractiveIndex   = refractiveIndex;
+
+        std::ofstream outfile(filename, std::ios::out | std::ios::binary);
+        if (!outfile)
+        {
+            throw ImagerException("Cannot create baked scene file.");
+        }
+
+        outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        for (size_t k=0; k < order.size(); ++k)
+        {
+            const Cuboid& cuboid = *cuboidList[order[k]];
+            const Optics& optics = cuboid.GetUniformOptics();
+
+            Vector rDir, sDir, tDir;
+            cuboid.GetOrientation(rDir, sDir, tDir);
+
+            BakedCuboid record;
+            StoreVector(record.center, cuboid.Center());
+            StoreVector(record.rDir, rDir);
+            StoreVector(record.sDir, sDir);
+            StoreVector(record.tDir, tDir);
+            record.extent[0] = cuboid.GetHalfWidth();
+            record.extent[1] = cuboid.GetHalfLength();
+            record.extent[2] = cuboid.GetHalfHeight();
+            StoreColor(record.matteColor, optics.GetMatteColor());
+            StoreColor(record.glossColor, optics.GetGlossColor());
+            record.opacity = optics.GetOpacity();
+
+            outfile.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+
+        if (!nodes.empty())
+        {
+            outfile.write(
+                reinterpret_cast<const char*>(&nodes[0]),
+                nodes.size() * sizeof(BvhNode));
+        }
+
+        LightSourceList::const_iterator liter = lightSourceList.begin();
+        LightSourceList::const_iterator lend  = lightSourceList.end();
+        for (; liter != lend; ++liter)
+        {
+            BakedLight light;
+            StoreVector(light.location, liter->location);
+            StoreColor(light.color, liter->color);
+            outfile.write(reinterpret_cast<const char*>(&light), sizeof(light));
+        }
+
+        if (!outfile)
+        {
+            throw ImagerException("Error writing baked scene file.");
+        }
+    }
+
+    void Scene::LoadBakedScene(const char *filename)
+    {
+        BakedCuboidField* field = new BakedCuboidField(filename);
+        AddSolidObject(field);
+
+        const BakedSceneHeader& header = field->Header();
+        SetBackgroundColor(Color(
+            header.backgroundColor[0],
+            header.backgroundColor[1],
+            header.backgroundColor[2]));
+        SetAmbientRefraction(header.ambientRefraction);
+
+        const BakedLight* lights = field->Lights();
+        for (uint64_t k=0; k < header.lightCount; ++k)
+        {
+            AddLightSource(LightSource(
+                MakeVector(lights[k].location),
+                Color(lights[k].color[0], lights[k].color[1], lights[k].color[2])));
+        }
+    }
+}
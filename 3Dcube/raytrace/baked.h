@@ -0,0 +1,130 @@
+/*
+    baked.h
+
+    A compact binary scene format for large fields of cuboids.
+
+    A baked scene file holds fixed-size records whose orientation bases,
+    centers, extents, and optics are already computed, followed by a
+    bounding volume hierarchy over those records.  Loading a file maps it
+    into memory and traces the records in place, so no SolidObject
+    constructors, RotateX/Y/Z calls, or parsing are needed at load time.
+
+    File layout (native byte order, all offsets 8-byte aligned):
+
+        BakedSceneHeader
+        BakedCuboid[cuboidCount]    in hierarchy leaf order
+        BvhNode[nodeCount]
+        BakedLight[lightCount]
+*/
+
+#ifndef __DDC_BAKED_H
+#define __DDC_BAKED_H
+
+#include <stdint.h>
+#include "imager.h"
+#include "bvh.h"
+#include "fingerprint.h"
+
+namespace Imager
+{
+    const char     BAKED_SCENE_MAGIC[8]  = { 'C','U','B','E','3','D','S','C' };
+    const uint32_t BAKED_SCENE_VERSION   = 1;
+
+    struct BakedSceneHeader
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint64_t cuboidCount;
+        uint64_t cuboidOffset;
+        uint64_t nodeCount;
+        uint64_t nodeOffset;
+        uint64_t lightCount;
+        uint64_t lightOffset;
+        double   backgroundColor[3];
+        double   ambientRefraction;
+        double   refractiveIndex;       // shared by every cuboid in the field
+    };
+
+    struct BakedCuboid
+    {
+        double center[3];
+        double rDir[3];         // camera-to-object rotation, row by row
+        double sDir[3];
+        double tDir[3];
+        double extent[3];       // half of the width, length, and height
+        double matteColor[3];
+        double glossColor[3];
+        double opacity;
+    };
+
+    struct BakedLight
+    {
+        double location[3];
+        double color[3];
+    };
+
+    // Read-only memory mapping of an entire file.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const char *filename);
+        ~MappedFile();
+
+        const unsigned char* Data() const { return data; }
+        size_t Size() const { return size; }
+
+    private:
+        MappedFile(const MappedFile&);              // not copyable
+        MappedFile& operator= (const MappedFile&);
+
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // A single SolidObject that stands for every cuboid in a baked file.
+    // The intersection context points at the record that was struck,
+    // which lets each cuboid keep its own optics.
+    class BakedCuboidField: public SolidObject
+    {
+    public:
+        explicit BakedCuboidField(const char *filename);
+        virtual ~BakedCuboidField();
+
+        virtual void AppendAllIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const;
+
+        virtual bool Contains(const Vector& point) const;
+
+        virtual Optics SurfaceOptics(
+            const Vector& surfacePoint,
+            const void *context) const;
+
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const;
+
+        // The records are fixed in the file, so the field can be moved as
+        // a whole but its cuboids cannot be rotated.
+        virtual SolidObject& RotateX(double angleInDegrees);
+        virtual SolidObject& RotateY(double angleInDegrees);
+        virtual SolidObject& RotateZ(double angleInDegrees);
+
+        const BakedSceneHeader& Header() const { return *header; }
+        const BakedLight* Lights() const { return lights; }
+
+    private:
+        MappedFile file;
+        const BakedSceneHeader* header;
+        const BakedCuboid* cuboids;
+        const BvhNode* nodes;
+        const BakedLight* lights;
+
+        // Digest of the whole file, computed the first time it is needed
+        // so that loading stays free of any pass over the records.
+        mutable FingerprintDigest contentDigest;
+        mutable bool hasContentDigest;
+    };
+}
+
+#endif // __DDC_BAKED_H
@@ -0,0 +1,490 @@
+/*
+    batchsolve.cpp
+
+    Implements the batch cubic and quartic solvers declared in algebra.h.
+
+    The single-equation solvers branch on what kind of roots an equation
+    has and call acos, cos, and cbrt, none of which have vector forms.
+    Here every equation goes through the same straight-line steps, so
+    four equations can share each AVX2 instruction:
+
+    - One real root of a cubic is found by Newton's method, starting
+      from Fujiwara's bound on the size of its roots on whichever side
+      lets Newton's method reach a root without ever overshooting.
+    - Dividing that root out leaves a quadratic for the other two.
+    - A quartic becomes a cubic through Ferrari's method, and a positive
+      root of that cubic factors the quartic into two quadratics.
+    - Every root gets one Newton step on the original polynomial, and
+      a sorting network puts each equation's roots in ascending order.
+
+    Equations whose leading coefficient is (nearly) zero are really of
+    lower degree, so they are handed to the single-equation solvers.
+*/
+
+#include <cmath>
+#include "algebra.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALGEBRA_HAVE_AVX2 1
+#include <immintrin.h>
+// Compiles one function for AVX2 and FMA, whatever the rest of the
+// program is compiled for.  It must only run if the processor has them.
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#else
+#define ALGEBRA_HAVE_AVX2 0
+#endif
+
+namespace Algebra
+{
+    namespace
+    {
+        // Sorts the roots of one equation into ascending order
+        // and fills its unused entries with HUGE_VAL.
+        void FinishRoots(int numRoots, int stride, double roots[])
+        {
+            for (int i=1; i < numRoots; ++i)
+            {
+                const double x = roots[i];
+                int k = i;
+                for (; k > 0 && roots[k-1] > x; --k)
+                {
+                    roots[k] = roots[k-1];
+                }
+                roots[k] = x;
+            }
+            for (int i=numRoots; i < stride; ++i)
+            {
+                roots[i] = HUGE_VAL;
+            }
+        }
+
+        void SolveCubicOneByOne(
+            size_t k,
+            const double a[], const double b[], const double c[], const double d[],
+            double roots[], int numRoots[])
+        {
+            numRoots[k] = SolveCubicEquation(a[k], b[k], c[k], d[k], &roots[3*k]);
+            FinishRoots(numRoots[k], 3, &roots[3*k]);
+        }
+
+        void SolveQuarticOneByOne(
+            size_t k,
+            const double a[], const double b[], const double c[], const double d[], const double e[],
+            double roots[], int numRoots[])
+        {
+            numRoots[k] = SolveQuarticEquation(a[k], b[k], c[k], d[k], e[k], &roots[4*k]);
+            FinishRoots(numRoots[k], 4, &roots[4*k]);
+        }
+
+#if ALGEBRA_HAVE_AVX2
+        bool CanUseAvx2()
+        {
+            static const bool supported =
+                __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            return supported;
+        }
+
+        // Four equations' worth of one quantity, one per lane.
+        typedef __m256d Lanes;
+
+        AVX2_TARGET inline Lanes Broadcast(double x)
+        {
+            return _mm256_set1_pd(x);
+        }
+
+        AVX2_TARGET inline Lanes Abs(Lanes x)
+        {
+            return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+        }
+
+        AVX2_TARGET inline Lanes Less(Lanes x, Lanes y)
+        {
+            return _mm256_cmp_pd(x, y, _CMP_LT_OQ);
+        }
+
+        AVX2_TARGET inline Lanes Select(Lanes mask, Lanes ifTrue, Lanes ifFalse)
+        {
+            return _mm256_blendv_pd(ifFalse, ifTrue, mask);
+        }
+
+        AVX2_TARGET inline void CompareSwap(Lanes& low, Lanes& high)
+        {
+            const Lanes smaller = _mm256_min_pd(low, high);
+            high = _mm256_max_pd(low, high);
+            low = smaller;
+        }
+
+        // Returns a number no smaller than the cube root of x >= 0.
+        // Dividing the bits of a float by 3 approximately takes the cube
+        // root of its exponent and mantissa alike; one Newton step then
+        // lands on or above the true cube root, because the mean of
+        // y, y, and x/y^2 is never less than the cube root of x.
+        AVX2_TARGET inline Lanes CubeRootUpperBound(Lanes x)
+        {
+            const __m128 single = _mm256_cvtpd_ps(_mm256_min_pd(x, Broadcast(1.0e+30)));
+            const __m128i bits = _mm_castps_si128(single);
+            const __m128 third = _mm_mul_ps(_mm_cvtepi32_ps(bits), _mm_set1_ps(1.0f / 3.0f));
+            const __m128i guessBits = _mm_add_epi32(_mm_cvttps_epi32(third), _mm_set1_epi32(709921077));
+            const Lanes y = _mm256_cvtps_pd(_mm_castsi128_ps(guessBits));
+            return _mm256_div_pd(_mm256_fmadd_pd(Broadcast(2.0), y, _mm256_div_pd(x, _mm256_mul_pd(y, y))), Broadcast(3.0));
+        }
+
+        AVX2_TARGET inline Lanes EvaluateCubic(Lanes x, Lanes B, Lanes C, Lanes D)
+        {
+            return _mm256_fmadd_pd(_mm256_fmadd_pd(_mm256_add_pd(x, B), x, C), x, D);
+        }
+
+        AVX2_TARGET inline Lanes EvaluateQuartic(Lanes x, Lanes B, Lanes C, Lanes D, Lanes E)
+        {
+            return _mm256_fmadd_pd(EvaluateCubic(x, B, C, D), x, E);
+        }
+
+        // One real root of x^3 + Bx^2 + Cx + D = 0 in each lane.
+        // Every root is within U = 2 max(|B|, |C|^(1/2), |D/2|^(1/3)) of
+        // zero (Fujiwara), and the cubic is convex to the right of its
+        // inflection point at -B/3 and concave to the left of it.  If the
+        // cubic is not positive at the inflection point, its largest root
+        // is to the right, and Newton's method started at +U walks down
+        // to that root without overshooting.  Otherwise its smallest root
+        // is to the left, and Newton's method started at -U walks up to it.
+        // 'preferLargest' forces the first way in lanes where the caller
+        // knows the largest root is right of the inflection point.
+        AVX2_TARGET Lanes RealCubicRoot(Lanes B, Lanes C, Lanes D, Lanes preferLargest)
+        {
+            Lanes bound = _mm256_max_pd(Abs(B), _mm256_sqrt_pd(Abs(C)));
+            bound = _mm256_max_pd(bound, CubeRootUpperBound(_mm256_mul_pd(Abs(D), Broadcast(0.5))));
+            bound = _mm256_mul_pd(bound, Broadcast(2.0));
+
+            const Lanes inflection = _mm256_mul_pd(B, Broadcast(-1.0/3.0));
+            const Lanes fromAbove = _mm256_or_pd(
+                preferLargest,
+                _mm256_cmp_pd(EvaluateCubic(inflection, B, C, D), _mm256_setzero_pd(), _CMP_LE_OQ));
+            Lanes x = Select(fromAbove, bound, _mm256_sub_pd(_mm256_setzero_pd(), bound));
+
+            // A simple root takes a handful of steps; a double root
+            // halves the distance each step, so allow for that too.
+            const int MAX_STEPS = 100;
+            for (int step = 0; step < MAX_STEPS; ++step)
+            {
+                const Lanes f = EvaluateCubic(x, B, C, D);
+                const Lanes slope = _mm256_fmadd_pd(_mm256_fmadd_pd(Broadcast(3.0), x, _mm256_add_pd(B, B)), x, C);
+                const Lanes moving = _mm256_cmp_pd(slope, _mm256_setzero_pd(), _CMP_NEQ_OQ);
+                const Lanes delta = _mm256_and_pd(moving, _mm256_div_pd(f, slope));
+                x = _mm256_sub_pd(x, delta);
+
+                const Lanes unfinished = _mm256_cmp_pd(Abs(delta), _mm256_mul_pd(Broadcast(1.0e-15), Abs(x)), _CMP_GT_OQ);
+                if (_mm256_movemask_pd(unfinished) == 0)
+                {
+                    break;
+                }
+            }
+            return x;
+        }
+
+        // The roots of x^2 + Bx + C = 0, computed the same cancellation-free
+        // way as the single-equation solvers.  'valid' is set in the lanes
+        // where the radicand is above 'minRadicand', and so the roots count
+        // as real; a slightly negative radicand is treated as zero.
+        AVX2_TARGET inline void MonicQuadraticRoots(
+            Lanes B, Lanes C, Lanes minRadicand,
+            Lanes& root1, Lanes& root2, Lanes& valid)
+        {
+            const Lanes radicand = _mm256_fmsub_pd(B, B, _mm256_mul_pd(Broadcast(4.0), C));
+            valid = _mm256_cmp_pd(radicand, minRadicand, _CMP_GT_OQ);
+            const Lanes r = _mm256_sqrt_pd(_mm256_max_pd(radicand, _mm256_setzero_pd()));
+            const Lanes half = Broadcast(0.5);
+            const Lanes q = Select(
+                Less(B, _mm256_setzero_pd()),
+                _mm256_mul_pd(_mm256_sub_pd(r, B), half),
+                _mm256_mul_pd(_mm256_add_pd(B, r), Broadcast(-0.5)));
+            const Lanes nonzero = _mm256_cmp_pd(q, _mm256_setzero_pd(), _CMP_NEQ_OQ);
+            root1 = q;
+            root2 = _mm256_and_pd(nonzero, _mm256_div_pd(C, q));
+        }
+
+        // One Newton step on x^3 + Bx^2 + Cx + D, kept only where it
+        // brings the cubic closer to zero.
+        AVX2_TARGET inline Lanes PolishCubicRoot(Lanes x, Lanes B, Lanes C, Lanes D)
+        {
+            const Lanes f = EvaluateCubic(x, B, C, D);
+            const Lanes slope = _mm256_fmadd_pd(_mm256_fmadd_pd(Broadcast(3.0), x, _mm256_add_pd(B, B)), x, C);
+            const Lanes polished = _mm256_sub_pd(x, _mm256_div_pd(f, slope));
+            return Select(Less(Abs(EvaluateCubic(polished, B, C, D)), Abs(f)), polished, x);
+        }
+
+        // Likewise for x^4 + Bx^3 + Cx^2 + Dx + E.
+        AVX2_TARGET inline Lanes PolishQuarticRoot(Lanes x, Lanes B, Lanes C, Lanes D, Lanes E)
+        {
+            const Lanes f = EvaluateQuartic(x, B, C, D, E);
+            const Lanes slope = _mm256_fmadd_pd(_mm256_fmadd_pd(_mm256_fmadd_pd(Broadcast(4.0), x, _mm256_mul_pd(Broadcast(3.0), B)), x, _mm256_add_pd(C, C)), x, D);
+            const Lanes polished = _mm256_sub_pd(x, _mm256_div_pd(f, slope));
+            return Select(Less(Abs(EvaluateQuartic(polished, B, C, D, E)), Abs(f)), polished, x);
+        }
+
+        // Solves the four cubic equations in the lanes, storing their
+        // sorted roots in out[i][lane] and the number of them in count[lane].
+        AVX2_TARGET void SolveCubicLanes(
+            Lanes a, Lanes b, Lanes c, Lanes d,
+            double out[3][4], int count[4])
+        {
+            const Lanes B = _mm256_div_pd(b, a);
+            const Lanes C = _mm256_div_pd(c, a);
+            const Lanes D = _mm256_div_pd(d, a);
+
+            Lanes x0 = RealCubicRoot(B, C, D, _mm256_setzero_pd());
+
+            // Dividing out (x - x0) leaves x^2 + Px + Q.  The other two
+            // roots are real only if they are not a complex pair, allowing
+            // imaginary parts too small to notice, as SolveCubicEquation does.
+            const Lanes P = _mm256_add_pd(B, x0);
+            const Lanes Q = _mm256_fmadd_pd(x0, P, C);
+            const Lanes minRadicand = Broadcast(-4.0 * TOLERANCE * TOLERANCE);
+            Lanes x1, x2, valid;
+            MonicQuadraticRoots(P, Q, minRadicand, x1, x2, valid);
+
+            x0 = PolishCubicRoot(x0, B, C, D);
+            x1 = Select(valid, PolishCubicRoot(x1, B, C, D), Broadcast(HUGE_VAL));
+            x2 = Select(valid, PolishCubicRoot(x2, B, C, D), Broadcast(HUGE_VAL));
+
+            CompareSwap(x0, x1);
+            CompareSwap(x1, x2);
+            CompareSwap(x0, x1);
+
+            _mm256_storeu_pd(out[0], x0);
+            _mm256_storeu_pd(out[1], x1);
+            _mm256_storeu_pd(out[2], x2);
+
+            const int validBits = _mm256_movemask_pd(valid);
+            for (int lane=0; lane < 4; ++lane)
+            {
+                count[lane] = ((validBits >> lane) & 1) ? 3 : 1;
+            }
+        }
+
+        // Solves the four quartic equations in the lanes, storing their
+        // sorted roots in out[i][lane] and the number of them in count[lane].
+        AVX2_TARGET void SolveQuarticLanes(
+            Lanes a, Lanes b, Lanes c, Lanes d, Lanes e,
+            double out[4][4], int count[4])
+        {
+            const Lanes B = _mm256_div_pd(b, a);
+            const Lanes C = _mm256_div_pd(c, a);
+            const Lanes D = _mm256_div_pd(d, a);
+            const Lanes E = _mm256_div_pd(e, a);
+
+            // Substituting x = y + t removes the cubed term, leaving
+            // y^4 + py^2 + qy + r = 0, exactly as SolveQuarticEquation does.
+            const Lanes t  = _mm256_mul_pd(B, Broadcast(-0.25));
+            const Lanes B2 = _mm256_mul_pd(B, B);
+            const Lanes p  = _mm256_fmadd_pd(Broadcast(-3.0/8.0), B2, C);
+            const Lanes q  = _mm256_add_pd(
+                _mm256_mul_pd(B, _mm256_fmsub_pd(B2, Broadcast(1.0/8.0), _mm256_mul_pd(C, Broadcast(0.5)))),
+                D);
+            const Lanes r  = _mm256_add_pd(
+                _mm256_mul_pd(B, _mm256_fmadd_pd(B, _mm256_fmadd_pd(Broadcast(-3.0/256.0), B2, _mm256_mul_pd(C, Broadcast(1.0/16.0))), _mm256_mul_pd(D, Broadcast(-0.25)))),
+                E);
+
+            // Ferrari: any positive root m of m^3 + pm^2 + (p^2/4 - r)m - q^2/8
+            // factors the quartic.  When q is not zero this cubic is negative
+            // at zero, so it has a positive root.  If its inflection point
+            // -p/3 is not positive, the largest root is right of it; if it is
+            // positive, whichever root RealCubicRoot finds is positive.
+            const Lanes m = RealCubicRoot(
+                p,
+                _mm256_fmsub_pd(_mm256_mul_pd(p, p), Broadcast(0.25), r),
+                _mm256_mul_pd(_mm256_mul_pd(q, q), Broadcast(-1.0/8.0)),
+                _mm256_cmp_pd(p, _mm256_setzero_pd(), _CMP_GE_OQ));
+
+            const Lanes tolerance = Broadcast(TOLERANCE);
+            const Lanes ferrari = _mm256_and_pd(
+                _mm256_cmp_pd(Abs(q), tolerance, _CMP_GE_OQ),
+                _mm256_cmp_pd(m, _mm256_setzero_pd(), _CMP_GT_OQ));
+
+            const Lanes s = _mm256_sqrt_pd(Select(ferrari, _mm256_add_pd(m, m), Broadcast(1.0)));
+            const Lanes h = _mm256_fmadd_pd(p, Broadcast(0.5), m);
+            const Lanes k = _mm256_div_pd(q, _mm256_add_pd(s, s));
+            const Lanes minRadicand = Broadcast(-TOLERANCE);
+
+            Lanes f0, f1, f2, f3, fValid01, fValid23;
+            MonicQuadraticRoots(_mm256_sub_pd(_mm256_setzero_pd(), s), _mm256_add_pd(h, k), minRadicand, f0, f1, fValid01);
+            MonicQuadraticRoots(s, _mm256_sub_pd(h, k), minRadicand, f2, f3, fValid23);
+
+            // Otherwise it is a quadratic in z = y^2.
+            Lanes z0, z1, zValid;
+            MonicQuadraticRoots(p, r, minRadicand, z0, z1, zValid);
+            const Lanes zero = _mm256_setzero_pd();
+            const Lanes w0 = _mm256_sqrt_pd(_mm256_max_pd(z0, zero));
+            const Lanes w1 = _mm256_sqrt_pd(_mm256_max_pd(z1, zero));
+            const Lanes negativeTolerance = Broadcast(-TOLERANCE);
+            const Lanes bValid01 = _mm256_and_pd(zValid, _mm256_cmp_pd(z0, negativeTolerance, _CMP_GT_OQ));
+            const Lanes bValid23 = _mm256_and_pd(zValid, _mm256_cmp_pd(z1, negativeTolerance, _CMP_GT_OQ));
+
+            const Lanes valid01 = Select(ferrari, fValid01, bValid01);
+            const Lanes valid23 = Select(ferrari, fValid23, bValid23);
+            const Lanes none = Broadcast(HUGE_VAL);
+
+            Lanes x0 = _mm256_add_pd(t, Select(ferrari, f0, w0));
+            Lanes x1 = _mm256_add_pd(t, Select(ferrari, f1, _mm256_sub_pd(zero, w0)));
+            Lanes x2 = _mm256_add_pd(t, Select(ferrari, f2, w1));
+            Lanes x3 = _mm256_add_pd(t, Select(ferrari, f3, _mm256_sub_pd(zero, w1)));
+
+            x0 = Select(valid01, PolishQuarticRoot(x0, B, C, D, E), none);
+            x1 = Select(valid01, PolishQuarticRoot(x1, B, C, D, E), none);
+            x2 = Select(valid23, PolishQuarticRoot(x2, B, C, D, E), none);
+            x3 = Select(valid23, PolishQuarticRoot(x3, B, C, D, E), none);
+
+            CompareSwap(x0, x1);
+            CompareSwap(x2, x3);
+            CompareSwap(x0, x2);
+            CompareSwap(x1, x3);
+            CompareSwap(x1, x2);
+
+            _mm256_storeu_pd(out[0], x0);
+            _mm256_storeu_pd(out[1], x1);
+            _mm256_storeu_pd(out[2], x2);
+            _mm256_storeu_pd(out[3], x3);
+
+            const int bits01 = _mm256_movemask_pd(valid01);
+            const int bits23 = _mm256_movemask_pd(valid23);
+            for (int lane=0; lane < 4; ++lane)
+            {
+                count[lane] = 2*((bits01 >> lane) & 1) + 2*((bits23 >> lane) & 1);
+            }
+        }
+
+        // Loads up to four consecutive coefficients starting at index k,
+        // padding a short group at the end of the arrays with 'padding'.
+        AVX2_TARGET inline Lanes LoadGroup(const double x[], size_t k, size_t lanes, double padding)
+        {
+            if (lanes == 4)
+            {
+                return _mm256_loadu_pd(&x[k]);
+            }
+            double group[4] = { padding, padding, padding, padding };
+            for (size_t lane=0; lane < lanes; ++lane)
+            {
+                group[lane] = x[k + lane];
+            }
+            return _mm256_loadu_pd(group);
+        }
+
+        AVX2_TARGET void SolveCubicsAvx2(
+            size_t count,
+            const double a[], const double b[], const double c[], const double d[],
+            double roots[], int numRoots[])
+        {
+            double out[3][4];
+            int laneCount[4];
+            for (size_t k=0; k < count; k += 4)
+            {
+                const size_t lanes = (count - k < 4) ? (count - k) : 4;
+                SolveCubicLanes(
+                    LoadGroup(a, k, lanes, 1.0),
+                    LoadGroup(b, k, lanes, 0.0),
+                    LoadGroup(c, k, lanes, 0.0),
+                    LoadGroup(d, k, lanes, 0.0),
+                    out, laneCount);
+
+                for (size_t lane=0; lane < lanes; ++lane)
+                {
+                    const size_t index = k + lane;
+                    if (fabs(a[index]) < TOLERANCE)
+                    {
+                        SolveCubicOneByOne(index, a, b, c, d, roots, numRoots);
+                    }
+                    else
+                    {
+                        for (int i=0; i < 3; ++i)
+                        {
+                            roots[3*index + i] = out[i][lane];
+                        }
+                        numRoots[index] = laneCount[lane];
+                    }
+                }
+            }
+        }
+
+        AVX2_TARGET void SolveQuarticsAvx2(
+            size_t count,
+            const double a[], const double b[], const double c[], const double d[], const double e[],
+            double roots[], int numRoots[])
+        {
+            double out[4][4];
+            int laneCount[4];
+            for (size_t k=0; k < count; k += 4)
+            {
+                const size_t lanes = (count - k < 4) ? (count - k) : 4;
+                SolveQuarticLanes(
+                    LoadGroup(a, k, lanes, 1.0),
+                    LoadGroup(b, k, lanes, 0.0),
+                    LoadGroup(c, k, lanes, 0.0),
+                    LoadGroup(d, k, lanes, 0.0),
+                    LoadGroup(e, k, lanes, 0.0),
+                    out, laneCount);
+
+                for (size_t lane=0; lane < lanes; ++lane)
+                {
+                    const size_t index = k + lane;
+                    if (fabs(a[index]) < TOLERANCE)
+                    {
+                        SolveQuarticOneByOne(index, a, b, c, d, e, roots, numRoots);
+                    }
+                    else
+                    {
+                        for (int i=0; i < 4; ++i)
+                        {
+                            roots[4*index + i] = out[i][lane];
+                        }
+                        numRoots[index] = laneCount[lane];
+                    }
+                }
+            }
+        }
+#endif
+    }
+
+    void SolveCubicEquations(
+        size_t count,
+        const double a[],
+        const double b[],
+        const double c[],
+        const double d[],
+        double roots[],
+        int numRoots[])
+    {
+#if ALGEBRA_HAVE_AVX2
+        if (CanUseAvx2())
+        {
+            SolveCubicsAvx2(count, a, b, c, d, roots, numRoots);
+            return;
+        }
+#endif
+        for (size_t k=0; k < count; ++k)
+        {
+            SolveCubicOneByOne(k, a, b, c, d, roots, numRoots);
+        }
+    }
+
+    void SolveQuarticEquations(
+        size_t count,
+        const double a[],
+        const double b[],
+        const double c[],
+        const double d[],
+        const double e[],
+        double roots[],
+        int numRoots[])
+    {
+#if ALGEBRA_HAVE_AVX2
+        if (CanUseAvx2())
+        {
+            SolveQuarticsAvx2(count, a, b, c, d, e, roots, numRoots);
+            return;
+        }
+#endif
+        for (size_t k=0; k < count; ++k)
+        {
+            SolveQuarticOneByOne(k, a, b, c, d, e, roots, numRoots);
+        }
+    }
+}
@@ -6,6 +6,7 @@
 */
 
 #include "imager.h"
+#include "fingerprint.h"
 
 namespace Imager
 {
@@ -93,4 +94,72 @@ namespace Imager
         const double dy = nc.y - c.y;
         nested.Move (c.x + (a*dx - b*dy), c.y + (a*dy + b*dx), nc.z);
     }
+
+    void SolidObject_BinaryOperator::CombineOperandSpans(
+        const Vector& vantage,
+        const Vector& direction,
+        SpanOperator op,
+        SpanList& spanList) const
+    {
+        CollectInsideSpans(Left(), vantage, direction, leftSpanList, leftCrossingList);
+
+        // A ray that never enters the left solid never enters its
+        // intersection with anything, so the right solid, which for
+        // a SetDifference is often the larger tree, need not be traced.
+        if (op == SPAN_INTERSECTION && leftSpanList.empty())
+        {
+            spanList.clear();
+            return;
+        }
+
+        CollectInsideSpans(Right(), vantage, direction, rightSpanList, rightCrossingList);
+        CombineSpans(leftSpanList, rightSpanList, op, spanList);
+    }
+
+    void SolidObject_BinaryOperator::RightDecidesEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray,
+        bool undecided) const
+    {
+        Vector gathered[CONTAINS_CHUNK];
+        size_t gatheredIndex[CONTAINS_CHUNK];
+        bool rightInside[CONTAINS_CHUNK];
+        size_t numGathered = 0;
+
+        for (size_t k=0; k < count; ++k)
+        {
+            if (insideArray[k] == undecided)
+            {
+                gathered[numGathered] = pointArray[k];
+                gatheredIndex[numGathered] = k;
+                ++numGathered;
+            }
+
+            if (numGathered == CONTAINS_CHUNK || (k+1 == count && numGathered > 0))
+            {
+                Right().ContainsEach(gathered, numGathered, rightInside);
+                for (size_t g=0; g < numGathered; ++g)
+                {
+                    insideArray[gatheredIndex[g]] = rightInside[g];
+                }
+                numGathered = 0;
+            }
+        }
+    }
+
+    bool SolidObject_BinaryOperator::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        // The tag distinguishes union, intersection, and difference.
+        AppendCommonFingerprint(fingerprint);
+        return
+            Left().AppendFingerprint(fingerprint) &&
+            Right().AppendFingerprint(fingerprint);
+    }
+
+    bool SetComplement::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        AppendCommonFingerprint(fingerprint);
+        return other->AppendFingerprint(fingerprint);
+    }
 }
@@ -7,6 +7,7 @@
 #define __DDC_BLOCK_H
 
 #include "imager.h"
+#include "csg.h"
 
 namespace Imager
 {
@@ -43,6 +44,32 @@ namespace Imager
             return new SetUnion(Vector(), topCuboid, bottomCuboid);
         }
     };
+
+    // The same block as a compile-time shape: no heap nodes and no
+    // virtual calls below the StaticCsgSolid.
+    typedef Csg::Difference< Csg::Box, Csg::Union<Csg::Box, Csg::Box> > ConcreteBlockShape;
+
+    class StaticConcreteBlock: public StaticCsgSolid<ConcreteBlockShape>
+    {
+    public:
+        StaticConcreteBlock(const Vector& _center, const Optics& _optics)
+            : StaticCsgSolid<ConcreteBlockShape>(_center, CreateShape())
+        {
+            SetUniformOptics(_optics);
+        }
+
+    private:
+        static ConcreteBlockShape CreateShape()
+        {
+            const Csg::Box largeBox (8.0, 16.0, 8.0);
+            const Csg::Box topBox   (6.0, 6.5, 8.01, Vector(0.0, +7.5, 0.0));
+            const Csg::Box bottomBox(6.0, 6.5, 8.01, Vector(0.0, -7.5, 0.0));
+
+            return ConcreteBlockShape(
+                largeBox,
+                Csg::Union<Csg::Box, Csg::Box>(topBox, bottomBox));
+        }
+    };
 }
 
 #endif 
@@ -0,0 +1,105 @@
+/*
+    boxkernel.h
+
+    The ray/box intersection kernel used by class Cuboid, which
+    calls it in object space, and by the compile-time CSG leaf
+    Csg::Box.
+*/
+
+#ifndef __DDC_BOXKERNEL_H
+#define __DDC_BOXKERNEL_H
+
+#include <cmath>
+#include "imager.h"
+
+namespace Imager
+{
+    inline bool CuboidContains(
+        double a, double b, double c, 
+        const Vector& point)
+    {
+        return 
+            (fabs(point.x) <= a + EPSILON) &
+            (fabs(point.y) <= b + EPSILON) &
+            (fabs(point.z) <= c + EPSILON);
+    }
+
+    // Appends the intersection, if any, of the ray with the face
+    // at the given coordinate ('plane') along one axis.
+    inline void AppendFaceIntersection(
+        const SolidObject* solid,
+        double a, double b, double c,
+        double plane,
+        double vantageComponent,
+        double directionComponent,
+        const Vector& vantage, 
+        const Vector& direction, 
+        const Vector& surfaceNormal,
+        const char* tag,
+        IntersectionList& intersectionList)
+    {
+        const double u = (plane - vantageComponent) / directionComponent;
+        if (u > EPSILON)
+        {
+            Intersection intersection;
+            const Vector displacement = u * direction;
+            intersection.point = vantage + displacement;
+            if (CuboidContains(a, b, c, intersection.point))
+            {
+                intersection.distanceSquared = displacement.MagnitudeSquared();
+                intersection.surfaceNormal = surfaceNormal;
+                intersection.solid = solid;
+                intersection.tag = tag;
+                intersectionList.push_back(intersection);
+            }
+        }
+    }
+
+    // The ray/cuboid kernel in object space.
+    inline void AppendCuboidIntersections(
+        const SolidObject* solid,
+        double a, double b, double c,
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList)
+    {
+        // Check for intersections with left/right faces: x = +a or x = -a.
+        if (fabs(direction.x) > EPSILON)
+        {
+            AppendFaceIntersection(solid, a, b, c, +a, vantage.x, direction.x,
+                vantage, direction, Vector(+1.0, 0.0, 0.0), "right face", intersectionList);
+            AppendFaceIntersection(solid, a, b, c, -a, vantage.x, direction.x,
+                vantage, direction, Vector(-1.0, 0.0, 0.0), "left face", intersectionList);
+        }
+
+        // Check for intersections with front/back faces: y = -b or y = +b.
+        if (fabs(direction.y) > EPSILON)
+        {
+            AppendFaceIntersection(solid, a, b, c, +b, vantage.y, direction.y,
+                vantage, direction, Vector(0.0, +1.0, 0.0), "front face", intersectionList);
+            AppendFaceIntersection(solid, a, b, c, -b, vantage.y, direction.y,
+                vantage, direction, Vector(0.0, -1.0, 0.0), "back face", intersectionList);
+        }
+
+        // Check for intersections with top/bottom faces: z = -c or z = +c.
+        if (fabs(direction.z) > EPSILON)
+        {
+            AppendFaceIntersection(solid, a, b, c, +c, vantage.z, direction.z,
+                vantage, direction, Vector(0.0, 0.0, +1.0), "top face", intersectionList);
+            AppendFaceIntersection(solid, a, b, c, -c, vantage.z, direction.z,
+                vantage, direction, Vector(0.0, 0.0, -1.0), "bottom face", intersectionList);
+        }
+    }
+
+    // The same kernel compiled once, out of line, for Csg::Box.  A shape
+    // with several boxes is too big for the compiler to inline all
+    // their face tests into, and calling each face test separately
+    // costs more than this one call per box.
+    void AppendBoxIntersections(
+        double a, double b, double c,
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList);
+}
+
+#endif // __DDC_BOXKERNEL_H
@@ -0,0 +1,170 @@
+/*
+    bvh.cpp
+
+    Builds the flat bounding volume hierarchy declared in bvh.h.
+*/
+
+#include <algorithm>
+#include "bvh.h"
+
+namespace Imager
+{
+    namespace
+    {
+        // Orders primitive indices by the centroid of their boxes along one axis.
+        class CentroidLess
+        {
+        public:
+            CentroidLess(const std::vector<Vector>& _centroids, int _axis)
+                : centroids(_centroids)
+                , axis(_axis)
+            {
+            }
+
+            bool operator() (size_t a, size_t b) const
+            {
+                return Component(centroids[a]) < Component(centroids[b]);
+            }
+
+        private:
+            double Component(const Vector& v) const
+            {
+                return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+            }
+
+            const std::vector<Vector>& centroids;
+            const int axis;
+        };
+
+        void StoreBox(BvhNode& node, const BoundingBox& box)
+        {
+            node.minCorner[0] = box.minCorner.x;
+            node.minCorner[1] = box.minCorner.y;
+            node.minCorner[2] = box.minCorner.z;
+            node.maxCorner[0] = box.maxCorner.x;
+            node.maxCorner[1] = box.maxCorner.y;
+            node.maxCorner[2] = box.maxCorner.z;
+        }
+
+        // Recursively builds the subtree for order[first .. first+count-1].
+        // Splitting at the median keeps the tree balanced, which bounds
+        // its depth well within BVH_STACK_SIZE for any realistic scene.
+        void BuildNode(
+            const std::vector<BoundingBox>& boxes,
+            const std::vector<Vector>& centroids,
+            std::vector<size_t>& order,
+            std::vector<BvhNode>& nodes,
+            size_t first,
+            size_t count)
+        {
+            const size_t index = nodes.size();
+            nodes.push_back(BvhNode());
+
+            BoundingBox bounds;
+            BoundingBox centroidBounds;
+            for (size_t k = first; k < first + count; ++k)
+            {
+                bounds.Include(boxes[order[k]]);
+                centroidBounds.Include(centroids[order[k]]);
+            }
+            StoreBox(nodes[index], bounds);
+
+            if (count <= BVH_MAX_LEAF_SIZE)
+            {
+                nodes[index].offset = static_cast<uint32_t>(first);
+                nodes[index].count  = static_cast<uint32_t>(count);
+                return;
+            }
+
+            // Split along the axis where the centroids are most spread out.
+            const Vector extent = centroidBounds.maxCorner - centroidBounds.minCorner;
+            int axis = 0;
+            if (extent.y > extent.x) axis = 1;
+            if (extent.z > ((axis == 0) ? extent.x : extent.y)) axis = 2;
+
+            const size_t half = count / 2;
+            std::nth_element(
+                order.begin() + first,
+                order.begin() + first + half,
+                order.begin() + first + count,
+                CentroidLess(centroids, axis));
+
+            BuildNode(boxes, centroids, order, nodes, first, half);
+            nodes[index].offset = static_cast<uint32_t>(nodes.size());
+            nodes[index].count  = 0;
+            BuildNode(boxes, centroids, order, nodes, first + half, count - half);
+        }
+    }
+
+    void BuildBoundingVolumeHierarchy(
+        const std::vector<BoundingBox>& boxes,
+        std::vector<size_t>& order,
+        std::vector<BvhNode>& nodes)
+    {
+        const size_t count = boxes.size();
+        order.resize(count);
+        nodes.clear();
+
+        std::vector<Vector> centroids(count);
+        for (size_t k=0; k < count; ++k)
+        {
+            order[k] = k;
+            centroids[k] = boxes[k].Centroid();
+        }
+
+        if (count > 0)
+        {
+            nodes.reserve(2 * (count / BVH_MAX_LEAF_SIZE + 1));
+            BuildNode(boxes, centroids, order, nodes, 0, count);
+        }
+    }
+
+    bool IsValidBoundingVolumeHierarchy(
+        const BvhNode* nodes,
+        uint64_t nodeCount,
+        uint64_t primitiveCount)
+    {
+        if (nodeCount == 0 || nodeCount > UINT32_MAX)
+        {
+            return false;
+        }
+
+        // Walk every node with the same stack discipline as TraverseBvh,
+        // which is its worst case: a ray that enters every box.  The
+        // builder stores nodes in exactly this visiting order, so any
+        // node out of order means shared or cyclic children.
+        uint32_t stack[BVH_STACK_SIZE];
+        int depth = 0;
+        stack[depth++] = 0;
+        uint64_t visited = 0;
+        while (depth > 0)
+        {
+            const uint32_t index = stack[--depth];
+            if (index != visited)
+            {
+                return false;
+            }
+            ++visited;
+
+            const BvhNode& node = nodes[index];
+            if (node.count > 0)
+            {
+                if (node.count > primitiveCount || node.offset > primitiveCount - node.count)
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                if (node.offset >= nodeCount || index + 1 >= nodeCount || depth + 2 > BVH_STACK_SIZE)
+                {
+                    return false;
+                }
+                stack[depth++] = node.offset;
+                stack[depth++] = index + 1;
+            }
+        }
+
+        return visited == nodeCount;
+    }
+}
@@ -0,0 +1,203 @@
+/*
+    bvh.h
+
+    A flat bounding volume hierarchy over axis-aligned boxes.
+    The nodes are plain old data with no pointers, so a hierarchy
+    can be written to a file and later used in place from a
+    memory-mapped image of that file.
+*/
+
+#ifndef __DDC_BVH_H
+#define __DDC_BVH_H
+
+#include <vector>
+#include <stdint.h>
+#include "imager.h"
+
+namespace Imager
+{
+    struct BoundingBox
+    {
+        Vector minCorner;
+        Vector maxCorner;
+
+        BoundingBox()
+            : minCorner( 1.0e+30,  1.0e+30,  1.0e+30)
+            , maxCorner(-1.0e+30, -1.0e+30, -1.0e+30)
+        {
+        }
+
+        BoundingBox(const Vector& _minCorner, const Vector& _maxCorner)
+            : minCorner(_minCorner)
+            , maxCorner(_maxCorner)
+        {
+        }
+
+        void Include(const Vector& point)
+        {
+            if (point.x < minCorner.x) minCorner.x = point.x;
+            if (point.y < minCorner.y) minCorner.y = point.y;
+            if (point.z < minCorner.z) minCorner.z = point.z;
+            if (point.x > maxCorner.x) maxCorner.x = point.x;
+            if (point.y > maxCorner.y) maxCorner.y = point.y;
+            if (point.z > maxCorner.z) maxCorner.z = point.z;
+        }
+
+        void Include(const BoundingBox& other)
+        {
+            Include(other.minCorner);
+            Include(other.maxCorner);
+        }
+
+        Vector Centroid() const
+        {
+            return 0.5 * (minCorner + maxCorner);
+        }
+    };
+
+    // One node of the hierarchy.  The left child of an interior node
+    // always immediately follows its parent in the node array, so
+    // only the index of the right child needs to be stored.
+    struct BvhNode
+    {
+        double   minCorner[3];
+        double   maxCorner[3];
+        uint32_t offset;    // leaf: first primitive; interior: right child node
+        uint32_t count;     // leaf: number of primitives; interior: zero
+    };
+
+    const size_t BVH_MAX_LEAF_SIZE = 4;
+    const int    BVH_STACK_SIZE    = 64;
+
+    // Builds a hierarchy over 'boxes'.  The primitives must be stored
+    // in the order given by 'order' for the leaf offsets in 'nodes' to
+    // refer to them: leaf primitive k is the one originally at order[k].
+    void BuildBoundingVolumeHierarchy(
+        const std::vector<BoundingBox>& boxes,
+        std::vector<size_t>& order,
+        std::vector<BvhNode>& nodes);
+
+    // Returns true if 'nodes' is laid out the way the builder lays out
+    // a hierarchy, so that TraverseBvh and QueryBvhPoint can walk it
+    // safely: every child index is in range, each node is reached exactly
+    // once in order, every leaf lies within 'primitiveCount' primitives,
+    // and the traversal stack never needs more than BVH_STACK_SIZE entries.
+    // Hierarchies read from files must pass this check before they are used.
+    bool IsValidBoundingVolumeHierarchy(
+        const BvhNode* nodes,
+        uint64_t nodeCount,
+        uint64_t primitiveCount);
+
+    // Returns true if the ray vantage + u*direction, for some u > 0,
+    // passes through the box of the given node.
+    inline bool RayHitsNode(
+        const BvhNode& node,
+        const double vantage[3],
+        const double inverseDir[3])
+    {
+        double uNear = 0.0;
+        double uFar  = 1.0e+30;
+        for (int k=0; k < 3; ++k)
+        {
+            double u1 = (node.minCorner[k] - vantage[k]) * inverseDir[k];
+            double u2 = (node.maxCorner[k] - vantage[k]) * inverseDir[k];
+            if (u1 > u2)
+            {
+                const double swap = u1;
+                u1 = u2;
+                u2 = swap;
+            }
+
+            // A NaN appears only when the ray runs exactly along
+            // a slab boundary; the comparisons below then leave
+            // the interval unchanged, which errs on the side of a hit.
+            if (u1 > uNear) uNear = u1;
+            if (u2 < uFar)  uFar  = u2;
+            if (uNear > uFar)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool PointInNode(const BvhNode& node, const Vector& point)
+    {
+        return
+            (point.x >= node.minCorner[0]) && (point.x <= node.maxCorner[0]) &&
+            (point.y >= node.minCorner[1]) && (point.y <= node.maxCorner[1]) &&
+            (point.z >= node.minCorner[2]) && (point.z <= node.maxCorner[2]);
+    }
+
+    // Calls visit(first, count) for every leaf whose box the ray enters.
+    template <typename Visitor>
+    void TraverseBvh(
+        const BvhNode* nodes,
+        const Vector& vantage,
+        const Vector& direction,
+        Visitor& visit)
+    {
+        const double origin[3] = { vantage.x, vantage.y, vantage.z };
+        const double inverseDir[3] =
+        {
+            1.0 / direction.x,
+            1.0 / direction.y,
+            1.0 / direction.z
+        };
+
+        uint32_t stack[BVH_STACK_SIZE];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const uint32_t index = stack[--depth];
+            const BvhNode& node = nodes[index];
+            if (RayHitsNode(node, origin, inverseDir))
+            {
+                if (node.count > 0)
+                {
+                    visit(node.offset, node.count);
+                }
+                else
+                {
+                    stack[depth++] = node.offset;
+                    stack[depth++] = index + 1;
+                }
+            }
+        }
+    }
+
+    // Calls visit(first, count) for every leaf whose box contains the point.
+    template <typename Visitor>
+    void QueryBvhPoint(
+        const BvhNode* nodes,
+        const Vector& point,
+        Visitor& visit)
+    {
+        uint32_t stack[BVH_STACK_SIZE];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const uint32_t index = stack[--depth];
+            const BvhNode& node = nodes[index];
+            if (PointInNode(node, point))
+            {
+                if (node.count > 0)
+                {
+                    if (visit(node.offset, node.count))
+                    {
+                        return;     // the visitor has what it needs
+                    }
+                }
+                else
+                {
+                    stack[depth++] = node.offset;
+                    stack[depth++] = index + 1;
+                }
+            }
+        }
+    }
+}
+
+#endif // __DDC_BVH_H
@@ -0,0 +1,374 @@
+/*
+    cache.cpp
+
+    Implements the rendered image cache declared in cache.h.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "fingerprint.h"
+#include "../lodepng/lodepng.h"
+
+namespace Imager
+{
+    namespace
+    {
+        const char * const CACHE_FILE_SUFFIX = ".img";
+
+        // Cache files are named by the hexadecimal digest of their key.
+        const size_t CACHE_NAME_LENGTH = 2 * FingerprintDigest::SIZE;
+
+        bool IsCacheFileName(const std::string& name)
+        {
+            const size_t suffixLength = strlen(CACHE_FILE_SUFFIX);
+            return
+                (name.size() == CACHE_NAME_LENGTH + suffixLength) &&
+                (name.compare(CACHE_NAME_LENGTH, suffixLength, CACHE_FILE_SUFFIX) == 0);
+        }
+
+        struct DiskEntry
+        {
+            std::string path;
+            double      lastUsed;   // seconds, with sub-second resolution
+            uint64_t    size;
+
+            bool operator< (const DiskEntry& other) const
+            {
+                return lastUsed < other.lastUsed;
+            }
+        };
+
+        // Lists the cache files in a directory, with their sizes and
+        // the times they were last written or served.
+        void ScanDirectory(const std::string& directory, std::vector<DiskEntry>& entries)
+        {
+            entries.clear();
+            DIR *dir = opendir(directory.c_str());
+            if (dir == NULL)
+            {
+                return;
+            }
+
+            struct dirent *item;
+            while ((item = readdir(dir)) != NULL)
+            {
+                const std::string name = item->d_name;
+                if (IsCacheFileName(name))
+                {
+                    DiskEntry entry;
+                    entry.path = directory + "/" + name;
+
+                    struct stat info;
+                    if (stat(entry.path.c_str(), &info) == 0)
+                    {
+                        entry.lastUsed = info.st_mtim.tv_sec + info.st_mtim.tv_nsec / 1.0e+9;
+                        entry.size = info.st_size;
+                        entries.push_back(entry);
+                    }
+                }
+            }
+            closedir(dir);
+        }
+
+        bool WriteFile(const std::string& path, const std::vector<unsigned char>& data)
+        {
+            std::ofstream outfile(path.c_str(), std::ios::out | std::ios::binary);
+            outfile.write(reinterpret_cast<const char*>(data.data()), data.size());
+            return outfile.good();
+        }
+    }
+
+    std::ostream& operator<< (std::ostream& output, const RenderCacheStats& stats)
+    {
+        output << "memory_hits="       << stats.memoryHits;
+        output << " disk_hits="        << stats.diskHits;
+        output << " misses="           << stats.misses;
+        output << " uncacheable="      << stats.uncacheable;
+        output << " memory_evictions=" << stats.memoryEvictions;
+        output << " disk_evictions="   << stats.diskEvictions;
+        output << " memory_bytes="     << stats.memoryBytes;
+        output << " disk_bytes="       << stats.diskBytes;
+        return output;
+    }
+
+    RenderCache::RenderCache(
+        size_t _memoryCapacity,
+        const char *_diskDirectory,
+        size_t _diskCapacity)
+            : memoryCapacity(_memoryCapacity)
+            , diskDirectory((_diskDirectory != NULL) ? _diskDirectory : "")
+            , diskCapacity(_diskCapacity)
+    {
+        if (!diskDirectory.empty())
+        {
+            mkdir(diskDirectory.c_str(), 0755);     // fine if it already exists
+
+            std::vector<DiskEntry> entries;
+            ScanDirectory(diskDirectory, entries);
+            for (size_t i=0; i < entries.size(); ++i)
+            {
+                stats.diskBytes += entries[i].size;
+            }
+        }
+    }
+
+    bool RenderCache::MakeKey(
+        const Scene& scene,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        double zoom,
+        size_t antiAliasFactor,
+        const char *format,
+        FingerprintDigest& key)
+    {
+        Fingerprint fingerprint;
+        if (!scene.AppendFingerprint(fingerprint))
+        {
+            return false;
+        }
+
+        fingerprint.AddInteger(pixelsWide);
+        fingerprint.AddInteger(pixelsHigh);
+        fingerprint.AddDouble(zoom);
+        fingerprint.AddInteger(antiAliasFactor);
+        fingerprint.AddString(format);
+        key = fingerprint.Digest();
+        return true;
+    }
+
+    bool RenderCache::Lookup(const FingerprintDigest& key, std::vector<unsigned char>& data)
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+
+        EntryIndex::iterator found = entryIndex.find(key);
+        if (found != entryIndex.end())
+        {
+            // Move the entry to the front: it is now the most recently used.
+            entryList.splice(entryList.begin(), entryList, found->second);
+            data = found->second->data;
+            ++stats.memoryHits;
+            return true;
+        }
+
+        if (!diskDirectory.empty() && LoadFromDisk(key, data))
+        {
+            StoreInMemory(key, data);
+            ++stats.diskHits;
+            return true;
+        }
+
+        ++stats.misses;
+        return false;
+    }
+
+    void RenderCache::Store(const FingerprintDigest& key, const std::vector<unsigned char>& data)
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+
+        StoreInMemory(key, data);
+        if (!diskDirectory.empty())
+        {
+            StoreOnDisk(key, data);
+        }
+    }
+
+    void RenderCache::CountUncacheable()
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        ++stats.uncacheable;
+    }
+
+    RenderCacheStats RenderCache::GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        return stats;
+    }
+
+    void RenderCache::StoreInMemory(const FingerprintDigest& key, const std::vector<unsigned char>& data)
+    {
+        if (data.size() > memoryCapacity)
+        {
+            return;     // would evict everything and still not fit
+        }
+
+        EntryIndex::iterator found = entryIndex.find(key);
+        if (found != entryIndex.end())
+        {
+            stats.memoryBytes -= found->second->data.size();
+            entryList.erase(found->second);
+            entryIndex.erase(found);
+        }
+
+        while (!entryList.empty() && stats.memoryBytes + data.size() > memoryCapacity)
+        {
+            const Entry& oldest = entryList.back();
+            stats.memoryBytes -= oldest.data.size();
+            entryIndex.erase(oldest.key);
+            entryList.pop_back();
+            ++stats.memoryEvictions;
+        }
+
+        Entry entry;
+        entry.key = key;
+        entry.data = data;
+        entryList.push_front(entry);
+        entryIndex[key] = entryList.begin();
+        stats.memoryBytes += data.size();
+    }
+
+    std::string RenderCache::DiskPath(const FingerprintDigest& key) const
+    {
+        return diskDirectory + "/" + key.ToHex() + CACHE_FILE_SUFFIX;
+    }
+
+    bool RenderCache::LoadFromDisk(const FingerprintDigest& key, std::vector<unsigned char>& data)
+    {
+        const std::string path = DiskPath(key);
+        std::ifstream infile(path.c_str(), std::ios::in | std::ios::binary);
+        if (!infile)
+        {
+            return false;
+        }
+
+        infile.seekg(0, std::ios::end);
+        const std::streamoff size = infile.tellg();
+        infile.seekg(0, std::ios::beg);
+        if (size <= 0)
+        {
+            return false;
+        }
+
+        data.resize(static_cast<size_t>(size));
+        infile.read(reinterpret_cast<char*>(data.data()), size);
+        if (!infile)
+        {
+            return false;
+        }
+
+        // Touch the file so eviction sees it as recently used.
+        utimes(path.c_str(), NULL);
+        return true;
+    }
+
+    void RenderCache::StoreOnDisk(const FingerprintDigest& key, const std::vector<unsigned char>& data)
+    {
+        if (data.size() > diskCapacity)
+        {
+            return;
+        }
+
+        // Write to a private temporary name and rename it into place,
+        // so that other processes sharing the directory never see a
+        // partially written entry.
+        const std::string path = DiskPath(key);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%d.tmp", static_cast<int>(getpid()));
+        const std::string tempPath = path + suffix;
+
+        struct stat info;
+        const bool existed = (stat(path.c_str(), &info) == 0);
+        if (WriteFile(tempPath, data) && rename(tempPath.c_str(), path.c_str()) == 0)
+        {
+            if (existed)
+            {
+                stats.diskBytes -= info.st_size;
+            }
+            stats.diskBytes += data.size();
+            if (stats.diskBytes > diskCapacity)
+            {
+                EvictFromDisk();
+            }
+        }
+        else
+        {
+            unlink(tempPath.c_str());
+        }
+    }
+
+    void RenderCache::EvictFromDisk()
+    {
+        // Rescan rather than trusting the running total, because
+        // other processes may share the same cache directory.
+        // Recency comes from file modification times, so entries used
+        // within the file system's timestamp resolution of each other
+        // may be evicted in either order.
+        std::vector<DiskEntry> entries;
+        ScanDirectory(diskDirectory, entries);
+        std::sort(entries.begin(), entries.end());
+
+        stats.diskBytes = 0;
+        for (size_t i=0; i < entries.size(); ++i)
+        {
+            stats.diskBytes += entries[i].size;
+        }
+
+        for (size_t i=0; i < entries.size() && stats.diskBytes > diskCapacity; ++i)
+        {
+            if (unlink(entries[i].path.c_str()) == 0)
+            {
+                stats.diskBytes -= entries[i].size;
+                ++stats.diskEvictions;
+            }
+        }
+    }
+
+    void RenderCache::RenderPng(
+        const Scene& scene,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        double zoom,
+        size_t antiAliasFactor,
+        std::vector<unsigned char>& png)
+    {
+        FingerprintDigest key;
+        const bool isCacheable = MakeKey(
+            scene, pixelsWide, pixelsHigh, zoom, antiAliasFactor, "png", key);
+
+        if (!isCacheable)
+        {
+            CountUncacheable();
+        }
+        else if (Lookup(key, png))
+        {
+            return;
+        }
+
+        const std::vector<unsigned char>& rgba = scene.RenderImage(
+            pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+
+        png.clear();
+        const unsigned error = lodepng::encode(png, rgba, pixelsWide, pixelsHigh);
+        if (error != 0)
+        {
+            throw ImagerException("PNG encoder error.");
+        }
+
+        if (isCacheable)
+        {
+            Store(key, png);
+        }
+    }
+
+    void RenderCache::SaveImage(
+        const Scene& scene,
+        const char *outPngFileName,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        double zoom,
+        size_t antiAliasFactor)
+    {
+        std::vector<unsigned char> png;
+        RenderPng(scene, pixelsWide, pixelsHigh, zoom, antiAliasFactor, png);
+        if (!WriteFile(outPngFileName, png))
+        {
+            throw ImagerException("Cannot write PNG file.");
+        }
+    }
+}
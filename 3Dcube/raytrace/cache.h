@@ -0,0 +1,133 @@
+/*
+    cache.h
+
+    A content-addressed cache of rendered images.  Each entry is keyed
+    by the fingerprint of the scene (solids, optics, lights) combined
+    with the image parameters, so asking again for an image that has
+    already been rendered costs a lookup instead of a full trace.
+
+    Entries live in memory and, optionally, in a directory on disk that
+    survives between runs.  Both stores are limited to a byte capacity
+    and evict the least recently used entries first.
+*/
+
+#ifndef __DDC_CACHE_H
+#define __DDC_CACHE_H
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "fingerprint.h"
+#include "imager.h"
+
+namespace Imager
+{
+    struct RenderCacheStats
+    {
+        uint64_t memoryHits;
+        uint64_t diskHits;
+        uint64_t misses;
+        uint64_t uncacheable;       // scenes containing solids with no fingerprint
+        uint64_t memoryEvictions;
+        uint64_t diskEvictions;
+        uint64_t memoryBytes;
+        uint64_t diskBytes;
+
+        RenderCacheStats()
+            : memoryHits(0)
+            , diskHits(0)
+            , misses(0)
+            , uncacheable(0)
+            , memoryEvictions(0)
+            , diskEvictions(0)
+            , memoryBytes(0)
+            , diskBytes(0)
+        {
+        }
+    };
+
+    std::ostream& operator<< (std::ostream&, const RenderCacheStats&);
+
+    class RenderCache
+    {
+    public:
+        // If 'diskDirectory' is NULL, only the memory store is used.
+        RenderCache(
+            size_t memoryCapacity,
+            const char *diskDirectory = NULL,
+            size_t diskCapacity = 0);
+
+        // Computes the cache key for rendering 'scene' with the given
+        // parameters into the named output format.  Returns false if
+        // the scene cannot be fingerprinted.
+        static bool MakeKey(
+            const Scene& scene,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            double zoom,
+            size_t antiAliasFactor,
+            const char *format,
+            FingerprintDigest& key);
+
+        // Copies a cached image into 'data' and returns true on a hit.
+        bool Lookup(const FingerprintDigest& key, std::vector<unsigned char>& data);
+
+        void Store(const FingerprintDigest& key, const std::vector<unsigned char>& data);
+
+        // Counts a request that could not use the cache at all.
+        void CountUncacheable();
+
+        // Produces the PNG file contents for a scene, rendering only on a miss.
+        void RenderPng(
+            const Scene& scene,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            double zoom,
+            size_t antiAliasFactor,
+            std::vector<unsigned char>& png);
+
+        // Like Scene::SaveImage, but served from the cache when possible.
+        void SaveImage(
+            const Scene& scene,
+            const char *outPngFileName,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            double zoom,
+            size_t antiAliasFactor);
+
+        RenderCacheStats GetStats() const;
+
+    private:
+        RenderCache(const RenderCache&);                // not copyable
+        RenderCache& operator= (const RenderCache&);
+
+        struct Entry
+        {
+            FingerprintDigest key;
+            std::vector<unsigned char> data;
+        };
+        typedef std::list<Entry> EntryList;             // most recently used first
+        typedef std::map<FingerprintDigest, EntryList::iterator> EntryIndex;
+
+        void StoreInMemory(const FingerprintDigest& key, const std::vector<unsigned char>& data);
+        bool LoadFromDisk(const FingerprintDigest& key, std::vector<unsigned char>& data);
+        void StoreOnDisk(const FingerprintDigest& key, const std::vector<unsigned char>& data);
+        void EvictFromDisk();
+        std::string DiskPath(const FingerprintDigest& key) const;
+
+        const size_t memoryCapacity;
+        const std::string diskDirectory;
+        const size_t diskCapacity;
+
+        mutable std::mutex cacheMutex;
+        EntryList entryList;
+        EntryIndex entryIndex;
+        RenderCacheStats stats;
+    };
+}
+
+#endif // __DDC_CACHE_H
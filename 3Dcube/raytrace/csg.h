@@ -0,0 +1,385 @@
+/*
+    csg.h
+
+    Constructive solid geometry composed at compile time.
+
+    SetUnion, SetIntersection, and SetComplement build a shape at run
+    time out of heap-allocated solids, so every ray walks the tree
+    through virtual calls.  Here a fixed shape is instead written as a
+    type, for example
+
+        Csg::Difference< Cuboid, Csg::Union<Cuboid, Cuboid> >
+
+    and each node holds its operands by value.  Every call down the tree
+    is a non-virtual call the compiler can see through, so it can inline
+    the whole evaluation for that one shape.  The nodes evaluate the
+    set operators the same way the run-time ones do (see spans.cpp):
+    each operand reports the sorted spans of the ray inside it, a union
+    or intersection merges two span lists, and an intersection whose
+    left operand the ray misses skips its right operand altogether.
+
+    A leaf is either a Csg::Box, which calls the same box kernel as class
+    Cuboid, or any concrete SolidObject class, whose own methods are
+    called without virtual dispatch.  The leaves are placed, while the shape is
+    being built, in the shape's own coordinates; the shape then goes into
+    a scene wrapped in a StaticCsgSolid, which moves and rotates it as a
+    whole like any other reorientable solid.
+*/
+
+#ifndef __DDC_CSG_H
+#define __DDC_CSG_H
+
+#include "imager.h"
+#include "boxkernel.h"
+
+namespace Imager
+{
+    namespace Csg
+    {
+        // Calls a leaf's or node's methods without virtual dispatch.
+        // The qualified name tells the compiler exactly which function
+        // runs, and because every operand is held by value, it also
+        // knows the dynamic type of any solid a leaf calls into.
+        template <typename Shape>
+        inline void AppendShapeIntersections(
+            const Shape& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList)
+        {
+            shape.Shape::AppendAllIntersections(vantage, direction, intersectionList);
+        }
+
+        template <typename Shape>
+        inline bool ShapeContains(const Shape& shape, const Vector& point)
+        {
+            return shape.Shape::Contains(point);
+        }
+
+        // Fills 'spanList' with the spans of the ray inside a leaf, worked
+        // out from its surface crossings, which go into 'scratch'.  The
+        // nodes below overload this to merge their operands' spans instead.
+        template <typename Shape>
+        inline void FindShapeSpans(
+            const Shape& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList,
+            IntersectionList& scratch)
+        {
+            scratch.clear();
+            AppendShapeIntersections(shape, vantage, direction, scratch);
+            SpansFromCrossings(scratch, direction, spanList);
+        }
+
+        // An axis-aligned box with half extents a, b, and c around
+        // 'center', in the shape's coordinates.
+        class Box
+        {
+        public:
+            Box(double _a, double _b, double _c, const Vector& _center = Vector())
+                : a(_a)
+                , b(_b)
+                , c(_c)
+                , center(_center)
+            {
+            }
+
+            void AppendAllIntersections(
+                const Vector& vantage,
+                const Vector& direction,
+                IntersectionList& intersectionList) const
+            {
+                const size_t first = intersectionList.size();
+                AppendBoxIntersections(
+                    a, b, c, vantage - center, direction, intersectionList);
+                for (size_t index = first; index < intersectionList.size(); ++index)
+                {
+                    intersectionList[index].point += center;
+                }
+            }
+
+            bool Contains(const Vector& point) const
+            {
+                return CuboidContains(a, b, c, point - center);
+            }
+
+        private:
+            double a;
+            double b;
+            double c;
+            Vector center;
+        };
+
+        // Operators shared by the binary nodes.
+        template <typename LeftShape, typename RightShape>
+        class BinaryNode
+        {
+        public:
+            BinaryNode(const LeftShape& _left, const RightShape& _right)
+                : left(_left)
+                , right(_right)
+            {
+            }
+
+            LeftShape&  Left()  { return left;  }
+            RightShape& Right() { return right; }
+
+            const LeftShape&  Left()  const { return left;  }
+            const RightShape& Right() const { return right; }
+
+            // Finds the spans of the ray inside both operands and merges
+            // them, as SolidObject_BinaryOperator::CombineOperandSpans does.
+            void CombineOperandSpans(
+                const Vector& vantage,
+                const Vector& direction,
+                SpanOperator op,
+                SpanList& spanList) const
+            {
+                FindShapeSpans(left, vantage, direction, leftSpanList, leftCrossingList);
+
+                // A ray that never enters the left operand never enters
+                // its intersection with anything.
+                if (op == SPAN_INTERSECTION && leftSpanList.empty())
+                {
+                    spanList.clear();
+                    return;
+                }
+
+                FindShapeSpans(right, vantage, direction, rightSpanList, rightCrossingList);
+                CombineSpans(leftSpanList, rightSpanList, op, spanList);
+            }
+
+        protected:
+            // Appends the crossings at the ends of the merged spans.
+            void AppendCombinedIntersections(
+                const Vector& vantage,
+                const Vector& direction,
+                SpanOperator op,
+                IntersectionList& intersectionList) const
+            {
+                CombineOperandSpans(vantage, direction, op, resultSpanList);
+                AppendSpanBoundaries(resultSpanList, intersectionList);
+            }
+
+        private:
+            LeftShape  left;
+            RightShape right;
+
+            // Scratch space for one ray at a time, like the lists kept
+            // by the run-time set operators.  The spans point into the
+            // crossing lists, so both are kept until the next ray.
+            mutable IntersectionList leftCrossingList;
+            mutable IntersectionList rightCrossingList;
+            mutable SpanList leftSpanList;
+            mutable SpanList rightSpanList;
+            mutable SpanList resultSpanList;
+        };
+
+        // Every point inside either operand.
+        template <typename LeftShape, typename RightShape>
+        class Union: public BinaryNode<LeftShape, RightShape>
+        {
+        public:
+            Union(const LeftShape& _left, const RightShape& _right)
+                : BinaryNode<LeftShape, RightShape>(_left, _right)
+            {
+            }
+
+            void AppendAllIntersections(
+                const Vector& vantage,
+                const Vector& direction,
+                IntersectionList& intersectionList) const
+            {
+                this->AppendCombinedIntersections(vantage, direction, SPAN_UNION, intersectionList);
+            }
+
+            bool Contains(const Vector& point) const
+            {
+                return ShapeContains(this->Left(), point) || ShapeContains(this->Right(), point);
+            }
+        };
+
+        // Every point inside both operands.
+        template <typename LeftShape, typename RightShape>
+        class Intersection: public BinaryNode<LeftShape, RightShape>
+        {
+        public:
+            Intersection(const LeftShape& _left, const RightShape& _right)
+                : BinaryNode<LeftShape, RightShape>(_left, _right)
+            {
+            }
+
+            void AppendAllIntersections(
+                const Vector& vantage,
+                const Vector& direction,
+                IntersectionList& intersectionList) const
+            {
+                this->AppendCombinedIntersections(vantage, direction, SPAN_INTERSECTION, intersectionList);
+            }
+
+            bool Contains(const Vector& point) const
+            {
+                return ShapeContains(this->Left(), point) && ShapeContains(this->Right(), point);
+            }
+        };
+
+        // Every point NOT inside the operand.
+        template <typename Shape>
+        class Complement
+        {
+        public:
+            explicit Complement(const Shape& _shape)
+                : shape(_shape)
+            {
+            }
+
+            Shape& Inner() { return shape; }
+            const Shape& Inner() const { return shape; }
+
+            void AppendAllIntersections(
+                const Vector& vantage,
+                const Vector& direction,
+                IntersectionList& intersectionList) const
+            {
+                // Same surface, but inside and outside are swapped.
+                const size_t first = intersectionList.size();
+                AppendShapeIntersections(shape, vantage, direction, intersectionList);
+                for (size_t index = first; index < intersectionList.size(); ++index)
+                {
+                    intersectionList[index].surfaceNormal *= -1.0;
+                }
+            }
+
+            bool Contains(const Vector& point) const
+            {
+                return !ShapeContains(shape, point);
+            }
+
+            // The gaps between the spans of the ray inside the operand.
+            void FindSpans(
+                const Vector& vantage,
+                const Vector& direction,
+                SpanList& spanList) const
+            {
+                FindShapeSpans(shape, vantage, direction, innerSpanList, crossingList);
+                ComplementSpans(innerSpanList, spanList);
+            }
+
+        private:
+            Shape shape;
+            mutable IntersectionList crossingList;
+            mutable SpanList innerSpanList;
+        };
+
+        // Every point inside the left operand but not the right one,
+        // built the same way SetDifference is.
+        template <typename LeftShape, typename RightShape>
+        class Difference: public Intersection< LeftShape, Complement<RightShape> >
+        {
+        public:
+            Difference(const LeftShape& _left, const RightShape& _right)
+                : Intersection< LeftShape, Complement<RightShape> >(
+                    _left,
+                    Complement<RightShape>(_right))
+            {
+            }
+
+            RightShape& Subtracted() { return this->Right().Inner(); }
+            const RightShape& Subtracted() const { return this->Right().Inner(); }
+        };
+
+        // The nodes find their spans directly and need no scratch list.
+        template <typename LeftShape, typename RightShape>
+        inline void FindShapeSpans(
+            const Union<LeftShape, RightShape>& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList,
+            IntersectionList&)
+        {
+            shape.CombineOperandSpans(vantage, direction, SPAN_UNION, spanList);
+        }
+
+        template <typename LeftShape, typename RightShape>
+        inline void FindShapeSpans(
+            const Intersection<LeftShape, RightShape>& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList,
+            IntersectionList&)
+        {
+            shape.CombineOperandSpans(vantage, direction, SPAN_INTERSECTION, spanList);
+        }
+
+        template <typename LeftShape, typename RightShape>
+        inline void FindShapeSpans(
+            const Difference<LeftShape, RightShape>& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList,
+            IntersectionList&)
+        {
+            shape.CombineOperandSpans(vantage, direction, SPAN_INTERSECTION, spanList);
+        }
+
+        template <typename Shape>
+        inline void FindShapeSpans(
+            const Complement<Shape>& shape,
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList,
+            IntersectionList&)
+        {
+            shape.FindSpans(vantage, direction, spanList);
+        }
+    }
+
+    // Puts a compile-time shape into a scene as an ordinary SolidObject.
+    // The shape sits in object space around the solid's center.  Unlike
+    // a tree of set operators, the whole shape has the one material set
+    // on this solid; the optics of any SolidObject leaves are ignored.
+    template <typename Shape>
+    class StaticCsgSolid: public SolidObject_Reorientable
+    {
+    public:
+        StaticCsgSolid(const Vector& _center, const Shape& _shape)
+            : SolidObject_Reorientable(_center)
+            , shape(_shape)
+        {
+            SetTag("StaticCsgSolid");
+        }
+
+        const Shape& GetShape() const
+        {
+            return shape;
+        }
+
+    protected:
+        virtual void ObjectSpace_AppendAllIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const
+        {
+            Csg::FindShapeSpans(shape, vantage, direction, spanList, crossingList);
+            const size_t first = intersectionList.size();
+            AppendSpanBoundaries(spanList, intersectionList);
+            for (size_t index = first; index < intersectionList.size(); ++index)
+            {
+                intersectionList[index].solid = this;
+            }
+        }
+
+        virtual bool ObjectSpace_Contains(const Vector& point) const
+        {
+            return Csg::ShapeContains(shape, point);
+        }
+
+    private:
+        Shape shape;
+        mutable IntersectionList crossingList;
+        mutable SpanList spanList;
+    };
+}
+
+#endif // __DDC_CSG_H
@@ -4,124 +4,56 @@
 */
 
 #include "imager.h"
+#include "fingerprint.h"
+#include "boxkernel.h"
 
 namespace Imager
 {
+    // Declared in boxkernel.h for Csg::Box, which sets the solid itself.
+    void AppendBoxIntersections(
+        double a, double b, double c,
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList)
+    {
+        AppendCuboidIntersections(
+            NULL, a, b, c, vantage, direction, intersectionList);
+    }
+
     void Cuboid::ObjectSpace_AppendAllIntersections(
         const Vector& vantage, 
         const Vector& direction, 
         IntersectionList& intersectionList) const
     {
-        double u;
-        Intersection intersection;
-        Vector displacement;
-
-        // Check for intersections with left/right faces: x = +a or x = -a.
-        if (fabs(direction.x) > EPSILON)
-        {
-            // right face (x = +a)
-            u = (a - vantage.x) / direction.x;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(+1.0, 0.0, 0.0);
-                    intersection.solid = this;
-                    intersection.tag = "right face";
-                    intersectionList.push_back(intersection);
-                }
-            }
-
-            // left face (x = -a)
-            u = (-a - vantage.x) / direction.x;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(-1.0, 0.0, 0.0);
-                    intersection.solid = this;
-                    intersection.tag = "left face";
-                    intersectionList.push_back(intersection);
-                }
-            }
-        }
+        AppendCuboidIntersections(
+            this, a, b, c, vantage, direction, intersectionList);
+    }
 
-        // Check for intersections with front/back faces: y = -b or y = +b.
-        if (fabs(direction.y) > EPSILON)
+    void Cuboid::ContainsEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray) const
+    {
+        for (size_t k=0; k < count; ++k)
         {
-            // front face (y = +b)
-            u = (b - vantage.y) / direction.y;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(0.0, +1.0, 0.0);
-                    intersection.solid = this;
-                    intersection.tag = "front face";
-                    intersectionList.push_back(intersection);
-                }
-            }
-
-            // back face (y = -b)
-            u = (-b - vantage.y) / direction.y;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(0.0, -1.0, 0.0);
-                    intersection.solid = this;
-                    intersection.tag = "back face";
-                    intersectionList.push_back(intersection);
-                }
-            }
+            insideArray[k] = CuboidContains(
+                a, b, c, 
+                ObjectPointFromCameraPoint(pointArray[k]));
         }
+    }
 
-        // Check for intersections with top/bottom faces: z = -c or z = +c.
-        if (fabs(direction.z) > EPSILON)
-        {
-            // top face (z = +c)
-            u = (c - vantage.z) / direction.z;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(0.0, 0.0, +1.0);
-                    intersection.solid = this;
-                    intersection.tag = "top face";
-                    intersectionList.push_back(intersection);
-                }
-            }
-
-            // bottom face (z = -c)
-            u = (-c - vantage.z) / direction.z;
-            if (u > EPSILON)
-            {
-                displacement = u * direction;
-                intersection.point = vantage + displacement;
-                if (ObjectSpace_Contains(intersection.point))
-                {
-                    intersection.distanceSquared = displacement.MagnitudeSquared();
-                    intersection.surfaceNormal = Vector(0.0, 0.0, -1.0);
-                    intersection.solid = this;
-                    intersection.tag = "bottom face";
-                    intersectionList.push_back(intersection);
-                }
-            }
-        }
+    bool Cuboid::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        Vector rDir, sDir, tDir;
+        GetOrientation(rDir, sDir, tDir);
+
+        AppendCommonFingerprint(fingerprint);
+        fingerprint.AddVector(rDir);
+        fingerprint.AddVector(sDir);
+        fingerprint.AddVector(tDir);
+        fingerprint.AddDouble(a);
+        fingerprint.AddDouble(b);
+        fingerprint.AddDouble(c);
+        return true;
     }
 }
@@ -0,0 +1,244 @@
+/*
+    describe.cpp
+
+    Parses the plain-text scene descriptions documented in describe.h.
+*/
+
+#include <sstream>
+#include "describe.h"
+
+namespace Imager
+{
+    namespace
+    {
+        // Caps the oversampled image a description may ask for,
+        // so that a bad request cannot exhaust memory.
+        const double MAX_DESCRIBED_SAMPLES = 256.0e+6;
+
+        double ReadNumber(std::istringstream& line)
+        {
+            double value;
+            if (!(line >> value))
+            {
+                throw ImagerException("Expected a number in scene description.");
+            }
+            return value;
+        }
+
+        size_t ReadCount(std::istringstream& line)
+        {
+            const double value = ReadNumber(line);
+            if (value < 1.0 || value > 100000.0 || value != static_cast<size_t>(value))
+            {
+                throw ImagerException("Expected a positive integer in scene description.");
+            }
+            return static_cast<size_t>(value);
+        }
+
+        // Reads an optional ray budget: a whole number of rays,
+        // where 0 means no budget.  Returns false at the end of the line.
+        bool ReadRayBudget(std::istringstream& line, unsigned long& budget)
+        {
+            double value;
+            if (!(line >> value))
+            {
+                return false;
+            }
+            if (value < 0.0 || value > 1.0e+12 || value != static_cast<unsigned long>(value))
+            {
+                throw ImagerException("Expected a ray budget in scene description.");
+            }
+            budget = static_cast<unsigned long>(value);
+            return true;
+        }
+
+        Vector ReadVector(std::istringstream& line)
+        {
+            const double x = ReadNumber(line);
+            const double y = ReadNumber(line);
+            const double z = ReadNumber(line);
+            return Vector(x, y, z);
+        }
+
+        Color ReadColor(std::istringstream& line)
+        {
+            const double red   = ReadNumber(line);
+            const double green = ReadNumber(line);
+            const double blue  = ReadNumber(line);
+            return Color(red, green, blue);
+        }
+
+        void ParseCuboid(std::istringstream& line, Scene& scene)
+        {
+            const double a = ReadNumber(line);
+            const double b = ReadNumber(line);
+            const double c = ReadNumber(line);
+
+            // Hand the cuboid to the scene right away, so that it is
+            // freed along with the scene if a modifier is malformed.
+            Cuboid* cuboid = new Cuboid(a, b, c);
+            scene.AddSolidObject(cuboid);
+
+            std::string modifier;
+            while (line >> modifier)
+            {
+                if (modifier == "center")
+                {
+                    cuboid->Move(ReadVector(line));
+                }
+                else if (modifier == "rotate")
+                {
+                    std::string axis;
+                    line >> axis;
+                    const double angle = ReadNumber(line);
+                    if (axis == "x")
+                    {
+                        cuboid->RotateX(angle);
+                    }
+                    else if (axis == "y")
+                    {
+                        cuboid->RotateY(angle);
+                    }
+                    else if (axis == "z")
+                    {
+                        cuboid->RotateZ(angle);
+                    }
+                    else
+                    {
+                        throw ImagerException("Rotation axis must be x, y, or z.");
+                    }
+                }
+                else if (modifier == "matte")
+                {
+                    cuboid->SetFullMatte(ReadColor(line));
+                }
+                else if (modifier == "gloss")
+                {
+                    const double glossFactor = ReadNumber(line);
+                    const Color matteColor = ReadColor(line);
+                    const Color glossColor = ReadColor(line);
+                    cuboid->SetMatteGlossBalance(glossFactor, matteColor, glossColor);
+                }
+                else if (modifier == "opacity")
+                {
+                    cuboid->SetOpacity(ReadNumber(line));
+                }
+                else if (modifier == "refraction")
+                {
+                    cuboid->SetRefraction(ReadNumber(line));
+                }
+                else
+                {
+                    throw ImagerException("Unknown cuboid modifier in scene description.");
+                }
+            }
+        }
+    }
+
+    void ParseSceneDescription(
+        const std::string& text,
+        Scene& scene,
+        RenderRequest& request,
+        bool allowFiles)
+    {
+        std::istringstream input(text);
+        std::string lineText;
+        while (std::getline(input, lineText))
+        {
+            std::istringstream line(lineText);
+            std::string keyword;
+            if (!(line >> keyword) || keyword[0] == '#')
+            {
+                continue;   // blank line or comment
+            }
+
+            if (keyword == "end")
+            {
+                return;
+            }
+            else if (keyword == "image")
+            {
+                request.pixelsWide = ReadCount(line);
+                request.pixelsHigh = ReadCount(line);
+                request.zoom = ReadNumber(line);
+                if (request.zoom <= 0.0)
+                {
+                    throw ImagerException("Zoom must be positive.");
+                }
+                request.antiAliasFactor = ReadCount(line);
+
+                const double numSamples =
+                    static_cast<double>(request.pixelsWide * request.antiAliasFactor) *
+                    static_cast<double>(request.pixelsHigh * request.antiAliasFactor);
+                if (numSamples > MAX_DESCRIBED_SAMPLES)
+                {
+                    throw ImagerException("Image is too large for a scene description.");
+                }
+
+                std::string format;
+                if (line >> format)
+                {
+                    if (format == "png")
+                    {
+                        request.format = IMAGE_FORMAT_PNG;
+                    }
+                    else if (format == "rgba")
+                    {
+                        request.format = IMAGE_FORMAT_RGBA;
+                    }
+                    else
+                    {
+                        throw ImagerException("Image format must be png or rgba.");
+                    }
+                }
+            }
+            else if (keyword == "background")
+            {
+                scene.SetBackgroundColor(ReadColor(line));
+            }
+            else if (keyword == "ambient")
+            {
+                scene.SetAmbientRefraction(ReadNumber(line));
+            }
+            else if (keyword == "limits")
+            {
+                RenderLimits limits;
+                limits.maxRecursionDepth = static_cast<int>(ReadCount(line));
+                limits.minRayIntensity = ReadNumber(line);
+                if (ReadRayBudget(line, limits.maxRaysPerPixel))
+                {
+                    ReadRayBudget(line, limits.maxRaysPerFrame);
+                }
+                scene.SetRenderLimits(limits);
+            }
+            else if (keyword == "light")
+            {
+                const Vector location = ReadVector(line);
+                const Color color = ReadColor(line);
+                scene.AddLightSource(LightSource(location, color));
+            }
+            else if (keyword == "baked")
+            {
+                if (!allowFiles)
+                {
+                    throw ImagerException("Baked scene files are not allowed in this description.");
+                }
+
+                std::string filename;
+                if (!(line >> filename))
+                {
+                    throw ImagerException("Expected a file name after 'baked'.");
+                }
+                scene.LoadBakedScene(filename.c_str());
+            }
+            else if (keyword == "cuboid")
+            {
+                ParseCuboid(line, scene);
+            }
+            else
+            {
+                throw ImagerException("Unknown statement in scene description.");
+            }
+        }
+    }
+}
@@ -0,0 +1,82 @@
+/*
+    describe.h
+
+    Reads a plain-text description of a scene and how to render it.
+    Each statement occupies one line; blank lines and lines starting
+    with '#' are ignored.  A description ends with a line "end".
+
+        image <width> <height> <zoom> <antiAliasFactor> [png|rgba]
+        background <red> <green> <blue>
+        ambient <refractiveIndex>
+        limits <maxDepth> <minIntensity> [<raysPerPixel> [<raysPerFrame>]]
+        light <x> <y> <z> <red> <green> <blue>
+        baked <filename>
+        cuboid <a> <b> <c> [modifier ...]
+
+    The limits statement sets the scene's RenderLimits; ray budgets
+    of 0, or left out, mean no budget.  The baked statement loads a
+    baked scene file (see baked.h) and is refused in descriptions
+    from untrusted sources, which must not be able to name files.
+
+    Cuboid modifiers are applied in the order written:
+
+        center <x> <y> <z>
+        rotate x|y|z <degrees>
+        matte <red> <green> <blue>
+        gloss <glossFactor> <matteRed> <matteGreen> <matteBlue>
+              <glossRed> <glossGreen> <glossBlue>
+        opacity <opacity>
+        refraction <refractiveIndex>
+
+    For example, the first of the stock cube images is:
+
+        image 300 300 3.0 2 png
+        cuboid 2 2 2 matte 0.7 0.7 0.8 center 0 0 -50 rotate x -115 rotate y 22
+        light -5 50 20 0.7 0.7 0.7
+        end
+*/
+
+#ifndef __DDC_DESCRIBE_H
+#define __DDC_DESCRIBE_H
+
+#include <string>
+#include "imager.h"
+
+namespace Imager
+{
+    enum ImageFormat
+    {
+        IMAGE_FORMAT_PNG,       // encoded PNG file contents
+        IMAGE_FORMAT_RGBA       // raw 8-bit red, green, blue, alpha per pixel
+    };
+
+    struct RenderRequest
+    {
+        size_t      pixelsWide;
+        size_t      pixelsHigh;
+        double      zoom;
+        size_t      antiAliasFactor;
+        ImageFormat format;
+
+        RenderRequest()
+            : pixelsWide(300)
+            , pixelsHigh(300)
+            , zoom(3.0)
+            , antiAliasFactor(1)
+            , format(IMAGE_FORMAT_PNG)
+        {
+        }
+    };
+
+    // Adds the solids and light sources described by 'text' to 'scene',
+    // and fills in 'request' from any "image" statement.
+    // Throws ImagerException if the description is malformed, or if
+    // it has a "baked" statement and 'allowFiles' is false.
+    void ParseSceneDescription(
+        const std::string& text,
+        Scene& scene,
+        RenderRequest& request,
+        bool allowFiles = true);
+}
+
+#endif // __DDC_DESCRIBE_H
@@ -0,0 +1,144 @@
+/*
+    fdio.h
+
+    Blocking reads and writes on file descriptors (pipes and sockets)
+    for the render server and the tile coordinator and workers.
+*/
+
+#ifndef __DDC_FDIO_H
+#define __DDC_FDIO_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+namespace Imager
+{
+    // Buffered line-at-a-time reading from a file descriptor.
+    // Binary data following a line can be read with ReadBytes,
+    // which takes whatever the line reading buffered first.
+    class LineReader
+    {
+    public:
+        // No line in any of the protocols comes near this long, so a
+        // longer one means the peer is broken or hostile.
+        static const size_t MAX_LINE_LENGTH = 64 << 10;
+
+        explicit LineReader(int _fd)
+            : fd(_fd)
+            , start(0)
+            , length(0)
+            , lineTooLong(false)
+        {
+        }
+
+        // Reads one line, without its terminating newline.
+        // Returns false once the input is exhausted, or if the line
+        // is longer than MAX_LINE_LENGTH, after which LineTooLong
+        // returns true and the reader must not be used again.
+        bool ReadLine(std::string& line)
+        {
+            line.clear();
+            for(;;)
+            {
+                while (start < length)
+                {
+                    const char c = buffer[start++];
+                    if (c == '\n')
+                    {
+                        return true;
+                    }
+                    if (line.size() == MAX_LINE_LENGTH)
+                    {
+                        lineTooLong = true;
+                        return false;
+                    }
+                    line += c;
+                }
+
+                if (!Fill())
+                {
+                    return !line.empty();
+                }
+            }
+        }
+
+        bool LineTooLong() const
+        {
+            return lineTooLong;
+        }
+
+        // Reads exactly 'size' bytes; returns false if the input
+        // ends first.
+        bool ReadBytes(void *data, size_t size)
+        {
+            char *bytes = static_cast<char *>(data);
+            while (size > 0)
+            {
+                if (start == length && !Fill())
+                {
+                    return false;
+                }
+                size_t count = length - start;
+                if (count > size)
+                {
+                    count = size;
+                }
+                memcpy(bytes, buffer + start, count);
+                start += count;
+                bytes += count;
+                size -= count;
+            }
+            return true;
+        }
+
+    private:
+        bool Fill()
+        {
+            for(;;)
+            {
+                const ssize_t count = read(fd, buffer, sizeof(buffer));
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    return false;
+                }
+                start = 0;
+                length = static_cast<size_t>(count);
+                return true;
+            }
+        }
+
+        const int fd;
+        char buffer[4096];
+        size_t start;
+        size_t length;
+        bool lineTooLong;
+    };
+
+    inline bool WriteAll(int fd, const void *data, size_t size)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            const ssize_t count = write(fd, bytes, size);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            bytes += count;
+            size -= static_cast<size_t>(count);
+        }
+        return true;
+    }
+}
+
+#endif // __DDC_FDIO_H
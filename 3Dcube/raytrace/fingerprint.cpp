@@ -0,0 +1,195 @@
+/*
+    fingerprint.cpp
+
+    Implements the SHA-256 scene fingerprint declared in fingerprint.h,
+    following FIPS 180-4.
+*/
+
+#include "fingerprint.h"
+
+namespace Imager
+{
+    namespace
+    {
+        const uint32_t ROUND_CONSTANTS[64] =
+        {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        inline uint32_t RotateRight(uint32_t x, int n)
+        {
+            return (x >> n) | (x << (32 - n));
+        }
+    }
+
+    std::string FingerprintDigest::ToHex() const
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (size_t k=0; k < SIZE; ++k)
+        {
+            hex += digits[bytes[k] >> 4];
+            hex += digits[bytes[k] & 15];
+        }
+        return hex;
+    }
+
+    Fingerprint::Fingerprint()
+        : blockLength(0)
+        , totalLength(0)
+    {
+        state[0] = 0x6a09e667;
+        state[1] = 0xbb67ae85;
+        state[2] = 0x3c6ef372;
+        state[3] = 0xa54ff53a;
+        state[4] = 0x510e527f;
+        state[5] = 0x9b05688c;
+        state[6] = 0x1f83d9ab;
+        state[7] = 0x5be0cd19;
+    }
+
+    void Fingerprint::Append(const void *data, size_t size)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        totalLength += size;
+
+        // Top up a partly filled block first.
+        if (blockLength > 0)
+        {
+            size_t count = sizeof(block) - blockLength;
+            if (count > size)
+            {
+                count = size;
+            }
+            memcpy(block + blockLength, bytes, count);
+            blockLength += count;
+            bytes += count;
+            size -= count;
+            if (blockLength < sizeof(block))
+            {
+                return;
+            }
+            Compress(block);
+            blockLength = 0;
+        }
+
+        // Whole blocks are compressed straight from the caller's data,
+        // which matters when fingerprinting large baked scene files.
+        while (size >= sizeof(block))
+        {
+            Compress(bytes);
+            bytes += sizeof(block);
+            size -= sizeof(block);
+        }
+
+        memcpy(block, bytes, size);
+        blockLength = size;
+    }
+
+    void Fingerprint::Compress(const unsigned char *data)
+    {
+        uint32_t w[64];
+        for (int i=0; i < 16; ++i)
+        {
+            w[i] =
+                (static_cast<uint32_t>(data[4*i])   << 24) |
+                (static_cast<uint32_t>(data[4*i+1]) << 16) |
+                (static_cast<uint32_t>(data[4*i+2]) <<  8) |
+                (static_cast<uint32_t>(data[4*i+3]));
+        }
+        for (int i=16; i < 64; ++i)
+        {
+            const uint32_t s0 = RotateRight(w[i-15], 7) ^ RotateRight(w[i-15], 18) ^ (w[i-15] >> 3);
+            const uint32_t s1 = RotateRight(w[i-2], 17) ^ RotateRight(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+        uint32_t e = state[4];
+        uint32_t f = state[5];
+        uint32_t g = state[6];
+        uint32_t h = state[7];
+
+        for (int i=0; i < 64; ++i)
+        {
+            const uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+            const uint32_t choose = (e & f) ^ (~e & g);
+            const uint32_t temp1 = h + s1 + choose + ROUND_CONSTANTS[i] + w[i];
+            const uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+            const uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t temp2 = s0 + majority;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    FingerprintDigest Fingerprint::Digest() const
+    {
+        // Pad a copy, so that more can still be added to this one.
+        Fingerprint padded = *this;
+        const uint64_t bitLength = totalLength * 8;
+
+        const unsigned char marker = 0x80;
+        padded.Append(&marker, 1);
+
+        const unsigned char zeros[64] = { 0 };
+        const size_t padding = (padded.blockLength <= 56) ?
+            (56 - padded.blockLength) :
+            (64 + 56 - padded.blockLength);
+        padded.Append(zeros, padding);
+
+        unsigned char lengthBytes[8];
+        for (int k=0; k < 8; ++k)
+        {
+            lengthBytes[k] = static_cast<unsigned char>(bitLength >> (8*(7-k)));
+        }
+        padded.Append(lengthBytes, sizeof(lengthBytes));
+
+        FingerprintDigest digest;
+        for (int i=0; i < 8; ++i)
+        {
+            digest.bytes[4*i]   = static_cast<unsigned char>(padded.state[i] >> 24);
+            digest.bytes[4*i+1] = static_cast<unsigned char>(padded.state[i] >> 16);
+            digest.bytes[4*i+2] = static_cast<unsigned char>(padded.state[i] >>  8);
+            digest.bytes[4*i+3] = static_cast<unsigned char>(padded.state[i]);
+        }
+        return digest;
+    }
+
+    uint64_t Fingerprint::Value() const
+    {
+        const FingerprintDigest digest = Digest();
+        uint64_t value = 0;
+        for (int k=0; k < 8; ++k)
+        {
+            value = (value << 8) | digest.bytes[k];
+        }
+        return value;
+    }
+}
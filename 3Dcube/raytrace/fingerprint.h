@@ -0,0 +1,132 @@
+/*
+    fingerprint.h
+
+    A SHA-256 digest accumulated over the canonical contents of a scene,
+    so that identical render requests can be recognized and served
+    from a cache (see cache.h).  The digest is long enough that two
+    different scenes sharing one is not a practical concern, even for
+    a cache directory that keeps entries between runs.
+*/
+
+#ifndef __DDC_FINGERPRINT_H
+#define __DDC_FINGERPRINT_H
+
+#include <cstring>
+#include <string>
+#include <stdint.h>
+#include "imager.h"
+
+namespace Imager
+{
+    struct FingerprintDigest
+    {
+        static const size_t SIZE = 32;
+        unsigned char bytes[SIZE];
+
+        FingerprintDigest()
+        {
+            memset(bytes, 0, SIZE);
+        }
+
+        bool operator< (const FingerprintDigest& other) const
+        {
+            return memcmp(bytes, other.bytes, SIZE) < 0;
+        }
+
+        bool operator== (const FingerprintDigest& other) const
+        {
+            return memcmp(bytes, other.bytes, SIZE) == 0;
+        }
+
+        bool operator!= (const FingerprintDigest& other) const
+        {
+            return !(*this == other);
+        }
+
+        // Returns the digest as 64 lowercase hexadecimal digits.
+        std::string ToHex() const;
+    };
+
+    class Fingerprint
+    {
+    public:
+        Fingerprint();
+
+        // Integers are added as 8 bytes, least significant first,
+        // so that a digest is the same on every machine.
+        void AddInteger(uint64_t value)
+        {
+            unsigned char bytes[8];
+            for (int k=0; k < 8; ++k)
+            {
+                bytes[k] = static_cast<unsigned char>(value >> (8*k));
+            }
+            Append(bytes, sizeof(bytes));
+        }
+
+        void AddDouble(double value)
+        {
+            // Treat negative zero the same as positive zero, so that
+            // equal values always produce equal fingerprints.
+            if (value == 0.0)
+            {
+                value = 0.0;
+            }
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            AddInteger(bits);
+        }
+
+        void AddVector(const Vector& vector)
+        {
+            AddDouble(vector.x);
+            AddDouble(vector.y);
+            AddDouble(vector.z);
+        }
+
+        void AddColor(const Color& color)
+        {
+            AddDouble(color.red);
+            AddDouble(color.green);
+            AddDouble(color.blue);
+        }
+
+        void AddString(const std::string& text)
+        {
+            AddBytes(text.data(), text.size());
+        }
+
+        // The size goes in first, so that no two different sequences
+        // of additions produce the same stream of bytes.
+        void AddBytes(const void *data, size_t size)
+        {
+            AddInteger(size);
+            Append(data, size);
+        }
+
+        void AddDigest(const FingerprintDigest& digest)
+        {
+            Append(digest.bytes, FingerprintDigest::SIZE);
+        }
+
+        // Returns the SHA-256 digest of everything added so far.
+        // More can still be added afterward.
+        FingerprintDigest Digest() const;
+
+        // Returns the first 8 bytes of the digest, for telling apart
+        // states of the same scene within one run.  Anything kept
+        // between runs, or shared between scenes, should use Digest.
+        uint64_t Value() const;
+
+    private:
+        void Append(const void *data, size_t size);
+        void Compress(const unsigned char *block);
+
+        uint32_t state[8];
+        unsigned char block[64];
+        size_t blockLength;
+        uint64_t totalLength;
+    };
+}
+
+#endif // __DDC_FINGERPRINT_H
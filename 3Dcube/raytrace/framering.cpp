@@ -0,0 +1,272 @@
+/*
+    framering.cpp
+
+    Implements the shared memory frame ring declared in framering.h.
+*/
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "framering.h"
+#include "imager.h"
+#include "timer.h"
+
+namespace Imager
+{
+    static_assert(sizeof(FrameRingHeader) == 64, "FrameRingHeader must be 64 bytes.");
+    static_assert(sizeof(FrameSlotHeader) == 64, "FrameSlotHeader must be 64 bytes.");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The frame ring needs lock-free 64-bit atomics.");
+
+    namespace
+    {
+        // How long to sleep between looks at the other side's progress.
+        const useconds_t FRAME_RING_POLL_MICROSECONDS = 50;
+
+        // Slots are a whole number of cache lines.
+        const size_t FRAME_SLOT_ALIGNMENT = 64;
+
+        FrameSlotHeader *SlotAt(FrameRingHeader *header, unsigned long long frameNumber)
+        {
+            char *base = reinterpret_cast<char *>(header) + sizeof(FrameRingHeader);
+            return reinterpret_cast<FrameSlotHeader *>(
+                base + (frameNumber % header->slotCount) * header->slotBytes);
+        }
+    }
+
+    size_t FrameBytesPerPixel(FrameFormat format)
+    {
+        switch (format)
+        {
+        case FRAME_FORMAT_RGBA8:
+            return 4;
+
+        case FRAME_FORMAT_RGBA_FLOAT:
+            return 4 * sizeof(float);
+
+        default:
+            throw ImagerException("Invalid frame format.");
+        }
+    }
+
+
+    FrameRingWriter::FrameRingWriter(
+        const char *_name,
+        FrameFormat format,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        size_t slotCount,
+        bool dropFrames)
+            : name(_name)
+            , mapBytes(0)
+            , header(NULL)
+            , slot(NULL)
+    {
+        if (pixelsWide == 0 || pixelsHigh == 0 || slotCount == 0)
+        {
+            throw ImagerException("Frame ring dimensions must be positive.");
+        }
+
+        const size_t frameBytes = pixelsWide * pixelsHigh * FrameBytesPerPixel(format);
+        size_t slotBytes = sizeof(FrameSlotHeader) + frameBytes;
+        slotBytes = (slotBytes + FRAME_SLOT_ALIGNMENT - 1) / FRAME_SLOT_ALIGNMENT * FRAME_SLOT_ALIGNMENT;
+        mapBytes = sizeof(FrameRingHeader) + slotCount * slotBytes;
+
+        shm_unlink(_name);      // remove any ring left by an earlier writer
+        const int fd = shm_open(_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            throw ImagerException("Cannot create frame ring shared memory.");
+        }
+
+        void *address = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(mapBytes)) == 0)
+        {
+            address = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (address == MAP_FAILED)
+        {
+            shm_unlink(_name);
+            throw ImagerException("Cannot map frame ring shared memory.");
+        }
+
+        // The new object is all zero bytes, which leaves every slot's
+        // sequence at 0: holding no frame.  The magic number goes in
+        // last, so a reader never sees a half-made header as valid.
+        header = static_cast<FrameRingHeader *>(address);
+        header->version = FRAME_RING_VERSION;
+        header->format = format;
+        header->slotCount = static_cast<unsigned>(slotCount);
+        header->pixelsWide = static_cast<unsigned>(pixelsWide);
+        header->pixelsHigh = static_cast<unsigned>(pixelsHigh);
+        header->slotBytes = slotBytes;
+        header->frameBytes = frameBytes;
+        header->dropFrames = dropFrames ? 1 : 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = FRAME_RING_MAGIC;
+    }
+
+    FrameRingWriter::~FrameRingWriter()
+    {
+        header->closed.store(1, std::memory_order_release);
+        munmap(header, mapBytes);
+        shm_unlink(name.c_str());
+    }
+
+    void *FrameRingWriter::BeginFrame(double timeoutSeconds)
+    {
+        const unsigned long long frameNumber = header->written.load(std::memory_order_relaxed);
+        if (!header->dropFrames)
+        {
+            // Frame n reuses the slot of frame n - slotCount, which the
+            // reader must have released.
+            const double deadline = WallClockSeconds() + timeoutSeconds;
+            while (frameNumber - header->released.load(std::memory_order_acquire) >= header->slotCount)
+            {
+                if (WallClockSeconds() > deadline)
+                {
+                    return NULL;
+                }
+                usleep(FRAME_RING_POLL_MICROSECONDS);
+            }
+        }
+
+        slot = SlotAt(header, frameNumber);
+        slot->sequence.store(2*frameNumber + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot->frameNumber = frameNumber;
+        return reinterpret_cast<char *>(slot) + sizeof(FrameSlotHeader);
+    }
+
+    void FrameRingWriter::EndFrame()
+    {
+        if (slot == NULL)
+        {
+            throw ImagerException("EndFrame called without BeginFrame.");
+        }
+        const unsigned long long frameNumber = slot->frameNumber;
+        slot->timeStamp = WallClockSeconds();
+        slot->sequence.store(2*frameNumber + 2, std::memory_order_release);
+        header->written.store(frameNumber + 1, std::memory_order_release);
+        slot = NULL;
+    }
+
+    bool FrameRingWriter::WriteFrame(const void *pixels, double timeoutSeconds)
+    {
+        void *target = BeginFrame(timeoutSeconds);
+        if (target == NULL)
+        {
+            return false;
+        }
+        memcpy(target, pixels, static_cast<size_t>(header->frameBytes));
+        EndFrame();
+        return true;
+    }
+
+
+    FrameRingReader::FrameRingReader(const char *name)
+        : mapBytes(0)
+        , header(NULL)
+        , next(0)
+        , skipped(0)
+        , slot(NULL)
+    {
+        const int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+        {
+            throw ImagerException("Cannot open frame ring shared memory.");
+        }
+
+        struct stat info;
+        void *address = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(FrameRingHeader))
+        {
+            mapBytes = static_cast<size_t>(info.st_size);
+            address = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (address == MAP_FAILED)
+        {
+            throw ImagerException("Cannot map frame ring shared memory.");
+        }
+
+        header = static_cast<FrameRingHeader *>(address);
+        const bool valid =
+            header->magic == FRAME_RING_MAGIC &&
+            header->version == FRAME_RING_VERSION &&
+            header->slotCount > 0 &&
+            sizeof(FrameRingHeader) + header->slotCount * header->slotBytes <= mapBytes;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!valid)
+        {
+            munmap(header, mapBytes);
+            throw ImagerException("Shared memory object is not a frame ring.");
+        }
+
+        // Start with the oldest frame still in the ring.
+        const unsigned long long written = header->written.load(std::memory_order_acquire);
+        next = header->released.load(std::memory_order_acquire);
+        if (written - next > header->slotCount)
+        {
+            next = written - header->slotCount;
+        }
+    }
+
+    FrameRingReader::~FrameRingReader()
+    {
+        munmap(header, mapBytes);
+    }
+
+    const void *FrameRingReader::AcquireFrame(unsigned long long& frameNumber, double timeoutSeconds)
+    {
+        const double deadline = WallClockSeconds() + timeoutSeconds;
+        for(;;)
+        {
+            const unsigned long long written = header->written.load(std::memory_order_acquire);
+            if (next < written)
+            {
+                const FrameSlotHeader *candidate = SlotAt(header, next);
+                if (candidate->sequence.load(std::memory_order_acquire) == 2*next + 2)
+                {
+                    slot = candidate;
+                    frameNumber = next;
+                    return reinterpret_cast<const char *>(slot) + sizeof(FrameSlotHeader);
+                }
+
+                // The writer has moved on to a later frame in this slot.
+                ++skipped;
+                ++next;
+                continue;
+            }
+
+            if (header->closed.load(std::memory_order_acquire) || WallClockSeconds() > deadline)
+            {
+                return NULL;
+            }
+            usleep(FRAME_RING_POLL_MICROSECONDS);
+        }
+    }
+
+    bool FrameRingReader::ReleaseFrame()
+    {
+        if (slot == NULL)
+        {
+            throw ImagerException("ReleaseFrame called without AcquireFrame.");
+        }
+
+        // The pixels are intact only if the writer did not start on a
+        // later frame in this slot while they were being read.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const bool intact = (slot->sequence.load(std::memory_order_relaxed) == 2*next + 2);
+        if (!intact)
+        {
+            ++skipped;
+        }
+        slot = NULL;
+        ++next;
+        header->released.store(next, std::memory_order_release);
+        return intact;
+    }
+}
@@ -0,0 +1,154 @@
+/*
+    framering.h
+
+    Hands finished frames to another process on the same machine
+    through a POSIX shared memory object, so that a consumer such as a
+    compositor can use the pixels in place instead of decoding PNG
+    files.  One writer fills a ring of frame slots; one reader maps the
+    same object and walks the slots in order.
+
+    The shared memory object starts with a FrameRingHeader, followed by
+    'slotCount' slots of 'slotBytes' bytes each.  A slot is a
+    FrameSlotHeader followed by the pixels, row by row from the top of
+    the image.  Both headers are 64 bytes so the pixels of every slot
+    start on a cache line.
+
+    Frame n (counting from 0) goes in slot n % slotCount.  Each slot's
+    'sequence' is odd while the writer is filling it and 2n+2 once
+    frame n is complete, so a reader can tell whether a slot holds the
+    frame it expects and whether it was overwritten while being read.
+    The header's 'written' counts complete frames and 'released' counts
+    frames the reader has finished with.  Unless it was told to drop
+    frames, the writer waits for the reader to release a slot before
+    reusing it; a writer that drops frames never waits, and a reader
+    that falls behind skips ahead to the oldest frame still in the ring.
+
+    Waiting on either side is done by polling with short sleeps, which
+    keeps the protocol to plain memory a consumer written in any
+    language can follow.  The counters must be lock-free 64-bit atomics.
+*/
+
+#ifndef __DDC_FRAMERING_H
+#define __DDC_FRAMERING_H
+
+#include <atomic>
+#include <string>
+
+namespace Imager
+{
+    const unsigned FRAME_RING_MAGIC   = 0x474E5246;    // "FRNG" in little-endian byte order
+    const unsigned FRAME_RING_VERSION = 1;
+
+    enum FrameFormat
+    {
+        FRAME_FORMAT_RGBA8,         // 4 bytes per pixel, as from Scene::RenderImage
+        FRAME_FORMAT_RGBA_FLOAT     // 4 floats per pixel, as from Scene::GetFloatImage
+    };
+
+    // Returns the number of bytes in one pixel of the given format.
+    size_t FrameBytesPerPixel(FrameFormat format);
+
+    struct FrameRingHeader
+    {
+        unsigned magic;             // FRAME_RING_MAGIC
+        unsigned version;           // FRAME_RING_VERSION
+        unsigned format;            // a FrameFormat
+        unsigned slotCount;
+        unsigned pixelsWide;
+        unsigned pixelsHigh;
+        unsigned long long slotBytes;       // bytes from one slot header to the next
+        unsigned long long frameBytes;      // bytes of pixels in a frame
+        std::atomic<unsigned long long> written;    // complete frames so far
+        std::atomic<unsigned long long> released;   // frames the reader is done with
+        std::atomic<unsigned> closed;               // nonzero once the writer has quit
+        unsigned dropFrames;                        // nonzero if the writer never waits
+    };
+
+    struct FrameSlotHeader
+    {
+        std::atomic<unsigned long long> sequence;   // odd while writing; 2n+2 when holding frame n
+        unsigned long long frameNumber;
+        double timeStamp;                           // WallClockSeconds when the frame was published
+        char padding[40];
+    };
+
+    // Creates a frame ring and publishes frames to it.
+    class FrameRingWriter
+    {
+    public:
+        // 'name' is a shared memory object name such as "/raytrace".
+        // Any object left with the same name is replaced.  Throws
+        // ImagerException if the object cannot be created.
+        FrameRingWriter(
+            const char *name,
+            FrameFormat format,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            size_t slotCount,
+            bool dropFrames);
+
+        // Marks the ring closed and removes its name.  A reader that
+        // has it mapped can still finish the frames in it.
+        ~FrameRingWriter();
+
+        // Returns where to put the next frame's pixels, after waiting
+        // for the reader to release the slot unless dropping frames.
+        // Returns NULL if the reader has not released it within
+        // 'timeoutSeconds'.
+        void *BeginFrame(double timeoutSeconds = 10.0);
+
+        // Publishes the frame started by BeginFrame.
+        void EndFrame();
+
+        // Copies 'pixels', of frameBytes bytes, into the ring as the
+        // next frame.  Returns false after a timeout as for BeginFrame.
+        bool WriteFrame(const void *pixels, double timeoutSeconds = 10.0);
+
+        FrameFormat GetFormat() const { return static_cast<FrameFormat>(header->format); }
+        size_t GetPixelsWide() const { return header->pixelsWide; }
+        size_t GetPixelsHigh() const { return header->pixelsHigh; }
+        size_t GetFrameBytes() const { return static_cast<size_t>(header->frameBytes); }
+
+    private:
+        std::string name;
+        size_t mapBytes;
+        FrameRingHeader *header;
+        FrameSlotHeader *slot;      // the slot between BeginFrame and EndFrame
+    };
+
+    // Maps an existing frame ring and reads its frames in place.
+    class FrameRingReader
+    {
+    public:
+        // Throws ImagerException if there is no frame ring called
+        // 'name' or it has the wrong magic number or version.
+        explicit FrameRingReader(const char *name);
+        ~FrameRingReader();
+
+        const FrameRingHeader& GetHeader() const { return *header; }
+
+        // Waits for the next frame and returns its pixels, which stay
+        // in place until ReleaseFrame.  Returns NULL once the writer
+        // has closed the ring and every frame has been read, or after
+        // 'timeoutSeconds' with no new frame.
+        const void *AcquireFrame(unsigned long long& frameNumber, double timeoutSeconds = 10.0);
+
+        // Hands the frame from AcquireFrame back to the writer.
+        // Returns false if the writer overwrote it in the meantime,
+        // which only happens when it drops frames; the pixels that
+        // were read must then be thrown away.
+        bool ReleaseFrame();
+
+        // Frames the writer overwrote before this reader got to them.
+        unsigned long long GetSkippedFrames() const { return skipped; }
+
+    private:
+        size_t mapBytes;
+        FrameRingHeader *header;
+        unsigned long long next;        // the frame number to read next
+        unsigned long long skipped;
+        const FrameSlotHeader *slot;    // the slot between AcquireFrame and ReleaseFrame
+    };
+}
+
+#endif // __DDC_FRAMERING_H
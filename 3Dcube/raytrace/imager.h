@@ -6,7 +6,9 @@
 #ifndef __DDC_IMAGER_H
 #define __DDC_IMAGER_H
 
+#include <atomic>
 #include <vector>
+#include <stdint.h>
 #include <cmath>
 #include "algebra.h"
 
@@ -23,6 +25,10 @@ namespace Imager
 
     class SolidObject;
     class ImageBuffer;
+    class ImageSink;
+    struct PixelData;
+    class Fingerprint;
+    class LightHierarchy;
 
     class ImagerException
     {
@@ -278,6 +284,59 @@ namespace Imager
         double  opacity;        // fraction 0..1 of reflected light
     };
 
+    // Identifies an entry in the MaterialTable.
+    typedef unsigned int MaterialId;
+
+    // Material 0 always holds the default-constructed Optics.
+    const MaterialId DEFAULT_MATERIAL = 0;
+
+    // A process-wide table of distinct Optics values.  Solids with
+    // uniform optics refer to an entry by its small MaterialId instead
+    // of each holding a copy, so thousands of solids sharing a handful
+    // of materials share a handful of entries.  The table is shared by
+    // all scenes rather than kept in each Scene, because solids are
+    // given their optics before they are added to any scene.
+    //
+    // Every holder of an id owns one reference to its entry, and an
+    // entry is freed for reuse when its last reference is released, so
+    // a long-running process that renders scene after scene needs only
+    // as many entries as there are distinct materials alive at once.
+    // A live entry never changes, and entries are stored in fixed chunks
+    // that never move, so Lookup needs no lock even while another thread
+    // interns new materials.  The default material is never freed.
+    class MaterialTable
+    {
+    public:
+        enum
+        {
+            CHUNK_BITS = 8,
+            CHUNK_SIZE = 1 << CHUNK_BITS,
+            MAX_CHUNKS = 4096
+        };
+
+        // Returns the id of an entry equal to 'optics', adding one if
+        // needed.  The caller owns one reference to the entry.
+        static MaterialId Intern(const Optics& optics);
+
+        // Adds or releases one reference to an entry.
+        static void AddReference(MaterialId id);
+        static void Release(MaterialId id);
+
+        static const Optics& Lookup(MaterialId id)
+        {
+            // Acquire pairs with the release in Intern that published
+            // the chunk, so its entries are seen fully written.
+            const Optics* chunk = chunkList[id >> CHUNK_BITS].load(std::memory_order_acquire);
+            return chunk[id & (CHUNK_SIZE - 1)];
+        }
+
+        // The number of distinct materials in use.
+        static size_t Count();
+
+    private:
+        static std::atomic<Optics*> chunkList[MAX_CHUNKS];
+    };
+
     struct Intersection
     {
 
@@ -306,6 +365,30 @@ namespace Imager
 
     typedef std::vector<Intersection> IntersectionList;
 
+    // One end of a RaySpan.  'crossing' points at the surface crossing
+    // in the list where the solid that found it keeps it, and is NULL
+    // at the start of a ray that begins inside the solid or the end of
+    // one that never leaves.  'flipped' means the crossing's surface
+    // normal must be turned around, as it is for a complement.
+    struct SpanEnd
+    {
+        double distanceSquared;
+        const Intersection* crossing;
+        bool flipped;
+    };
+
+    // The stretch of a ray that lies inside a solid.  Spans only point
+    // at crossings, so they are cheap to merge, and they are valid until
+    // the solids that found the crossings are asked about another ray.
+    struct RaySpan
+    {
+        SpanEnd enter;
+        SpanEnd exit;
+    };
+
+    // Spans along one ray, sorted by distance and never overlapping.
+    typedef std::vector<RaySpan> SpanList;
+
     int PickClosestIntersection(
         const IntersectionList& list, 
         Intersection& intersection);
@@ -341,13 +424,27 @@ namespace Imager
     public:
         SolidObject(const Vector& _center = Vector(), bool _isFullyEnclosed = true)
             : center(_center)
+            , materialId(DEFAULT_MATERIAL)
+            , hasProceduralOptics(false)
             , refractiveIndex(REFRACTION_GLASS)
             , isFullyEnclosed(_isFullyEnclosed)
         {
         }
 
+        SolidObject(const SolidObject& other)
+            : Taggable(other)
+            , center(other.center)
+            , materialId(other.materialId)
+            , hasProceduralOptics(other.hasProceduralOptics)
+            , refractiveIndex(other.refractiveIndex)
+            , isFullyEnclosed(other.isFullyEnclosed)
+        {
+            MaterialTable::AddReference(materialId);
+        }
+
         virtual ~SolidObject()
         {
+            MaterialTable::Release(materialId);
         }
 
         virtual void AppendAllIntersections(
@@ -365,13 +462,65 @@ namespace Imager
             return PickClosestIntersection(cachedIntersectionList, intersection);
         }
 
+        // Whether the point is inside the solid.  Every solid in this
+        // library overrides this with an exact test; the base class
+        // version, for solids that do not, counts surface crossings
+        // along a ray from the point.
         virtual bool Contains(const Vector& point) const;
 
+        // Sets insideArray[k] to Contains(pointArray[k]) for each of the
+        // 'count' points.  Solids that can test many points faster than
+        // one call at a time override this.
+        virtual void ContainsEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray) const;
+
+        // Solids that can find the spans of a ray inside them directly,
+        // like the set operators, override this to fill 'spanList' and
+        // return true.  For any other solid the spans are worked out
+        // from its surface crossings; see CollectInsideSpans.
+        virtual bool FindInsideSpans(
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList) const
+        {
+            return false;
+        }
+
+        // Adds everything that affects how this solid looks to the
+        // fingerprint, for recognizing repeated renders of the same scene.
+        // Returns false for solids that cannot describe themselves that
+        // way, which makes any scene containing them uncacheable.
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const
+        {
+            return false;
+        }
+
+        // Solids whose optics vary from point to point override this,
+        // and must call UseProceduralOptics in their constructors;
+        // otherwise the renderer reads the material table directly.
         virtual Optics SurfaceOptics(
             const Vector& surfacePoint,
             const void *context) const
         {
-            return uniformOptics;
+            return MaterialTable::Lookup(materialId);
+        }
+
+        // The optics at a surface point, as used by the renderer.
+        // Solids with uniform optics need only a table lookup;
+        // procedural optics are computed into 'scratch'.
+        const Optics& OpticsAt(
+            const Vector& surfacePoint,
+            const void *context,
+            Optics& scratch) const
+        {
+            if (hasProceduralOptics)
+            {
+                scratch = SurfaceOptics(surfacePoint, context);
+                return scratch;
+            }
+            return MaterialTable::Lookup(materialId);
         }
 
         double GetRefractiveIndex() const
@@ -407,7 +556,21 @@ namespace Imager
 
         void SetUniformOptics(const Optics& optics)
         {
-            uniformOptics = optics;
+            const MaterialId previous = materialId;
+            materialId = MaterialTable::Intern(optics);
+            MaterialTable::Release(previous);
+        }
+
+        void SetMaterial(MaterialId id)
+        {
+            MaterialTable::AddReference(id);
+            MaterialTable::Release(materialId);
+            materialId = id;
+        }
+
+        MaterialId GetMaterial() const
+        {
+            return materialId;
         }
 
         void SetMatteGlossBalance(
@@ -415,23 +578,29 @@ namespace Imager
             const Color& rawMatteColor,
             const Color& rawGlossColor)
         {
-            uniformOptics.SetMatteGlossBalance(
+            Optics optics = GetUniformOptics();
+            optics.SetMatteGlossBalance(
                 glossFactor, 
                 rawMatteColor,
                 rawGlossColor);
+            SetUniformOptics(optics);
         }
 
         void SetFullMatte(const Color& matteColor)
         {
-            uniformOptics.SetMatteGlossBalance(
+            Optics optics = GetUniformOptics();
+            optics.SetMatteGlossBalance(
                 0.0,        // glossFactor=0 indicates full matte reflection
                 matteColor,
                 Color(0.0, 0.0, 0.0));  
+            SetUniformOptics(optics);
         }
 
         void SetOpacity(const double opacity)
         {
-            uniformOptics.SetOpacity(opacity);
+            Optics optics = GetUniformOptics();
+            optics.SetOpacity(opacity);
+            SetUniformOptics(optics);
         }
 
         void SetRefraction(const double refraction)
@@ -440,15 +609,30 @@ namespace Imager
             refractiveIndex = refraction;
         }
 
-    protected:
         const Optics& GetUniformOptics() const
         {
-            return uniformOptics;
+            return MaterialTable::Lookup(materialId);
+        }
+
+    protected:
+        // Adds the tag, center, optics, and refractive index shared by all solids.
+        void AppendCommonFingerprint(Fingerprint& fingerprint) const;
+
+        void UseProceduralOptics()
+        {
+            hasProceduralOptics = true;
         }
 
     private:
+        // Not assignable.  The copy constructor and destructor keep
+        // the material table's reference counts right, but nothing
+        // ever assigns one solid over another, so there is no
+        // assignment to keep them right in.
+        SolidObject& operator= (const SolidObject&);
+
         Vector center;  
-        Optics uniformOptics;
+        MaterialId materialId;
+        bool hasProceduralOptics;
 
         double refractiveIndex;
 
@@ -459,6 +643,47 @@ namespace Imager
     };
 
 
+    // Fills 'spanList' with the spans of the ray inside 'solid'.  Solids
+    // that do not override FindInsideSpans are asked for their surface
+    // crossings, which go into 'scratch' and are paired into spans by
+    // which way the surface normal faces the ray; 'scratch' must then be
+    // left alone for as long as the spans are in use.
+    void CollectInsideSpans(
+        const SolidObject& solid,
+        const Vector& vantage,
+        const Vector& direction,
+        SpanList& spanList,
+        IntersectionList& scratch);
+
+    // Sorts a solid's surface crossings along the ray and pairs them into
+    // spans, the way CollectInsideSpans does for solids that cannot find
+    // their spans directly.  The spans point into 'crossingList'.
+    void SpansFromCrossings(
+        IntersectionList& crossingList,
+        const Vector& direction,
+        SpanList& spanList);
+
+    enum SpanOperator
+    {
+        SPAN_UNION,
+        SPAN_INTERSECTION
+    };
+
+    // Merges two sorted span lists in one pass over their ends.
+    void CombineSpans(
+        const SpanList& aList,
+        const SpanList& bList,
+        SpanOperator op,
+        SpanList& result);
+
+    // The gaps between the spans: the parts of the ray outside the solid,
+    // with the surface normals at their ends turned around.
+    void ComplementSpans(const SpanList& spanList, SpanList& result);
+
+    // Appends the surface crossings at the ends of the spans.
+    void AppendSpanBoundaries(const SpanList& spanList, IntersectionList& intersectionList);
+
+
     class SolidObject_BinaryOperator: public SolidObject
     {
     public:
@@ -489,6 +714,8 @@ namespace Imager
 
         virtual SolidObject& Translate(double dx, double dy, double dz);
 
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const;
+
     protected:
         SolidObject& Left()  const { return *left;  }
         SolidObject& Right() const { return *right; }
@@ -511,7 +738,32 @@ namespace Imager
             double a, 
             double b);
 
-        mutable IntersectionList tempIntersectionList;
+        // For each point whose entry in insideArray equals 'undecided',
+        // replaces that entry with whether the right solid contains the
+        // point.  The points are gathered and passed to the right
+        // solid's ContainsEach in chunks of CONTAINS_CHUNK, in arrays on
+        // the stack, so points already settled by the left solid are
+        // never tested again.
+        void RightDecidesEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray,
+            bool undecided) const;
+
+        enum { CONTAINS_CHUNK = 128 };
+
+        // Finds the spans of the ray inside both operands and merges them.
+        void CombineOperandSpans(
+            const Vector& vantage,
+            const Vector& direction,
+            SpanOperator op,
+            SpanList& spanList) const;
+
+        mutable IntersectionList leftCrossingList;
+        mutable IntersectionList rightCrossingList;
+        mutable SpanList leftSpanList;
+        mutable SpanList rightSpanList;
+        mutable SpanList resultSpanList;
 
     private:
         SolidObject* left;
@@ -538,6 +790,16 @@ namespace Imager
 
             return Left().Contains(point) || Right().Contains(point);
         }
+
+        virtual void ContainsEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray) const;
+
+        virtual bool FindInsideSpans(
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList) const;
     };
 
 
@@ -564,19 +826,15 @@ namespace Imager
             return Left().Contains(point) && Right().Contains(point);
         }
 
-    private:
-        void AppendOverlappingIntersections(
-            const Vector& vantage,
-            const Vector& direction,
-            const SolidObject& aSolid, 
-            const SolidObject& bSolid, 
-            IntersectionList& intersectionList) const;
+        virtual void ContainsEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray) const;
 
-        bool HasOverlappingIntersection(
+        virtual bool FindInsideSpans(
             const Vector& vantage,
             const Vector& direction,
-            const SolidObject& aSolid,
-            const SolidObject& bSolid) const;
+            SpanList& spanList) const;
     };
 
     class SetComplement: public SolidObject
@@ -601,11 +859,23 @@ namespace Imager
             return !other->Contains(point);
         }
 
+        virtual void ContainsEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray) const;
+
         virtual void AppendAllIntersections(
             const Vector& vantage, 
             const Vector& direction, 
             IntersectionList& intersectionList) const;
 
+        virtual bool FindInsideSpans(
+            const Vector& vantage,
+            const Vector& direction,
+            SpanList& spanList) const;
+
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const;
+
         virtual SolidObject& Translate(double dx, double dy, double dz)
         {
             SolidObject::Translate(dx, dy, dz);
@@ -633,6 +903,10 @@ namespace Imager
 
     private:
         SolidObject* other;
+
+        mutable IntersectionList otherCrossingList;
+        mutable SpanList otherSpanList;
+        mutable SpanList resultSpanList;
     };
 
     class SetDifference: public SetIntersection
@@ -686,6 +960,14 @@ namespace Imager
                 context);
         }
 
+        // Reports the camera-to-object rotation as three row vectors.
+        void GetOrientation(Vector& _rDir, Vector& _sDir, Vector& _tDir) const
+        {
+            _rDir = rDir;
+            _sDir = sDir;
+            _tDir = tDir;
+        }
+
     protected:
 
         virtual void ObjectSpace_AppendAllIntersections(
@@ -761,17 +1043,32 @@ namespace Imager
             SetTag("Cuboid");
         }
 
+        double GetHalfWidth()  const { return a; }
+        double GetHalfLength() const { return b; }
+        double GetHalfHeight() const { return c; }
+
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const;
+
+        // Moves each point into object space and tests it inline,
+        // with no virtual call per point.
+        virtual void ContainsEach(
+            const Vector* pointArray, 
+            size_t count, 
+            bool* insideArray) const;
+
     protected:
         virtual void ObjectSpace_AppendAllIntersections(
             const Vector& vantage, 
             const Vector& direction, 
             IntersectionList& intersectionList) const;
 
+        // Uses '&' rather than '&&' so the three comparisons
+        // compile to straight-line code with no branches.
         virtual bool ObjectSpace_Contains(const Vector& point) const
         {
             return 
-                (fabs(point.x) <= a + EPSILON) &&
-                (fabs(point.y) <= b + EPSILON) &&
+                (fabs(point.x) <= a + EPSILON) &
+                (fabs(point.y) <= b + EPSILON) &
                 (fabs(point.z) <= c + EPSILON);
         }
 
@@ -781,6 +1078,58 @@ namespace Imager
         const double  c;   // half of the height: faces at t = -c and t = +c.
     };
 
+    // A torus (doughnut) whose axis of symmetry is the object's t axis.
+    // R is the distance from that axis to the center of the tube,
+    // and r is the radius of the tube.  A ray meets a torus where a
+    // quartic equation is zero.
+    class Torus: public SolidObject_Reorientable
+    {
+    public:
+        Torus(double _R, double _r)
+            : SolidObject_Reorientable()
+            , R(_R)
+            , r(_r)
+        {
+            SetTag("Torus");
+        }
+
+        double GetMajorRadius() const { return R; }
+        double GetMinorRadius() const { return r; }
+
+        virtual bool AppendFingerprint(Fingerprint& fingerprint) const;
+
+        // For a packet of rays that all start at 'vantage', sets hitArray[k]
+        // to the smallest u > EPSILON such that vantage + u*directionArray[k]
+        // is on the surface, or HUGE_VAL if the ray misses.  The quartics of
+        // the whole packet are solved together by SolveQuarticEquations.
+        void ClosestHitEach(
+            const Vector& vantage,
+            const Vector* directionArray,
+            size_t count,
+            double* hitArray) const;
+
+    protected:
+        virtual void ObjectSpace_AppendAllIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const;
+
+        virtual bool ObjectSpace_Contains(const Vector& point) const;
+
+    private:
+        // Fills in the coefficients, highest power first, of the quartic
+        // in u whose roots are where vantage + u*direction meets the torus.
+        void RayQuartic(
+            const Vector& vantage,
+            const Vector& direction,
+            double& a, double& b, double& c, double& d, double& e) const;
+
+        Vector SurfaceNormal(const Vector& point) const;
+
+        const double R;     // distance from the t axis to the center of the tube
+        const double r;     // radius of the tube
+    };
+
     struct LightSource: public Taggable
     {
         LightSource(const Vector& _location, const Color& _color, std::string _tag = "")
@@ -795,6 +1144,101 @@ namespace Imager
     };
 
 
+    // The order in which RenderImage traces the pixels of the image.
+    // The image is the same in every order; the order only decides
+    // how close in the scene and in memory consecutive rays are.
+    enum PixelOrder
+    {
+        PIXEL_ORDER_COLUMNS,    // top to bottom, then left to right
+        PIXEL_ORDER_ROWS,       // left to right, then top to bottom, as stored
+        PIXEL_ORDER_TILES,      // rows within square tiles, tiles in rows
+        PIXEL_ORDER_MORTON,     // Z-order curve through square blocks
+        PIXEL_ORDER_HILBERT     // Hilbert curve through square blocks
+    };
+
+    // Counts kept by each thread about the shadow rays it traced
+    // for one scene, and how often the last-occluder cache saved it
+    // from scanning the scene's solids.
+    struct ShadowRayStats
+    {
+        unsigned long shadowRays;           // calls to HasClearLineOfSight
+        unsigned long blockedRays;          // shadow rays that hit something
+        unsigned long occluderHits;         // blocked by the cached occluder
+        unsigned long intersectionTests;    // solids tested for intersection
+
+        ShadowRayStats()
+            : shadowRays(0)
+            , blockedRays(0)
+            , occluderHits(0)
+            , intersectionTests(0)
+        {
+        }
+    };
+
+    // A limit to how deeply in recursion CalculateLighting may go
+    // before it gives up, so as to avoid call stack overflow.
+    const int MAX_OPTICAL_RECURSION_DEPTH = 20;
+
+    // A limit to how weak the red, green, or blue intensity of
+    // a light ray may be after recursive calls from multiple
+    // reflections and/or refractions before giving up.
+    // This intensity is deemed too weak to make a significant
+    // difference to the image.
+    const double MIN_OPTICAL_INTENSITY = 0.001;
+
+    // Controls how much work a render may do.  A scene full of glass
+    // can split every ray in two at every surface, so the depth and
+    // intensity limits alone still allow exponentially many rays.
+    // The ray budgets cap the number of camera, reflected, and
+    // refracted rays traced for each oversampled pixel and for the
+    // whole image; zero means no cap.  Every pixel still gets its
+    // camera ray, so only secondary rays are ever left out, and
+    // once the frame budget runs out, the pixels not yet traced see
+    // only what their camera rays hit.  When a surface wants to
+    // split a ray into more rays than the budget has left, the
+    // stronger one carries the weight of both, and once nothing is
+    // left, the missing rays are counted as if they had escaped to
+    // the background, so that running out of budget does not simply
+    // throw their share of the light away.
+    struct RenderLimits
+    {
+        int maxRecursionDepth;
+        double minRayIntensity;
+        unsigned long maxRaysPerPixel;
+        unsigned long maxRaysPerFrame;
+
+        RenderLimits()
+            : maxRecursionDepth(MAX_OPTICAL_RECURSION_DEPTH)
+            , minRayIntensity(MIN_OPTICAL_INTENSITY)
+            , maxRaysPerPixel(0)
+            , maxRaysPerFrame(0)
+        {
+        }
+    };
+
+    // Counts gathered over the most recent render of a scene.
+    struct RenderStats
+    {
+        unsigned long raysTraced;           // camera, reflected, and refracted rays
+        unsigned long depthCutoffs;         // rays that went too deep to be lit
+        unsigned long intensityCutoffs;     // rays too weak to be lit
+        unsigned long mergedRays;           // rays left out, their sibling carrying their weight
+        unsigned long terminatedRays;       // rays left out, lit by the background
+        unsigned long pixelsOverBudget;     // pixels that ran out of their own budget
+        unsigned long pixelsOverFrameBudget;// pixels cut short by the frame budget
+
+        RenderStats()
+            : raysTraced(0)
+            , depthCutoffs(0)
+            , intensityCutoffs(0)
+            , mergedRays(0)
+            , terminatedRays(0)
+            , pixelsOverBudget(0)
+            , pixelsOverFrameBudget(0)
+        {
+        }
+    };
+
     class Scene
     {
     public:
@@ -802,33 +1246,297 @@ namespace Imager
             : backgroundColor(_backgroundColor)
             , ambientRefraction(REFRACTION_VACUUM)
             , activeDebugPoint(NULL)
-        {
-        }
-
-        virtual ~Scene()
-        {
-            ClearSolidObjectList();
-        }
+            , renderBuffer(NULL)
+            , floatOutput(false)
+            , floatRequested(false)
+            , retainPrimaryHits(false)
+            , hasRetainedHits(false)
+            , retainedPixelsWide(0)
+            , retainedPixelsHigh(0)
+            , retainedZoom(0.0)
+            , retainedAntiAliasFactor(0)
+            , hasRetainedSolids(false)
+            , retainedSolids(0)
+            , lightCulling(true)
+            , lightHierarchy(NULL)
+            , lightHierarchyStale(true)
+            , occluderCaching(true)
+            , mediumTracking(true)
+            , wavefrontTracing(false)
+            , reorderBatchSize(0)
+            , pixelOrder(PIXEL_ORDER_TILES)
+            , tracedRayCount(0)
+            , containmentQueryCount(0)
+            , serialNumber(NextSerialNumber())
+        {
+        }
+
+        virtual ~Scene();
 
         SolidObject& AddSolidObject(SolidObject* solidObject)
         {
             solidObjectList.push_back(solidObject);
+            hasRetainedHits = false;
             return *solidObject;
         }
 
         void AddLightSource(const LightSource &lightSource)
         {
             lightSourceList.push_back(lightSource);
+            lightHierarchyStale = true;
+        }
+
+        size_t GetNumLightSources() const
+        {
+            return lightSourceList.size();
+        }
+
+        // Light sources may be moved or recolored between a render
+        // and a call to RelightImage.
+        LightSource& GetLightSource(size_t index)
+        {
+            lightHierarchyStale = true;
+            return lightSourceList.at(index);
+        }
+
+        void ClearLightSources()
+        {
+            lightSourceList.clear();
+            lightHierarchyStale = true;
+        }
+
+        // When enabled (the default), matte lighting visits the light
+        // sources brightest-first through a light hierarchy and skips
+        // any light that could add less than the render limits'
+        // minRayIntensity times the illumination already found there.
+        // Disabling it tests every light at every point, in the order
+        // the lights were added.
+        void SetLightCulling(bool enable)
+        {
+            lightCulling = enable;
         }
 
+        // When enabled (the default), each thread remembers, for every
+        // light, the solid that last blocked a shadow ray toward it, and
+        // tests that solid before any other.  Neighboring points are
+        // usually shadowed by the same solid.
+        void SetOccluderCaching(bool enable)
+        {
+            occluderCaching = enable;
+        }
+
+        // When enabled, RenderImage traces rays a generation at a time
+        // instead of following each one recursively to the end: the
+        // camera rays of one tile of the image are all intersected with
+        // the scene, then all shaded, and the reflected and refracted
+        // rays that shading gives rise to wait in queues for the next
+        // generation, until none are left.  The image is the same apart
+        // from rounding, because each pixel sums the same contributions
+        // in a different order.  Debug points work only without it.
+        void SetWavefrontTracing(bool enable)
+        {
+            wavefrontTracing = enable;
+        }
+
+        // Selects the order in which recursive tracing visits pixels
+        // (PIXEL_ORDER_TILES by default).  Wavefront tracing always
+        // works through the image in tiles.
+        void SetPixelOrder(PixelOrder order)
+        {
+            pixelOrder = order;
+        }
+
+        // Reflected and refracted rays scatter in all directions, so
+        // tracing them in the order of the pixels they belong to jumps
+        // around the scene and its hierarchies from one ray to the
+        // next.  With a nonzero batch size, wavefront tracing sorts
+        // each batch of that many secondary rays by the octant of
+        // their direction and then by the cell of a 16x16x16 grid
+        // around the batch that they start from, so that rays
+        // traced one after another touch the same memory.  Zero, the
+        // default, leaves rays in pixel order.  It has no effect on
+        // recursive tracing.
+        void SetRayReordering(size_t batchSize)
+        {
+            reorderBatchSize = batchSize;
+        }
+
+        // The number of rays whose closest intersection has been
+        // searched for, not counting shadow rays, since the count
+        // was last reset.
+        unsigned long GetTracedRayCount() const
+        {
+            return tracedRayCount;
+        }
+
+        void ResetTracedRayCount() const
+        {
+            tracedRayCount = 0;
+        }
+
+        // When enabled (the default), every ray carries the list of
+        // solids it is inside, updated as it crosses their surfaces,
+        // so refraction learns the medium beyond a surface without
+        // testing every solid for containment.
+        void SetMediumTracking(bool enable)
+        {
+            mediumTracking = enable;
+        }
+
+        // The number of Contains calls made to find the medium beyond
+        // a refracting surface since the count was last reset.
+        unsigned long GetContainmentQueryCount() const
+        {
+            return containmentQueryCount;
+        }
+
+        void ResetContainmentQueryCount() const
+        {
+            containmentQueryCount = 0;
+        }
+
+        // Limits that apply to every later render of this scene.
+        // Throws ImagerException if the depth or intensity is negative.
+        void SetRenderLimits(const RenderLimits& limits)
+        {
+            if (limits.maxRecursionDepth < 0 || limits.minRayIntensity < 0.0)
+            {
+                throw ImagerException("Invalid render limits.");
+            }
+            renderLimits = limits;
+        }
+
+        const RenderLimits& GetRenderLimits() const
+        {
+            return renderLimits;
+        }
+
+        // Counts from the most recent RenderImage or RelightImage.
+        const RenderStats& GetRenderStats() const
+        {
+            return renderStats;
+        }
+
+        // Shadow ray counts for this scene gathered by the calling
+        // thread since it last started rendering a different scene
+        // or called ResetShadowRayStats.
+        ShadowRayStats GetShadowRayStats() const;
+        void ResetShadowRayStats() const;
+
+
+        // Renders an image into a file whose format follows its name's
+        // extension: PNG unless it ends in .ppm, .pam, or .pfm.
+        void SaveImage(
+            const char *outFileName, 
+            size_t pixelsWide, 
+            size_t pixelsHigh, 
+            double zoom, 
+            size_t antiAliasFactor) const;
 
+        // Renders an image and hands it, a row at a time, to 'sink',
+        // which decides where it goes and in what form (see imagesink.h).
         void SaveImage(
-            const char *outPngFileName, 
+            ImageSink& sink, 
             size_t pixelsWide, 
             size_t pixelsHigh, 
             double zoom, 
             size_t antiAliasFactor) const;
 
+        const std::vector<unsigned char>& RenderImage(
+            size_t pixelsWide, 
+            size_t pixelsHigh, 
+            double zoom, 
+            size_t antiAliasFactor) const;
+
+        // When enabled, RenderImage and RelightImage also keep each
+        // image as 4 floats per pixel (red, green, blue, and an alpha
+        // of 1), in the scene's own color units: not scaled to the
+        // brightest pixel nor clamped as the RGBA bytes are.
+        void SetFloatOutput(bool enable)
+        {
+            floatOutput = enable;
+            if (!enable)
+            {
+                floatBuffer.clear();
+            }
+        }
+
+        // The float image from the most recent render, row by row from
+        // the top; empty unless float output is enabled.
+        const std::vector<float>& GetFloatImage() const
+        {
+            return floatBuffer;
+        }
+
+        // When enabled, RenderImage remembers where every camera ray
+        // struck the scene and the optics it found there.  RelightImage
+        // can then produce a new image after the light sources have been
+        // edited, skipping the primary ray intersection searches.
+        // The retained hits stay valid only while the solids are left
+        // unchanged; moving or rotating a solid requires a new RenderImage.
+        // A solid is transformed through its own methods, which the scene
+        // never sees, so RelightImage compares a fingerprint of the solids
+        // with the one taken when the hits were retained and throws
+        // ImagerException if they differ.  Scenes with solids that cannot
+        // be fingerprinted (see SolidObject::AppendFingerprint) are not
+        // checked.
+        void SetRetainPrimaryHits(bool retain)
+        {
+            retainPrimaryHits = retain;
+            if (!retain)
+            {
+                hasRetainedHits = false;
+                primaryHitList.clear();
+            }
+        }
+
+        bool HasRetainedPrimaryHits() const
+        {
+            return hasRetainedHits;
+        }
+
+        // Renders the same view as the most recent RenderImage using
+        // the current light sources.  Shadows, reflections, and
+        // refractions are all traced again; only the primary hits are
+        // reused.  Throws ImagerException if no hits were retained.
+        const std::vector<unsigned char>& RelightImage() const;
+
+        void SaveRelitImage(const char *outPngFileName) const;
+
+        // Rebuilds the light hierarchy if the light sources have changed.
+        // RenderImage and RelightImage call this themselves; see RenderTile.
+        void PrepareLights() const;
+
+        // Traces the rectangle of the oversampled image whose upper
+        // left pixel is (iFirst, jFirst) into 'tile', for a render
+        // split into tiles (see tiles.h).  The arguments are otherwise
+        // the same as for RenderImage.  Ambiguous pixels are left
+        // marked but not healed.
+        //
+        // A Scene must not be rendered from two threads at once, not
+        // even one tile per thread: every render writes the scene's
+        // render statistics and its mutable intersection lists.  Give
+        // each thread its own Scene, as the tile workers do.
+        //
+        // RenderTile does not rebuild the light hierarchy itself: call
+        // PrepareLights after changing the lights, or it throws
+        // ImagerException.
+        void RenderTile(
+            size_t pixelsWide, 
+            size_t pixelsHigh, 
+            double zoom, 
+            size_t antiAliasFactor,
+            size_t iFirst,
+            size_t jFirst,
+            ImageBuffer& tile) const;
+
+        // Turns an oversampled image put together from RenderTile
+        // tiles into the RGBA bytes RenderImage would have returned.
+        const std::vector<unsigned char>& FinishTiledImage(
+            ImageBuffer& buffer,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            size_t antiAliasFactor) const;
 
         void SetAmbientRefraction(double refraction)
         {
@@ -836,6 +1544,26 @@ namespace Imager
             ambientRefraction = refraction;
         }
 
+        void SetBackgroundColor(const Color& _backgroundColor)
+        {
+            backgroundColor = _backgroundColor;
+        }
+
+        // Writes every solid and light source in this scene to a baked
+        // scene file (see baked.h).  Only Cuboid solids can be baked.
+        void SaveBakedScene(const char *filename) const;
+
+        // Adds everything that affects the rendered image to the
+        // fingerprint.  Returns false if some solid cannot be fingerprinted.
+        bool AppendFingerprint(Fingerprint& fingerprint) const;
+
+        // Adds only the solids, in scene order; AppendFingerprint uses it.
+        bool AppendSolidsFingerprint(Fingerprint& fingerprint) const;
+
+        // Memory-maps a baked scene file and adds its cuboids, lights,
+        // background color, and ambient refraction to this scene.
+        void LoadBakedScene(const char *filename);
+
         void AddDebugPoint(int iPixel, int jPixel)
         {
             debugPointList.push_back(DebugPoint(iPixel, jPixel));
@@ -844,47 +1572,112 @@ namespace Imager
     private:
         void ClearSolidObjectList();
 
+        ImageBuffer& PrepareRenderBuffer(
+            size_t pixelsWide,
+            size_t pixelsHigh) const;
+
+        // Also reports which solid in solidObjectList
+        // the closest intersection belongs to.
         int FindClosestIntersection(
             const Vector& vantage, 
             const Vector& direction, 
-            Intersection& intersection) const;
+            Intersection& intersection,
+            size_t& solidIndex) const;
 
         bool HasClearLineOfSight(
             const Vector& point1, 
-            const Vector& point2) const;
+            const Vector& point2,
+            size_t lightIndex) const;
+
+        // The solids a ray is traveling inside of, as indexes into
+        // solidObjectList in the order the ray entered them.  Crossing
+        // an entry face pushes a solid and crossing an exit face removes
+        // it.  When the list loses track, as when a ray leaves a solid
+        // it never entered or is inside more than MAX_DEPTH solids at
+        // once, it is marked invalid and rebuilt by containment tests.
+        struct MediumStack
+        {
+            enum { MAX_DEPTH = 8 };
+
+            size_t depth;
+            bool valid;
+            size_t solidIndex[MAX_DEPTH];
+
+            MediumStack()
+                : depth(0)
+                , valid(true)
+            {
+            }
+        };
+
+        // The refractive index of the medium a ray is traveling through:
+        // the first solid in scene order that the ray is inside,
+        // or the ambient refraction when it is inside none.
+        double MediumRefractiveIndex(const MediumStack& media) const;
+
+        // Fills 'media' with every solid that contains the point.
+        void FindContainers(const Vector& point, MediumStack& media) const;
 
         Color TraceRay(
             const Vector& vantage,
             const Vector& direction,
-            double refractiveIndex,
+            const MediumStack& media,
             Color rayIntensity,
             int recursionDepth) const;
 
         Color CalculateLighting(
             const Intersection& intersection, 
+            size_t solidIndex,
+            const Vector& direction, 
+            const MediumStack& media,
+            Color rayIntensity,
+            int recursionDepth) const;
+
+        Color CalculateSurfaceLighting(
+            const Intersection& intersection, 
+            size_t solidIndex,
+            const Optics& optics,
             const Vector& direction, 
-            double refractiveIndex,
+            const MediumStack& media,
             Color rayIntensity,
             int recursionDepth) const;
 
         Color CalculateMatte(const Intersection& intersection) const;
 
+        Color CalculateCulledMatte(const Intersection& intersection) const;
+
+        struct LightCandidate;
+        void PushLightNode(
+            std::vector<LightCandidate>& heap,
+            size_t nodeIndex,
+            const Vector& point) const;
+
+        void AddLightContribution(
+            const Intersection& intersection,
+            size_t lightIndex,
+            Color& colorSum) const;
+
+        static unsigned long NextSerialNumber();
+
         Color CalculateReflection(
             const Intersection& intersection, 
             const Vector& incidentDir, 
-            double refractiveIndex,
+            const MediumStack& media,
             Color rayIntensity,
             int recursionDepth) const;
 
-        Color CalculateRefraction(
+        // Finds the direction and media of the ray refracted where
+        // 'direction' strikes the surface, and the fraction of the
+        // light reflected there instead, without tracing the ray.
+        // Returns false if the ray is totally internally reflected.
+        bool RefractRay(
             const Intersection& intersection, 
+            size_t solidIndex,
             const Vector& direction, 
-            double sourceRefractiveIndex,
-            Color rayIntensity,
-            int recursionDepth,
-            double& outReflectionFactor) const;
-
-        const SolidObject* PrimaryContainer(const Vector& point) const;
+            const MediumStack& sourceMedia,
+            double& outReflectionFactor,
+            Vector& outDirection,
+            MediumStack& outMedia) const;
 
         double PolarizedReflection(
             double n1,              
@@ -933,6 +1726,133 @@ namespace Imager
         };
         typedef std::vector<PixelCoordinates> PixelList;
 
+        const std::vector<unsigned char>& FinishImage(
+            ImageBuffer& buffer,
+            const PixelList& ambiguousPixelList,
+            size_t pixelsWide,
+            size_t pixelsHigh,
+            size_t antiAliasFactor) const;
+
+        // What a camera ray found the first time it was traced.
+        enum PrimaryHitState
+        {
+            PRIMARY_MISS,           // the ray escaped to the background
+            PRIMARY_HIT,            // the ray struck a solid at 'point'
+            PRIMARY_AMBIGUOUS       // tied closest intersections
+        };
+
+        struct PrimaryHit
+        {
+            Vector point;
+            Vector surfaceNormal;
+            const SolidObject* solid;
+            size_t solidIndex;
+            const void* context;
+            Optics optics;
+            PrimaryHitState state;
+        };
+        typedef std::vector<PrimaryHit> PrimaryHitList;
+
+        Color TraceRetainedPrimaryRay(
+            const Vector& vantage,
+            const Vector& direction,
+            const MediumStack& cameraMedia,
+            PrimaryHit& hit) const;
+
+        void TracePixel(
+            PixelData& pixel,
+            const Vector& direction,
+            const MediumStack& cameraMedia,
+            PrimaryHit* retainedHit) const;
+
+        // A ray waiting in a wavefront queue.  Whatever it finds is
+        // multiplied by its intensity and added to its pixel.
+        struct WavefrontRay
+        {
+            Vector vantage;
+            Vector direction;
+            Color intensity;
+            MediumStack media;
+            PixelData* pixel;
+            size_t pixelIndex;      // row-major index of the oversampled pixel
+            int depth;              // recursion depth of the surface it will hit
+        };
+        typedef std::vector<WavefrontRay> WavefrontQueue;
+
+        struct WavefrontHit
+        {
+            Intersection intersection;
+            size_t solidIndex;
+            int numClosest;
+        };
+        typedef std::vector<WavefrontHit> WavefrontHitList;
+
+        // The kinds of secondary rays, each queued separately.
+        enum WavefrontRayType
+        {
+            WAVEFRONT_REFLECTION,
+            WAVEFRONT_REFRACTION,
+            NUM_WAVEFRONT_RAY_TYPES
+        };
+
+        void RenderWavefront(
+            ImageBuffer& buffer,
+            double largeZoom,
+            const MediumStack& cameraMedia,
+            PixelList& ambiguousPixelList) const;
+
+        void IntersectWavefront(
+            const WavefrontQueue& queue,
+            WavefrontHitList& hitList) const;
+
+        void ShadeWavefront(
+            const WavefrontQueue& queue,
+            const WavefrontHitList& hitList,
+            WavefrontQueue nextQueue[NUM_WAVEFRONT_RAY_TYPES]) const;
+
+        void RetainWavefrontHits(
+            const WavefrontQueue& queue,
+            const WavefrontHitList& hitList) const;
+
+        void ReorderWavefront(
+            WavefrontQueue& queue,
+            WavefrontQueue& scratch) const;
+
+        // How much of the ray budget one oversampled pixel has used.
+        struct PixelBudget
+        {
+            unsigned long rays;
+            bool overBudget;
+            bool overFrameBudget;
+
+            PixelBudget()
+                : rays(0)
+                , overBudget(false)
+                , overFrameBudget(false)
+            {
+            }
+        };
+        typedef std::vector<PixelBudget> PixelBudgetList;
+
+        void StartPixelBudget(PixelBudget& budget) const;
+
+        void BudgetBranches(
+            PixelBudget& budget,
+            bool& traceRefraction,
+            Color& refractionIntensity,
+            bool& traceReflection,
+            Color& reflectionIntensity,
+            Color& untracedIntensity) const;
+
+        bool IsSignificant(const Color& color) const;
+
+        RenderLimits renderLimits;
+        mutable RenderStats renderStats;
+        mutable PixelBudget recursiveBudget;    // the pixel being traced recursively
+        mutable PixelBudgetList pixelBudgetList;
+
+        mutable std::vector<unsigned long long> reorderKeyList;
+
         SolidObjectList solidObjectList;
 
         LightSourceList lightSourceList;
@@ -940,6 +1860,7 @@ namespace Imager
         double ambientRefraction;
 
         mutable IntersectionList cachedIntersectionList;
+        mutable std::vector<size_t> cachedSolidIndexList;   // owner of each cached intersection
 
         struct DebugPoint
         {
@@ -955,6 +1876,67 @@ namespace Imager
         typedef std::vector<DebugPoint> DebugPointList;
         DebugPointList debugPointList;
         mutable const DebugPoint* activeDebugPoint;
+
+        // Kept between calls to SaveImage so that rendering a sequence
+        // of same-sized frames does not reallocate them every time.
+        mutable ImageBuffer* renderBuffer;
+        mutable std::vector<unsigned char> rgbaBuffer;
+        bool floatOutput;
+        mutable bool floatRequested;    // by the sink SaveImage is rendering for
+        mutable std::vector<float> floatBuffer;
+
+        // Primary hits kept for RelightImage, one per oversampled pixel
+        // in row-major order, along with the view they were traced for.
+        bool retainPrimaryHits;
+        mutable bool hasRetainedHits;
+        mutable PrimaryHitList primaryHitList;
+        mutable size_t retainedPixelsWide;
+        mutable size_t retainedPixelsHigh;
+        mutable double retainedZoom;
+        mutable size_t retainedAntiAliasFactor;
+        mutable bool hasRetainedSolids;         // whether retainedSolids can be checked
+        mutable uint64_t retainedSolids;        // fingerprint of the solids when retained
+
+        // A node of the light hierarchy, or a single light, waiting
+        // to be visited by CalculateCulledMatte.  Ordered by 'bound',
+        // the most it could add to the point's illumination.
+        struct LightCandidate
+        {
+            double bound;
+            size_t index;       // node index, or light index if isLight
+            bool   isLight;
+
+            LightCandidate(double _bound, size_t _index, bool _isLight)
+                : bound(_bound)
+                , index(_index)
+                , isLight(_isLight)
+            {
+            }
+
+            bool operator< (const LightCandidate& other) const
+            {
+                return bound < other.bound;
+            }
+        };
+        typedef std::vector<LightCandidate> LightCandidateList;
+
+        bool lightCulling;
+        mutable LightHierarchy* lightHierarchy;     // rebuilt by PrepareLights
+        mutable bool lightHierarchyStale;
+
+        bool occluderCaching;
+
+        bool mediumTracking;
+        bool wavefrontTracing;
+        size_t reorderBatchSize;
+        PixelOrder pixelOrder;
+        mutable unsigned long tracedRayCount;
+        mutable unsigned long containmentQueryCount;
+
+        // Identifies this scene to the per-thread occluder caches.
+        // Unlike the scene's address, it is never reused by a later
+        // scene, so a cache can never hold pointers into a dead one.
+        const unsigned long serialNumber;
     };
 
     struct PixelData
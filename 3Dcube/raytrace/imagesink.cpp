@@ -0,0 +1,341 @@
+/*
+    imagesink.cpp
+
+    Implements the image sinks declared in imagesink.h.
+*/
+
+#include <cstring>
+#include "framering.h"
+#include "imager.h"
+#include "imagesink.h"
+#include "pngstream.h"
+#include "../lodepng/lodepng.h"
+
+namespace Imager
+{
+    void WriteImage(
+        ImageSink& sink,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        const unsigned char *rgba,
+        const float *floatRgba)
+    {
+        const bool wantsFloat = sink.WantsFloatRows();
+        if (wantsFloat && floatRgba == NULL)
+        {
+            throw ImagerException("Image sink needs float pixels.");
+        }
+
+        sink.BeginImage(pixelsWide, pixelsHigh);
+        const size_t rowValues = 4 * pixelsWide;
+        for (size_t j=0; j < pixelsHigh; ++j)
+        {
+            sink.WriteRow(
+                rgba + j*rowValues,
+                wantsFloat ? (floatRgba + j*rowValues) : NULL);
+        }
+        sink.EndImage();
+    }
+
+
+    ImageFileFormat ImageFileFormatFromName(const char *filename)
+    {
+        const char *dot = strrchr(filename, '.');
+        if (dot != NULL)
+        {
+            if (strcmp(dot, ".ppm") == 0)
+            {
+                return IMAGE_FILE_PPM;
+            }
+            if (strcmp(dot, ".pam") == 0)
+            {
+                return IMAGE_FILE_PAM;
+            }
+            if (strcmp(dot, ".pfm") == 0)
+            {
+                return IMAGE_FILE_PFM;
+            }
+        }
+        return IMAGE_FILE_PNG;
+    }
+
+    ImageFileSink::ImageFileSink(const char *_filename)
+        : filename(_filename)
+        , format(ImageFileFormatFromName(_filename))
+        , outfile(NULL)
+        , pixelsWide(0)
+        , pixelsHigh(0)
+        , row(0)
+        , dataOffset(0)
+    {
+    }
+
+    ImageFileSink::ImageFileSink(const char *_filename, ImageFileFormat _format)
+        : filename(_filename)
+        , format(_format)
+        , outfile(NULL)
+        , pixelsWide(0)
+        , pixelsHigh(0)
+        , row(0)
+        , dataOffset(0)
+    {
+    }
+
+    ImageFileSink::~ImageFileSink()
+    {
+        if (outfile != NULL)
+        {
+            fclose(outfile);
+            outfile = NULL;
+        }
+    }
+
+    void ImageFileSink::BeginImage(size_t _pixelsWide, size_t _pixelsHigh)
+    {
+        pixelsWide = _pixelsWide;
+        pixelsHigh = _pixelsHigh;
+        row = 0;
+
+        if (format == IMAGE_FILE_PNG)
+        {
+            buffer.resize(4 * pixelsWide * pixelsHigh);
+            return;
+        }
+
+        outfile = fopen(filename.c_str(), "wb");
+        if (outfile == NULL)
+        {
+            throw ImagerException("Cannot open image file for writing.");
+        }
+
+        switch (format)
+        {
+        case IMAGE_FILE_PPM:
+            fprintf(outfile, "P6\n%u %u\n255\n",
+                static_cast<unsigned>(pixelsWide),
+                static_cast<unsigned>(pixelsHigh));
+            buffer.resize(3 * pixelsWide);
+            break;
+
+        case IMAGE_FILE_PAM:
+            fprintf(outfile, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                static_cast<unsigned>(pixelsWide),
+                static_cast<unsigned>(pixelsHigh));
+            break;
+
+        case IMAGE_FILE_PFM:
+            {
+                // The sign of the scale factor gives the byte order of
+                // the floats: negative for little-endian.
+                const unsigned short probe = 1;
+                const bool littleEndian = (*reinterpret_cast<const unsigned char *>(&probe) == 1);
+                fprintf(outfile, "PF\n%u %u\n%s\n",
+                    static_cast<unsigned>(pixelsWide),
+                    static_cast<unsigned>(pixelsHigh),
+                    littleEndian ? "-1.0" : "1.0");
+                dataOffset = ftell(outfile);
+                buffer.resize(3 * sizeof(float) * pixelsWide);
+            }
+            break;
+
+        default:
+            throw ImagerException("Invalid image file format.");
+        }
+    }
+
+    void ImageFileSink::WriteRow(const unsigned char *rgba, const float *floatRgba)
+    {
+        if (row >= pixelsHigh)
+        {
+            throw ImagerException("Too many rows written to image file.");
+        }
+
+        switch (format)
+        {
+        case IMAGE_FILE_PNG:
+            memcpy(&buffer[4 * pixelsWide * row], rgba, 4 * pixelsWide);
+            break;
+
+        case IMAGE_FILE_PPM:
+            for (size_t i=0; i < pixelsWide; ++i)
+            {
+                buffer[3*i + 0] = rgba[4*i + 0];
+                buffer[3*i + 1] = rgba[4*i + 1];
+                buffer[3*i + 2] = rgba[4*i + 2];
+            }
+            Write(&buffer[0], buffer.size());
+            break;
+
+        case IMAGE_FILE_PAM:
+            Write(rgba, 4 * pixelsWide);
+            break;
+
+        case IMAGE_FILE_PFM:
+            {
+                float *rgb = reinterpret_cast<float *>(&buffer[0]);
+                for (size_t i=0; i < pixelsWide; ++i)
+                {
+                    rgb[3*i + 0] = floatRgba[4*i + 0];
+                    rgb[3*i + 1] = floatRgba[4*i + 1];
+                    rgb[3*i + 2] = floatRgba[4*i + 2];
+                }
+
+                // PFM stores the bottom row first.
+                const long offset = dataOffset + static_cast<long>((pixelsHigh - 1 - row) * buffer.size());
+                if (fseek(outfile, offset, SEEK_SET) != 0)
+                {
+                    throw ImagerException("Cannot write image file.");
+                }
+                Write(&buffer[0], buffer.size());
+            }
+            break;
+
+        default:
+            throw ImagerException("Invalid image file format.");
+        }
+
+        ++row;
+    }
+
+    void ImageFileSink::EndImage()
+    {
+        if (row != pixelsHigh)
+        {
+            Close();
+            throw ImagerException("Image file is missing rows.");
+        }
+
+        if (format == IMAGE_FILE_PNG)
+        {
+            const unsigned error = lodepng::encode(
+                filename,
+                buffer,
+                static_cast<unsigned>(pixelsWide),
+                static_cast<unsigned>(pixelsHigh));
+
+            if (error != 0)
+            {
+                std::string message = "PNG encoder error: ";
+                message += lodepng_error_text(error);
+                throw ImagerException(message.c_str());
+            }
+            return;
+        }
+
+        Close();
+    }
+
+    void ImageFileSink::Write(const void *data, size_t size)
+    {
+        if (fwrite(data, 1, size, outfile) != size)
+        {
+            throw ImagerException("Cannot write image file.");
+        }
+    }
+
+    void ImageFileSink::Close()
+    {
+        if (outfile != NULL)
+        {
+            const bool failed = (fclose(outfile) != 0);
+            outfile = NULL;
+            if (failed)
+            {
+                throw ImagerException("Cannot write image file.");
+            }
+        }
+    }
+
+
+    PngStreamSink::~PngStreamSink()
+    {
+        delete encoder;
+        encoder = NULL;
+    }
+
+    void PngStreamSink::BeginImage(size_t pixelsWide, size_t pixelsHigh)
+    {
+        delete encoder;
+        encoder = NULL;
+        encoder = new PngStreamEncoder(fd, pixelsWide, pixelsHigh, withAlpha);
+    }
+
+    void PngStreamSink::WriteRow(const unsigned char *rgba, const float *floatRgba)
+    {
+        encoder->WriteRow(rgba);
+    }
+
+    void PngStreamSink::EndImage()
+    {
+        encoder->Finish();
+        delete encoder;
+        encoder = NULL;
+    }
+
+
+    void MemoryImageSink::BeginImage(size_t _pixelsWide, size_t _pixelsHigh)
+    {
+        pixelsWide = _pixelsWide;
+        pixelsHigh = _pixelsHigh;
+        rgbaBuffer.clear();
+        rgbaBuffer.reserve(4 * pixelsWide * pixelsHigh);
+        floatBuffer.clear();
+        if (keepFloat)
+        {
+            floatBuffer.reserve(4 * pixelsWide * pixelsHigh);
+        }
+    }
+
+    void MemoryImageSink::WriteRow(const unsigned char *rgba, const float *floatRgba)
+    {
+        rgbaBuffer.insert(rgbaBuffer.end(), rgba, rgba + 4*pixelsWide);
+        if (keepFloat)
+        {
+            floatBuffer.insert(floatBuffer.end(), floatRgba, floatRgba + 4*pixelsWide);
+        }
+    }
+
+    void MemoryImageSink::EndImage()
+    {
+    }
+
+
+    bool FrameRingSink::WantsFloatRows() const
+    {
+        return writer.GetFormat() == FRAME_FORMAT_RGBA_FLOAT;
+    }
+
+    void FrameRingSink::BeginImage(size_t pixelsWide, size_t pixelsHigh)
+    {
+        if (pixelsWide != writer.GetPixelsWide() || pixelsHigh != writer.GetPixelsHigh())
+        {
+            throw ImagerException("Image size differs from the frame ring's.");
+        }
+
+        target = static_cast<unsigned char *>(writer.BeginFrame());
+        if (target == NULL)
+        {
+            throw ImagerException("Frame ring reader stopped releasing frames.");
+        }
+        rowBytes = pixelsWide * FrameBytesPerPixel(writer.GetFormat());
+    }
+
+    void FrameRingSink::WriteRow(const unsigned char *rgba, const float *floatRgba)
+    {
+        if (floatRgba != NULL)
+        {
+            memcpy(target, floatRgba, rowBytes);
+        }
+        else
+        {
+            memcpy(target, rgba, rowBytes);
+        }
+        target += rowBytes;
+    }
+
+    void FrameRingSink::EndImage()
+    {
+        writer.EndFrame();
+        target = NULL;
+    }
+}
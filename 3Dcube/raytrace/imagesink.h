@@ -0,0 +1,194 @@
+/*
+    imagesink.h
+
+    Destinations for finished images.  Scene::SaveImage hands each
+    image to an ImageSink a row at a time, from the top, so a sink can
+    write it out as it arrives, keep it in memory, or pass it to
+    another process, without Scene knowing which.
+
+    Every row comes as RGBA bytes, scaled to the brightest pixel as for
+    PNG files.  A sink that asks for them also gets the same row as 4
+    floats per pixel in the scene's own color units, neither scaled nor
+    clamped (see Scene::SetFloatOutput), for high dynamic range output.
+*/
+
+#ifndef __DDC_IMAGESINK_H
+#define __DDC_IMAGESINK_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace Imager
+{
+    class FrameRingWriter;
+    class PngStreamEncoder;
+
+    class ImageSink
+    {
+    public:
+        virtual ~ImageSink()
+        {
+        }
+
+        // Whether WriteRow should be passed float pixels.
+        virtual bool WantsFloatRows() const
+        {
+            return false;
+        }
+
+        // Called before the rows of each image.
+        virtual void BeginImage(size_t pixelsWide, size_t pixelsHigh) = 0;
+
+        // Called once for each row, from the top of the image.
+        // 'rgba' holds 4 bytes per pixel; 'floatRgba' holds 4 floats
+        // per pixel if WantsFloatRows, and is NULL otherwise.
+        virtual void WriteRow(const unsigned char *rgba, const float *floatRgba) = 0;
+
+        // Called after the last row.
+        virtual void EndImage() = 0;
+    };
+
+    // Feeds a whole image, held row by row from the top, to 'sink'.
+    // 'floatRgba' may be NULL if the sink does not want float rows.
+    void WriteImage(
+        ImageSink& sink,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        const unsigned char *rgba,
+        const float *floatRgba);
+
+
+    enum ImageFileFormat
+    {
+        IMAGE_FILE_PNG,     // deflate-compressed 8-bit RGBA
+        IMAGE_FILE_PPM,     // binary portable pixmap (P6): raw 8-bit RGB
+        IMAGE_FILE_PAM,     // portable arbitrary map (P7): raw 8-bit RGBA
+        IMAGE_FILE_PFM      // portable float map: raw 32-bit float RGB, bottom row first
+    };
+
+    // Picks a file format from the extension of 'filename': .ppm, .pam,
+    // and .pfm for those formats, and PNG for anything else.
+    ImageFileFormat ImageFileFormatFromName(const char *filename);
+
+    // Writes each image to a file, replacing what the last one wrote.
+    // PNG files are encoded once the whole image has arrived; the
+    // uncompressed formats are written a row at a time.  Throws
+    // ImagerException if the file cannot be written.
+    class ImageFileSink: public ImageSink
+    {
+    public:
+        explicit ImageFileSink(const char *_filename);
+        ImageFileSink(const char *_filename, ImageFileFormat _format);
+        virtual ~ImageFileSink();
+
+        virtual bool WantsFloatRows() const
+        {
+            return format == IMAGE_FILE_PFM;
+        }
+
+        virtual void BeginImage(size_t pixelsWide, size_t pixelsHigh);
+        virtual void WriteRow(const unsigned char *rgba, const float *floatRgba);
+        virtual void EndImage();
+
+    private:
+        void Write(const void *data, size_t size);
+        void Close();
+
+        const std::string filename;
+        const ImageFileFormat format;
+        FILE *outfile;
+        size_t pixelsWide;
+        size_t pixelsHigh;
+        size_t row;                         // rows written so far
+        long dataOffset;                    // where the first PFM row starts
+        std::vector<unsigned char> buffer;  // the PNG image, or one row of the others
+    };
+
+    // Streams each image to a file descriptor as a PNG file as its
+    // rows arrive (see pngstream.h), holding only a few rows at a time.
+    // Without 'withAlpha' the PNG is RGB, since rendered images are
+    // always opaque.  The descriptor stays open.
+    class PngStreamSink: public ImageSink
+    {
+    public:
+        explicit PngStreamSink(int _fd, bool _withAlpha = false)
+            : fd(_fd)
+            , withAlpha(_withAlpha)
+            , encoder(NULL)
+        {
+        }
+
+        virtual ~PngStreamSink();
+
+        virtual void BeginImage(size_t pixelsWide, size_t pixelsHigh);
+        virtual void WriteRow(const unsigned char *rgba, const float *floatRgba);
+        virtual void EndImage();
+
+    private:
+        const int fd;
+        const bool withAlpha;
+        PngStreamEncoder *encoder;  // for the image being written
+    };
+
+    // Keeps a copy of the most recent image.
+    class MemoryImageSink: public ImageSink
+    {
+    public:
+        // With 'keepFloat', the float pixels are kept as well.
+        explicit MemoryImageSink(bool _keepFloat = false)
+            : keepFloat(_keepFloat)
+            , pixelsWide(0)
+            , pixelsHigh(0)
+        {
+        }
+
+        virtual bool WantsFloatRows() const
+        {
+            return keepFloat;
+        }
+
+        virtual void BeginImage(size_t _pixelsWide, size_t _pixelsHigh);
+        virtual void WriteRow(const unsigned char *rgba, const float *floatRgba);
+        virtual void EndImage();
+
+        size_t GetPixelsWide() const { return pixelsWide; }
+        size_t GetPixelsHigh() const { return pixelsHigh; }
+        const std::vector<unsigned char>& GetRgba() const { return rgbaBuffer; }
+        const std::vector<float>& GetFloatRgba() const { return floatBuffer; }
+
+    private:
+        const bool keepFloat;
+        size_t pixelsWide;
+        size_t pixelsHigh;
+        std::vector<unsigned char> rgbaBuffer;
+        std::vector<float> floatBuffer;
+    };
+
+    // Publishes each image as the next frame of a shared memory frame
+    // ring (see framering.h), writing the rows straight into the slot
+    // in the ring's format.  Throws ImagerException if the image size
+    // differs from the ring's, or if the reader stops releasing frames.
+    class FrameRingSink: public ImageSink
+    {
+    public:
+        explicit FrameRingSink(FrameRingWriter& _writer)
+            : writer(_writer)
+            , target(NULL)
+            , rowBytes(0)
+        {
+        }
+
+        virtual bool WantsFloatRows() const;
+        virtual void BeginImage(size_t pixelsWide, size_t pixelsHigh);
+        virtual void WriteRow(const unsigned char *rgba, const float *floatRgba);
+        virtual void EndImage();
+
+    private:
+        FrameRingWriter& writer;
+        unsigned char *target;      // where the next row goes in the ring
+        size_t rowBytes;
+    };
+}
+
+#endif // __DDC_IMAGESINK_H
@@ -0,0 +1,336 @@
+/*
+    instance.cpp
+
+    Implements class InstanceSet, declared in instance.h.
+*/
+
+#include <cmath>
+#include "instance.h"
+
+namespace Imager
+{
+    namespace
+    {
+        inline Vector MakeVector(const double v[3])
+        {
+            return Vector(v[0], v[1], v[2]);
+        }
+
+        // Camera space to prototype space, relative to the instance center.
+        inline Vector ToPrototype(const SolidInstance& instance, const Vector& v)
+        {
+            const float* r = instance.rotation;
+            return Vector(
+                r[0]*v.x + r[1]*v.y + r[2]*v.z,
+                r[3]*v.x + r[4]*v.y + r[5]*v.z,
+                r[6]*v.x + r[7]*v.y + r[8]*v.z);
+        }
+
+        // Prototype space back to camera space: the transpose of the above.
+        inline Vector FromPrototype(const SolidInstance& instance, const Vector& v)
+        {
+            const float* r = instance.rotation;
+            return Vector(
+                r[0]*v.x + r[3]*v.y + r[6]*v.z,
+                r[1]*v.x + r[4]*v.y + r[7]*v.z,
+                r[2]*v.x + r[5]*v.y + r[8]*v.z);
+        }
+
+        // Rotates the three rows the same way SolidObject_Reorientable
+        // rotates rDir, sDir, and tDir.
+        void RotateRows(Vector row[3], int axis, double angleInDegrees)
+        {
+            const double angleInRadians = RadiansFromDegrees(angleInDegrees);
+            const double a = cos(angleInRadians);
+            const double b = sin(angleInRadians);
+
+            for (int k=0; k < 3; ++k)
+            {
+                const Vector& d = row[k];
+                switch (axis)
+                {
+                case 0:  row[k] = Vector(d.x, a*d.y - b*d.z, a*d.z + b*d.y);  break;
+                case 1:  row[k] = Vector(a*d.x + b*d.z, d.y, a*d.z - b*d.x);  break;
+                default: row[k] = Vector(a*d.x - b*d.y, a*d.y + b*d.x, d.z);  break;
+                }
+            }
+        }
+    }
+
+    class InstanceSet::LeafIntersector
+    {
+    public:
+        LeafIntersector(
+            const InstanceSet& _set,
+            const Vector& _vantage,
+            const Vector& _direction,
+            IntersectionList& _intersectionList)
+                : set(_set)
+                , vantage(_vantage)
+                , direction(_direction)
+                , intersectionList(_intersectionList)
+        {
+        }
+
+        void operator() (uint32_t first, uint32_t count)
+        {
+            for (uint32_t k = first; k < first + count; ++k)
+            {
+                set.AppendInstanceIntersections(
+                    set.instanceList[k],
+                    vantage,
+                    direction,
+                    intersectionList);
+            }
+        }
+
+    private:
+        const InstanceSet& set;
+        const Vector& vantage;
+        const Vector& direction;
+        IntersectionList& intersectionList;
+    };
+
+    class InstanceSet::LeafContainment
+    {
+    public:
+        LeafContainment(const InstanceSet& _set, const Vector& _point)
+            : set(_set)
+            , point(_point)
+            , found(false)
+        {
+        }
+
+        bool operator() (uint32_t first, uint32_t count)
+        {
+            for (uint32_t k = first; k < first + count; ++k)
+            {
+                if (set.InstanceContains(set.instanceList[k], point))
+                {
+                    found = true;
+                    break;
+                }
+            }
+            return found;
+        }
+
+        bool Found() const { return found; }
+
+    private:
+        const InstanceSet& set;
+        const Vector& point;
+        bool found;
+    };
+
+    InstanceSet::InstanceSet(SolidObject* _prototype, double _boundingRadius)
+        : SolidObject()
+        , prototype(_prototype)
+        , boundingRadius(_boundingRadius)
+        , instanceList()
+        , nodeList()
+        , isPrepared(true)
+        , prototypeIntersectionList()
+    {
+        SetTag("InstanceSet");
+
+        // Each instance has its own material, found through the
+        // intersection context.
+        UseProceduralOptics();
+    }
+
+    InstanceSet::~InstanceSet()
+    {
+        for (size_t k=0; k < instanceList.size(); ++k)
+        {
+            MaterialTable::Release(instanceList[k].material);
+        }
+
+        delete prototype;
+        prototype = NULL;
+    }
+
+    void InstanceSet::AddInstance(
+        const Vector& center,
+        double angleX,
+        double angleY,
+        double angleZ,
+        MaterialId material)
+    {
+        Vector row[3] =
+        {
+            Vector(1.0, 0.0, 0.0),
+            Vector(0.0, 1.0, 0.0),
+            Vector(0.0, 0.0, 1.0)
+        };
+
+        if (angleX != 0.0) RotateRows(row, 0, angleX);
+        if (angleY != 0.0) RotateRows(row, 1, angleY);
+        if (angleZ != 0.0) RotateRows(row, 2, angleZ);
+
+        SolidInstance instance;
+        instance.center[0] = center.x;
+        instance.center[1] = center.y;
+        instance.center[2] = center.z;
+        for (int k=0; k < 3; ++k)
+        {
+            instance.rotation[3*k + 0] = static_cast<float>(row[k].x);
+            instance.rotation[3*k + 1] = static_cast<float>(row[k].y);
+            instance.rotation[3*k + 2] = static_cast<float>(row[k].z);
+        }
+        instance.material = material;
+
+        instanceList.push_back(instance);
+        MaterialTable::AddReference(material);
+        isPrepared = false;
+    }
+
+    size_t InstanceSet::GetMemoryUsage() const
+    {
+        return
+            sizeof(InstanceSet) +
+            instanceList.capacity() * sizeof(SolidInstance) +
+            nodeList.capacity() * sizeof(BvhNode);
+    }
+
+    void InstanceSet::Prepare() const
+    {
+        if (isPrepared)
+        {
+            return;
+        }
+
+        // Every instance fits in a cube of side 2*boundingRadius
+        // around its center, however it is rotated.
+        const Vector extent(boundingRadius, boundingRadius, boundingRadius);
+        const size_t count = instanceList.size();
+        std::vector<BoundingBox> boxes(count);
+        for (size_t k=0; k < count; ++k)
+        {
+            const Vector center = MakeVector(instanceList[k].center);
+            boxes[k] = BoundingBox(center - extent, center + extent);
+        }
+
+        std::vector<size_t> order;
+        BuildBoundingVolumeHierarchy(boxes, order, nodeList);
+
+        InstanceList sorted(count);
+        for (size_t k=0; k < count; ++k)
+        {
+            sorted[k] = instanceList[order[k]];
+        }
+        instanceList.swap(sorted);
+
+        isPrepared = true;
+    }
+
+    void InstanceSet::AppendInstanceIntersections(
+        const SolidInstance& instance,
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList) const
+    {
+        // Transform the ray once into the prototype's space...
+        const Vector& prototypeCenter = prototype->Center();
+        const Vector localVantage =
+            prototypeCenter + ToPrototype(instance, vantage - MakeVector(instance.center));
+        const Vector localDirection = ToPrototype(instance, direction);
+
+        prototypeIntersectionList.clear();
+        prototype->AppendAllIntersections(
+            localVantage,
+            localDirection,
+            prototypeIntersectionList);
+
+        // ...and each intersection back out of it.  The prototype's own
+        // context is not kept, because the instance needs the context
+        // to find its material.
+        IntersectionList::const_iterator iter = prototypeIntersectionList.begin();
+        IntersectionList::const_iterator end  = prototypeIntersectionList.end();
+        for (; iter != end; ++iter)
+        {
+            Intersection intersection;
+            intersection.point =
+                MakeVector(instance.center) +
+                FromPrototype(instance, iter->point - prototypeCenter);
+            intersection.surfaceNormal = FromPrototype(instance, iter->surfaceNormal);
+            intersection.distanceSquared = (intersection.point - vantage).MagnitudeSquared();
+            intersection.solid = this;
+            intersection.context = &instance;
+            intersection.tag = iter->tag;
+            intersectionList.push_back(intersection);
+        }
+    }
+
+    bool InstanceSet::InstanceContains(const SolidInstance& instance, const Vector& point) const
+    {
+        return prototype->Contains(
+            prototype->Center() +
+            ToPrototype(instance, point - MakeVector(instance.center)));
+    }
+
+    void InstanceSet::AppendAllIntersections(
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList) const
+    {
+        Prepare();
+        if (!nodeList.empty())
+        {
+            LeafIntersector visit(*this, vantage, direction, intersectionList);
+            TraverseBvh(&nodeList[0], vantage, direction, visit);
+        }
+    }
+
+    bool InstanceSet::Contains(const Vector& point) const
+    {
+        Prepare();
+        if (nodeList.empty())
+        {
+            return false;
+        }
+
+        LeafContainment visit(*this, point);
+        QueryBvhPoint(&nodeList[0], point, visit);
+        return visit.Found();
+    }
+
+    Optics InstanceSet::SurfaceOptics(
+        const Vector& surfacePoint,
+        const void *context) const
+    {
+        const SolidInstance* instance = static_cast<const SolidInstance*>(context);
+        return MaterialTable::Lookup(instance->material);
+    }
+
+    SolidObject& InstanceSet::Translate(double dx, double dy, double dz)
+    {
+        SolidObject::Translate(dx, dy, dz);
+
+        InstanceList::iterator iter = instanceList.begin();
+        InstanceList::iterator end  = instanceList.end();
+        for (; iter != end; ++iter)
+        {
+            iter->center[0] += dx;
+            iter->center[1] += dy;
+            iter->center[2] += dz;
+        }
+
+        isPrepared = false;
+        return *this;
+    }
+
+    SolidObject& InstanceSet::RotateX(double angleInDegrees)
+    {
+        throw ImagerException("An instance set cannot be rotated.");
+    }
+
+    SolidObject& InstanceSet::RotateY(double angleInDegrees)
+    {
+        throw ImagerException("An instance set cannot be rotated.");
+    }
+
+    SolidObject& InstanceSet::RotateZ(double angleInDegrees)
+    {
+        throw ImagerException("An instance set cannot be rotated.");
+    }
+}
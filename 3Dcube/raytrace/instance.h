@@ -0,0 +1,112 @@
+/*
+    instance.h
+
+    Lightweight instancing: one SolidObject that stands for many
+    rotated and translated copies of a single prototype solid.
+
+    A Cuboid carries its own tag string, six orientation vectors,
+    center, material, refractive index, intersection caches, and heap
+    allocation.  An instance stores only a center, a single-precision
+    rotation, and a material id, and the set keeps a bounding volume
+    hierarchy over its instances.  Each instance a ray might hit is
+    traced by moving the ray into the prototype's space once and
+    asking the prototype for its intersections.
+*/
+
+#ifndef __DDC_INSTANCE_H
+#define __DDC_INSTANCE_H
+
+#include <vector>
+#include "imager.h"
+#include "bvh.h"
+
+namespace Imager
+{
+    // One copy of the prototype.  The rotation rows take a camera-space
+    // direction to the prototype's space, like rDir, sDir, and tDir in
+    // SolidObject_Reorientable.
+    struct SolidInstance
+    {
+        double      center[3];
+        float       rotation[9];
+        MaterialId  material;
+    };
+
+    class InstanceSet: public SolidObject
+    {
+    public:
+        // The set takes ownership of 'prototype'.  Every point of the
+        // prototype must lie within 'boundingRadius' of its center.
+        InstanceSet(SolidObject* _prototype, double _boundingRadius);
+        virtual ~InstanceSet();
+
+        // Adds a copy of the prototype moved to 'center' and rotated
+        // about the x, y, and z axes, in that order, as the Rotate
+        // methods of any other solid would do.  Each instance holds
+        // its own reference to 'material' in the MaterialTable.
+        void AddInstance(
+            const Vector& center,
+            double angleX,
+            double angleY,
+            double angleZ,
+            MaterialId material);
+
+        size_t GetInstanceCount() const
+        {
+            return instanceList.size();
+        }
+
+        // Bytes of memory used by the instances and the hierarchy.
+        size_t GetMemoryUsage() const;
+
+        virtual void AppendAllIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const;
+
+        virtual bool Contains(const Vector& point) const;
+
+        // The intersection context points at the instance that was hit.
+        virtual Optics SurfaceOptics(
+            const Vector& surfacePoint,
+            const void *context) const;
+
+        // Moves every instance along with the set's center.
+        virtual SolidObject& Translate(double dx, double dy, double dz);
+
+        // The instances can be moved as a whole but not rotated.
+        virtual SolidObject& RotateX(double angleInDegrees);
+        virtual SolidObject& RotateY(double angleInDegrees);
+        virtual SolidObject& RotateZ(double angleInDegrees);
+
+    private:
+        InstanceSet(const InstanceSet&);                // not copyable
+        InstanceSet& operator= (const InstanceSet&);
+
+        // Sorts the instances into hierarchy leaf order and builds the
+        // hierarchy, if instances were added since it was last built.
+        void Prepare() const;
+
+        void AppendInstanceIntersections(
+            const SolidInstance& instance,
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const;
+
+        bool InstanceContains(const SolidInstance& instance, const Vector& point) const;
+
+        class LeafIntersector;      // visitors for TraverseBvh and QueryBvhPoint
+        class LeafContainment;
+
+        typedef std::vector<SolidInstance> InstanceList;
+
+        SolidObject* prototype;
+        const double boundingRadius;
+        mutable InstanceList instanceList;
+        mutable std::vector<BvhNode> nodeList;
+        mutable bool isPrepared;
+        mutable IntersectionList prototypeIntersectionList;
+    };
+}
+
+#endif // __DDC_INSTANCE_H
@@ -0,0 +1,85 @@
+/*
+    lights.cpp
+
+    Builds the light hierarchy declared in lights.h.
+*/
+
+#include "lights.h"
+
+namespace Imager
+{
+    void LightHierarchy::Build(const std::vector<LightSource>& lightSourceList)
+    {
+        // Each light is a point, so its box has no size at all.
+        const size_t numLights = lightSourceList.size();
+        std::vector<BoundingBox> boxes(numLights);
+        for (size_t k=0; k < numLights; ++k)
+        {
+            boxes[k] = BoundingBox(lightSourceList[k].location, lightSourceList[k].location);
+        }
+
+        BuildBoundingVolumeHierarchy(boxes, order, nodes);
+
+        // Children always have larger indices than their parent,
+        // so walking the nodes backward finishes every child
+        // before the parent that looks at it.
+        nodeBrightness.resize(nodes.size());
+        for (size_t index = nodes.size(); index > 0; --index)
+        {
+            const size_t n = index - 1;
+            const BvhNode& node = nodes[n];
+            double brightness = 0.0;
+            if (node.count > 0)
+            {
+                for (uint32_t slot = node.offset; slot < node.offset + node.count; ++slot)
+                {
+                    const double b = BrightestComponent(lightSourceList[order[slot]].color);
+                    if (b > brightness)
+                    {
+                        brightness = b;
+                    }
+                }
+            }
+            else
+            {
+                brightness = nodeBrightness[n+1];
+                if (nodeBrightness[node.offset] > brightness)
+                {
+                    brightness = nodeBrightness[node.offset];
+                }
+            }
+            nodeBrightness[n] = brightness;
+        }
+    }
+
+    double LightHierarchy::UpperBound(size_t nodeIndex, const Vector& point) const
+    {
+        // Find the squared distance from the point to the nearest
+        // point in the node's box.  The cosine of the incidence angle
+        // never exceeds 1, so no light in the box can do better than
+        // the brightest one's brightness divided by this distance.
+        const BvhNode& node = nodes[nodeIndex];
+        const double p[3] = { point.x, point.y, point.z };
+        double distanceSquared = 0.0;
+        for (int k=0; k < 3; ++k)
+        {
+            double gap = 0.0;
+            if (p[k] < node.minCorner[k])
+            {
+                gap = node.minCorner[k] - p[k];
+            }
+            else if (p[k] > node.maxCorner[k])
+            {
+                gap = p[k] - node.maxCorner[k];
+            }
+            distanceSquared += gap * gap;
+        }
+
+        if (distanceSquared <= 0.0)
+        {
+            return -1.0;
+        }
+
+        return nodeBrightness[nodeIndex] / distanceSquared;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+    lights.h
+
+    A bounding volume hierarchy over the light sources in a scene.
+
+    Each node knows the brightest light below it, so the most any one
+    light in a cluster can add to the matte illumination of a point is
+    bounded by that brightness divided by the squared distance from the
+    point to the cluster's box.  Scene::CalculateMatte uses these bounds
+    to visit lights in order of contribution and to skip, without any
+    shadow rays, whole clusters of lights too dim to matter.
+*/
+
+#ifndef __DDC_LIGHTS_H
+#define __DDC_LIGHTS_H
+
+#include <vector>
+#include "imager.h"
+#include "bvh.h"
+
+namespace Imager
+{
+    // The largest of the red, green, and blue components.
+    inline double BrightestComponent(const Color& color)
+    {
+        double brightest = color.red;
+        if (color.green > brightest) brightest = color.green;
+        if (color.blue  > brightest) brightest = color.blue;
+        return brightest;
+    }
+
+    class LightHierarchy
+    {
+    public:
+        void Build(const std::vector<LightSource>& lightSourceList);
+
+        bool IsEmpty() const
+        {
+            return nodes.empty();
+        }
+
+        const BvhNode& Node(size_t nodeIndex) const
+        {
+            return nodes[nodeIndex];
+        }
+
+        // Leaf slot k refers to lightSourceList[LightIndex(k)].
+        size_t LightIndex(size_t slot) const
+        {
+            return order[slot];
+        }
+
+        // An upper bound on the matte illumination that any single light
+        // below the node can give 'point', ignoring shadows.  Returns a
+        // negative number when the point is inside the node's box, where
+        // no finite bound exists.
+        double UpperBound(size_t nodeIndex, const Vector& point) const;
+
+    private:
+        std::vector<BvhNode> nodes;
+        std::vector<size_t>  order;
+        std::vector<double>  nodeBrightness;    // largest BrightestComponent below each node
+    };
+}
+
+#endif // __DDC_LIGHTS_H
@@ -2,108 +2,2570 @@
   Main source file.
 */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "algebra.h"
+#include "animation.h"
+#include "baked.h"
 #include "block.h"
+#include "cache.h"
+#include "describe.h"
+#include "framering.h"
+#include "imagesink.h"
+#include "pngdecode.h"
+#include "instance.h"
+#include "perfcount.h"
+#include "server.h"
+#include "tiles.h"
+#include "timer.h"
+#include "../lodepng/lodepng.h"
 //#include "chessboard.h"
 
-void renderCubes()
+// Returns the path of a file named 'name' in a scratch directory, for
+// the images written by the demonstration and timing verbs.  Only the
+// stock images written by 'run' belong in ../output, which is under
+// version control.  The directory is made under $TMPDIR, or /tmp, the
+// first time it is needed, and reported then.
+std::string ScratchFileName(const char *name)
 {
+    static std::string directory;
+    if (directory.empty())
+    {
+        const char *parent = getenv("TMPDIR");
+        std::string pattern = std::string((parent != NULL && parent[0] != '\0') ? parent : "/tmp") + "/raytrace.XXXXXX";
+        if (mkdtemp(&pattern[0]) == NULL)
+        {
+            throw Imager::ImagerException("Cannot create scratch directory.");
+        }
+        directory = pattern;
+        std::cout << "Writing images to " << directory << std::endl;
+    }
+    return directory + "/" + name;
+}
+
+// Writes one of the stock cube images, through the render cache if there is one.
+void SaveStockImage(
+    const Imager::Scene& scene,
+    const char *filename,
+    Imager::RenderCache *cache)
+{
+    if (cache != NULL)
+    {
+        cache->SaveImage(scene, filename, 300, 300, 3.0, 2);
+    }
+    else
+    {
+        scene.SaveImage(filename, 300, 300, 3.0, 2);
+    }
+}
+
+// Placement of the cube in each of the stock images written by 'run'.
+struct StockCube
+{
+    double z;           // distance in front of the camera (negative)
+    double angleX;      // rotation about the x axis, applied first
+    double angleY;      // rotation about the y axis, applied second
+};
+
+const StockCube StockCubeTable[] =
+{
+    { -50.0, -115.0,   22.0 },
+    { -50.0, -115.0,  -22.0 },
+    { -20.0,  -90.0,   22.0 },
+    { -55.0, -115.0,  122.0 },
+    { -20.0,   21.0,   22.0 },
+    { -65.0,  -35.0,  122.0 },
+};
+
+const size_t NUM_STOCK_CUBES = sizeof(StockCubeTable) / sizeof(StockCubeTable[0]);
+
+// Fills an empty scene with stock cube image number 'index'.
+void BuildStockScene(Imager::Scene& scene, size_t index)
+{
+    using namespace Imager;
+
+    const StockCube& stock = StockCubeTable[index];
+
+    Cuboid *cuboid = new Cuboid(2.0, 2.0, 2.0);  //cube with length, width and height
+    cuboid->SetFullMatte(Color(0.7, 0.7, 0.8));
+    cuboid->Move(0.0, 0.0, stock.z);
+    cuboid->RotateX(stock.angleX);
+    cuboid->RotateY(stock.angleY);
+
+    scene.AddSolidObject(cuboid);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+}
+
+// run [cache directory]
+void renderCubes(int argc, const char *argv[])
+{
+    using namespace Imager;
+
+    // With a cache directory, images already rendered by an earlier
+    // run are copied from the cache instead of being traced again.
+    RenderCache *cache = NULL;
+    if (argc > 0)
+    {
+        cache = new RenderCache(64 << 20, argv[0], 256 << 20);
+    }
+
+    char filename[64];
+    for (size_t i=0; i < NUM_STOCK_CUBES; ++i)
+    {
+        Scene scene(Color(0.0, 0.0, 0.0));
+        BuildStockScene(scene, i);
+
+        snprintf(filename, sizeof(filename), "../output/cuboid_%u.png", static_cast<unsigned>(i + 1));
+        SaveStockImage(scene, filename, cache);
+    }
+
+    if (cache != NULL)
+    {
+        std::cout << "Render cache: " << cache->GetStats() << std::endl;
+        delete cache;
+    }
+}
+
+
+// Adds a field of randomly tilted cubes to a scene, centered in front of the camera.
+void AddCubeField(Imager::Scene& scene, size_t cubesPerSide)
+{
+    using namespace Imager;
+
+    const double spacing = 6.0;
+    const double offset = spacing * (cubesPerSide - 1) / 2.0;
+    unsigned seed = 12345;
+    for (size_t i=0; i < cubesPerSide; ++i)
+    {
+        for (size_t j=0; j < cubesPerSide; ++j)
+        {
+            Cuboid *cuboid = new Cuboid(2.0, 2.0, 2.0);
+            cuboid->SetFullMatte(Color(0.7, 0.7, 0.8));
+            cuboid->Move(i*spacing - offset, j*spacing - offset, -2.0*offset - 60.0);
+
+            seed = seed*1103515245 + 12345;
+            cuboid->RotateX((seed >> 16) % 360);
+            seed = seed*1103515245 + 12345;
+            cuboid->RotateY((seed >> 16) % 360);
+
+            scene.AddSolidObject(cuboid);
+        }
+    }
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+}
+
+// bake <outfile> [cubes per side]
+// Builds a square field of cubes and writes it as a baked scene file.
+void BakeCubeField(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    if (argc < 1)
+    {
+        cerr << "ERROR:  bake requires an output file name." << endl;
+        return;
+    }
+    const size_t cubesPerSide = (argc > 1) ? atoi(argv[1]) : 100;
+
+    double start = WallClockSeconds();
+    Scene scene(Color(0.0, 0.0, 0.0));
+    AddCubeField(scene, cubesPerSide);
+    const double buildTime = WallClockSeconds() - start;
+
+    start = WallClockSeconds();
+    scene.SaveBakedScene(argv[0]);
+    const double bakeTime = WallClockSeconds() - start;
+
+    cout << "Built " << (cubesPerSide * cubesPerSide) << " cubes in " << buildTime;
+    cout << " s, baked to " << argv[0] << " in " << bakeTime << " s" << endl;
+}
+
+// baked <infile> <outfile.png>
+// Maps a baked scene file and renders it.
+void RenderBakedScene(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    if (argc < 2)
+    {
+        cerr << "ERROR:  baked requires a baked scene file and a PNG file name." << endl;
+        return;
+    }
+
+    double start = WallClockSeconds();
+    Scene scene;
+    scene.LoadBakedScene(argv[0]);
+    const double loadTime = WallClockSeconds() - start;
+
+    start = WallClockSeconds();
+    scene.SaveImage(argv[1], 400, 400, 1.0, 1);
+    const double renderTime = WallClockSeconds() - start;
+
+    cout << "Loaded " << argv[0] << " in " << loadTime;
+    cout << " s, rendered " << argv[1] << " in " << renderTime << " s" << endl;
+}
+
+// spin [frames]
+// Renders a turntable sequence of the first cube image from one persistent scene.
+void RenderTurntable(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numFrames = (argc > 0) ? atoi(argv[0]) : 36;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+
+    Cuboid *cuboid = new Cuboid(2.0, 2.0, 2.0);
+    cuboid->SetFullMatte(Color(0.7, 0.7, 0.8));
+    cuboid->Move(0.0, 0.0, -50.0);
+    cuboid->RotateX(-115.0);
+
+    scene.AddSolidObject(cuboid);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+
+    Animation animation(scene);
+    animation.AddKeyframe(*cuboid, 0, cuboid->Center(), 0.0, 0.0, 0.0);
+    animation.AddKeyframe(*cuboid, numFrames, cuboid->Center(), 0.0, 360.0, 0.0);
+    animation.Render(ScratchFileName("spin_%03u.png").c_str(), numFrames, 300, 300, 3.0, 2);
+
+    cout << "Rendered " << numFrames << " frames: ";
+    cout << animation.PoseSeconds() << " s posing, ";
+    cout << animation.TraceSeconds() << " s rendering" << endl;
+}
+
+// relight [frames]
+// Renders a field of cubes once, then moves the light around it,
+// comparing full renders against relighting the retained primary hits.
+void RelightCubeField(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numFrames = (argc > 0) ? atoi(argv[0]) : 8;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    AddCubeField(scene, 10);
+    scene.SetRetainPrimaryHits(true);
+
+    double start = WallClockSeconds();
+    const vector<unsigned char> firstImage = scene.RenderImage(300, 300, 1.5, 2);
+    const double firstTime = WallClockSeconds() - start;
+
+    // Relighting must reproduce a full render exactly, both with the
+    // lights untouched and after each move below.
+    if (scene.RelightImage() != firstImage)
+    {
+        throw ImagerException("Relit image differs from the full render.");
+    }
+
+    double renderTime = 0.0;
+    double relightTime = 0.0;
+    for (size_t frame=0; frame < numFrames; ++frame)
+    {
+        const double angle = (2.0 * PI * frame) / numFrames;
+        scene.GetLightSource(0).location = Vector(50.0*cos(angle), 50.0*sin(angle), +20.0);
+
+        start = WallClockSeconds();
+        const vector<unsigned char> relitImage = scene.RelightImage();
+        relightTime += WallClockSeconds() - start;
+
+        start = WallClockSeconds();
+        const vector<unsigned char>& renderedImage = scene.RenderImage(300, 300, 1.5, 2);
+        renderTime += WallClockSeconds() - start;
+
+        if (relitImage != renderedImage)
+        {
+            throw ImagerException("Relit image differs from the full render.");
+        }
+    }
+
+    scene.SaveRelitImage(ScratchFileName("relight.png").c_str());
+
+    cout << "First render with retained hits: " << firstTime << " s" << endl;
+    cout << numFrames << " light positions: " << renderTime << " s rendering, ";
+    cout << relightTime << " s relighting" << endl;
+}
+
+// Adds a field of cubes lit only by the given number of small lights.
+void BuildManyLightsScene(Imager::Scene& scene, size_t numLights)
+{
+    using namespace Imager;
+
+    AddCubeField(scene, 6);
+    scene.ClearLightSources();
+
+    // Scatter lights over a wide slab around the cubes, as with street
+    // lamps around a city block: most are far away and matter little.
+    unsigned seed = 6789;
+    for (size_t k=0; k < numLights; ++k)
+    {
+        double coord[3];
+        for (int c=0; c < 3; ++c)
+        {
+            seed = seed*1103515245 + 12345;
+            coord[c] = ((seed >> 16) % 1000) / 1000.0;
+        }
+        const Vector location(2000.0*coord[0] - 1000.0, 2000.0*coord[1] - 1000.0, -40.0*coord[2] - 40.0);
+        scene.AddLightSource(LightSource(location, Color(0.7, 0.7, 0.8)));
+    }
+}
+
+// lights [count]
+// Renders a field of cubes lit by many small lights, once visiting
+// every light at every point and once through the light hierarchy.
+void RenderManyLights(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numLights = (argc > 0) ? atoi(argv[0]) : 1000;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    BuildManyLightsScene(scene, numLights);
+
+    scene.SetLightCulling(false);
+    double start = WallClockSeconds();
+    const vector<unsigned char> exactImage = scene.RenderImage(200, 200, 1.0, 1);
+    const double exactTime = WallClockSeconds() - start;
+
+    scene.SetLightCulling(true);
+    start = WallClockSeconds();
+    const vector<unsigned char>& culledImage = scene.RenderImage(200, 200, 1.0, 1);
+    const double culledTime = WallClockSeconds() - start;
+
+    int maxDiff = 0;
+    for (size_t k=0; k < exactImage.size(); ++k)
+    {
+        const int diff = abs(static_cast<int>(exactImage[k]) - static_cast<int>(culledImage[k]));
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+        }
+    }
+
+    cout << numLights << " lights: " << exactTime << " s testing every light, ";
+    cout << culledTime << " s with the light hierarchy; ";
+    cout << "largest pixel difference " << maxDiff << "/255" << endl;
+}
+
+// Prints one line of shadow ray statistics.
+void PrintShadowRayStats(const char *label, const Imager::ShadowRayStats& stats, double seconds)
+{
+    using namespace std;
+
+    cout << label << ": " << seconds << " s, ";
+    cout << stats.shadowRays << " shadow rays, ";
+    cout << (stats.shadowRays ? (double)stats.intersectionTests / stats.shadowRays : 0.0);
+    cout << " tests per shadow ray, " << stats.blockedRays << " blocked, ";
+    cout << (stats.blockedRays ? (100.0 * stats.occluderHits) / stats.blockedRays : 0.0);
+    cout << "% of those by the cached occluder" << endl;
+}
+
+// shadows [cubes per side]
+// Renders a field of cubes casting shadows onto a wall behind them,
+// with and without the per-thread last-occluder cache.
+void RenderShadowField(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 10;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    AddCubeField(scene, cubesPerSide);
+
+    // The wall is added last, so without the cache every shadow
+    // ray that reaches it must first be tested against every cube.
+    const double size = 6.0 * cubesPerSide + 40.0;
+    Cuboid *wall = new Cuboid(size, size, 1.0);
+    wall->SetFullMatte(Color(0.8, 0.8, 0.7));
+    wall->Move(0.0, 0.0, -6.0 * cubesPerSide - 90.0);
+    scene.AddSolidObject(wall);
+
+    // A light off to one side casts the shadows of the cubes onto the wall.
+    scene.ClearLightSources();
+    scene.AddLightSource(LightSource(Vector(-size, 0.5 * size, 0.0), Color(0.7, 0.7, 0.7)));
+
+    scene.SetOccluderCaching(false);
+    double start = WallClockSeconds();
+    const vector<unsigned char> plainImage = scene.RenderImage(300, 300, 1.0, 1);
+    const double plainTime = WallClockSeconds() - start;
+    const ShadowRayStats plainStats = scene.GetShadowRayStats();
+
+    scene.ResetShadowRayStats();
+    scene.SetOccluderCaching(true);
+    start = WallClockSeconds();
+    const vector<unsigned char>& cachedImage = scene.RenderImage(300, 300, 1.0, 1);
+    const double cachedTime = WallClockSeconds() - start;
+    const ShadowRayStats cachedStats = scene.GetShadowRayStats();
+
+    if (plainImage != cachedImage)
+    {
+        throw ImagerException("The occluder cache changed the image.");
+    }
+
+    PrintShadowRayStats("Without occluder cache", plainStats, plainTime);
+    PrintShadowRayStats("With occluder cache   ", cachedStats, cachedTime);
+
+    scene.SaveImage(ScratchFileName("shadows.png").c_str(), 300, 300, 1.0, 1);
+}
+
+// Adds a field of tilted glass cubes, each with a denser core, in front of the camera.
+void AddGlassField(Imager::Scene& scene, size_t cubesPerSide)
+{
+    using namespace Imager;
+
+    const double spacing = 6.0;
+    const double offset = spacing * (cubesPerSide - 1) / 2.0;
+    unsigned seed = 24680;
+    for (size_t i=0; i < cubesPerSide; ++i)
+    {
+        for (size_t j=0; j < cubesPerSide; ++j)
+        {
+            seed = seed*1103515245 + 12345;
+            const double angleX = (seed >> 16) % 360;
+            seed = seed*1103515245 + 12345;
+            const double angleY = (seed >> 16) % 360;
+
+            // The core is added before the cube around it, so that
+            // it controls the refractive index where the two overlap.
+            for (int layer=0; layer < 2; ++layer)
+            {
+                const double size = layer ? 2.0 : 1.0;
+                Cuboid *cuboid = new Cuboid(size, size, size);
+                cuboid->SetFullMatte(layer ? Color(0.6, 0.8, 0.7) : Color(0.9, 0.5, 0.5));
+                cuboid->SetOpacity(0.1);
+                cuboid->SetRefraction(layer ? REFRACTION_GLASS : 2.0);
+                cuboid->Move(i*spacing - offset, j*spacing - offset, -2.0*offset - 40.0);
+                cuboid->RotateX(angleX);
+                cuboid->RotateY(angleY);
+                scene.AddSolidObject(cuboid);
+            }
+        }
+    }
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+}
+
+// glass [cubes per side]
+// Renders a field of glass cubes, each with a denser core, finding the
+// medium beyond every refracting surface once by containment tests and
+// once from the media each ray carries along with it.
+void RenderGlassField(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 4;
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, cubesPerSide);
+
+    scene.SetMediumTracking(false);
+    double start = WallClockSeconds();
+    const vector<unsigned char> scanImage = scene.RenderImage(300, 300, 2.0, 1);
+    const double scanTime = WallClockSeconds() - start;
+    const unsigned long scanQueries = scene.GetContainmentQueryCount();
+
+    scene.ResetContainmentQueryCount();
+    scene.SetMediumTracking(true);
+    start = WallClockSeconds();
+    const vector<unsigned char>& trackedImage = scene.RenderImage(300, 300, 2.0, 1);
+    const double trackedTime = WallClockSeconds() - start;
+    const unsigned long trackedQueries = scene.GetContainmentQueryCount();
+
+    int maxDiff = 0;
+    size_t numDiffering = 0;
+    for (size_t k=0; k < scanImage.size(); ++k)
+    {
+        const int diff = abs(static_cast<int>(scanImage[k]) - static_cast<int>(trackedImage[k]));
+        if (diff > 0)
+        {
+            ++numDiffering;
+        }
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+        }
+    }
+
+    scene.SaveImage(ScratchFileName("glass.png").c_str(), 300, 300, 2.0, 1);
+
+    cout << 2 * cubesPerSide * cubesPerSide << " glass solids:" << endl;
+    cout << "    containment tests: " << scanTime << " s, " << scanQueries << " queries" << endl;
+    cout << "    medium tracking:   " << trackedTime << " s, " << trackedQueries << " queries" << endl;
+    cout << "    " << numDiffering << " channels differ, largest by " << maxDiff << "/255" << endl;
+}
+
+// Renders a scene recursively and as wavefronts, and reports
+// the times and how far apart the two images are.
+void CompareWavefront(
+    const char *label,
+    Imager::Scene& scene,
+    size_t pixelsWide,
+    size_t pixelsHigh,
+    double zoom,
+    size_t antiAliasFactor)
+{
+    using namespace std;
+    using namespace Imager;
+
+    scene.SetWavefrontTracing(false);
+    double start = WallClockSeconds();
+    const vector<unsigned char> recursiveImage = scene.RenderImage(pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+    const double recursiveTime = WallClockSeconds() - start;
+
+    scene.SetWavefrontTracing(true);
+    start = WallClockSeconds();
+    const vector<unsigned char>& wavefrontImage = scene.RenderImage(pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+    const double wavefrontTime = WallClockSeconds() - start;
+
+    int maxDiff = 0;
+    size_t numDiffering = 0;
+    for (size_t k=0; k < recursiveImage.size(); ++k)
+    {
+        const int diff = abs(static_cast<int>(recursiveImage[k]) - static_cast<int>(wavefrontImage[k]));
+        if (diff > 0)
+        {
+            ++numDiffering;
+        }
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+        }
+    }
+
+    cout << label << ": recursive " << recursiveTime << " s, wavefront " << wavefrontTime;
+    cout << " s, " << numDiffering << " channels differ, largest by " << maxDiff << "/255" << endl;
+}
+
+// wavefront [cubes per side]
+// Renders the stock cube images and a field of glass cubes both by
+// recursive ray tracing and a generation of rays at a time.
+void RenderWavefrontComparison(int argc, const char *argv[])
+{
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 4;
+
+    char label[32];
+    for (size_t i=0; i < NUM_STOCK_CUBES; ++i)
+    {
+        Scene scene(Color(0.0, 0.0, 0.0));
+        BuildStockScene(scene, i);
+        snprintf(label, sizeof(label), "cuboid_%u", static_cast<unsigned>(i + 1));
+        CompareWavefront(label, scene, 300, 300, 3.0, 2);
+    }
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, cubesPerSide);
+    CompareWavefront("glass", scene, 300, 300, 2.0, 1);
+    scene.SaveImage(ScratchFileName("wavefront.png").c_str(), 300, 300, 2.0, 1);
+}
+
+void PrintRenderStats(const char *label, const Imager::RenderStats& stats, double seconds)
+{
+    using namespace std;
+
+    cout << label << ": " << seconds << " s, " << stats.raysTraced << " rays, ";
+    cout << stats.depthCutoffs << " too deep, " << stats.intensityCutoffs << " too weak, ";
+    cout << stats.mergedRays << " merged, " << stats.terminatedRays << " terminated, ";
+    cout << stats.pixelsOverBudget << " pixels over budget, ";
+    cout << stats.pixelsOverFrameBudget << " cut by the frame budget" << endl;
+}
+
+// budget [cubes per side] [rays per pixel] [rays per frame]
+// Renders a field of glass cubes without a ray budget, with a budget
+// per pixel, and with a budget for the whole frame, and reports how
+// often each budget cut tracing short and how much the image changed.
+void CompareRayBudgets(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 4;
+    const unsigned long raysPerPixel = (argc > 1) ? atol(argv[1]) : 8;
+    const unsigned long raysPerFrame = (argc > 2) ? atol(argv[2]) : 400000;
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, cubesPerSide);
+
+    struct BudgetCase
+    {
+        const char *label;
+        unsigned long raysPerPixel;
+        unsigned long raysPerFrame;
+        bool wavefront;
+    };
+    const BudgetCase caseTable[] =
+    {
+        { "no budget         ", 0,            0,            false },
+        { "pixel budget      ", raysPerPixel, 0,            false },
+        { "pixel (wavefront) ", raysPerPixel, 0,            true  },
+        { "frame budget      ", 0,            raysPerFrame, false },
+    };
+    const size_t numCases = sizeof(caseTable) / sizeof(caseTable[0]);
+
+    vector<unsigned char> fullImage;
+    for (size_t c=0; c < numCases; ++c)
+    {
+        RenderLimits limits;
+        limits.maxRaysPerPixel = caseTable[c].raysPerPixel;
+        limits.maxRaysPerFrame = caseTable[c].raysPerFrame;
+        scene.SetRenderLimits(limits);
+        scene.SetWavefrontTracing(caseTable[c].wavefront);
+
+        const double start = WallClockSeconds();
+        const vector<unsigned char>& image = scene.RenderImage(300, 300, 2.0, 1);
+        const double elapsed = WallClockSeconds() - start;
+        PrintRenderStats(caseTable[c].label, scene.GetRenderStats(), elapsed);
+
+        if (c == 0)
+        {
+            fullImage = image;
+        }
+        else
+        {
+            int maxDiff = 0;
+            double sumDiff = 0.0;
+            for (size_t k=0; k < image.size(); ++k)
+            {
+                const int diff = abs(static_cast<int>(fullImage[k]) - static_cast<int>(image[k]));
+                sumDiff += diff;
+                if (diff > maxDiff)
+                {
+                    maxDiff = diff;
+                }
+            }
+            cout << "    differs from the full render by " << sumDiff / image.size();
+            cout << "/255 on average, at most " << maxDiff << "/255" << endl;
+        }
+    }
+
+    scene.SaveImage(ScratchFileName("budget.png").c_str(), 300, 300, 2.0, 1);
+}
+
+// Bytes currently allocated from the heap, including large blocks
+// that the allocator maps directly.
+size_t HeapBytesInUse()
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Adds the same layout and the same sequence of tilts as AddCubeField,
+// but as instances of one cube, all with the given optics.
+Imager::InstanceSet *AddInstancedCubeField(
+    Imager::Scene& scene,
+    size_t cubesPerSide,
+    const Imager::Optics& optics)
+{
+    using namespace Imager;
+
+    Cuboid *prototype = new Cuboid(2.0, 2.0, 2.0);
+    InstanceSet *instanceSet = new InstanceSet(prototype, 2.0 * sqrt(3.0));    // center to corner
+    const MaterialId material = MaterialTable::Intern(optics);
+
+    const double spacing = 6.0;
+    const double offset = spacing * (cubesPerSide - 1) / 2.0;
+    unsigned seed = 12345;
+    for (size_t i=0; i < cubesPerSide; ++i)
+    {
+        for (size_t j=0; j < cubesPerSide; ++j)
+        {
+            seed = seed*1103515245 + 12345;
+            const double angleX = (seed >> 16) % 360;
+            seed = seed*1103515245 + 12345;
+            const double angleY = (seed >> 16) % 360;
+
+            instanceSet->AddInstance(
+                Vector(i*spacing - offset, j*spacing - offset, -2.0*offset - 60.0),
+                angleX, angleY, 0.0,
+                material);
+        }
+    }
+    MaterialTable::Release(material);      // the instances hold their own references
+    scene.AddSolidObject(instanceSet);
+    return instanceSet;
+}
+
+// instances [cubes per side]
+// Builds the same field of tilted cubes from separate Cuboid objects and
+// from one instanced prototype, then compares memory and render time.
+void CompareInstancing(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 300;
+    const size_t numCubes = cubesPerSide * cubesPerSide;
+    const LightSource light(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7));
+
+    size_t heapBefore = HeapBytesInUse();
+    Scene cuboidScene(Color(0.0, 0.0, 0.0));
+    AddCubeField(cuboidScene, cubesPerSide);
+    const size_t cuboidBytes = HeapBytesInUse() - heapBefore;
+
+    heapBefore = HeapBytesInUse();
+    Scene instanceScene(Color(0.0, 0.0, 0.0));
+    Optics optics;
+    optics.SetMatteGlossBalance(0.0, Color(0.7, 0.7, 0.8), Color(0.0, 0.0, 0.0));
+    InstanceSet *instanceSet = AddInstancedCubeField(instanceScene, cubesPerSide, optics);
+    instanceScene.AddLightSource(light);
+    const size_t instanceBytes = HeapBytesInUse() - heapBefore;
+
+    // Only the instanced field is rendered; the Cuboid scene exists for
+    // the memory comparison, and tracing it without a hierarchy would
+    // test every cube for every ray.  Rendering also builds the
+    // instance hierarchy, which is counted below.
+    const double start = WallClockSeconds();
+    instanceScene.SaveImage(ScratchFileName("instances.png").c_str(), 300, 300, 1.0, 1);
+    const double renderTime = WallClockSeconds() - start;
+
+    cout << numCubes << " cubes:" << endl;
+    cout << "    Cuboid objects: " << (double)cuboidBytes / numCubes << " bytes per cube" << endl;
+    cout << "    Instances:      " << (double)instanceBytes / numCubes << " bytes per cube while adding, ";
+    cout << (double)instanceSet->GetMemoryUsage() / numCubes << " with the hierarchy (";
+    cout << sizeof(SolidInstance) << " per instance record)" << endl;
+    cout << "    Rendered the instances in " << renderTime << " s" << endl;
+}
+
+// reorder [cubes per side] [batch size]
+// Renders a field of mirror-finished cubes in front of a mirror by
+// wavefront tracing, with the secondary rays in pixel order and
+// reordered, and reports ray throughput and cache misses.
+void CompareRayReordering(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t cubesPerSide = (argc > 0) ? atoi(argv[0]) : 100;
+    const size_t batchSize = (argc > 1) ? atoi(argv[1]) : 4096;
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    Optics optics;
+    optics.SetMatteGlossBalance(0.6, Color(0.7, 0.7, 0.8), Color(1.0, 1.0, 1.0));
+    AddInstancedCubeField(scene, cubesPerSide, optics);
+
+    // A mirror behind the field sends the reflected rays back into it.
+    const double offset = 6.0 * (cubesPerSide - 1) / 2.0;
+    Cuboid *mirror = new Cuboid(offset + 10.0, offset + 10.0, 0.5);
+    mirror->SetMatteGlossBalance(0.9, Color(0.5, 0.5, 0.5), Color(1.0, 1.0, 1.0));
+    mirror->Move(0.0, 0.0, -2.0*offset - 70.0);
+    scene.AddSolidObject(mirror);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+    scene.SetWavefrontTracing(true);
+
+    PerfCounter cacheMisses(PERF_CACHE_MISSES);
+    PerfCounter l1Misses(PERF_L1D_READ_MISSES);
+
+    // The first render also builds the instance hierarchy,
+    // so it is left out of the comparison.
+    scene.RenderImage(400, 400, 1.0, 1);
+
+    vector<unsigned char> image[2];
+    for (int reorder=0; reorder < 2; ++reorder)
+    {
+        scene.SetRayReordering(reorder ? batchSize : 0);
+        scene.ResetTracedRayCount();
+        cacheMisses.Start();
+        l1Misses.Start();
+        const double start = WallClockSeconds();
+        image[reorder] = scene.RenderImage(400, 400, 1.0, 1);
+        const double elapsed = WallClockSeconds() - start;
+        const unsigned long long numCacheMisses = cacheMisses.Stop();
+        const unsigned long long numL1Misses = l1Misses.Stop();
+        const unsigned long numRays = scene.GetTracedRayCount();
+
+        cout << (reorder ? "reordered:   " : "pixel order: ");
+        cout << numRays << " rays in " << elapsed << " s, ";
+        cout << numRays / elapsed << " rays/s, cache misses ";
+        if (cacheMisses.IsAvailable())
+        {
+            cout << numCacheMisses;
+        }
+        else
+        {
+            cout << "unavailable";
+        }
+        cout << ", L1 data read misses ";
+        if (l1Misses.IsAvailable())
+        {
+            cout << numL1Misses;
+        }
+        else
+        {
+            cout << "unavailable";
+        }
+        cout << endl;
+    }
+
+    int maxDiff = 0;
+    size_t numDiffering = 0;
+    for (size_t k=0; k < image[0].size(); ++k)
+    {
+        const int diff = abs(static_cast<int>(image[0][k]) - static_cast<int>(image[1][k]));
+        if (diff > 0)
+        {
+            ++numDiffering;
+        }
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+        }
+    }
+    cout << numDiffering << " channels differ, largest by " << maxDiff << "/255" << endl;
+
+    scene.SaveImage(ScratchFileName("reorder.png").c_str(), 400, 400, 1.0, 1);
+}
+
+// order [width height [antialias [cubes per side]]]
+// Renders an instanced field of glossy cubes with the pixels traced
+// in each PixelOrder, and reports frame times and cache misses.
+// The oversampled buffer takes 32 bytes per sample, so the default
+// 4K frame with 4x4 antialiasing needs over 4 GB of memory.
+void ComparePixelOrders(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t pixelsWide = (argc > 1) ? atoi(argv[0]) : 3840;
+    const size_t pixelsHigh = (argc > 1) ? atoi(argv[1]) : 2160;
+    const size_t antiAliasFactor = (argc > 2) ? atoi(argv[2]) : 4;
+    const size_t cubesPerSide = (argc > 3) ? atoi(argv[3]) : 100;
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    Optics optics;
+    optics.SetMatteGlossBalance(0.4, Color(0.7, 0.7, 0.8), Color(1.0, 1.0, 1.0));
+    AddInstancedCubeField(scene, cubesPerSide, optics);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+
+    struct OrderEntry
+    {
+        const char *name;
+        PixelOrder order;
+    };
+    const OrderEntry orderTable[] =
+    {
+        { "columns", PIXEL_ORDER_COLUMNS },
+        { "rows   ", PIXEL_ORDER_ROWS    },
+        { "tiles  ", PIXEL_ORDER_TILES   },
+        { "Morton ", PIXEL_ORDER_MORTON  },
+        { "Hilbert", PIXEL_ORDER_HILBERT },
+    };
+    const size_t numOrders = sizeof(orderTable) / sizeof(orderTable[0]);
+
+    PerfCounter cacheMisses(PERF_CACHE_MISSES);
+    PerfCounter l1Misses(PERF_L1D_READ_MISSES);
+
+    // Builds the instance hierarchy and the image buffer up front.
+    scene.RenderImage(pixelsWide / 8, pixelsHigh / 8, 1.0, 1);
+
+    cout << pixelsWide << "x" << pixelsHigh << ", antialias " << antiAliasFactor;
+    cout << ", " << cubesPerSide * cubesPerSide << " cubes:" << endl;
+
+    vector<unsigned char> firstImage;
+    for (size_t k=0; k < numOrders; ++k)
+    {
+        scene.SetPixelOrder(orderTable[k].order);
+        cacheMisses.Start();
+        l1Misses.Start();
+        const double start = WallClockSeconds();
+        const vector<unsigned char>& image = scene.RenderImage(pixelsWide, pixelsHigh, 1.0, antiAliasFactor);
+        const double elapsed = WallClockSeconds() - start;
+        const unsigned long long numCacheMisses = cacheMisses.Stop();
+        const unsigned long long numL1Misses = l1Misses.Stop();
+
+        cout << "    " << orderTable[k].name << ": " << elapsed << " s, cache misses ";
+        if (cacheMisses.IsAvailable())
+        {
+            cout << numCacheMisses;
+        }
+        else
+        {
+            cout << "unavailable";
+        }
+        cout << ", L1 data read misses ";
+        if (l1Misses.IsAvailable())
+        {
+            cout << numL1Misses;
+        }
+        else
+        {
+            cout << "unavailable";
+        }
+
+        if (k == 0)
+        {
+            firstImage = image;
+        }
+        else
+        {
+            cout << ((image == firstImage) ? ", same image" : ", DIFFERENT image");
+        }
+        cout << endl;
+    }
+}
+
+// Adds a grid of tilted concrete blocks, built either from heap-allocated
+// set operators or as compile-time shapes.
+template <typename Block>
+void AddConcreteBlocks(Imager::Scene& scene, size_t blocksPerSide)
+{
+    using namespace Imager;
+
+    Optics optics;
+    optics.SetMatteGlossBalance(0.2, Color(0.6, 0.6, 0.6), Color(1.0, 1.0, 1.0));
+
+    const double spacing = 40.0;
+    const double offset = spacing * (blocksPerSide - 1) / 2.0;
+    for (size_t i=0; i < blocksPerSide; ++i)
+    {
+        for (size_t j=0; j < blocksPerSide; ++j)
+        {
+            Block *block = new Block(Vector(i*spacing - offset, j*spacing - offset, -4.0*offset - 120.0), optics);
+            block->RotateX(-40.0 + 10.0*i);
+            block->RotateY(25.0 + 15.0*j);
+            scene.AddSolidObject(block);
+        }
+    }
+
+    scene.AddLightSource(LightSource(Vector(-45.0, +10.0, +50.0), Color(1.0, 1.0, 0.3, 1.0)));
+    scene.AddLightSource(LightSource(Vector(+5.0, +90.0, -40.0), Color(0.5, 0.5, 1.5, 0.5)));
+}
+
+// blocks [blocks per side]
+// Renders the same grid of concrete blocks built from SetUnion and
+// SetDifference objects and as compile-time Csg shapes.
+void CompareConcreteBlocks(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t blocksPerSide = (argc > 0) ? atoi(argv[0]) : 3;
+
+    Scene dynamicScene(Color(0.0, 0.0, 0.0));
+    AddConcreteBlocks<ConcreteBlock>(dynamicScene, blocksPerSide);
+
+    Scene staticScene(Color(0.0, 0.0, 0.0));
+    AddConcreteBlocks<StaticConcreteBlock>(staticScene, blocksPerSide);
+
+    double start = WallClockSeconds();
+    const vector<unsigned char> dynamicImage = dynamicScene.RenderImage(400, 400, 3.0, 2);
+    const double dynamicTime = WallClockSeconds() - start;
+
+    start = WallClockSeconds();
+    const vector<unsigned char> staticImage = staticScene.RenderImage(400, 400, 3.0, 2);
+    const double staticTime = WallClockSeconds() - start;
+
+    int maxDiff = 0;
+    for (size_t k=0; k < dynamicImage.size(); ++k)
+    {
+        const int diff = abs(static_cast<int>(dynamicImage[k]) - static_cast<int>(staticImage[k]));
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+        }
+    }
+
+    staticScene.SaveImage(ScratchFileName("blocks.png").c_str(), 400, 400, 3.0, 2);
+
+    cout << blocksPerSide * blocksPerSide << " concrete blocks:" << endl;
+    cout << "    set operator objects: " << dynamicTime << " s" << endl;
+    cout << "    compile-time shapes:  " << staticTime << " s" << endl;
+    cout << "    largest pixel difference " << maxDiff << "/255" << endl;
+}
+
+// grille [slots]
+// Renders a slab with a row of slots cut out of it, where the slots are
+// a chain of nested SetUnion objects, to show how set operator trees
+// scale with their size.
+void RenderGrille(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const int maxSlots = (argc > 0) ? atoi(argv[0]) : 64;
+
+    for (int slots = 1; slots <= maxSlots; slots *= 2)
+    {
+        SolidObject *holes = NULL;
+        for (int k=0; k < slots; ++k)
+        {
+            Cuboid *slot = new Cuboid(0.4, 1.4, 2.0);
+            slot->SetFullMatte(Color(0.7, 0.7, 0.8));
+            slot->Move(1.0 + 2.0*k - slots, 0.0, 0.0);
+            holes = (holes == NULL) ? static_cast<SolidObject*>(slot) : new SetUnion(Vector(), holes, slot);
+        }
+
+        Cuboid *slab = new Cuboid(slots, 2.0, 1.0);
+        slab->SetFullMatte(Color(0.7, 0.7, 0.8));
+
+        SetDifference *grille = new SetDifference(Vector(), slab, holes);
+        grille->Move(0.0, 0.0, -2.5*slots - 8.0);
+        grille->RotateX(-20.0);
+        grille->RotateY(15.0);
+
+        Scene scene(Color(0.0, 0.0, 0.0));
+        scene.AddSolidObject(grille);
+        scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+
+        const double start = WallClockSeconds();
+        scene.SaveImage(ScratchFileName("grille.png").c_str(), 300, 300, 3.0, 1);
+        cout << setw(4) << slots << " slots: " << (WallClockSeconds() - start) << " s" << endl;
+    }
+}
+
+// contains [points]
+// Times point containment queries against a concrete block, one call
+// per point and as a single batch, and checks that both agree.
+void TimeContainment(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numPoints = (argc > 0) ? atoi(argv[0]) : 1000000;
+
+    ConcreteBlock block(Vector(0.0, 0.0, 0.0), Optics());
+    block.RotateX(-30.0);
+    block.RotateY(25.0);
+
+    // Points scattered through a box a little larger than the block.
+    vector<Vector> pointList(numPoints);
+    unsigned seed = 12345;
+    for (size_t k=0; k < numPoints; ++k)
+    {
+        double coord[3];
+        for (int axis=0; axis < 3; ++axis)
+        {
+            seed = seed*1103515245 + 12345;
+            coord[axis] = ((seed >> 8) % 40000) / 1000.0 - 20.0;
+        }
+        pointList[k] = Vector(coord[0], coord[1], coord[2]);
+    }
+
+    vector<char> singleResult(numPoints);
+    double start = WallClockSeconds();
+    for (size_t k=0; k < numPoints; ++k)
+    {
+        singleResult[k] = block.Contains(pointList[k]);
+    }
+    const double singleTime = WallClockSeconds() - start;
+
+    bool *batchResult = new bool[numPoints]();     // touched before the clock starts
+    start = WallClockSeconds();
+    block.ContainsEach(&pointList[0], numPoints, batchResult);
+    const double batchTime = WallClockSeconds() - start;
+
+    size_t numInside = 0;
+    size_t numMismatched = 0;
+    for (size_t k=0; k < numPoints; ++k)
+    {
+        if (batchResult[k])
+        {
+            ++numInside;
+        }
+        if (batchResult[k] != (singleResult[k] != 0))
+        {
+            ++numMismatched;
+        }
+    }
+    delete[] batchResult;
+
+    cout << numPoints << " points, " << numInside << " inside the block" << endl;
+    cout << "    one at a time: " << 1.0e+9 * singleTime / numPoints << " ns per point" << endl;
+    cout << "    batched:       " << 1.0e+9 * batchTime / numPoints << " ns per point" << endl;
+    cout << "    " << numMismatched << " results differ" << endl;
+}
+
+// Fills poly[0..degree], highest power first, with 'scale' times
+// the product of (x - root) over the given roots.
+void ExpandRoots(int degree, double scale, const Algebra::complex root[], double poly[])
+{
+    Algebra::complex coeff[5] = { scale, 0.0, 0.0, 0.0, 0.0 };
+    for (int n=0; n < degree; ++n)
+    {
+        for (int k = n+1; k > 0; --k)
+        {
+            coeff[k] -= root[n] * coeff[k-1];
+        }
+    }
+    for (int k=0; k <= degree; ++k)
+    {
+        poly[k] = coeff[k].real();
+    }
+}
+
+// Finds the real roots of a polynomial of degree 2, 3, or 4 through
+// the complex solvers and FilterRealNumbers, as callers used to.
+int SolveThroughComplex(int degree, const double p[], double roots[])
+{
+    using Algebra::complex;
+
+    complex croots[4];
+    int numComplexRoots;
+    switch (degree)
+    {
+    case 2:  numComplexRoots = Algebra::SolveQuadraticEquation(complex(p[0]), complex(p[1]), complex(p[2]), croots);  break;
+    case 3:  numComplexRoots = Algebra::SolveCubicEquation(complex(p[0]), complex(p[1]), complex(p[2]), complex(p[3]), croots);  break;
+    default: numComplexRoots = Algebra::SolveQuarticEquation(complex(p[0]), complex(p[1]), complex(p[2]), complex(p[3]), complex(p[4]), croots);  break;
+    }
+    return Algebra::FilterRealNumbers(numComplexRoots, croots, roots);
+}
+
+int SolveReal(int degree, const double p[], double roots[])
+{
+    switch (degree)
+    {
+    case 2:  return Algebra::SolveQuadraticEquation(p[0], p[1], p[2], roots);
+    case 3:  return Algebra::SolveCubicEquation(p[0], p[1], p[2], p[3], roots);
+    default: return Algebra::SolveQuarticEquation(p[0], p[1], p[2], p[3], p[4], roots);
+    }
+}
+
+// Sorts the few roots of one polynomial into increasing order.
+void SortRoots(int count, double roots[])
+{
+    for (int i=1; i < count; ++i)
+    {
+        const double x = roots[i];
+        int k = i;
+        for (; k > 0 && roots[k-1] > x; --k)
+        {
+            roots[k] = roots[k-1];
+        }
+        roots[k] = x;
+    }
+}
+
+// Accuracy of one solver over many polynomials with known roots.
+struct SolverAccuracy
+{
+    size_t wrongCounts;     // polynomials where the number of real roots was wrong
+    double worstError;      // largest distance of a root found from the true root
+
+    SolverAccuracy()
+        : wrongCounts(0)
+        , worstError(0.0)
+    {
+    }
+
+    // 'known' must already be sorted.
+    void Check(int numKnown, const double known[], int numFound, double found[])
+    {
+        if (numFound != numKnown)
+        {
+            ++wrongCounts;
+            return;
+        }
+        SortRoots(numFound, found);
+        for (int k=0; k < numFound; ++k)
+        {
+            const double error = fabs(found[k] - known[k]);
+            if (error > worstError)
+            {
+                worstError = error;
+            }
+        }
+    }
+};
+
+// solvers [polynomials]
+// Checks the real-coefficient quadratic, cubic, and quartic solvers
+// against polynomials built from known roots and against the complex
+// solvers, then times both kinds, and the batch solvers as well.
+void CompareSolvers(int argc, const char *argv[])
+{
+    using namespace std;
+    using Imager::WallClockSeconds;
+    using Algebra::complex;
+
+    const size_t numPolys = (argc > 0) ? atoi(argv[0]) : 100000;
+    const char * const degreeName[] = { "", "", "quadratic", "cubic", "quartic" };
+
+    unsigned seed = 13579;
+    for (int degree = 2; degree <= 4; ++degree)
+    {
+        // Each polynomial has up to degree/2 complex conjugate pairs of
+        // roots and real roots between -10 and +10 for the rest.
+        vector<double> polyList(numPolys * (degree+1));
+        vector<double> knownList(numPolys * 4);
+        vector<int> numKnownList(numPolys);
+        SolverAccuracy complexAccuracy;
+        SolverAccuracy realAccuracy;
+        for (size_t n=0; n < numPolys; ++n)
+        {
+            double random[10];
+            for (int k=0; k < 10; ++k)
+            {
+                seed = seed*1103515245 + 12345;
+                random[k] = ((seed >> 8) % 1000000) / 1000000.0;
+            }
+
+            const int numPairs = static_cast<int>(random[0] * (degree/2 + 1));
+            complex root[4];
+            double known[4];
+            int numKnown = 0;
+            for (int k=0; k < degree; ++k)
+            {
+                if (k < 2*numPairs)
+                {
+                    const complex z(20.0*random[1+k] - 10.0, 0.5 + 4.5*random[5+k]);
+                    root[k] = (k % 2) ? conj(root[k-1]) : z;
+                }
+                else
+                {
+                    root[k] = 20.0*random[1+k] - 10.0;
+                    known[numKnown++] = root[k].real();
+                }
+            }
+
+            double *poly = &polyList[n * (degree+1)];
+            ExpandRoots(degree, 0.1 + 10.0*random[9], root, poly);
+
+            SortRoots(numKnown, known);
+            copy(known, known + numKnown, &knownList[4*n]);
+            numKnownList[n] = numKnown;
+
+            double found[4];
+            complexAccuracy.Check(numKnown, known, SolveThroughComplex(degree, poly, found), found);
+            realAccuracy.Check(numKnown, known, SolveReal(degree, poly, found), found);
+        }
+
+        // Time both solvers over the same polynomials.  The sum of the
+        // roots found keeps the compiler from skipping the calls.
+        double roots[4];
+        double checksum = 0.0;
+        double start = WallClockSeconds();
+        for (size_t n=0; n < numPolys; ++n)
+        {
+            const int count = SolveThroughComplex(degree, &polyList[n * (degree+1)], roots);
+            checksum += count ? roots[0] : 0.0;
+        }
+        const double complexTime = WallClockSeconds() - start;
+
+        start = WallClockSeconds();
+        for (size_t n=0; n < numPolys; ++n)
+        {
+            const int count = SolveReal(degree, &polyList[n * (degree+1)], roots);
+            checksum += count ? roots[0] : 0.0;
+        }
+        const double realTime = WallClockSeconds() - start;
+
+        cout << degreeName[degree] << ": " << numPolys << " polynomials (checksum " << checksum << ")" << endl;
+        cout << "    complex: " << setw(7) << 1.0e+9 * complexTime / numPolys << " ns per call, ";
+        cout << complexAccuracy.wrongCounts << " wrong root counts, worst error " << complexAccuracy.worstError << endl;
+        cout << "    real:    " << setw(7) << 1.0e+9 * realTime / numPolys << " ns per call, ";
+        cout << realAccuracy.wrongCounts << " wrong root counts, worst error " << realAccuracy.worstError << endl;
+
+        if (degree > 2)
+        {
+            // The batch solvers take each coefficient in its own array.
+            vector< vector<double> > coefficient(degree+1, vector<double>(numPolys));
+            for (size_t n=0; n < numPolys; ++n)
+            {
+                for (int k=0; k <= degree; ++k)
+                {
+                    coefficient[k][n] = polyList[n*(degree+1) + k];
+                }
+            }
+
+            vector<double> batchRoots(numPolys * degree);
+            vector<int> batchCounts(numPolys);
+            start = WallClockSeconds();
+            if (degree == 3)
+            {
+                Algebra::SolveCubicEquations(numPolys,
+                    &coefficient[0][0], &coefficient[1][0], &coefficient[2][0], &coefficient[3][0],
+                    &batchRoots[0], &batchCounts[0]);
+            }
+            else
+            {
+                Algebra::SolveQuarticEquations(numPolys,
+                    &coefficient[0][0], &coefficient[1][0], &coefficient[2][0], &coefficient[3][0], &coefficient[4][0],
+                    &batchRoots[0], &batchCounts[0]);
+            }
+            const double batchTime = WallClockSeconds() - start;
+
+            SolverAccuracy batchAccuracy;
+            for (size_t n=0; n < numPolys; ++n)
+            {
+                batchAccuracy.Check(numKnownList[n], &knownList[4*n], batchCounts[n], &batchRoots[degree*n]);
+            }
+
+            cout << "    batch:   " << setw(7) << 1.0e+9 * batchTime / numPolys << " ns per call, ";
+            cout << batchAccuracy.wrongCounts << " wrong root counts, worst error " << batchAccuracy.worstError << endl;
+        }
+    }
+}
+
+// torus [rings]
+// Renders a chain of linked tori, then finds where every camera ray
+// of the image first meets one torus, one ray at a time and as
+// a packet through the batch quartic solver, and compares the two.
+void RenderTorusChain(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numRings = (argc > 0) ? atoi(argv[0]) : 5;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    for (size_t k=0; k < numRings; ++k)
+    {
+        // Alternate rings stand at right angles so that each one
+        // passes through the holes of its neighbors.
+        Torus *ring = new Torus(3.0, 0.8);
+        ring->SetFullMatte((k % 2) ? Color(0.8, 0.6, 0.3) : Color(0.6, 0.7, 0.9));
+        if (k % 2)
+        {
+            ring->RotateX(90.0);
+        }
+        ring->Move(4.4*k - 2.2*(numRings - 1), 0.0, -50.0);
+        scene.AddSolidObject(ring);
+    }
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+
+    double start = WallClockSeconds();
+    scene.SaveImage(ScratchFileName("torus.png").c_str(), 400, 400, 2.0, 1);
+    const double renderTime = WallClockSeconds() - start;
+
+    // The camera rays of a 400 by 400 image at the same zoom,
+    // aimed at a single tilted torus.
+    Torus torus(3.0, 0.8);
+    torus.RotateX(60.0);
+    torus.Move(0.0, 0.0, -20.0);
+
+    const size_t pixels = 400;
+    const double zoom = 2.0 * pixels;
+    vector<Vector> directionList;
+    for (size_t j=0; j < pixels; ++j)
+    {
+        for (size_t i=0; i < pixels; ++i)
+        {
+            directionList.push_back(Vector((i - pixels/2.0) / zoom, (pixels/2.0 - j) / zoom, -1.0));
+        }
+    }
+    const size_t numRays = directionList.size();
+    const Vector camera(0.0, 0.0, 0.0);
+
+    vector<double> singleHit(numRays);
+    start = WallClockSeconds();
+    for (size_t k=0; k < numRays; ++k)
+    {
+        Intersection intersection;
+        singleHit[k] =
+            torus.FindClosestIntersection(camera, directionList[k], intersection) ?
+            sqrt(intersection.distanceSquared / directionList[k].MagnitudeSquared()) :
+            HUGE_VAL;
+    }
+    const double singleTime = WallClockSeconds() - start;
+
+    vector<double> packetHit(numRays);
+    start = WallClockSeconds();
+    torus.ClosestHitEach(camera, &directionList[0], numRays, &packetHit[0]);
+    const double packetTime = WallClockSeconds() - start;
+
+    size_t numHits = 0;
+    size_t numMismatched = 0;
+    double worstDifference = 0.0;
+    for (size_t k=0; k < numRays; ++k)
+    {
+        if ((singleHit[k] == HUGE_VAL) != (packetHit[k] == HUGE_VAL))
+        {
+            ++numMismatched;
+        }
+        else if (singleHit[k] != HUGE_VAL)
+        {
+            ++numHits;
+            worstDifference = max(worstDifference, fabs(singleHit[k] - packetHit[k]));
+        }
+    }
+
+    cout << numRings << " linked tori rendered in " << renderTime << " s" << endl;
+    cout << numRays << " camera rays, " << numHits << " hitting a torus:" << endl;
+    cout << "    one at a time: " << 1.0e+9 * singleTime / numRays << " ns per ray" << endl;
+    cout << "    as a packet:   " << 1.0e+9 * packetTime / numRays << " ns per ray" << endl;
+    cout << "    " << numMismatched << " hits disagree, largest distance difference " << worstDifference << endl;
+}
+
+// serve <socket path | -> [threads]
+// Runs the long-lived render server (see server.h).
+void ServeRenderRequests(int argc, const char *argv[])
+{
+    using namespace std;
+
+    if (argc < 1)
+    {
+        cerr << "ERROR:  serve requires a socket path, or - for standard input/output." << endl;
+        return;
+    }
+    const size_t numThreads = (argc > 1) ? atoi(argv[1]) : 0;
+    Imager::RunRenderServer(argv[0], numThreads);
+}
+
+
+// Writes a scene description of the same field of glass cubes
+// AddGlassField builds, for rendering by tile workers.
+std::string DescribeGlassField(
+    size_t cubesPerSide, 
+    size_t pixelsWide, 
+    size_t pixelsHigh, 
+    double zoom, 
+    size_t antiAliasFactor)
+{
+    std::ostringstream text;
+    text << "image " << pixelsWide << ' ' << pixelsHigh << ' ' << zoom << ' ' << antiAliasFactor << " png\n";
+    text << "background 0.1 0.1 0.2\n";
+
+    const double spacing = 6.0;
+    const double offset = spacing * (cubesPerSide - 1) / 2.0;
+    unsigned seed = 24680;
+    for (size_t i=0; i < cubesPerSide; ++i)
+    {
+        for (size_t j=0; j < cubesPerSide; ++j)
+        {
+            seed = seed*1103515245 + 12345;
+            const double angleX = (seed >> 16) % 360;
+            seed = seed*1103515245 + 12345;
+            const double angleY = (seed >> 16) % 360;
+
+            for (int layer=0; layer < 2; ++layer)
+            {
+                const double size = layer ? 2.0 : 1.0;
+                text << "cuboid " << size << ' ' << size << ' ' << size;
+                text << (layer ? " matte 0.6 0.8 0.7" : " matte 0.9 0.5 0.5");
+                text << " opacity 0.1 refraction " << (layer ? Imager::REFRACTION_GLASS : 2.0);
+                text << " center " << (i*spacing - offset) << ' ' << (j*spacing - offset) << ' ' << (-2.0*offset - 40.0);
+                text << " rotate x " << angleX << " rotate y " << angleY << "\n";
+            }
+        }
+    }
+
+    text << "light -5 50 20 0.7 0.7 0.7\n";
+    text << "end\n";
+    return text.str();
+}
+
+void PrintTileRenderStats(const Imager::TileRenderStats& stats)
+{
+    using namespace std;
+
+    cout << "    " << stats.numTiles << " tiles, " << stats.numWorkers << " workers";
+    cout << ", " << stats.failedWorkers << " failed, " << stats.reassignedTiles << " tiles reassigned";
+    cout << ", " << stats.duplicatedTiles << " duplicated, " << stats.discardedTiles << " discarded" << endl;
+}
+
+// distribute [max workers] [cubes per side]
+// Renders a field of glass cubes in one process, then split into tiles
+// among 1, 2, ... up to 'max workers' worker processes, and checks that
+// every tiled image is the same.  Then renders it again with a worker
+// that hangs up partway through and with one that stalls on each tile.
+void CompareTileWorkers(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t maxWorkers = (argc > 0) ? atoi(argv[0]) : 4;
+    const size_t cubesPerSide = (argc > 1) ? atoi(argv[1]) : 4;
+
+    const string description = DescribeGlassField(cubesPerSide, 600, 600, 2.0, 2);
+
+    Scene scene;
+    RenderRequest request;
+    ParseSceneDescription(description, scene, request);
+    double start = WallClockSeconds();
+    const vector<unsigned char> expected = scene.RenderImage(
+        request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor);
+    const double singleTime = WallClockSeconds() - start;
+    cout << "one process:  " << singleTime << " s" << endl;
+
+    vector<unsigned char> rgba;
+    TileRenderStats stats;
+    for (size_t numWorkers = 1; numWorkers <= maxWorkers; ++numWorkers)
+    {
+        TileRenderOptions options;
+        options.numLocalWorkers = numWorkers;
+        start = WallClockSeconds();
+        RenderTiled(description, options, request, rgba, stats);
+        const double tiledTime = WallClockSeconds() - start;
+        cout << numWorkers << " worker(s):  " << tiledTime << " s, speedup " << singleTime / tiledTime;
+        cout << (rgba == expected ? ", same image" : ", IMAGE DIFFERS") << endl;
+    }
+
+    TileRenderOptions crashOptions;
+    crashOptions.numLocalWorkers = 2;
+    crashOptions.crashAfterTiles = 3;
+    RenderTiled(description, crashOptions, request, rgba, stats);
+    cout << "first worker hangs up after 3 tiles:" << (rgba == expected ? " same image" : " IMAGE DIFFERS") << endl;
+    PrintTileRenderStats(stats);
+
+    TileRenderOptions stallOptions;
+    stallOptions.numLocalWorkers = 2;
+    stallOptions.stallSeconds = 1.0;
+    RenderTiled(description, stallOptions, request, rgba, stats);
+    cout << "first worker stalls 1 s per tile:" << (rgba == expected ? " same image" : " IMAGE DIFFERS") << endl;
+    PrintTileRenderStats(stats);
+
+    lodepng::encode(ScratchFileName("distribute.png").c_str(), rgba, request.pixelsWide, request.pixelsHigh);
+}
+
+// coordinate <description file> <outfile.png> [local workers] [listen address]
+// Renders a scene description split into tiles among worker processes:
+// some forked here, and any that connect to the listen address.
+void CoordinateTileWorkers(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    if (argc < 2)
+    {
+        cerr << "ERROR:  coordinate requires a scene description file and a PNG file name." << endl;
+        return;
+    }
+
+    ifstream infile(argv[0]);
+    if (!infile)
+    {
+        cerr << "ERROR:  Cannot open scene description " << argv[0] << endl;
+        return;
+    }
+    ostringstream description;
+    description << infile.rdbuf();
+
+    TileRenderOptions options;
+    options.numLocalWorkers = (argc > 2) ? atoi(argv[2]) : 2;
+    if (argc > 3)
+    {
+        options.listenAddress = argv[3];
+    }
+
+    RenderRequest request;
+    vector<unsigned char> rgba;
+    TileRenderStats stats;
+    const double start = WallClockSeconds();
+    RenderTiled(description.str(), options, request, rgba, stats);
+    const double renderTime = WallClockSeconds() - start;
+
+    const unsigned error = lodepng::encode(argv[1], rgba, request.pixelsWide, request.pixelsHigh);
+    if (error != 0)
+    {
+        cerr << "ERROR:  " << lodepng_error_text(error) << endl;
+        return;
+    }
+
+    cout << "Rendered " << argv[1] << " in " << renderTime << " s" << endl;
+    PrintTileRenderStats(stats);
+}
+
+// worker <address>
+// Traces tiles for a coordinator at a Unix socket path or host:port.
+void ServeTileCoordinator(int argc, const char *argv[])
+{
+    using namespace std;
+
+    if (argc < 1)
+    {
+        cerr << "ERROR:  worker requires the coordinator's address." << endl;
+        return;
+    }
+    Imager::ConnectTileWorker(argv[0]);
+}
+
+
+// The reference consumer for framering.h: reads every frame from the
+// ring called 'name' in place until the writer closes it, touching
+// every byte as a compositor would, and reports what arrived.
+void ConsumeFrameRing(const char *name, bool verbose, double timeoutSeconds)
+{
+    using namespace std;
+    using namespace Imager;
+
+    FrameRingReader reader(name);
+    const FrameRingHeader& header = reader.GetHeader();
+    const size_t frameBytes = static_cast<size_t>(header.frameBytes);
+
+    unsigned long long numFrames = 0;
+    unsigned long long checksum = 0;
+    unsigned long long frameNumber = 0;
+    const double start = WallClockSeconds();
+    const void *pixels;
+    while ((pixels = reader.AcquireFrame(frameNumber, timeoutSeconds)) != NULL)
+    {
+        // Frames start on a cache line, so they can be read a word at a time.
+        const unsigned long long *words = static_cast<const unsigned long long *>(pixels);
+        const unsigned char *bytes = static_cast<const unsigned char *>(pixels);
+        unsigned long long sum = 0;
+        const size_t numWords = frameBytes / 8;
+        for (size_t k=0; k < numWords; ++k)
+        {
+            sum += words[k];
+        }
+        for (size_t k = 8*numWords; k < frameBytes; ++k)
+        {
+            sum += bytes[k];
+        }
+
+        if (reader.ReleaseFrame())
+        {
+            ++numFrames;
+            checksum += sum;
+            if (verbose)
+            {
+                cout << "frame " << frameNumber << ": checksum " << hex << sum << dec << endl;
+            }
+        }
+    }
+    const double seconds = WallClockSeconds() - start;
+
+    cout << "    consumer: " << numFrames << " frames of " << header.pixelsWide << "x" << header.pixelsHigh;
+    cout << ((header.format == FRAME_FORMAT_RGBA8) ? " RGBA8" : " float RGBA");
+    cout << " in " << seconds << " s, " << reader.GetSkippedFrames() << " skipped, checksum ";
+    cout << hex << checksum << dec << endl;
+}
+
+// ringview <name> [timeout seconds]
+// Reads and checksums frames from a frame ring (see framering.h)
+// until its writer closes it.
+void ViewFrameRing(int argc, const char *argv[])
+{
+    using namespace std;
+
+    if (argc < 1)
+    {
+        cerr << "ERROR:  ringview requires the name of a frame ring, such as /raytrace." << endl;
+        return;
+    }
+    const double timeoutSeconds = (argc > 1) ? atof(argv[1]) : 60.0;
+    ConsumeFrameRing(argv[0], true, timeoutSeconds);
+}
+
+// Forks a process running the reference consumer on 'name'.
+pid_t ForkFrameConsumer(const char *name)
+{
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        // The child must not run the destructors of the parent's
+        // objects, which would close the parent's frame ring.
+        try
+        {
+            ConsumeFrameRing(name, false, 60.0);
+        }
+        catch (const Imager::ImagerException& ex)
+        {
+            std::cerr << "EXCEPTION: " << ex.GetMessage() << std::endl;
+        }
+        std::cout.flush();
+        _exit(0);
+    }
+    return pid;
+}
+
+// ring [frames] [width height]
+// Compares handing finished frames to another process as PNG files
+// against handing them over through a shared memory frame ring, in
+// raw RGBA8 and float formats.
+void CompareFrameHandoff(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numFrames = (argc > 0) ? atoi(argv[0]) : 12;
+    const size_t pixelsWide = (argc > 2) ? atoi(argv[1]) : 1920;
+    const size_t pixelsHigh = (argc > 2) ? atoi(argv[2]) : 1080;
+    const size_t numRawFrames = 100;
+    const size_t numSlots = 4;
+    const char * const ringName = "/raytrace_ring";
+    const string pngFileName = ScratchFileName("ring.png");
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    scene.SetFloatOutput(true);
+    Cuboid *cuboid = new Cuboid(2.0, 2.0, 2.0);
+    cuboid->SetFullMatte(Color(0.7, 0.7, 0.8));
+    cuboid->Move(0.0, 0.0, -50.0);
+    cuboid->RotateX(-115.0);
+    scene.AddSolidObject(cuboid);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+
+    // A rendered sequence handed over frame by frame as it finishes.
+    double renderTime = 0.0;
+    double pngTime = 0.0;
+    double ringTime = 0.0;
+    pid_t consumer;
+    {
+        FrameRingWriter writer(ringName, FRAME_FORMAT_RGBA8, pixelsWide, pixelsHigh, numSlots, false);
+        consumer = ForkFrameConsumer(ringName);
+        for (size_t frame=0; frame < numFrames; ++frame)
+        {
+            double start = WallClockSeconds();
+            const vector<unsigned char>& rgba = scene.RenderImage(pixelsWide, pixelsHigh, 3.0, 1);
+            renderTime += WallClockSeconds() - start;
+
+            // What the compositor does now: encode to a file, decode it again.
+            start = WallClockSeconds();
+            lodepng::encode(pngFileName, rgba, pixelsWide, pixelsHigh);
+            vector<unsigned char> decoded;
+            unsigned decodedWide, decodedHigh;
+            lodepng::decode(decoded, decodedWide, decodedHigh, pngFileName);
+            pngTime += WallClockSeconds() - start;
+
+            start = WallClockSeconds();
+            if (!writer.WriteFrame(&rgba[0]))
+            {
+                cerr << "ERROR:  The frame consumer stopped releasing frames." << endl;
+                break;
+            }
+            ringTime += WallClockSeconds() - start;
+
+            cuboid->RotateY(360.0 / numFrames);
+        }
+        cout << numFrames << " rendered frames, " << pixelsWide << "x" << pixelsHigh << ":" << endl;
+        cout << "    render:            " << 1000.0 * renderTime / numFrames << " ms per frame" << endl;
+        cout << "    PNG encode+decode: " << 1000.0 * pngTime / numFrames << " ms per frame" << endl;
+        cout << "    ring publish:      " << 1000.0 * ringTime / numFrames << " ms per frame" << endl;
+        cout.flush();
+    }
+    waitpid(consumer, NULL, 0);     // the writer closed the ring, so the consumer finishes
+
+    // The last frame sent over and over, to find what the handoff
+    // itself costs, with the consumer reading every byte.
+    const FrameFormat formatList[] = { FRAME_FORMAT_RGBA8, FRAME_FORMAT_RGBA_FLOAT };
+    for (size_t f=0; f < sizeof(formatList)/sizeof(formatList[0]); ++f)
+    {
+        const FrameFormat format = formatList[f];
+        const void *pixels = (format == FRAME_FORMAT_RGBA8) ?
+            static_cast<const void *>(&scene.RenderImage(pixelsWide, pixelsHigh, 3.0, 1)[0]) :
+            static_cast<const void *>(&scene.GetFloatImage()[0]);
+
+        double seconds;
+        size_t frameBytes;
+        {
+            FrameRingWriter writer(ringName, format, pixelsWide, pixelsHigh, numSlots, false);
+            frameBytes = writer.GetFrameBytes();
+            consumer = ForkFrameConsumer(ringName);
+            const double start = WallClockSeconds();
+            for (size_t frame=0; frame < numRawFrames; ++frame)
+            {
+                writer.WriteFrame(pixels);
+            }
+            seconds = WallClockSeconds() - start;
+        }
+        waitpid(consumer, NULL, 0);
+
+        cout << numRawFrames << ((format == FRAME_FORMAT_RGBA8) ? " RGBA8" : " float RGBA");
+        cout << " frames through " << numSlots << " slots: " << numRawFrames / seconds << " frames/s, ";
+        cout << (numRawFrames * frameBytes) / seconds / 1.0e+9 << " GB/s" << endl;
+    }
+}
+
+
+// Times writing one image to 'sink' several times, and prints the
+// time per image and megapixels per second.  If 'filename' is not
+// NULL, also prints the size of the file the sink writes.
+void TimeImageSink(
+    const char *label, 
+    Imager::ImageSink& sink, 
+    const char *filename, 
+    const Imager::MemoryImageSink& image)
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t numRepeats = 5;
+    const size_t pixelsWide = image.GetPixelsWide();
+    const size_t pixelsHigh = image.GetPixelsHigh();
+
+    const double start = WallClockSeconds();
+    for (size_t k=0; k < numRepeats; ++k)
+    {
+        WriteImage(
+            sink, 
+            pixelsWide, 
+            pixelsHigh, 
+            &image.GetRgba()[0], 
+            &image.GetFloatRgba()[0]);
+    }
+    const double seconds = (WallClockSeconds() - start) / numRepeats;
+
+    cout << "    " << setw(12) << left << label << right;
+    cout << setw(10) << fixed << setprecision(2) << 1000.0 * seconds << " ms";
+    cout << setw(10) << setprecision(1) << (pixelsWide * pixelsHigh) / seconds / 1.0e+6 << " Mpixel/s";
+    struct stat info;
+    if (filename != NULL && stat(filename, &info) == 0)
+    {
+        cout << setw(12) << info.st_size << " bytes";
+    }
+    cout << endl;
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+// sinks [width height]
+// Renders a field of glass cubes once, then times writing the image
+// to each kind of image sink.
+void CompareImageSinks(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t pixelsWide = (argc > 1) ? atoi(argv[0]) : 1920;
+    const size_t pixelsHigh = (argc > 1) ? atoi(argv[1]) : 1080;
+
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, 3);
+
+    MemoryImageSink image(true);
+    const double start = WallClockSeconds();
+    scene.SaveImage(image, pixelsWide, pixelsHigh, 2.0, 1);
+    cout << "Rendered " << pixelsWide << "x" << pixelsHigh << " in " << WallClockSeconds() - start << " s" << endl;
+
+    const string pngFileName = ScratchFileName("sinks.png");
+    ImageFileSink pngSink(pngFileName.c_str());
+    TimeImageSink("PNG", pngSink, pngFileName.c_str(), image);
+
+    const string ppmFileName = ScratchFileName("sinks.ppm");
+    ImageFileSink ppmSink(ppmFileName.c_str());
+    TimeImageSink("PPM", ppmSink, ppmFileName.c_str(), image);
+
+    const string pamFileName = ScratchFileName("sinks.pam");
+    ImageFileSink pamSink(pamFileName.c_str());
+    TimeImageSink("PAM", pamSink, pamFileName.c_str(), image);
+
+    const string pfmFileName = ScratchFileName("sinks.pfm");
+    ImageFileSink pfmSink(pfmFileName.c_str());
+    TimeImageSink("PFM", pfmSink, pfmFileName.c_str(), image);
+
+    MemoryImageSink memorySink;
+    TimeImageSink("memory", memorySink, NULL, image);
+
+    // Enough slots that the ring never waits for a reader.
+    FrameRingWriter ringWriter("/raytrace_sinks", FRAME_FORMAT_RGBA8, pixelsWide, pixelsHigh, 8, false);
+    FrameRingSink ringSink(ringWriter);
+    TimeImageSink("frame ring", ringSink, NULL, image);
+}
+
+
+// Returns the peak resident memory of this process in kilobytes
+// since the last reset, or -1 if it cannot be read.
+long PeakResidentKilobytes()
+{
+    long kilobytes = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL)
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), status))
+        {
+            if (strncmp(line, "VmHWM:", 6) == 0)
+            {
+                sscanf(line + 6, "%ld", &kilobytes);
+            }
+        }
+        fclose(status);
+    }
+    return kilobytes;
+}
+
+// Starts measuring this process's peak resident memory afresh and
+// returns it in kilobytes, or -1 where that cannot be done.
+long ResetPeakResidentKilobytes()
+{
+    // Writing 5 to clear_refs sets the peak to the current size.
+    FILE *clear = fopen("/proc/self/clear_refs", "w");
+    if (clear == NULL)
+    {
+        return -1;
+    }
+    fputs("5", clear);
+    fclose(clear);
+    return PeakResidentKilobytes();
+}
+
+// Encodes 'image' as a PNG file in a child process, with LodePNG or
+// streaming, so the child's peak memory is the encoder's alone, and
+// prints the time, the memory the encoder added, and the file size.
+void TimePngEncoder(const char *label, bool streaming, const char *filename, const Imager::MemoryImageSink& image)
+{
+    using namespace std;
+    using namespace Imager;
+
+    cout.flush();
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        const size_t pixelsWide = image.GetPixelsWide();
+        const size_t pixelsHigh = image.GetPixelsHigh();
+        const long baseline = ResetPeakResidentKilobytes();
+        const double start = WallClockSeconds();
+        if (streaming)
+        {
+            const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            PngStreamSink sink(fd);
+            WriteImage(sink, pixelsWide, pixelsHigh, &image.GetRgba()[0], NULL);
+            close(fd);
+        }
+        else
+        {
+            lodepng::encode(filename, image.GetRgba(), pixelsWide, pixelsHigh);
+        }
+        const double seconds = WallClockSeconds() - start;
+        const long peak = PeakResidentKilobytes();
+
+        struct stat info;
+        stat(filename, &info);
+        cout << "    " << setw(10) << left << label << right;
+        cout << setw(10) << fixed << setprecision(1) << 1000.0 * seconds << " ms";
+        cout << setw(10) << (peak - baseline) / 1024.0 << " MB peak";
+        cout << setw(12) << info.st_size << " bytes" << endl;
+        cout.flush();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Returns the size in bytes of the named PNG file, and sets 'colorType'
+// to the color type in its header: 2 for RGB, 3 for a palette, 6 for RGBA.
+long PngFileSize(const std::string& filename, int& colorType)
+{
+    std::vector<unsigned char> png;
+    lodepng::load_file(png, filename);
+    colorType = (png.size() > 25) ? png[25] : -1;
+    return static_cast<long>(png.size());
+}
+
+// Fills 'grid' with a copies-by-copies grid of 'image'.
+void TileImage(const Imager::MemoryImageSink& image, size_t copies, Imager::MemoryImageSink& grid)
+{
+    const size_t pixelsWide = image.GetPixelsWide();
+    const size_t pixelsHigh = image.GetPixelsHigh();
+    const std::vector<unsigned char>& rgba = image.GetRgba();
+    const size_t rowBytes = 4 * pixelsWide;
+    std::vector<unsigned char> row(copies * rowBytes);
+    grid.BeginImage(copies * pixelsWide, copies * pixelsHigh);
+    for (size_t j=0; j < copies * pixelsHigh; ++j)
+    {
+        for (size_t c=0; c < copies; ++c)
+        {
+            memcpy(&row[c * rowBytes], &rgba[(j % pixelsHigh) * rowBytes], rowBytes);
+        }
+        grid.WriteRow(&row[0], NULL);
+    }
+    grid.EndImage();
+}
+
+// pngstream [width height]
+// Renders a field of glass cubes, then compares encoding it as PNG with
+// LodePNG and with the streaming encoder, for time, memory, and size;
+// then the same for a much larger image made of copies of it.
+void ComparePngEncoders(int argc, const char *argv[])
+{
+    using namespace std;
     using namespace Imager;
 
-    Scene scene1(Color(0.0, 0.0, 0.0));  
+    const size_t pixelsWide = (argc > 1) ? atoi(argv[0]) : 1920;
+    const size_t pixelsHigh = (argc > 1) ? atoi(argv[1]) : 1080;
+    const size_t copies = 4;
 
-    Cuboid *cuboid1 = new Cuboid(2.0, 2.0, 2.0);  //cube with length, width and height
-    cuboid1->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid1->Move(0.0, 0.0, -50.0);
-    cuboid1->RotateX(-115.0);
-    cuboid1->RotateY(22.0);
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, 3);
+    MemoryImageSink image;
+    scene.SaveImage(image, pixelsWide, pixelsHigh, 2.0, 1);
 
-    scene1.AddSolidObject(cuboid1);
-    scene1.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
-    
-    const char *filename1 = "../output/cuboid_1.png";
-    scene1.SaveImage(filename1, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
-    
-    Scene scene2(Color(0.0, 0.0, 0.0));
+    MemoryImageSink large;
+    TileImage(image, copies, large);
+
+    const MemoryImageSink * const imageList[] = { &image, &large };
+    for (size_t k=0; k < 2; ++k)
+    {
+        const MemoryImageSink& source = *imageList[k];
+        cout << source.GetPixelsWide() << "x" << source.GetPixelsHigh() << ", ";
+        cout << source.GetRgba().size() / (1024.0 * 1024.0) << " MB of RGBA:" << endl;
+        const string streamFileName = ScratchFileName("pngstream.png");
+        const string lodeFileName = ScratchFileName("pngstream_lodepng.png");
+        TimePngEncoder("LodePNG", false, lodeFileName.c_str(), source);
+        TimePngEncoder("streaming", true, streamFileName.c_str(), source);
+
+        // The streaming encoder already picks the best filter for each
+        // row, but it has to choose the color type before it sees the
+        // pixels.  LodePNG counts the colors first and writes a palette
+        // when there are 256 or fewer, which can make its file much smaller.
+        int lodeColorType, streamColorType;
+        const long lodeSize = PngFileSize(lodeFileName, lodeColorType);
+        const long streamSize = PngFileSize(streamFileName, streamColorType);
+        cout << "    streamed file is " << fixed << setprecision(2) << (static_cast<double>(streamSize) / lodeSize);
+        cout << "x the size of LodePNG's";
+        if (lodeColorType == 3 && streamColorType != 3)
+        {
+            cout << " (LodePNG wrote a palette; the streaming encoder cannot)";
+        }
+        cout << endl;
+
+        vector<unsigned char> decoded;
+        unsigned decodedWide, decodedHigh;
+        const unsigned error = lodepng::decode(decoded, decodedWide, decodedHigh, streamFileName);
+        cout << "    streamed file " << ((error == 0 && decoded == source.GetRgba()) ? "decodes to the same pixels" : "DOES NOT MATCH") << endl;
+    }
+}
 
-    Cuboid *cuboid2 = new Cuboid(2.0, 2.0, 2.0);
-    cuboid2->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid2->Move(0.0, 0.0, -50.0);
-    cuboid2->RotateX(-115.0);
-    cuboid2->RotateY(-22.0);
 
-    scene2.AddSolidObject(cuboid2);
-    scene2.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+// Decodes the PNG file in 'png' repeatedly, for at least a second,
+// with LodePNG and then with DecodePng, and prints the time per decode
+// of each and whether they gave the same pixels.
+void TimePngDecoders(const char *label, const std::vector<unsigned char>& png)
+{
+    using namespace std;
+    using namespace Imager;
 
-    const char *filename2 = "../output/cuboid_2.png";
-    scene2.SaveImage(filename2, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
+    vector<unsigned char> expected;
+    unsigned lodeWide = 0, lodeHigh = 0;
+    unsigned error = 0;
+    int lodeCount = 0;
+    double start = WallClockSeconds();
+    double lodeSeconds;
+    do
+    {
+        expected.clear();
+        error = lodepng::decode(expected, lodeWide, lodeHigh, png);
+        ++lodeCount;
+        lodeSeconds = WallClockSeconds() - start;
+    }
+    while (error == 0 && lodeSeconds < 1.0);
 
-    Scene scene3(Color(0.0, 0.0, 0.0));
+    vector<unsigned char> rgba;
+    size_t pixelsWide = 0, pixelsHigh = 0;
+    int count = 0;
+    start = WallClockSeconds();
+    double seconds;
+    do
+    {
+        DecodePng(&png[0], png.size(), rgba, pixelsWide, pixelsHigh);
+        ++count;
+        seconds = WallClockSeconds() - start;
+    }
+    while (seconds < 1.0);
 
-    Cuboid *cuboid3 = new Cuboid(2.0, 2.0, 2.0);
-    cuboid3->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid3->Move(0.0, 0.0, -20.0);
-    cuboid3->RotateX(-90.0);
-    cuboid3->RotateY(22.0);
+    const double lodeMillis = 1000.0 * lodeSeconds / lodeCount;
+    const double millis = 1000.0 * seconds / count;
+    cout << "    " << setw(24) << left << label << right;
+    cout << setw(10) << png.size() << " bytes";
+    cout << fixed << setprecision(2);
+    cout << setw(10) << lodeMillis << " ms";
+    cout << setw(10) << millis << " ms";
+    cout << setw(7) << setprecision(1) << (lodeMillis / millis) << "x";
+    const bool same = (error == 0 && expected == rgba && lodeWide == pixelsWide && lodeHigh == pixelsHigh);
+    cout << (same ? "" : "  PIXELS DIFFER") << endl;
+}
 
-    scene3.AddSolidObject(cuboid3);
-    scene3.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
-    
-    const char *filename3 = "../output/cuboid_3.png";
-    scene3.SaveImage(filename3, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
-    
-    Scene scene4(Color(0.0, 0.0, 0.0));
+// pngdecode [width height]
+// Compares decoding PNG files with LodePNG and with the table-driven
+// decoder in pngdecode.cpp: first the stock images in ../output, then
+// a grid of glass fields rendered at the given size, written by
+// LodePNG, streamed as RGB, and streamed as RGBA with a little noise
+// added, which leaves fewer matches and harder work for the filters.
+void ComparePngDecoders(int argc, const char *argv[])
+{
+    using namespace std;
+    using namespace Imager;
 
-    Cuboid *cuboid4 = new Cuboid(2.0, 2.0, 2.0);
-    cuboid4->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid4->Move(0.0, 0.0, -55.0);
-    cuboid4->RotateX(-115.0);
-    cuboid4->RotateY(122.0);
+    const size_t pixelsWide = (argc > 1) ? atoi(argv[0]) : 1920;
+    const size_t pixelsHigh = (argc > 1) ? atoi(argv[1]) : 1080;
+    const size_t copies = 4;
 
-    scene4.AddSolidObject(cuboid4);
-    scene4.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+    cout << "    " << setw(24) << left << "image" << right;
+    cout << setw(16) << "size" << setw(13) << "LodePNG" << setw(13) << "table" << endl;
+    for (int i=1; i <= 6; ++i)
+    {
+        char filename[100];
+        sprintf(filename, "../output/cuboid_%d.png", i);
+        vector<unsigned char> png;
+        lodepng::load_file(png, filename);
+        if (png.empty())
+        {
+            cout << "    cannot read " << filename << endl;
+            continue;
+        }
+        TimePngDecoders(filename + 10, png);
+    }
 
-    const char *filename4 = "../output/cuboid_4.png";
-    scene4.SaveImage(filename4, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
+    Scene scene(Color(0.1, 0.1, 0.2));
+    AddGlassField(scene, 3);
+    MemoryImageSink image;
+    scene.SaveImage(image, pixelsWide, pixelsHigh, 2.0, 1);
+    MemoryImageSink large;
+    TileImage(image, copies, large);
+    const size_t largeWide = large.GetPixelsWide();
+    const size_t largeHigh = large.GetPixelsHigh();
 
-    Scene scene5(Color(0.0, 0.0, 0.0));
+    vector<unsigned char> png;
+    lodepng::encode(png, large.GetRgba(), largeWide, largeHigh);
+    TimePngDecoders("grid, LodePNG", png);
 
-    Cuboid *cuboid5 = new Cuboid(2.0, 2.0, 2.0);
-    cuboid5->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid5->Move(0.0, 0.0, -20.0);
-    cuboid5->RotateX(21.0);
-    cuboid5->RotateY(22.0);
+    const string scratchFileName = ScratchFileName("pngdecode.png");
+    const char * const filename = scratchFileName.c_str();
+    const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    {
+        PngStreamSink sink(fd);
+        WriteImage(sink, largeWide, largeHigh, &large.GetRgba()[0], NULL);
+    }
+    close(fd);
+    png.clear();
+    lodepng::load_file(png, filename);
+    TimePngDecoders("grid, RGB", png);
+
+    vector<unsigned char> noisy = large.GetRgba();
+    unsigned random = 12345;
+    for (size_t k=0; k < noisy.size(); ++k)
+    {
+        if (k % 4 != 3)
+        {
+            random = 1103515245 * random + 12345;
+            noisy[k] = static_cast<unsigned char>(noisy[k] + ((random >> 16) % 5) - 2);
+        }
+    }
+    const int noisyFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    {
+        PngStreamSink sink(noisyFd, true);
+        WriteImage(sink, largeWide, largeHigh, &noisy[0], NULL);
+    }
+    close(noisyFd);
+    png.clear();
+    lodepng::load_file(png, filename);
+    TimePngDecoders("grid, noisy RGBA", png);
+}
+
+
+// Throws if a self-check has failed.
+void Check(bool condition, const char *message)
+{
+    if (!condition)
+    {
+        throw Imager::ImagerException(message);
+    }
+}
+
+
+// Renders the same scene description as the server would, once
+// as written and once with render limits added, through one cache.
+// The limited request must miss the cache and get the image a fresh
+// render of the limited scene produces.
+void CheckCacheKeyedOnLimits()
+{
+    using namespace std;
+    using namespace Imager;
+
+    const string plainText = DescribeGlassField(1, 64, 64, 3.0, 1);
+    string limitedText = plainText;
+    limitedText.insert(limitedText.rfind("end\n"), "limits 1 0.5\n");
+
+    RenderRequest request;
+    Scene plainScene;
+    ParseSceneDescription(plainText, plainScene, request);
+    Scene limitedScene;
+    ParseSceneDescription(limitedText, limitedScene, request);
+
+    RenderCache cache(16 << 20);
+    vector<unsigned char> plainPng;
+    cache.RenderPng(plainScene, request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor, plainPng);
+    vector<unsigned char> limitedPng;
+    cache.RenderPng(limitedScene, request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor, limitedPng);
+    Check(cache.GetStats().memoryHits == 0, "A limited render was served from the cache entry of an unlimited one.");
+
+    Scene freshScene;
+    ParseSceneDescription(limitedText, freshScene, request);
+    vector<unsigned char> freshPng;
+    const unsigned error = lodepng::encode(
+        freshPng,
+        freshScene.RenderImage(request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor),
+        request.pixelsWide,
+        request.pixelsHigh);
+    Check(error == 0, "PNG encoder error.");
+    Check(limitedPng == freshPng, "A cached limited render differs from a fresh one.");
+    Check(limitedPng != plainPng, "Render limits did not change the test image.");
+
+    // Asking again for the limited image must now hit the cache.
+    cache.RenderPng(limitedScene, request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor, limitedPng);
+    Check(cache.GetStats().memoryHits == 1, "A repeated limited render missed the cache.");
+    Check(limitedPng == freshPng, "A cache hit returned the wrong image.");
+
+    cout << "Render cache is keyed on render limits." << endl;
+}
+
+
+// Turning off medium tracking changes the image, so it must change the cache key.
+void CheckCacheKeyedOnMediumTracking()
+{
+    using namespace std;
+    using namespace Imager;
+
+    const string text = DescribeGlassField(1, 64, 64, 3.0, 1);
+    RenderRequest request;
+    Scene trackingScene;
+    ParseSceneDescription(text, trackingScene, request);
+    Scene plainScene;
+    ParseSceneDescription(text, plainScene, request);
+    plainScene.SetMediumTracking(false);
+
+    FingerprintDigest trackingKey;
+    FingerprintDigest plainKey;
+    Check(RenderCache::MakeKey(trackingScene, request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor, "png", trackingKey) &&
+          RenderCache::MakeKey(plainScene, request.pixelsWide, request.pixelsHigh, request.zoom, request.antiAliasFactor, "png", plainKey),
+          "The test scene could not be fingerprinted.");
+    Check(trackingKey != plainKey, "Medium tracking does not change the render cache key.");
+
+    cout << "Render cache is keyed on medium tracking." << endl;
+}
+
+
+// Writes 'bytes' to a file and returns true if it loads as a baked scene.
+bool LoadsAsBakedScene(const char *filename, const std::vector<unsigned char>& bytes)
+{
+    using namespace Imager;
+
+    std::ofstream outfile(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    outfile.write(reinterpret_cast<const char*>(&bytes[0]), bytes.size());
+    outfile.close();
+    if (!outfile)
+    {
+        throw ImagerException("Cannot write baked scene test file.");
+    }
+
+    try
+    {
+        Scene scene;
+        scene.LoadBakedScene(filename);
+        return true;
+    }
+    catch (const ImagerException&)
+    {
+        return false;
+    }
+}
+
+
+// Returns a copy of a baked scene file whose hierarchy is replaced by a
+// chain of 'depth' interior nodes, each with a one-cuboid leaf on its
+// right, ending in a leaf.  Such a tree is valid, but its traversal
+// stack grows by one entry for each level.
+std::vector<unsigned char> MakeChainedBakedScene(
+    const std::vector<unsigned char>& bytes,
+    uint32_t depth)
+{
+    using namespace Imager;
+
+    BakedSceneHeader header;
+    memcpy(&header, &bytes[0], sizeof(header));
+
+    std::vector<BvhNode> nodes(2*depth + 1);
+    for (uint32_t k=0; k < nodes.size(); ++k)
+    {
+        BvhNode& node = nodes[k];
+        for (int i=0; i < 3; ++i)
+        {
+            node.minCorner[i] = -1.0e+6;
+            node.maxCorner[i] = +1.0e+6;
+        }
+        // Interior node k's left child follows it; its right child is
+        // the leaf stored after the whole left subtree.
+        node.offset = (k < depth) ? (2*depth - k) : 0;
+        node.count  = (k < depth) ? 0 : 1;
+    }
+
+    std::vector<unsigned char> chained(bytes.begin(), bytes.begin() + header.nodeOffset);
+    header.nodeCount   = nodes.size();
+    header.lightCount  = 0;
+    header.lightOffset = header.nodeOffset + nodes.size() * sizeof(BvhNode);
+    memcpy(&chained[0], &header, sizeof(header));
+
+    const unsigned char* nodeBytes = reinterpret_cast<const unsigned char*>(&nodes[0]);
+    chained.insert(chained.end(), nodeBytes, nodeBytes + nodes.size() * sizeof(BvhNode));
+    return chained;
+}
+
+
+// Bakes a small field of cubes, then damages the file in ways that
+// would make rendering it read outside the file or overflow the
+// hierarchy traversal stack.  Each damaged file must fail to load.
+void CheckCorruptBakedScenes()
+{
+    using namespace std;
+    using namespace Imager;
+
+    char filename[] = "/tmp/raytrace_check_XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0)
+    {
+        throw ImagerException("Cannot create baked scene test file.");
+    }
+    close(fd);
+
+    try
+    {
+        Scene scene(Color(0.0, 0.0, 0.0));
+        AddCubeField(scene, 10);
+        scene.SaveBakedScene(filename);
+
+        vector<unsigned char> bytes;
+        lodepng::load_file(bytes, filename);
+        Check(bytes.size() > sizeof(BakedSceneHeader), "Cannot read baked scene test file.");
+        Check(LoadsAsBakedScene(filename, bytes), "A correct baked scene file was rejected.");
+
+        BakedSceneHeader header;
+        memcpy(&header, &bytes[0], sizeof(header));
+        const size_t rootOffset = header.nodeOffset;
+        Check(reinterpret_cast<const BvhNode*>(&bytes[rootOffset])->count == 0, "The test scene has no interior nodes.");
+
+        vector<unsigned char> truncated(bytes.begin(), bytes.begin() + bytes.size()/2);
+        Check(!LoadsAsBakedScene(filename, truncated), "A truncated baked scene file was accepted.");
+
+        vector<unsigned char> badChild = bytes;
+        reinterpret_cast<BvhNode*>(&badChild[rootOffset])->offset = static_cast<uint32_t>(header.nodeCount);
+        Check(!LoadsAsBakedScene(filename, badChild), "A child index past the last node was accepted.");
+
+        vector<unsigned char> cycle = bytes;
+        reinterpret_cast<BvhNode*>(&cycle[rootOffset])->offset = 0;
+        Check(!LoadsAsBakedScene(filename, cycle), "A hierarchy that loops back to its root was accepted.");
+
+        // Find a leaf and point it past the end of the cuboids.
+        vector<unsigned char> badLeaf = bytes;
+        BvhNode* nodes = reinterpret_cast<BvhNode*>(&badLeaf[rootOffset]);
+        size_t leaf = 0;
+        while (nodes[leaf].count == 0)
+        {
+            ++leaf;
+        }
+        nodes[leaf].offset = static_cast<uint32_t>(header.cuboidCount);
+        Check(!LoadsAsBakedScene(filename, badLeaf), "A leaf past the last cuboid was accepted.");
+
+        Check(LoadsAsBakedScene(filename, MakeChainedBakedScene(bytes, 8)), "A shallow chained hierarchy was rejected.");
+        Check(!LoadsAsBakedScene(filename, MakeChainedBakedScene(bytes, 200)), "A hierarchy too deep for the traversal stack was accepted.");
+    }
+    catch (...)
+    {
+        unlink(filename);
+        throw;
+    }
+    unlink(filename);
+
+    cout << "Corrupt baked scene files are rejected." << endl;
+}
 
-    scene5.AddSolidObject(cuboid5);
-    scene5.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
-    
-    const char *filename5 = "../output/cuboid_5.png";
-    scene5.SaveImage(filename5, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
-    
-    Scene scene6(Color(0.0, 0.0, 0.0));
 
-    Cuboid *cuboid6 = new Cuboid(2.0, 2.0, 2.0);
-    cuboid6->SetFullMatte(Color(0.7, 0.7, 0.8));
-    cuboid6->Move(0.0, 0.0, -65.0);
-    cuboid6->RotateX(-35.0);
-    cuboid6->RotateY(122.0);
+// Builds and destroys scenes full of distinct materials, as a render
+// server does, and requires the material table to shrink back each time.
+void CheckMaterialsFreed()
+{
+    using namespace std;
+    using namespace Imager;
+
+    const size_t baseline = MaterialTable::Count();
+    for (int round=0; round < 3; ++round)
+    {
+        Scene scene;
+        const Cuboid* first = NULL;
+        for (int k=0; k < 2000; ++k)
+        {
+            Cuboid* cuboid = new Cuboid(1.0, 1.0, 1.0);
+            cuboid->SetFullMatte(Color(k / 2000.0, round / 3.0, 0.5));
+            scene.AddSolidObject(cuboid);
+            if (first == NULL)
+            {
+                first = cuboid;
+            }
+        }
+        Check(MaterialTable::Count() == baseline + 2000, "Distinct materials were not all interned.");
+
+        const Cuboid copy(*first);
+        Check(copy.GetUniformOptics().GetMatteColor().green == round / 3.0, "A reused material entry holds stale optics.");
+    }
+    Check(MaterialTable::Count() == baseline, "Materials of destroyed scenes were not freed.");
+
+    cout << "Materials of destroyed scenes are freed." << endl;
+}
+
+
+// RenderTile does not build the light hierarchy itself, so it must
+// refuse to render with one left stale by changing the lights.
+void CheckTilesNeedPreparedLights()
+{
+    using namespace std;
+    using namespace Imager;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    BuildManyLightsScene(scene, 50);
+
+    ImageBuffer buffer(64, 64, Color());
+    bool rejected = false;
+    try
+    {
+        scene.RenderTile(64, 64, 1.0, 1, 0, 0, buffer);
+    }
+    catch (const ImagerException&)
+    {
+        rejected = true;
+    }
+    Check(rejected, "A tile was rendered with a stale light hierarchy.");
+
+    scene.PrepareLights();
+    scene.RenderTile(64, 64, 1.0, 1, 0, 0, buffer);
+    const vector<unsigned char> tiledImage = scene.FinishTiledImage(buffer, 64, 64, 1);
+    Check(tiledImage == scene.RenderImage(64, 64, 1.0, 1), "A tiled render differs from the whole image.");
+
+    cout << "Tiles are rendered with a prepared light hierarchy." << endl;
+}
+
+
+// Moving a solid after its primary hits were retained must make
+// RelightImage refuse, rather than relight hits that are out of date.
+void CheckRelightAfterMove()
+{
+    using namespace std;
+    using namespace Imager;
+
+    Scene scene(Color(0.0, 0.0, 0.0));
+    Cuboid* cuboid = new Cuboid(3.0, 4.0, 5.0);
+    cuboid->Move(0.0, 0.0, -50.0);
+    cuboid->RotateY(30.0);
+    scene.AddSolidObject(cuboid);
+    scene.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
+    scene.SetRetainPrimaryHits(true);
+
+    const vector<unsigned char> image = scene.RenderImage(64, 64, 3.0, 1);
+    Check(scene.RelightImage() == image, "Relighting an unchanged scene changed the image.");
+
+    cuboid->RotateX(10.0);
+    bool rejected = false;
+    try
+    {
+        scene.RelightImage();
+    }
+    catch (const ImagerException&)
+    {
+        rejected = true;
+    }
+    Check(rejected, "Hits retained before a solid was rotated were relit.");
+    Check(!scene.HasRetainedPrimaryHits(), "Retained hits stayed valid after a solid was rotated.");
+
+    cout << "Relighting refuses hits retained before solids moved." << endl;
+}
+
+
+// The render server parses descriptions from socket clients, which
+// must not be able to make it open files with a "baked" statement.
+void CheckUntrustedBakedRefused()
+{
+    using namespace std;
+    using namespace Imager;
+
+    const string description = "baked /dev/null\nend\n";
+    bool rejected = false;
+    try
+    {
+        Scene scene;
+        RenderRequest request;
+        ParseSceneDescription(description, scene, request, false);
+    }
+    catch (const ImagerException& ex)
+    {
+        rejected = (strstr(ex.GetMessage(), "not allowed") != NULL);
+    }
+    Check(rejected, "An untrusted description was allowed to load a baked scene file.");
+
+    cout << "Untrusted descriptions cannot name files." << endl;
+}
+
+
+// Render cache keys are SHA-256 digests of the scene's fingerprint.
+// The expected values were computed independently from the same bytes:
+// each string is added as its length in 8 little-endian bytes, then
+// its characters.
+void CheckFingerprintDigests()
+{
+    using namespace std;
+    using namespace Imager;
+
+    Fingerprint empty;
+    Check(empty.Digest().ToHex() == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "Wrong digest for an empty fingerprint.");
+
+    Fingerprint shortText;
+    shortText.AddString("abc");
+    Check(shortText.Digest().ToHex() == "ce91dc5eec0139adf091900d225971d6ad246a845bad791b5693a9d0d55dd391",
+        "Wrong digest for a short fingerprint.");
+
+    Fingerprint longText;
+    longText.AddString(string(1000, 'a'));
+    Check(longText.Digest().ToHex() == "853b74abfcd932e3e88590b70c8680d543d6dd75ee327ecd6c36ff6b406f738b",
+        "Wrong digest for a fingerprint several blocks long.");
+
+    // Taking a digest part way through must not change the final one.
+    shortText.AddString("abc");
+    Fingerprint twice;
+    twice.AddString("abc");
+    twice.AddString("abc");
+    Check(shortText.Digest() == twice.Digest(), "Taking a digest changed the fingerprint.");
+
+    cout << "Fingerprints are SHA-256 digests." << endl;
+}
 
-    scene6.AddSolidObject(cuboid6);
-    scene6.AddLightSource(LightSource(Vector(-5.0, 50.0, +20.0), Color(0.7, 0.7, 0.7)));
 
-    const char *filename6 = "../output/cuboid_6.png";
-    scene6.SaveImage(filename6, 300, 300, 3.0, 2);
-    //std::cout << "Wrote cube" << filename << std::endl;
+// Turning off light culling changes the image, so it must change the cache key.
+void CheckCacheKeyedOnLightCulling()
+{
+    using namespace std;
+    using namespace Imager;
+
+    Scene culledScene(Color(0.0, 0.0, 0.0));
+    BuildManyLightsScene(culledScene, 50);
+    Scene allLightsScene(Color(0.0, 0.0, 0.0));
+    BuildManyLightsScene(allLightsScene, 50);
+    allLightsScene.SetLightCulling(false);
+
+    FingerprintDigest culledKey;
+    FingerprintDigest allLightsKey;
+    Check(RenderCache::MakeKey(culledScene, 64, 64, 1.0, 1, "png", culledKey) &&
+          RenderCache::MakeKey(allLightsScene, 64, 64, 1.0, 1, "png", allLightsKey),
+          "The test scene could not be fingerprinted.");
+    Check(culledKey != allLightsKey, "Light culling does not change the render cache key.");
+
+    cout << "Render cache is keyed on light culling." << endl;
+}
+
+
+// check
+// Runs self-checks of behavior that has been broken before.
+// Each throws ImagerException if it fails, so the exit status
+// is nonzero unless every check passed.
+void RunSelfChecks(int argc, const char *argv[])
+{
+    CheckCacheKeyedOnLimits();
+    CheckCacheKeyedOnMediumTracking();
+    CheckCorruptBakedScenes();
+    CheckMaterialsFreed();
+    CheckTilesNeedPreparedLights();
+    CheckRelightAfterMove();
+    CheckUntrustedBakedRefused();
+    CheckFingerprintDigests();
+    CheckCacheKeyedOnLightCulling();
+    std::cout << "All checks passed." << std::endl;
 }
 
 
-typedef void (* COMMAND_FUNCTION) ();
+typedef void (* COMMAND_FUNCTION) (int argc, const char *argv[]);
 
 struct CommandEntry
 {
@@ -116,7 +2578,168 @@ struct CommandEntry
 const CommandEntry CommandTable[] =
 {
     { "run", renderCubes,
+        "    run [cachedir]\n"
         "    Runs renderCubes() that generates 6 different images of cubes.\n"
+        "    If cachedir is given, images rendered before are served from it.\n"
+    },
+
+    { "check", RunSelfChecks,
+        "    check\n"
+        "    Runs self-checks and exits with a nonzero status if any fails.\n"
+    },
+
+    { "spin", RenderTurntable,
+        "    spin [frames]\n"
+        "    Renders a turntable animation of a cube to spin_NNN.png files\n"
+        "    in a scratch directory.\n"
+    },
+
+    { "serve", ServeRenderRequests,
+        "    serve socketpath [threads]\n"
+        "    serve - [threads]\n"
+        "    Renders scene descriptions sent over a Unix domain socket,\n"
+        "    or over standard input/output, on a warm thread pool.\n"
+    },
+
+    { "coordinate", CoordinateTileWorkers,
+        "    coordinate descfile outfile.png [local workers] [address]\n"
+        "    Renders a scene description split into tiles among worker\n"
+        "    processes, forked here or connecting to the address, which is\n"
+        "    a Unix socket path or host:port.\n"
+    },
+
+    { "worker", ServeTileCoordinator,
+        "    worker address\n"
+        "    Traces tiles for a coordinator listening at the address.\n"
+    },
+
+    { "ring", CompareFrameHandoff,
+        "    ring [frames] [width height]\n"
+        "    Times handing rendered frames to another process as PNG files\n"
+        "    and through a shared memory frame ring, raw and as floats.\n"
+    },
+
+    { "ringview", ViewFrameRing,
+        "    ringview name [timeout seconds]\n"
+        "    Reads frames from a shared memory frame ring until it closes.\n"
+    },
+
+    { "sinks", CompareImageSinks,
+        "    sinks [width height]\n"
+        "    Renders a field of glass cubes and times writing it as PNG,\n"
+        "    PPM, PAM, and PFM files, to memory, and to a frame ring.\n"
+    },
+
+    { "pngstream", ComparePngEncoders,
+        "    pngstream [width height]\n"
+        "    Compares LodePNG with the streaming PNG encoder for time,\n"
+        "    peak memory, and file size, on a rendered and a large image.\n"
+    },
+
+    { "pngdecode", ComparePngDecoders,
+        "    pngdecode [width height]\n"
+        "    Compares LodePNG with the table-driven PNG decoder on the\n"
+        "    stock images and on large rendered images.\n"
+    },
+
+    { "distribute", CompareTileWorkers,
+        "    distribute [max workers] [cubes per side]\n"
+        "    Times a field of glass cubes rendered by 1, 2, ... worker\n"
+        "    processes, and checks recovery from failed and slow workers.\n"
+    },
+
+    { "relight", RelightCubeField,
+        "    relight [frames]\n"
+        "    Moves the light around a field of cubes, timing full renders\n"
+        "    against relighting the primary hits kept from the first render.\n"
+    },
+
+    { "lights", RenderManyLights,
+        "    lights [count]\n"
+        "    Times a field of cubes lit by many lights, with and without\n"
+        "    the light hierarchy, and reports how much the images differ.\n"
+    },
+
+    { "shadows", RenderShadowField,
+        "    shadows [n]\n"
+        "    Renders an n by n field of cubes shadowing a wall, comparing\n"
+        "    shadow ray costs with and without the last-occluder cache.\n"
+    },
+
+    { "solvers", CompareSolvers,
+        "    solvers [polynomials]\n"
+        "    Checks the real-coefficient polynomial solvers against known\n"
+        "    roots and the complex solvers, and times both.\n"
+    },
+
+    { "torus", RenderTorusChain,
+        "    torus [rings]\n"
+        "    Renders a chain of linked tori, and times the quartic solving\n"
+        "    for a packet of camera rays one ray at a time and batched.\n"
+    },
+
+    { "glass", RenderGlassField,
+        "    glass [cubes per side]\n"
+        "    Renders a field of glass cubes, finding the medium beyond each\n"
+        "    refracting surface by containment tests and by medium tracking.\n"
+    },
+
+    { "wavefront", RenderWavefrontComparison,
+        "    wavefront [cubes per side]\n"
+        "    Renders the stock cubes and a field of glass cubes by recursive\n"
+        "    and by wavefront ray tracing, and compares times and images.\n"
+    },
+
+    { "reorder", CompareRayReordering,
+        "    reorder [cubes per side] [batch size]\n"
+        "    Times wavefront tracing of a field of mirrored cubes with\n"
+        "    secondary rays in pixel order and sorted into coherent batches.\n"
+    },
+
+    { "budget", CompareRayBudgets,
+        "    budget [cubes per side] [rays per pixel] [rays per frame]\n"
+        "    Renders a field of glass cubes with and without per-pixel and\n"
+        "    per-frame ray budgets, and reports how often they applied.\n"
+    },
+
+    { "order", ComparePixelOrders,
+        "    order [width height [antialias [cubes per side]]]\n"
+        "    Times rendering a field of glossy cubes with the pixels traced\n"
+        "    by columns, rows, tiles, and Morton and Hilbert curves.\n"
+    },
+
+    { "blocks", CompareConcreteBlocks,
+        "    blocks [blocks per side]\n"
+        "    Renders a grid of concrete blocks built from set operator\n"
+        "    objects and as compile-time shapes, and compares the times.\n"
+    },
+
+    { "contains", TimeContainment,
+        "    contains [points]\n"
+        "    Times containment tests against a concrete block,\n"
+        "    one point at a time and batched.\n"
+    },
+
+    { "grille", RenderGrille,
+        "    grille [slots]\n"
+        "    Renders a slab with 1, 2, 4, ... up to 'slots' slots cut out\n"
+        "    of it by nested set operators, timing each size.\n"
+    },
+
+    { "instances", CompareInstancing,
+        "    instances [n]\n"
+        "    Reports bytes per cube for an n by n field built from Cuboid\n"
+        "    objects and from instances of one prototype, then renders it.\n"
+    },
+
+    { "bake", BakeCubeField,
+        "    bake outfile [n]\n"
+        "    Builds an n by n field of cubes and saves it as a baked scene file.\n"
+    },
+
+    { "baked", RenderBakedScene,
+        "    baked infile outfile.png\n"
+        "    Memory-maps a baked scene file and renders it to a PNG file.\n"
     },
 
 };
@@ -164,8 +2787,15 @@ int main(int argc, const char *argv[])
             if (verb == CommandTable[i].verb)
             {
                 found = true;                   
-                CommandTable[i].command();      
-                rc = 0;                         
+                try
+                {
+                    CommandTable[i].command(argc-2, argv+2);
+                    rc = 0;
+                }
+                catch (const Imager::ImagerException& error)
+                {
+                    cerr << "EXCEPTION: " << error.GetMessage() << endl;
+                }
                 break;                          
             }
         }
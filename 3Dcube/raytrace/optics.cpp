@@ -6,6 +6,8 @@
 */
 
 #include <cmath>
+#include <map>
+#include <mutex>
 #include "imager.h"
 
 namespace Imager
@@ -68,4 +70,125 @@ namespace Imager
         }
         opacity = _opacity;
     }
+
+    namespace
+    {
+        // Orders Optics by their exact component values, so that
+        // interning finds only materials that are truly identical.
+        struct OpticsLess
+        {
+            bool operator() (const Optics& a, const Optics& b) const
+            {
+                const double x[7] =
+                {
+                    a.GetMatteColor().red, a.GetMatteColor().green, a.GetMatteColor().blue,
+                    a.GetGlossColor().red, a.GetGlossColor().green, a.GetGlossColor().blue,
+                    a.GetOpacity()
+                };
+                const double y[7] =
+                {
+                    b.GetMatteColor().red, b.GetMatteColor().green, b.GetMatteColor().blue,
+                    b.GetGlossColor().red, b.GetGlossColor().green, b.GetGlossColor().blue,
+                    b.GetOpacity()
+                };
+                for (int k=0; k < 7; ++k)
+                {
+                    if (x[k] < y[k]) return true;
+                    if (x[k] > y[k]) return false;
+                }
+                return false;
+            }
+        };
+
+        typedef std::map<Optics, MaterialId, OpticsLess> MaterialIndex;
+
+        // The first chunk is a plain array, so that material 0 holds
+        // the default Optics before anything has been interned.
+        Optics firstMaterialChunk[MaterialTable::CHUNK_SIZE];
+
+        // Everything below is guarded by materialMutex.  Entry k has
+        // referenceCount[k] holders; freed entries are listed in freeList
+        // for reuse, and ids past the end of referenceCount were never used.
+        std::mutex materialMutex;
+        MaterialIndex materialIndex;
+        std::vector<size_t> referenceCount(1, 0);
+        std::vector<MaterialId> freeList;
+    }
+
+    std::atomic<Optics*> MaterialTable::chunkList[MaterialTable::MAX_CHUNKS] = { firstMaterialChunk };
+
+    MaterialId MaterialTable::Intern(const Optics& optics)
+    {
+        std::lock_guard<std::mutex> lock(materialMutex);
+
+        if (materialIndex.empty())
+        {
+            materialIndex[firstMaterialChunk[0]] = DEFAULT_MATERIAL;
+        }
+
+        MaterialIndex::const_iterator found = materialIndex.find(optics);
+        if (found != materialIndex.end())
+        {
+            ++referenceCount[found->second];
+            return found->second;
+        }
+
+        size_t id;
+        if (!freeList.empty())
+        {
+            id = freeList.back();
+            freeList.pop_back();
+        }
+        else
+        {
+            id = referenceCount.size();
+            const size_t chunk = id >> CHUNK_BITS;
+            if (chunk >= MAX_CHUNKS)
+            {
+                throw ImagerException("Too many distinct materials in use.");
+            }
+
+            if (chunkList[chunk].load(std::memory_order_relaxed) == NULL)
+            {
+                // Release publishes the new chunk to lock-free readers in Lookup.
+                chunkList[chunk].store(new Optics[CHUNK_SIZE], std::memory_order_release);
+            }
+            referenceCount.push_back(0);
+        }
+
+        // No one can be reading this entry: it is either new or was
+        // freed when its last holder released it.
+        chunkList[id >> CHUNK_BITS].load(std::memory_order_relaxed)[id & (CHUNK_SIZE - 1)] = optics;
+        referenceCount[id] = 1;
+        materialIndex[optics] = static_cast<MaterialId>(id);
+        return static_cast<MaterialId>(id);
+    }
+
+    void MaterialTable::AddReference(MaterialId id)
+    {
+        if (id != DEFAULT_MATERIAL)
+        {
+            std::lock_guard<std::mutex> lock(materialMutex);
+            ++referenceCount[id];
+        }
+    }
+
+    void MaterialTable::Release(MaterialId id)
+    {
+        if (id != DEFAULT_MATERIAL)
+        {
+            std::lock_guard<std::mutex> lock(materialMutex);
+            if (--referenceCount[id] == 0)
+            {
+                materialIndex.erase(Lookup(id));
+                freeList.push_back(id);
+            }
+        }
+    }
+
+    size_t MaterialTable::Count()
+    {
+        std::lock_guard<std::mutex> lock(materialMutex);
+        return referenceCount.size() - freeList.size();
+    }
 }
@@ -0,0 +1,113 @@
+/*
+    perfcount.cpp
+
+    Implements class PerfCounter, declared in perfcount.h.
+*/
+
+#include <cstring>
+#include "perfcount.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Imager
+{
+#ifdef __linux__
+    PerfCounter::PerfCounter(PerfCounterKind kind)
+        : fd(-1)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        switch (kind)
+        {
+        case PERF_CACHE_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+
+        case PERF_CACHE_REFERENCES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_REFERENCES;
+            break;
+
+        case PERF_L1D_READ_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config =
+                PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+
+        default:
+            return;
+        }
+
+        // Counts the calling thread (pid 0) on whatever CPU it runs on.
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    PerfCounter::~PerfCounter()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    void PerfCounter::Start()
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    unsigned long long PerfCounter::Stop()
+    {
+        unsigned long long count = 0;
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+            {
+                count = 0;
+            }
+        }
+        return count;
+    }
+#else
+    PerfCounter::PerfCounter(PerfCounterKind)
+        : fd(-1)
+    {
+    }
+
+    PerfCounter::~PerfCounter()
+    {
+    }
+
+    void PerfCounter::Start()
+    {
+    }
+
+    unsigned long long PerfCounter::Stop()
+    {
+        return 0;
+    }
+#endif
+}
@@ -0,0 +1,52 @@
+/*
+    perfcount.h
+
+    Hardware performance counters for benchmarks, such as the number
+    of cache misses the calling thread causes while rendering.
+    Counters come from the Linux perf_event interface; where it is
+    missing or forbidden (other systems, many virtual machines,
+    restrictive perf_event_paranoid settings), a counter simply
+    reports that it is unavailable.
+*/
+
+#ifndef __DDC_PERFCOUNT_H
+#define __DDC_PERFCOUNT_H
+
+namespace Imager
+{
+    enum PerfCounterKind
+    {
+        PERF_CACHE_MISSES,          // last-level cache misses
+        PERF_CACHE_REFERENCES,      // last-level cache accesses
+        PERF_L1D_READ_MISSES,       // level 1 data cache read misses
+        PERF_INSTRUCTIONS           // instructions retired
+    };
+
+    // Counts one kind of hardware event in the calling thread,
+    // user mode only, between calls to Start and Stop.
+    class PerfCounter
+    {
+    public:
+        explicit PerfCounter(PerfCounterKind kind);
+        ~PerfCounter();
+
+        bool IsAvailable() const
+        {
+            return fd >= 0;
+        }
+
+        void Start();
+
+        // Returns the number of events since Start,
+        // or 0 if the counter is unavailable.
+        unsigned long long Stop();
+
+    private:
+        PerfCounter(const PerfCounter&);                // not copyable
+        PerfCounter& operator= (const PerfCounter&);
+
+        int fd;
+    };
+}
+
+#endif // __DDC_PERFCOUNT_H
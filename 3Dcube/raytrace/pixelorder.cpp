@@ -0,0 +1,193 @@
+/*
+    pixelorder.cpp
+
+    Implements class PixelWalk, declared in pixelorder.h.
+*/
+
+#include <algorithm>
+#include "pixelorder.h"
+
+namespace Imager
+{
+    namespace
+    {
+        // Gathers the even-numbered bits of 'n' into its low half.
+        inline size_t CompactBits(unsigned long long n)
+        {
+            n &= 0x5555555555555555ULL;
+            n = (n | (n >> 1)) & 0x3333333333333333ULL;
+            n = (n | (n >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+            n = (n | (n >> 4)) & 0x00ff00ff00ff00ffULL;
+            n = (n | (n >> 8)) & 0x0000ffff0000ffffULL;
+            n = (n | (n >> 16)) & 0x00000000ffffffffULL;
+            return static_cast<size_t>(n);
+        }
+
+        // Finds the point at distance 'd' along the Hilbert curve
+        // that fills a square 'side' pixels across, a power of 2.
+        void HilbertPoint(size_t side, unsigned long long d, size_t& x, size_t& y)
+        {
+            x = y = 0;
+            for (size_t s = 1; s < side; s *= 2)
+            {
+                const size_t rx = 1 & static_cast<size_t>(d / 2);
+                const size_t ry = 1 & static_cast<size_t>(d ^ rx);
+                if (ry == 0)
+                {
+                    // Rotate the quadrant so the curve joins up.
+                    if (rx == 1)
+                    {
+                        x = s-1 - x;
+                        y = s-1 - y;
+                    }
+                    const size_t t = x;
+                    x = y;
+                    y = t;
+                }
+                x += s * rx;
+                y += s * ry;
+                d /= 4;
+            }
+        }
+    }
+
+    PixelWalk::PixelWalk(PixelOrder _order, size_t _pixelsWide, size_t _pixelsHigh)
+        : order(_order)
+        , pixelsWide(_pixelsWide)
+        , pixelsHigh(_pixelsHigh)
+        , iNext(0)
+        , jNext(0)
+        , iBlock(0)
+        , jBlock(0)
+        , blockSize(1)
+        , step(0)
+    {
+        // The curves fill square blocks whose side is a power of 2,
+        // as large as fits within the image, taken in rows.  Blocks
+        // at the right and bottom edges hang over the image, and the
+        // steps of the curve that fall outside it are skipped.
+        const size_t smaller = (pixelsWide < pixelsHigh) ? pixelsWide : pixelsHigh;
+        while (2*blockSize <= smaller)
+        {
+            blockSize *= 2;
+        }
+
+        if (pixelsWide == 0 || pixelsHigh == 0)
+        {
+            // Nothing to walk; make Next stop at once.
+            pixelsWide = pixelsHigh = 0;
+        }
+    }
+
+    bool PixelWalk::Next(size_t& i, size_t& j)
+    {
+        if (pixelsWide == 0)
+        {
+            return false;
+        }
+
+        switch (order)
+        {
+        case PIXEL_ORDER_COLUMNS:
+            if (iNext == pixelsWide)
+            {
+                return false;
+            }
+            i = iNext;
+            j = jNext;
+            if (++jNext == pixelsHigh)
+            {
+                jNext = 0;
+                ++iNext;
+            }
+            return true;
+
+        case PIXEL_ORDER_ROWS:
+            if (jNext == pixelsHigh)
+            {
+                return false;
+            }
+            i = iNext;
+            j = jNext;
+            if (++iNext == pixelsWide)
+            {
+                iNext = 0;
+                ++jNext;
+            }
+            return true;
+
+        case PIXEL_ORDER_TILES:
+            {
+                if (jBlock >= pixelsHigh)
+                {
+                    return false;
+                }
+                i = iBlock + iNext;
+                j = jBlock + jNext;
+
+                // Rows within the tile, then tiles in rows,
+                // with the tiles at the edges cut short.
+                const size_t tileWide = std::min(PIXEL_TILE_SIZE, pixelsWide - iBlock);
+                const size_t tileHigh = std::min(PIXEL_TILE_SIZE, pixelsHigh - jBlock);
+                if (++iNext == tileWide)
+                {
+                    iNext = 0;
+                    if (++jNext == tileHigh)
+                    {
+                        jNext = 0;
+                        iBlock += PIXEL_TILE_SIZE;
+                        if (iBlock >= pixelsWide)
+                        {
+                            iBlock = 0;
+                            jBlock += PIXEL_TILE_SIZE;
+                        }
+                    }
+                }
+                return true;
+            }
+
+        default:
+            return NextInBlocks(i, j);
+        }
+    }
+
+    bool PixelWalk::NextInBlocks(size_t& i, size_t& j)
+    {
+        const unsigned long long blockSteps =
+            static_cast<unsigned long long>(blockSize) * blockSize;
+
+        while (jBlock < pixelsHigh)
+        {
+            while (step < blockSteps)
+            {
+                size_t x, y;
+                if (order == PIXEL_ORDER_HILBERT)
+                {
+                    HilbertPoint(blockSize, step, x, y);
+                }
+                else
+                {
+                    x = CompactBits(step);
+                    y = CompactBits(step >> 1);
+                }
+                ++step;
+
+                i = iBlock + x;
+                j = jBlock + y;
+                if (i < pixelsWide && j < pixelsHigh)
+                {
+                    return true;
+                }
+            }
+
+            step = 0;
+            iBlock += blockSize;
+            if (iBlock >= pixelsWide)
+            {
+                iBlock = 0;
+                jBlock += blockSize;
+            }
+        }
+        return false;
+    }
+}
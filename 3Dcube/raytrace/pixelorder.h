@@ -0,0 +1,46 @@
+/*
+    pixelorder.h
+
+    Walks the pixels of an image in one of the orders named by
+    PixelOrder (see imager.h), one pixel at a time, without building
+    a list of them, so that a huge oversampled image costs no memory.
+*/
+
+#ifndef __DDC_PIXELORDER_H
+#define __DDC_PIXELORDER_H
+
+#include "imager.h"
+
+namespace Imager
+{
+    // The side, in pixels, of the square tiles of PIXEL_ORDER_TILES.
+    const size_t PIXEL_TILE_SIZE = 16;
+
+    class PixelWalk
+    {
+    public:
+        PixelWalk(PixelOrder _order, size_t _pixelsWide, size_t _pixelsHigh);
+
+        // Finds the next pixel, returning false after the last one.
+        bool Next(size_t& i, size_t& j);
+
+    private:
+        bool NextInBlocks(size_t& i, size_t& j);
+
+        PixelOrder order;
+        size_t pixelsWide;
+        size_t pixelsHigh;
+
+        // Position of the next pixel, or for the space-filling curves,
+        // the corner of the current block and the next step along the
+        // curve through it.
+        size_t iNext;
+        size_t jNext;
+        size_t iBlock;
+        size_t jBlock;
+        size_t blockSize;
+        unsigned long long step;
+    };
+}
+
+#endif // __DDC_PIXELORDER_H
@@ -0,0 +1,1436 @@
+/*
+    pngdecode.cpp
+
+    Implements the table-driven inflater and PNG decoder declared in
+    pngdecode.h.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "imager.h"
+#include "pngdecode.h"
+#include "../lodepng/lodepng.h"
+
+#if defined(__SSE2__)
+#define PNG_HAVE_SSE2 1
+#include <emmintrin.h>
+#else
+#define PNG_HAVE_SSE2 0
+#endif
+
+namespace Imager
+{
+    namespace
+    {
+        // How many bits each kind of Huffman table looks up at once.
+        // Codes longer than that continue in a subtable indexed by
+        // their remaining bits.  Deflate codes are at most 15 bits.
+        const int LITLEN_TABLE_BITS      = 10;
+        const int DISTANCE_TABLE_BITS    = 8;
+        const int CODE_LENGTH_TABLE_BITS = 7;
+        const int MAX_CODE_BITS          = 15;
+
+        const unsigned short LENGTH_BASE[29] =
+        {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+        };
+
+        const unsigned char LENGTH_EXTRA[29] =
+        {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+
+        const unsigned short DISTANCE_BASE[30] =
+        {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+            8193, 12289, 16385, 24577
+        };
+
+        const unsigned char DISTANCE_EXTRA[30] =
+        {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+        };
+
+        // The order code length code lengths are sent in.
+        const unsigned char CODE_LENGTH_ORDER[19] =
+        {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+        };
+
+        // What a table entry stands for, in its 'op' byte.  The low 4
+        // bits of an OP_BASE entry are how many extra bits follow the
+        // code, to be added to the entry's value.
+        const unsigned char OP_BASE     = 0x00;     // a match length or distance
+        const unsigned char OP_LITERAL  = 0x10;     // a literal byte, or a code length symbol
+        const unsigned char OP_END      = 0x20;     // the end of the block
+        const unsigned char OP_SUBTABLE = 0x40;     // 'value' is where a subtable starts; 'bits' is its size
+        const unsigned char OP_INVALID  = 0x80;     // no code leads here
+
+        struct TableEntry
+        {
+            unsigned short value;
+            unsigned char  bits;    // how many bits of code this entry uses up
+            unsigned char  op;
+        };
+
+        enum TableKind
+        {
+            TABLE_LITLEN,
+            TABLE_DISTANCE,
+            TABLE_CODE_LENGTH
+        };
+
+        TableEntry SymbolEntry(unsigned symbol, TableKind kind)
+        {
+            TableEntry entry;
+            entry.value = 0;
+            entry.bits = 0;
+            entry.op = OP_INVALID;
+            switch (kind)
+            {
+            case TABLE_LITLEN:
+                if (symbol < 256)
+                {
+                    entry.value = static_cast<unsigned short>(symbol);
+                    entry.op = OP_LITERAL;
+                }
+                else if (symbol == 256)
+                {
+                    entry.op = OP_END;
+                }
+                else if (symbol < 286)
+                {
+                    entry.value = LENGTH_BASE[symbol - 257];
+                    entry.op = OP_BASE | LENGTH_EXTRA[symbol - 257];
+                }
+                break;
+
+            case TABLE_DISTANCE:
+                if (symbol < 30)
+                {
+                    entry.value = DISTANCE_BASE[symbol];
+                    entry.op = OP_BASE | DISTANCE_EXTRA[symbol];
+                }
+                break;
+
+            case TABLE_CODE_LENGTH:
+                entry.value = static_cast<unsigned short>(symbol);
+                entry.op = OP_LITERAL;
+                break;
+            }
+            return entry;
+        }
+
+        // Decodes one canonical Huffman code, given the code length of
+        // each symbol as deflate sends them.  Indexing the primary table
+        // with the next 'primaryBits' bits of input gives the symbol
+        // whose code they start with, or a subtable to index with the
+        // bits after them.
+        class HuffmanTable
+        {
+        public:
+            HuffmanTable()
+                : primaryBits(0)
+            {
+            }
+
+            // Throws ImagerException if the lengths do not make a
+            // prefix code.  A code with unused bit patterns is allowed,
+            // as deflate sends one for a single distance; decoding
+            // such a pattern gives an OP_INVALID entry.
+            void Build(const unsigned char *lengths, size_t count, TableKind kind, int _primaryBits);
+
+            int primaryBits;
+            std::vector<TableEntry> entry;      // the primary table, then the subtables
+        };
+
+        void HuffmanTable::Build(const unsigned char *lengths, size_t count, TableKind kind, int _primaryBits)
+        {
+            unsigned lengthCount[MAX_CODE_BITS + 1];
+            memset(lengthCount, 0, sizeof(lengthCount));
+            for (size_t s=0; s < count; ++s)
+            {
+                ++lengthCount[lengths[s]];
+            }
+            lengthCount[0] = 0;
+
+            // There are 2^n bit patterns of length n.  If the codes
+            // shorter than n leave fewer of them than there are codes of
+            // length n, some codes would be prefixes of others.
+            int left = 1;
+            int maxBits = 0;
+            unsigned nextCode[MAX_CODE_BITS + 1];
+            unsigned code = 0;
+            for (int bits=1; bits <= MAX_CODE_BITS; ++bits)
+            {
+                left = (left << 1) - static_cast<int>(lengthCount[bits]);
+                if (left < 0)
+                {
+                    throw ImagerException("Invalid Huffman code in deflate stream.");
+                }
+                if (lengthCount[bits] > 0)
+                {
+                    maxBits = bits;
+                }
+                code = (code + lengthCount[bits - 1]) << 1;
+                nextCode[bits] = code;
+            }
+
+            primaryBits = _primaryBits;
+            const size_t primarySize = static_cast<size_t>(1) << primaryBits;
+            const int subtableBits = (maxBits > primaryBits) ? (maxBits - primaryBits) : 0;
+            const size_t subtableSize = static_cast<size_t>(1) << subtableBits;
+
+            TableEntry invalid;
+            invalid.value = 0;
+            invalid.bits = 0;
+            invalid.op = OP_INVALID;
+            entry.assign(primarySize, invalid);
+
+            for (size_t s=0; s < count; ++s)
+            {
+                const int bits = lengths[s];
+                if (bits == 0)
+                {
+                    continue;
+                }
+
+                // Deflate packs codes starting from their most
+                // significant bit, so they are indexed bit-reversed.
+                unsigned value = nextCode[bits]++;
+                size_t reversed = 0;
+                for (int b=0; b < bits; ++b)
+                {
+                    reversed = (reversed << 1) | (value & 1);
+                    value >>= 1;
+                }
+
+                TableEntry symbolEntry = SymbolEntry(static_cast<unsigned>(s), kind);
+                if (bits <= primaryBits)
+                {
+                    // Every index whose low bits are this code.
+                    symbolEntry.bits = static_cast<unsigned char>(bits);
+                    for (size_t i = reversed; i < primarySize; i += (static_cast<size_t>(1) << bits))
+                    {
+                        entry[i] = symbolEntry;
+                    }
+                }
+                else
+                {
+                    const size_t prefix = reversed & (primarySize - 1);
+                    if (entry[prefix].op != OP_SUBTABLE)
+                    {
+                        TableEntry link;
+                        link.value = static_cast<unsigned short>(entry.size());
+                        link.bits = static_cast<unsigned char>(subtableBits);
+                        link.op = OP_SUBTABLE;
+                        entry[prefix] = link;
+                        entry.resize(entry.size() + subtableSize, invalid);
+                    }
+
+                    const size_t start = entry[prefix].value;
+                    const int rest = bits - primaryBits;
+                    symbolEntry.bits = static_cast<unsigned char>(rest);
+                    for (size_t i = (reversed >> primaryBits); i < subtableSize; i += (static_cast<size_t>(1) << rest))
+                    {
+                        entry[start + i] = symbolEntry;
+                    }
+                }
+            }
+        }
+
+        // The codes of blocks compressed with fixed Huffman codes, built once.
+        struct FixedTables
+        {
+            HuffmanTable litlen;
+            HuffmanTable distance;
+
+            FixedTables()
+            {
+                unsigned char lengths[288];
+                memset(lengths +   0, 8, 144);
+                memset(lengths + 144, 9, 112);
+                memset(lengths + 256, 7,  24);
+                memset(lengths + 280, 8,   8);
+                litlen.Build(lengths, 288, TABLE_LITLEN, LITLEN_TABLE_BITS);
+
+                memset(lengths, 5, 32);
+                distance.Build(lengths, 32, TABLE_DISTANCE, DISTANCE_TABLE_BITS);
+            }
+        };
+
+        const FixedTables& GetFixedTables()
+        {
+            static const FixedTables tables;
+            return tables;
+        }
+
+        unsigned Adler32(const unsigned char *data, size_t size)
+        {
+            // Taking the sums modulo 65521 every 5552 bytes keeps them
+            // from overflowing.
+            unsigned a = 1;
+            unsigned b = 0;
+#if PNG_HAVE_SSE2
+            // For each 16 bytes x[0..15], a grows by their sum and b by
+            // 16 times the old a plus the sum of (16-i) x[i].  The sums
+            // of bytes come from _mm_sad_epu8, the weighted sums from
+            // _mm_madd_epi16, and 'olderA' adds up a before each block.
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i weightHigh = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+            const __m128i weightLow  = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+            while (size >= 16)
+            {
+                const size_t blocks = std::min<size_t>(size / 16, 5552 / 16);
+                __m128i sumA = zero;
+                __m128i olderA = zero;
+                __m128i sumB = zero;
+                for (size_t k=0; k < blocks; ++k)
+                {
+                    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16*k));
+                    olderA = _mm_add_epi32(olderA, sumA);
+                    sumA = _mm_add_epi32(sumA, _mm_sad_epu8(x, zero));
+                    sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weightHigh));
+                    sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weightLow));
+                }
+
+                unsigned lanesA[4], lanesOlder[4], lanesB[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(lanesA), sumA);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(lanesOlder), olderA);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(lanesB), sumB);
+                const unsigned long long older =
+                    static_cast<unsigned long long>(lanesOlder[0]) + lanesOlder[2];
+                const unsigned long long newB =
+                    b + 16ULL * blocks * a + 16 * older +
+                    lanesB[0] + lanesB[1] + lanesB[2] + lanesB[3];
+                a = static_cast<unsigned>((a + static_cast<unsigned long long>(lanesA[0]) + lanesA[2]) % 65521);
+                b = static_cast<unsigned>(newB % 65521);
+                data += 16 * blocks;
+                size -= 16 * blocks;
+            }
+#endif
+            while (size > 0)
+            {
+                const size_t chunk = std::min<size_t>(size, 5552);
+                for (size_t i=0; i < chunk; ++i)
+                {
+                    a += data[i];
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+                data += chunk;
+                size -= chunk;
+            }
+            return (b << 16) | a;
+        }
+
+        unsigned GetBigEndian(const unsigned char *bytes)
+        {
+            return
+                (static_cast<unsigned>(bytes[0]) << 24) |
+                (static_cast<unsigned>(bytes[1]) << 16) |
+                (static_cast<unsigned>(bytes[2]) << 8) |
+                static_cast<unsigned>(bytes[3]);
+        }
+
+        void ThrowTruncated()
+        {
+            throw ImagerException("Deflate stream is truncated.");
+        }
+
+        void ThrowTooLong()
+        {
+            throw ImagerException("Deflate stream holds too much data.");
+        }
+
+        // Reads deflate's bit stream, least significant bit first.
+        // The inflater copies one into local variables for its inner
+        // loop, where the compiler can keep it in registers; as members
+        // they would have to be reloaded after every byte of output,
+        // since a store through an unsigned char pointer may change
+        // any other memory.
+        struct BitReader
+        {
+            const unsigned char *in;
+            const unsigned char *inEnd;
+
+            // Input bits not used yet, the next one in the lowest bit.
+            // Bits above 'bitCount' may hold input too, loaded ahead of
+            // time, but they are loaded again before being used.
+            unsigned long long bitBuffer;
+            int bitCount;
+            size_t padding;     // zero bytes added after the end of the input
+
+            // Loads input until at least 56 bits are buffered.  Where 8
+            // bytes of input remain this is one unaligned load; near the
+            // end the input is padded with zero bytes, which
+            // CheckTruncated notices if they are used.
+            void Refill()
+            {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+                if (inEnd - in >= 8)
+                {
+                    unsigned long long word;
+                    memcpy(&word, in, 8);
+                    bitBuffer |= word << bitCount;
+                    in += (63 - bitCount) >> 3;
+                    bitCount |= 56;
+                    return;
+                }
+#endif
+                while (bitCount <= 56)
+                {
+                    unsigned long long byte = 0;
+                    if (in < inEnd)
+                    {
+                        byte = *in++;
+                    }
+                    else
+                    {
+                        ++padding;
+                    }
+                    bitBuffer |= byte << bitCount;
+                    bitCount += 8;
+                }
+            }
+
+            // Takes up to 32 bits, which must be buffered already.
+            unsigned TakeBits(int count)
+            {
+                const unsigned value = static_cast<unsigned>(bitBuffer & ((1ULL << count) - 1));
+                bitBuffer >>= count;
+                bitCount -= count;
+                return value;
+            }
+
+            // Decodes one symbol with a HuffmanTable's entries.  Its
+            // code must be buffered already.
+            TableEntry Decode(const TableEntry *entry, int primaryBits)
+            {
+                TableEntry e = entry[bitBuffer & ((1U << primaryBits) - 1)];
+                if (e.op == OP_SUBTABLE)
+                {
+                    bitBuffer >>= primaryBits;
+                    bitCount -= primaryBits;
+                    e = entry[e.value + (bitBuffer & ((1U << e.bits) - 1))];
+                }
+                bitBuffer >>= e.bits;
+                bitCount -= e.bits;
+                return e;
+            }
+
+            TableEntry Decode(const HuffmanTable& table)
+            {
+                return Decode(&table.entry[0], table.primaryBits);
+            }
+
+            // Moves to the next byte boundary and gives back the whole
+            // bytes still buffered, for stored blocks and the checksum,
+            // which are read a byte at a time.
+            void ReturnBufferedBytes()
+            {
+                TakeBits(bitCount & 7);
+                const size_t buffered = static_cast<size_t>(bitCount >> 3);
+                if (padding > buffered)
+                {
+                    ThrowTruncated();
+                }
+                in -= buffered - padding;
+                bitBuffer = 0;
+                bitCount = 0;
+                padding = 0;
+            }
+
+            void CheckTruncated() const
+            {
+                if (8 * padding > static_cast<size_t>(bitCount))
+                {
+                    ThrowTruncated();
+                }
+            }
+        };
+
+        // Copies a match of 'length' bytes from 'distance' bytes back,
+        // which the caller has checked are within the output, and
+        // returns where the output continues.
+        inline unsigned char *CopyMatch(unsigned char *out, unsigned char *outEnd, size_t length, size_t distance)
+        {
+            const unsigned char *source = out - distance;
+            unsigned char * const stop = out + length;
+            if (static_cast<size_t>(outEnd - out) >= length + 8)
+            {
+                // With room to spare after the match, copy 8 bytes at a
+                // time, letting the last copy run past the end.
+                unsigned char *dest = out;
+                if (distance >= 8)
+                {
+                    do
+                    {
+                        memcpy(dest, source, 8);
+                        dest += 8;
+                        source += 8;
+                    }
+                    while (dest < stop);
+                }
+                else if (distance == 1)
+                {
+                    memset(dest, *source, length);
+                }
+                else
+                {
+                    // A pattern shorter than 8 bytes, such as a run of
+                    // identical pixels.  Once 8 bytes are written one at
+                    // a time, the pattern also repeats at a whole number
+                    // of patterns at least 8 bytes back.
+                    for (int i=0; i < 8; ++i)
+                    {
+                        dest[i] = source[i];
+                    }
+                    const size_t period = distance * ((7 + distance) / distance);
+                    dest += 8;
+                    source = dest - period;
+                    while (dest < stop)
+                    {
+                        memcpy(dest, source, 8);
+                        dest += 8;
+                        source += 8;
+                    }
+                }
+            }
+            else
+            {
+                for (size_t i=0; i < length; ++i)
+                {
+                    out[i] = source[i];
+                }
+            }
+            return stop;
+        }
+
+        class Inflater
+        {
+        public:
+            Inflater(const unsigned char *data, size_t size, unsigned char *_out, size_t outSize)
+                : outStart(_out)
+                , out(_out)
+                , outEnd(_out + outSize)
+            {
+                input.in = data;
+                input.inEnd = data + size;
+                input.bitBuffer = 0;
+                input.bitCount = 0;
+                input.padding = 0;
+            }
+
+            void Run();
+
+        private:
+            void StoredBlock();
+            void ReadDynamicTables();
+            void HuffmanBlock(const HuffmanTable& litlen, const HuffmanTable& distance);
+
+            BitReader input;
+            unsigned char * const outStart;
+            unsigned char *out;
+            unsigned char * const outEnd;
+
+            HuffmanTable litlenTable;
+            HuffmanTable distanceTable;
+            HuffmanTable codeLengthTable;
+        };
+
+        void Inflater::Run()
+        {
+            const unsigned char *in = input.in;
+            if (input.inEnd - in < 2)
+            {
+                ThrowTruncated();
+            }
+            const unsigned method = in[0];
+            const unsigned flags = in[1];
+            if ((method & 0x0F) != 8 || (method >> 4) > 7 || ((method << 8) | flags) % 31 != 0 || (flags & 0x20) != 0)
+            {
+                throw ImagerException("Invalid zlib header.");
+            }
+            input.in += 2;
+
+            bool final = false;
+            while (!final)
+            {
+                input.Refill();
+                final = (input.TakeBits(1) != 0);
+                switch (input.TakeBits(2))
+                {
+                case 0:
+                    StoredBlock();
+                    break;
+
+                case 1:
+                    HuffmanBlock(GetFixedTables().litlen, GetFixedTables().distance);
+                    break;
+
+                case 2:
+                    ReadDynamicTables();
+                    HuffmanBlock(litlenTable, distanceTable);
+                    break;
+
+                default:
+                    throw ImagerException("Invalid block type in deflate stream.");
+                }
+                input.CheckTruncated();
+            }
+
+            if (out != outEnd)
+            {
+                throw ImagerException("Deflate stream holds too little data.");
+            }
+
+            input.ReturnBufferedBytes();
+            if (input.inEnd - input.in < 4)
+            {
+                ThrowTruncated();
+            }
+            if (Adler32(outStart, outEnd - outStart) != GetBigEndian(input.in))
+            {
+                throw ImagerException("Zlib stream has the wrong Adler-32 checksum.");
+            }
+        }
+
+        void Inflater::StoredBlock()
+        {
+            input.ReturnBufferedBytes();
+            const unsigned char *in = input.in;
+            if (input.inEnd - in < 4)
+            {
+                ThrowTruncated();
+            }
+            const size_t length = in[0] | (in[1] << 8);
+            const size_t complement = in[2] | (in[3] << 8);
+            in += 4;
+            if (length != (~complement & 0xFFFF))
+            {
+                throw ImagerException("Invalid stored block in deflate stream.");
+            }
+            if (static_cast<size_t>(input.inEnd - in) < length)
+            {
+                ThrowTruncated();
+            }
+            if (static_cast<size_t>(outEnd - out) < length)
+            {
+                ThrowTooLong();
+            }
+            memcpy(out, in, length);
+            input.in = in + length;
+            out += length;
+        }
+
+        void Inflater::ReadDynamicTables()
+        {
+            input.Refill();
+            const size_t litlenCount = input.TakeBits(5) + 257;
+            const size_t distanceCount = input.TakeBits(5) + 1;
+            const size_t codeLengthCount = input.TakeBits(4) + 4;
+            if (litlenCount > 286 || distanceCount > 30)
+            {
+                throw ImagerException("Invalid block header in deflate stream.");
+            }
+
+            unsigned char codeLengthLengths[19];
+            memset(codeLengthLengths, 0, sizeof(codeLengthLengths));
+            for (size_t i=0; i < codeLengthCount; ++i)
+            {
+                if (input.bitCount < 3)
+                {
+                    input.Refill();
+                }
+                codeLengthLengths[CODE_LENGTH_ORDER[i]] = static_cast<unsigned char>(input.TakeBits(3));
+            }
+            codeLengthTable.Build(codeLengthLengths, 19, TABLE_CODE_LENGTH, CODE_LENGTH_TABLE_BITS);
+
+            // The code lengths of both codes run together, compressed
+            // with the code length code and repeat counts.
+            unsigned char lengths[286 + 30];
+            const size_t total = litlenCount + distanceCount;
+            size_t n = 0;
+            while (n < total)
+            {
+                // A code length code and its extra bits are at most 14 bits.
+                if (input.bitCount < 14)
+                {
+                    input.Refill();
+                }
+                const TableEntry e = input.Decode(codeLengthTable);
+                if (e.op != OP_LITERAL)
+                {
+                    throw ImagerException("Invalid code length in deflate stream.");
+                }
+                if (e.value < 16)
+                {
+                    lengths[n++] = static_cast<unsigned char>(e.value);
+                    continue;
+                }
+
+                unsigned char repeated = 0;
+                size_t repeat;
+                if (e.value == 16)
+                {
+                    if (n == 0)
+                    {
+                        throw ImagerException("Invalid code length in deflate stream.");
+                    }
+                    repeated = lengths[n - 1];
+                    repeat = 3 + input.TakeBits(2);
+                }
+                else if (e.value == 17)
+                {
+                    repeat = 3 + input.TakeBits(3);
+                }
+                else
+                {
+                    repeat = 11 + input.TakeBits(7);
+                }
+
+                if (repeat > total - n)
+                {
+                    throw ImagerException("Invalid code length in deflate stream.");
+                }
+                memset(lengths + n, repeated, repeat);
+                n += repeat;
+            }
+            input.CheckTruncated();
+
+            if (lengths[256] == 0)
+            {
+                throw ImagerException("Deflate block has no end code.");
+            }
+            litlenTable.Build(lengths, litlenCount, TABLE_LITLEN, LITLEN_TABLE_BITS);
+            distanceTable.Build(lengths + litlenCount, distanceCount, TABLE_DISTANCE, DISTANCE_TABLE_BITS);
+        }
+
+        void Inflater::HuffmanBlock(const HuffmanTable& litlen, const HuffmanTable& distance)
+        {
+            BitReader bits = input;
+            unsigned char *dest = out;
+            unsigned char * const start = outStart;
+            unsigned char * const end = outEnd;
+            const TableEntry * const litlenEntry = &litlen.entry[0];
+            const int litlenBits = litlen.primaryBits;
+            const TableEntry * const distanceEntry = &distance.entry[0];
+            const int distanceBits = distance.primaryBits;
+
+            for (;;)
+            {
+                bits.Refill();
+                TableEntry e = bits.Decode(litlenEntry, litlenBits);
+
+                // Most symbols are literals, and several fit in the
+                // buffered bits, so keep taking them while they do.
+                while (e.op == OP_LITERAL)
+                {
+                    if (dest == end)
+                    {
+                        ThrowTooLong();
+                    }
+                    *dest++ = static_cast<unsigned char>(e.value);
+                    if (bits.bitCount < MAX_CODE_BITS)
+                    {
+                        bits.Refill();
+                    }
+                    e = bits.Decode(litlenEntry, litlenBits);
+                }
+
+                if (e.op == OP_END)
+                {
+                    break;
+                }
+                if ((e.op & 0xF0) != OP_BASE)
+                {
+                    throw ImagerException("Invalid code in deflate stream.");
+                }
+
+                // The length's extra bits, the distance code, and its
+                // extra bits take at most 33 bits.
+                bits.Refill();
+                const size_t length = e.value + bits.TakeBits(e.op & 0x0F);
+                const TableEntry d = bits.Decode(distanceEntry, distanceBits);
+                if ((d.op & 0xF0) != OP_BASE)
+                {
+                    throw ImagerException("Invalid distance code in deflate stream.");
+                }
+                const size_t back = d.value + bits.TakeBits(d.op & 0x0F);
+                if (back > static_cast<size_t>(dest - start))
+                {
+                    throw ImagerException("Deflate stream refers back before its start.");
+                }
+                if (length > static_cast<size_t>(end - dest))
+                {
+                    ThrowTooLong();
+                }
+                dest = CopyMatch(dest, end, length, back);
+            }
+
+            input = bits;
+            out = dest;
+        }
+
+        // The scalar unfilters, for any pixel size.  Each starts at byte
+        // 'start' of the row, so it can finish what an SSE2 unfilter
+        // below could not do, or do the whole row from 0.
+
+        void UnfilterSub(unsigned char *row, size_t rowBytes, size_t bpp, size_t start)
+        {
+            for (size_t i = std::max(start, bpp); i < rowBytes; ++i)
+            {
+                row[i] = static_cast<unsigned char>(row[i] + row[i - bpp]);
+            }
+        }
+
+        void UnfilterUp(unsigned char *row, const unsigned char *previous, size_t rowBytes, size_t start)
+        {
+            for (size_t i = start; i < rowBytes; ++i)
+            {
+                row[i] = static_cast<unsigned char>(row[i] + previous[i]);
+            }
+        }
+
+        void UnfilterAverage(unsigned char *row, const unsigned char *previous, size_t rowBytes, size_t bpp, size_t start)
+        {
+            for (size_t i = start; i < bpp && i < rowBytes; ++i)
+            {
+                row[i] = static_cast<unsigned char>(row[i] + (previous[i] >> 1));
+            }
+            for (size_t i = std::max(start, bpp); i < rowBytes; ++i)
+            {
+                row[i] = static_cast<unsigned char>(row[i] + ((row[i - bpp] + previous[i]) >> 1));
+            }
+        }
+
+        void UnfilterPaeth(unsigned char *row, const unsigned char *previous, size_t rowBytes, size_t bpp, size_t start)
+        {
+            for (size_t i = start; i < bpp && i < rowBytes; ++i)
+            {
+                row[i] = static_cast<unsigned char>(row[i] + previous[i]);
+            }
+            for (size_t i = std::max(start, bpp); i < rowBytes; ++i)
+            {
+                const int a = row[i - bpp];
+                const int b = previous[i];
+                const int c = previous[i - bpp];
+                const int pa = abs(b - c);
+                const int pb = abs(a - c);
+                const int pc = abs(a + b - 2*c);
+                const int predictor = (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+                row[i] = static_cast<unsigned char>(row[i] + predictor);
+            }
+        }
+
+#if PNG_HAVE_SSE2
+        // The SSE2 unfilters.  Each pixel of a Sub, Average, or Paeth
+        // row depends on the one to its left, so rather than 16 bytes
+        // at once these do all the channels of a pixel at once, for 3
+        // and 4 byte pixels.  Pixels are always loaded as 4 bytes, as
+        // putting 3 bytes together costs more than the arithmetic; so
+        // with 3 byte pixels the last one is left to the scalar code.
+        // Each returns how far along the row it got.
+
+        inline __m128i LoadPixel(const unsigned char *p)
+        {
+            int value;
+            memcpy(&value, p, 4);
+            return _mm_cvtsi32_si128(value);
+        }
+
+        template <size_t BPP>
+        inline void StorePixel(unsigned char *p, __m128i pixel)
+        {
+            const unsigned value = static_cast<unsigned>(_mm_cvtsi128_si32(pixel));
+            for (size_t k=0; k < BPP; ++k)
+            {
+                p[k] = static_cast<unsigned char>(value >> (8 * k));
+            }
+        }
+
+        template <size_t BPP>
+        size_t UnfilterSubSse2(unsigned char *row, size_t rowBytes)
+        {
+            __m128i a = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 4 <= rowBytes; i += BPP)
+            {
+                a = _mm_add_epi8(a, LoadPixel(row + i));
+                StorePixel<BPP>(row + i, a);
+            }
+            return i;
+        }
+
+        size_t UnfilterUpSse2(unsigned char *row, const unsigned char *previous, size_t rowBytes)
+        {
+            size_t i = 0;
+            for (; i + 16 <= rowBytes; i += 16)
+            {
+                const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(previous + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), _mm_add_epi8(x, b));
+            }
+            return i;
+        }
+
+        template <size_t BPP>
+        size_t UnfilterAverageSse2(unsigned char *row, const unsigned char *previous, size_t rowBytes)
+        {
+            // _mm_avg_epu8 rounds up; taking away the low bit of a^b
+            // turns that into the rounding down PNG wants.
+            const __m128i one = _mm_set1_epi8(1);
+            __m128i a = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 4 <= rowBytes; i += BPP)
+            {
+                const __m128i b = LoadPixel(previous + i);
+                const __m128i average = _mm_sub_epi8(
+                    _mm_avg_epu8(a, b),
+                    _mm_and_si128(_mm_xor_si128(a, b), one));
+                a = _mm_add_epi8(LoadPixel(row + i), average);
+                StorePixel<BPP>(row + i, a);
+            }
+            return i;
+        }
+
+        inline __m128i AbsoluteValue16(__m128i x)
+        {
+            return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+        }
+
+        inline __m128i Select(__m128i condition, __m128i ifTrue, __m128i ifFalse)
+        {
+            return _mm_or_si128(_mm_and_si128(condition, ifTrue), _mm_andnot_si128(condition, ifFalse));
+        }
+
+        template <size_t BPP>
+        size_t UnfilterPaethSse2(unsigned char *row, const unsigned char *previous, size_t rowBytes)
+        {
+            // The channels are widened to 16 bits so the differences
+            // between them cannot overflow.
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i lowByte = _mm_set1_epi16(0x00FF);
+            __m128i a = zero;
+            __m128i c = zero;
+            size_t i = 0;
+            for (; i + 4 <= rowBytes; i += BPP)
+            {
+                const __m128i b = _mm_unpacklo_epi8(LoadPixel(previous + i), zero);
+                const __m128i x = _mm_unpacklo_epi8(LoadPixel(row + i), zero);
+
+                // With p = a + b - c: p - a = b - c, p - b = a - c,
+                // and p - c = (b - c) + (a - c).
+                const __m128i bc = _mm_sub_epi16(b, c);
+                const __m128i ac = _mm_sub_epi16(a, c);
+                const __m128i pa = AbsoluteValue16(bc);
+                const __m128i pb = AbsoluteValue16(ac);
+                const __m128i pc = AbsoluteValue16(_mm_add_epi16(bc, ac));
+                const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+                const __m128i predictor = Select(
+                    _mm_cmpeq_epi16(smallest, pa), a,
+                    Select(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+                a = _mm_and_si128(_mm_add_epi16(x, predictor), lowByte);
+                c = b;
+                StorePixel<BPP>(row + i, _mm_packus_epi16(a, a));
+            }
+            return i;
+        }
+#endif
+
+
+        // What the ancillary chunks say about turning samples into RGBA.
+        struct PngInfo
+        {
+            size_t pixelsWide;
+            size_t pixelsHigh;
+            unsigned bitDepth;
+            unsigned colorType;
+            unsigned channels;
+            bool interlaced;
+            size_t paletteSize;
+            unsigned char palette[4 * 256];     // RGBA of each palette index
+            bool keyDefined;                    // whether samples equal to the key are transparent
+            unsigned key[3];
+        };
+
+        // Returns sample 'index' of a row with samples under 8 bits.
+        inline unsigned SmallSample(const unsigned char *row, size_t index, unsigned bitDepth)
+        {
+            const size_t bit = index * bitDepth;
+            return (row[bit >> 3] >> (8 - bitDepth - (bit & 7))) & ((1U << bitDepth) - 1);
+        }
+
+        void ConvertRow(const unsigned char *row, unsigned char *rgba, const PngInfo& info)
+        {
+            const size_t n = info.pixelsWide;
+            const bool wide = (info.bitDepth == 16);
+            switch (info.colorType)
+            {
+            case 0:     // grey
+                for (size_t i=0; i < n; ++i)
+                {
+                    unsigned value;
+                    unsigned char grey;
+                    if (wide)
+                    {
+                        value = (row[2*i] << 8) | row[2*i + 1];
+                        grey = row[2*i];
+                    }
+                    else if (info.bitDepth == 8)
+                    {
+                        value = row[i];
+                        grey = row[i];
+                    }
+                    else
+                    {
+                        value = SmallSample(row, i, info.bitDepth);
+                        grey = static_cast<unsigned char>((value * 255) / ((1U << info.bitDepth) - 1));
+                    }
+                    rgba[4*i + 0] = rgba[4*i + 1] = rgba[4*i + 2] = grey;
+                    rgba[4*i + 3] = (info.keyDefined && value == info.key[0]) ? 0 : 255;
+                }
+                break;
+
+            case 2:     // RGB
+                for (size_t i=0; i < n; ++i)
+                {
+                    bool matches = info.keyDefined;
+                    for (int k=0; k < 3; ++k)
+                    {
+                        unsigned value;
+                        if (wide)
+                        {
+                            value = (row[6*i + 2*k] << 8) | row[6*i + 2*k + 1];
+                            rgba[4*i + k] = row[6*i + 2*k];
+                        }
+                        else
+                        {
+                            value = row[3*i + k];
+                            rgba[4*i + k] = row[3*i + k];
+                        }
+                        matches = matches && (value == info.key[k]);
+                    }
+                    rgba[4*i + 3] = matches ? 0 : 255;
+                }
+                break;
+
+            case 3:     // palette
+                for (size_t i=0; i < n; ++i)
+                {
+                    const unsigned index = (info.bitDepth == 8) ? row[i] : SmallSample(row, i, info.bitDepth);
+                    if (index >= info.paletteSize)
+                    {
+                        throw ImagerException("PNG pixel is outside the palette.");
+                    }
+                    memcpy(rgba + 4*i, info.palette + 4*index, 4);
+                }
+                break;
+
+            case 4:     // grey and alpha
+                for (size_t i=0; i < n; ++i)
+                {
+                    const unsigned char grey  = wide ? row[4*i + 0] : row[2*i + 0];
+                    const unsigned char alpha = wide ? row[4*i + 2] : row[2*i + 1];
+                    rgba[4*i + 0] = rgba[4*i + 1] = rgba[4*i + 2] = grey;
+                    rgba[4*i + 3] = alpha;
+                }
+                break;
+
+            case 6:     // RGBA
+                if (!wide)
+                {
+                    memcpy(rgba, row, 4*n);
+                }
+                else
+                {
+                    for (size_t i=0; i < 4*n; ++i)
+                    {
+                        rgba[i] = row[2*i];
+                    }
+                }
+                break;
+            }
+        }
+
+        void ReadHeader(const unsigned char *data, size_t length, PngInfo& info)
+        {
+            if (length != 13)
+            {
+                throw ImagerException("Invalid PNG header chunk.");
+            }
+            info.pixelsWide = GetBigEndian(data);
+            info.pixelsHigh = GetBigEndian(data + 4);
+            info.bitDepth = data[8];
+            info.colorType = data[9];
+            info.interlaced = (data[12] != 0);
+            if (info.pixelsWide == 0 || info.pixelsHigh == 0 ||
+                info.pixelsWide > 0x7FFFFFFF || info.pixelsHigh > 0x7FFFFFFF ||
+                data[10] != 0 || data[11] != 0 || data[12] > 1)
+            {
+                throw ImagerException("Invalid PNG header chunk.");
+            }
+
+            const unsigned depth = info.bitDepth;
+            const bool eightOrSixteen = (depth == 8 || depth == 16);
+            const bool upToEight = (depth == 1 || depth == 2 || depth == 4 || depth == 8);
+            bool valid = false;
+            switch (info.colorType)
+            {
+            case 0:  info.channels = 1;  valid = upToEight || depth == 16;  break;
+            case 2:  info.channels = 3;  valid = eightOrSixteen;            break;
+            case 3:  info.channels = 1;  valid = upToEight;                 break;
+            case 4:  info.channels = 2;  valid = eightOrSixteen;            break;
+            case 6:  info.channels = 4;  valid = eightOrSixteen;            break;
+            }
+            if (!valid)
+            {
+                throw ImagerException("Invalid PNG color type or bit depth.");
+            }
+        }
+
+        // Tables for taking the CRC 8 bytes at a time ("slicing by 8"):
+        // entry[k][n] is the CRC of byte n followed by k zero bytes.
+        struct CrcTable
+        {
+            unsigned entry[8][256];
+
+            CrcTable()
+            {
+                for (unsigned n=0; n < 256; ++n)
+                {
+                    unsigned c = n;
+                    for (int k=0; k < 8; ++k)
+                    {
+                        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+                    }
+                    entry[0][n] = c;
+                }
+                for (unsigned n=0; n < 256; ++n)
+                {
+                    for (int k=1; k < 8; ++k)
+                    {
+                        const unsigned c = entry[k - 1][n];
+                        entry[k][n] = entry[0][c & 0xFF] ^ (c >> 8);
+                    }
+                }
+            }
+        };
+
+        unsigned Crc32(const unsigned char *data, size_t size)
+        {
+            static const CrcTable table;
+            const unsigned (* const t)[256] = table.entry;
+            unsigned crc = 0xFFFFFFFFu;
+            for (; size >= 8; size -= 8, data += 8)
+            {
+                crc ^=
+                    static_cast<unsigned>(data[0]) |
+                    (static_cast<unsigned>(data[1]) << 8) |
+                    (static_cast<unsigned>(data[2]) << 16) |
+                    (static_cast<unsigned>(data[3]) << 24);
+                crc =
+                    t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF] ^
+                    t[5][(crc >> 16) & 0xFF] ^ t[4][crc >> 24] ^
+                    t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+            }
+            for (; size > 0; --size, ++data)
+            {
+                crc = t[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+    }
+
+
+    void InflateZlib(
+        const unsigned char *data,
+        size_t size,
+        unsigned char *out,
+        size_t outSize)
+    {
+        Inflater inflater(data, size, out, outSize);
+        inflater.Run();
+    }
+
+    void UnfilterScanline(
+        unsigned char *row,
+        const unsigned char *previous,
+        size_t rowBytes,
+        size_t bytesPerPixel,
+        int filterType)
+    {
+        // How much of the row the SSE2 code did.
+        size_t done = 0;
+
+        switch (filterType)
+        {
+        case 0:     // none
+            break;
+
+        case 1:     // sub
+#if PNG_HAVE_SSE2
+            if (bytesPerPixel == 4)
+            {
+                done = UnfilterSubSse2<4>(row, rowBytes);
+            }
+            else if (bytesPerPixel == 3)
+            {
+                done = UnfilterSubSse2<3>(row, rowBytes);
+            }
+#endif
+            UnfilterSub(row, rowBytes, bytesPerPixel, done);
+            break;
+
+        case 2:     // up
+#if PNG_HAVE_SSE2
+            done = UnfilterUpSse2(row, previous, rowBytes);
+#endif
+            UnfilterUp(row, previous, rowBytes, done);
+            break;
+
+        case 3:     // average
+#if PNG_HAVE_SSE2
+            if (bytesPerPixel == 4)
+            {
+                done = UnfilterAverageSse2<4>(row, previous, rowBytes);
+            }
+            else if (bytesPerPixel == 3)
+            {
+                done = UnfilterAverageSse2<3>(row, previous, rowBytes);
+            }
+#endif
+            UnfilterAverage(row, previous, rowBytes, bytesPerPixel, done);
+            break;
+
+        case 4:     // Paeth
+#if PNG_HAVE_SSE2
+            if (bytesPerPixel == 4)
+            {
+                done = UnfilterPaethSse2<4>(row, previous, rowBytes);
+            }
+            else if (bytesPerPixel == 3)
+            {
+                done = UnfilterPaethSse2<3>(row, previous, rowBytes);
+            }
+#endif
+            UnfilterPaeth(row, previous, rowBytes, bytesPerPixel, done);
+            break;
+
+        default:
+            throw ImagerException("Invalid PNG filter type.");
+        }
+    }
+
+    void DecodePng(
+        const unsigned char *file,
+        size_t size,
+        std::vector<unsigned char>& rgba,
+        size_t& pixelsWide,
+        size_t& pixelsHigh)
+    {
+        static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+        if (size < 8 || memcmp(file, signature, 8) != 0)
+        {
+            throw ImagerException("Not a PNG file.");
+        }
+
+        PngInfo info;
+        memset(&info, 0, sizeof(info));
+        bool haveHeader = false;
+        const unsigned char *firstData = NULL;     // the first IDAT chunk's data
+        size_t dataChunks = 0;
+        size_t dataBytes = 0;
+        size_t offset = 8;
+        for (;;)
+        {
+            if (size - offset < 12)
+            {
+                throw ImagerException("PNG file is truncated.");
+            }
+            const size_t length = GetBigEndian(file + offset);
+            if (length > size - offset - 12)
+            {
+                throw ImagerException("PNG file is truncated.");
+            }
+            const unsigned char *type = file + offset + 4;
+            const unsigned char *data = type + 4;
+            if (Crc32(type, length + 4) != GetBigEndian(data + length))
+            {
+                throw ImagerException("PNG chunk has the wrong CRC.");
+            }
+            offset += length + 12;
+
+            if (memcmp(type, "IHDR", 4) == 0)
+            {
+                ReadHeader(data, length, info);
+                haveHeader = true;
+            }
+            else if (!haveHeader)
+            {
+                throw ImagerException("PNG file does not start with a header chunk.");
+            }
+            else if (memcmp(type, "IDAT", 4) == 0)
+            {
+                if (dataChunks == 0)
+                {
+                    firstData = data;
+                }
+                ++dataChunks;
+                dataBytes += length;
+            }
+            else if (memcmp(type, "PLTE", 4) == 0)
+            {
+                info.paletteSize = length / 3;
+                if (length % 3 != 0 || info.paletteSize == 0 || info.paletteSize > 256)
+                {
+                    throw ImagerException("Invalid PNG palette.");
+                }
+                for (size_t i=0; i < info.paletteSize; ++i)
+                {
+                    memcpy(info.palette + 4*i, data + 3*i, 3);
+                    info.palette[4*i + 3] = 255;
+                }
+            }
+            else if (memcmp(type, "tRNS", 4) == 0)
+            {
+                if (info.colorType == 3)
+                {
+                    if (length > info.paletteSize)
+                    {
+                        throw ImagerException("PNG transparency chunk is longer than the palette.");
+                    }
+                    for (size_t i=0; i < length; ++i)
+                    {
+                        info.palette[4*i + 3] = data[i];
+                    }
+                }
+                else if ((info.colorType == 0 && length == 2) || (info.colorType == 2 && length == 6))
+                {
+                    info.keyDefined = true;
+                    for (size_t k=0; 2*k < length; ++k)
+                    {
+                        info.key[k] = (data[2*k] << 8) | data[2*k + 1];
+                    }
+                }
+                else
+                {
+                    throw ImagerException("Invalid PNG transparency chunk.");
+                }
+            }
+            else if (memcmp(type, "IEND", 4) == 0)
+            {
+                break;
+            }
+            else if ((type[0] & 0x20) == 0)
+            {
+                throw ImagerException("PNG file has an unknown critical chunk.");
+            }
+        }
+
+        if (info.colorType == 3 && info.paletteSize == 0)
+        {
+            throw ImagerException("PNG file has no palette.");
+        }
+        if (dataBytes == 0)
+        {
+            throw ImagerException("PNG file has no image data.");
+        }
+
+        if (info.interlaced)
+        {
+            unsigned decodedWide, decodedHigh;
+            const unsigned error = lodepng::decode(rgba, decodedWide, decodedHigh, file, size);
+            if (error != 0)
+            {
+                std::string message = "PNG decoder error: ";
+                message += lodepng_error_text(error);
+                throw ImagerException(message.c_str());
+            }
+            pixelsWide = decodedWide;
+            pixelsHigh = decodedHigh;
+            return;
+        }
+
+        // Each row is led by its filter type byte.
+        const size_t bitsPerPixel = info.channels * info.bitDepth;
+        const size_t rowBytes = (info.pixelsWide * bitsPerPixel + 7) / 8;
+        const size_t bytesPerPixel = std::max<size_t>(1, bitsPerPixel / 8);
+        std::vector<unsigned char> raw(info.pixelsHigh * (rowBytes + 1));
+        if (dataChunks == 1)
+        {
+            InflateZlib(firstData, dataBytes, &raw[0], raw.size());
+        }
+        else
+        {
+            // The compressed data is split across IDAT chunks, which
+            // are all known to be whole and in order.
+            std::vector<unsigned char> compressed;
+            compressed.reserve(dataBytes);
+            for (offset = 8; compressed.size() < dataBytes; )
+            {
+                const size_t length = GetBigEndian(file + offset);
+                const unsigned char *data = file + offset + 8;
+                if (memcmp(file + offset + 4, "IDAT", 4) == 0)
+                {
+                    compressed.insert(compressed.end(), data, data + length);
+                }
+                offset += length + 12;
+            }
+            InflateZlib(&compressed[0], compressed.size(), &raw[0], raw.size());
+        }
+
+        // Convert each row while it is still in the cache.
+        rgba.resize(4 * info.pixelsWide * info.pixelsHigh);
+        const std::vector<unsigned char> zeroRow(rowBytes, 0);
+        const unsigned char *previous = &zeroRow[0];
+        for (size_t j=0; j < info.pixelsHigh; ++j)
+        {
+            unsigned char *line = &raw[j * (rowBytes + 1)];
+            UnfilterScanline(line + 1, previous, rowBytes, bytesPerPixel, line[0]);
+            ConvertRow(line + 1, &rgba[4 * info.pixelsWide * j], info);
+            previous = line + 1;
+        }
+
+        pixelsWide = info.pixelsWide;
+        pixelsHigh = info.pixelsHigh;
+    }
+
+    void DecodePngFile(
+        const char *filename,
+        std::vector<unsigned char>& rgba,
+        size_t& pixelsWide,
+        size_t& pixelsHigh)
+    {
+        FILE *infile = fopen(filename, "rb");
+        if (infile == NULL)
+        {
+            throw ImagerException("Cannot open PNG file.");
+        }
+
+        std::vector<unsigned char> file;
+        unsigned char block[65536];
+        size_t count;
+        while ((count = fread(block, 1, sizeof(block), infile)) > 0)
+        {
+            file.insert(file.end(), block, block + count);
+        }
+        const bool failed = (ferror(infile) != 0);
+        fclose(infile);
+        if (failed || file.empty())
+        {
+            throw ImagerException("Cannot read PNG file.");
+        }
+
+        DecodePng(&file[0], file.size(), rgba, pixelsWide, pixelsHigh);
+    }
+}
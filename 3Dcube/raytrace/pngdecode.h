@@ -0,0 +1,60 @@
+/*
+    pngdecode.h
+
+    Decodes PNG files into RGBA bytes, giving the same pixels as
+    lodepng::decode, but faster.  LodePNG walks a Huffman tree one bit
+    at a time for every symbol it inflates; here each symbol is found by
+    one lookup of the next several bits in a table, with a second, small
+    table for the few long codes, and the bits come from a 64-bit buffer
+    refilled a word at a time.  Scanlines are unfiltered with SSE2 where
+    the processor has it, a pixel at a time for 3 and 4 byte pixels, and
+    each row is converted to RGBA as soon as it is unfiltered.
+
+    Interlaced images are rare enough that they are handed to LodePNG.
+*/
+
+#ifndef __DDC_PNGDECODE_H
+#define __DDC_PNGDECODE_H
+
+#include <vector>
+
+namespace Imager
+{
+    // Inflates the zlib stream (RFC 1950 and 1951) in 'data' into
+    // exactly 'outSize' bytes at 'out', and checks its Adler-32.
+    // Throws ImagerException if the stream is corrupt or does not hold
+    // exactly 'outSize' bytes.
+    void InflateZlib(
+        const unsigned char *data,
+        size_t size,
+        unsigned char *out,
+        size_t outSize);
+
+    // Undoes PNG filter 'filterType' (0 through 4) on the 'rowBytes'
+    // bytes of 'row', in place.  'previous' is the row above, already
+    // unfiltered, or all zeros for the top row.
+    void UnfilterScanline(
+        unsigned char *row,
+        const unsigned char *previous,
+        size_t rowBytes,
+        size_t bytesPerPixel,
+        int filterType);
+
+    // Decodes the PNG file held in 'file' into 4 bytes per pixel, row by
+    // row from the top.  Throws ImagerException if the file is invalid.
+    void DecodePng(
+        const unsigned char *file,
+        size_t size,
+        std::vector<unsigned char>& rgba,
+        size_t& pixelsWide,
+        size_t& pixelsHigh);
+
+    // Reads and decodes a PNG file as above.
+    void DecodePngFile(
+        const char *filename,
+        std::vector<unsigned char>& rgba,
+        size_t& pixelsWide,
+        size_t& pixelsHigh);
+}
+
+#endif // __DDC_PNGDECODE_H
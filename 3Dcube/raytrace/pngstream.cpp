@@ -0,0 +1,958 @@
+/*
+    pngstream.cpp
+
+    Implements the streaming deflate compressor and PNG encoder
+    declared in pngstream.h.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include "fdio.h"
+#include "imager.h"
+#include "pngstream.h"
+
+namespace Imager
+{
+    namespace
+    {
+        const size_t WINDOW_SIZE   = 32768;         // the most distant match deflate allows
+        const size_t WINDOW_MASK   = WINDOW_SIZE - 1;
+        const size_t WINDOW_BUFFER = 2 * WINDOW_SIZE;
+        const int    HASH_BITS     = 15;
+        const size_t MIN_MATCH     = 3;
+        const size_t MAX_MATCH     = 258;
+        const size_t MIN_LOOKAHEAD = MAX_MATCH + MIN_MATCH + 1;
+
+        // How hard to look for matches.  A match this long is taken
+        // without looking any further, and no more than this many
+        // earlier positions are tried for each.
+        const size_t NICE_MATCH    = 128;
+        const int    MAX_CHAIN     = 128;
+
+        // Symbols collected before a block is written with its own codes.
+        const size_t BLOCK_SYMBOLS = 32768;
+
+        // Compressed bytes collected before they are written as an IDAT chunk.
+        const size_t IDAT_BYTES    = 65536;
+
+        const unsigned LENGTH_BASE[29] =
+        {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+        };
+
+        const unsigned LENGTH_EXTRA[29] =
+        {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+
+        const unsigned DISTANCE_BASE[30] =
+        {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+            8193, 12289, 16385, 24577
+        };
+
+        const unsigned DISTANCE_EXTRA[30] =
+        {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+        };
+
+        // The order code length code lengths are sent in.
+        const unsigned CODE_LENGTH_ORDER[19] =
+        {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+        };
+
+        unsigned LengthCode(size_t length)
+        {
+            unsigned code = 0;
+            while (code < 28 && LENGTH_BASE[code + 1] <= length)
+            {
+                ++code;
+            }
+            return code;
+        }
+
+        unsigned DistanceCode(size_t distance)
+        {
+            unsigned code = 0;
+            while (code < 29 && DISTANCE_BASE[code + 1] <= distance)
+            {
+                ++code;
+            }
+            return code;
+        }
+
+        // Lookup tables for the two searches above, built once.
+        struct CodeTables
+        {
+            unsigned char lengthCode[MAX_MATCH + 1];
+            unsigned char distanceCode[512];    // by distance-1 up to 256, then by (distance-1) >> 7
+
+            CodeTables()
+            {
+                for (size_t length = MIN_MATCH; length <= MAX_MATCH; ++length)
+                {
+                    lengthCode[length] = static_cast<unsigned char>(LengthCode(length));
+                }
+                for (size_t d = 0; d < 256; ++d)
+                {
+                    distanceCode[d] = static_cast<unsigned char>(DistanceCode(d + 1));
+                }
+                for (size_t d = 256; d < 512; ++d)
+                {
+                    distanceCode[d] = static_cast<unsigned char>(DistanceCode(((d - 256) << 7) + 1));
+                }
+            }
+
+            unsigned Distance(size_t distance) const
+            {
+                return (distance <= 256) ?
+                    distanceCode[distance - 1] :
+                    distanceCode[256 + ((distance - 1) >> 7)];
+            }
+        };
+
+        const CodeTables& GetCodeTables()
+        {
+            static const CodeTables tables;
+            return tables;
+        }
+
+        struct SymbolCount
+        {
+            unsigned count;
+            unsigned symbol;
+
+            bool operator< (const SymbolCount& other) const
+            {
+                return (count != other.count) ? (count < other.count) : (symbol < other.symbol);
+            }
+        };
+
+        // Finds Huffman code lengths, no longer than 'maxBits', for the
+        // symbols with nonzero counts; the rest get length 0.  The code
+        // lengths of a minimum-redundancy code are found in place
+        // (Moffat and Katajainen), then the deepest codes are pulled up
+        // to 'maxBits' while keeping the code complete.
+        void BuildCodeLengths(const unsigned *count, size_t numSymbols, int maxBits, unsigned char *length)
+        {
+            std::vector<SymbolCount> used;
+            for (size_t s=0; s < numSymbols; ++s)
+            {
+                length[s] = 0;
+                if (count[s] > 0)
+                {
+                    SymbolCount sc;
+                    sc.count = count[s];
+                    sc.symbol = static_cast<unsigned>(s);
+                    used.push_back(sc);
+                }
+            }
+
+            const int n = static_cast<int>(used.size());
+            if (n == 0)
+            {
+                return;
+            }
+            if (n == 1)
+            {
+                length[used[0].symbol] = 1;
+                return;
+            }
+
+            std::sort(used.begin(), used.end());
+            std::vector<unsigned> A(n);
+            for (int k=0; k < n; ++k)
+            {
+                A[k] = used[k].count;
+            }
+
+            // Combine the two smallest weights repeatedly; internal
+            // nodes are left holding the index of their parent.
+            A[0] += A[1];
+            int root = 0;
+            int leaf = 2;
+            for (int next = 1; next < n-1; ++next)
+            {
+                if (leaf >= n || A[root] < A[leaf])
+                {
+                    A[next] = A[root];
+                    A[root++] = next;
+                }
+                else
+                {
+                    A[next] = A[leaf++];
+                }
+
+                if (leaf >= n || (root < next && A[root] < A[leaf]))
+                {
+                    A[next] += A[root];
+                    A[root++] = next;
+                }
+                else
+                {
+                    A[next] += A[leaf++];
+                }
+            }
+
+            // Turn parent indexes into internal node depths...
+            A[n-2] = 0;
+            for (int next = n-3; next >= 0; --next)
+            {
+                A[next] = A[A[next]] + 1;
+            }
+
+            // ...and those into leaf depths, deepest first.
+            int available = 1;
+            int usedNodes = 0;
+            unsigned depth = 0;
+            root = n-2;
+            int next = n-1;
+            while (available > 0)
+            {
+                while (root >= 0 && A[root] == depth)
+                {
+                    ++usedNodes;
+                    --root;
+                }
+                while (available > usedNodes)
+                {
+                    A[next--] = depth;
+                    --available;
+                }
+                available = 2 * usedNodes;
+                ++depth;
+                usedNodes = 0;
+            }
+
+            // Count codes of each length, folding the too-long ones into
+            // maxBits, then lengthen shorter codes until the code is
+            // complete again.
+            unsigned numCodes[33] = {0};
+            for (int k=0; k < n; ++k)
+            {
+                ++numCodes[std::min<unsigned>(A[k], 32)];
+            }
+            for (int bits = maxBits+1; bits <= 32; ++bits)
+            {
+                numCodes[maxBits] += numCodes[bits];
+                numCodes[bits] = 0;
+            }
+            unsigned long total = 0;
+            for (int bits = maxBits; bits > 0; --bits)
+            {
+                total += static_cast<unsigned long>(numCodes[bits]) << (maxBits - bits);
+            }
+            while (total != (1UL << maxBits))
+            {
+                --numCodes[maxBits];
+                for (int bits = maxBits-1; bits > 0; --bits)
+                {
+                    if (numCodes[bits] > 0)
+                    {
+                        --numCodes[bits];
+                        numCodes[bits+1] += 2;
+                        break;
+                    }
+                }
+                --total;
+            }
+
+            // The most frequent symbols get the shortest codes.
+            int k = n;
+            for (int bits = 1; bits <= maxBits; ++bits)
+            {
+                for (unsigned c = numCodes[bits]; c > 0; --c)
+                {
+                    length[used[--k].symbol] = static_cast<unsigned char>(bits);
+                }
+            }
+        }
+
+        // Assigns canonical Huffman codes for the given lengths, with
+        // their bits reversed because deflate sends codes starting from
+        // the most significant bit but packs bits from the least.
+        void BuildCodes(const unsigned char *length, size_t numSymbols, unsigned *code)
+        {
+            unsigned lengthCount[16] = {0};
+            for (size_t s=0; s < numSymbols; ++s)
+            {
+                ++lengthCount[length[s]];
+            }
+            lengthCount[0] = 0;
+
+            unsigned nextCode[16];
+            unsigned c = 0;
+            for (int bits = 1; bits < 16; ++bits)
+            {
+                c = (c + lengthCount[bits-1]) << 1;
+                nextCode[bits] = c;
+            }
+
+            for (size_t s=0; s < numSymbols; ++s)
+            {
+                const unsigned bits = length[s];
+                code[s] = 0;
+                if (bits > 0)
+                {
+                    unsigned value = nextCode[bits]++;
+                    unsigned reversed = 0;
+                    for (unsigned b=0; b < bits; ++b)
+                    {
+                        reversed = (reversed << 1) | (value & 1);
+                        value >>= 1;
+                    }
+                    code[s] = reversed;
+                }
+            }
+        }
+
+        struct CrcTable
+        {
+            unsigned entry[256];
+
+            CrcTable()
+            {
+                for (unsigned n=0; n < 256; ++n)
+                {
+                    unsigned c = n;
+                    for (int k=0; k < 8; ++k)
+                    {
+                        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+                    }
+                    entry[n] = c;
+                }
+            }
+        };
+
+        // The CRC-32 PNG chunks end with, continuing from 'crc'.
+        unsigned Crc32(unsigned crc, const unsigned char *data, size_t size)
+        {
+            static const CrcTable table;
+            crc = ~crc;
+            for (size_t i=0; i < size; ++i)
+            {
+                crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+
+        void PutBigEndian(unsigned char *bytes, unsigned value)
+        {
+            bytes[0] = static_cast<unsigned char>(value >> 24);
+            bytes[1] = static_cast<unsigned char>(value >> 16);
+            bytes[2] = static_cast<unsigned char>(value >> 8);
+            bytes[3] = static_cast<unsigned char>(value);
+        }
+    }
+
+
+    DeflateStream::DeflateStream()
+        : window(WINDOW_BUFFER)
+        , head(static_cast<size_t>(1) << HASH_BITS, -1)
+        , prev(WINDOW_SIZE, -1)
+        , pos(0)
+        , end(0)
+        , bitBuffer(0)
+        , bitCount(0)
+        , adlerA(1)
+        , adlerB(0)
+        , started(false)
+    {
+        symbolList.reserve(BLOCK_SYMBOLS);
+        memset(litlenCount, 0, sizeof(litlenCount));
+        memset(distanceCount, 0, sizeof(distanceCount));
+    }
+
+    void DeflateStream::Write(const unsigned char *data, size_t size, std::vector<unsigned char>& out)
+    {
+        if (!started)
+        {
+            // zlib header: deflate with a 32K window, default compression.
+            out.push_back(0x78);
+            out.push_back(0x9C);
+            started = true;
+        }
+
+        // The Adler-32 checksum of the uncompressed data, taking sums
+        // modulo 65521 often enough that they cannot overflow.
+        const unsigned char *p = data;
+        size_t left = size;
+        while (left > 0)
+        {
+            const size_t chunk = std::min<size_t>(left, 5552);
+            for (size_t i=0; i < chunk; ++i)
+            {
+                adlerA += p[i];
+                adlerB += adlerA;
+            }
+            adlerA %= 65521;
+            adlerB %= 65521;
+            p += chunk;
+            left -= chunk;
+        }
+
+        while (size > 0)
+        {
+            if (end == WINDOW_BUFFER)
+            {
+                Slide();
+            }
+            const size_t count = std::min(size, WINDOW_BUFFER - end);
+            memcpy(&window[end], data, count);
+            end += count;
+            data += count;
+            size -= count;
+            Compress(false, out);
+        }
+    }
+
+    void DeflateStream::Finish(std::vector<unsigned char>& out)
+    {
+        if (!started)
+        {
+            Write(NULL, 0, out);
+        }
+        Compress(true, out);
+        FlushBlock(true, out);
+        AlignToByte(out);
+
+        unsigned char adler[4];
+        PutBigEndian(adler, (adlerB << 16) | adlerA);
+        out.insert(out.end(), adler, adler + 4);
+    }
+
+    // Moves the upper half of the window down, once the lower half is
+    // further back than any match can reach.
+    void DeflateStream::Slide()
+    {
+        memmove(&window[0], &window[WINDOW_SIZE], WINDOW_SIZE);
+        pos -= WINDOW_SIZE;
+        end -= WINDOW_SIZE;
+
+        const int shift = static_cast<int>(WINDOW_SIZE);
+        for (std::vector<int>::iterator iter = head.begin(); iter != head.end(); ++iter)
+        {
+            *iter = (*iter >= shift) ? (*iter - shift) : -1;
+        }
+        for (std::vector<int>::iterator iter = prev.begin(); iter != prev.end(); ++iter)
+        {
+            *iter = (*iter >= shift) ? (*iter - shift) : -1;
+        }
+    }
+
+    inline unsigned DeflateStream::Hash(size_t p) const
+    {
+        const unsigned key = window[p] | (window[p+1] << 8) | (window[p+2] << 16);
+        return (key * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    inline void DeflateStream::Insert(size_t p)
+    {
+        if (p + MIN_MATCH <= end)
+        {
+            const unsigned h = Hash(p);
+            prev[p & WINDOW_MASK] = head[h];
+            head[h] = static_cast<int>(p);
+        }
+    }
+
+    // Returns the length of the longest earlier match for the bytes at
+    // 'p', and its distance, or 0 if there is none of MIN_MATCH bytes.
+    // Must be called before Insert(p).
+    size_t DeflateStream::LongestMatch(size_t p, size_t& distance) const
+    {
+        const size_t limit = std::min(MAX_MATCH, end - p);
+        if (limit < MIN_MATCH)
+        {
+            return 0;
+        }
+
+        const unsigned char *here = &window[p];
+        size_t best = MIN_MATCH - 1;
+        int candidate = head[Hash(p)];
+        for (int chain = MAX_CHAIN; candidate >= 0 && chain > 0; --chain)
+        {
+            const size_t c = static_cast<size_t>(candidate);
+            if (p - c > WINDOW_SIZE)
+            {
+                break;
+            }
+
+            const unsigned char *there = &window[c];
+            if (there[best] == here[best] && there[0] == here[0])
+            {
+                size_t length = 0;
+                while (length < limit && there[length] == here[length])
+                {
+                    ++length;
+                }
+                if (length > best)
+                {
+                    best = length;
+                    distance = p - c;
+                    if (length >= NICE_MATCH || length == limit)
+                    {
+                        break;
+                    }
+                }
+            }
+
+            // Chains only lead back; a later position means this slot
+            // was reused for a position more than 32K on.
+            const int next = prev[c & WINDOW_MASK];
+            if (next >= candidate)
+            {
+                break;
+            }
+            candidate = next;
+        }
+
+        return (best >= MIN_MATCH) ? best : 0;
+    }
+
+    void DeflateStream::Compress(bool flush, std::vector<unsigned char>& out)
+    {
+        // Without 'flush', keep enough bytes ahead to find the longest
+        // match and look one position further for a better one.
+        while (flush ? (pos < end) : (end - pos >= MIN_LOOKAHEAD))
+        {
+            size_t distance = 0;
+            size_t length = LongestMatch(pos, distance);
+            Insert(pos);
+
+            if (length > 0 && length < NICE_MATCH && pos + 1 < end)
+            {
+                // Lazy matching: if the next position starts a longer
+                // match, send this byte as a literal and take that one.
+                size_t nextDistance = 0;
+                const size_t nextLength = LongestMatch(pos + 1, nextDistance);
+                Insert(pos + 1);
+                size_t inserted = 2;    // positions from 'pos' already hashed
+                if (nextLength > length)
+                {
+                    AddLiteral(window[pos]);
+                    ++pos;
+                    length = nextLength;
+                    distance = nextDistance;
+                    inserted = 1;
+                }
+
+                AddMatch(length, distance);
+                for (size_t k = inserted; k < length; ++k)
+                {
+                    Insert(pos + k);
+                }
+                pos += length;
+            }
+            else if (length > 0)
+            {
+                AddMatch(length, distance);
+                for (size_t k=1; k < length; ++k)
+                {
+                    Insert(pos + k);
+                }
+                pos += length;
+            }
+            else
+            {
+                AddLiteral(window[pos]);
+                ++pos;
+            }
+
+            if (symbolList.size() >= BLOCK_SYMBOLS)
+            {
+                FlushBlock(false, out);
+            }
+        }
+    }
+
+    inline void DeflateStream::AddLiteral(unsigned char c)
+    {
+        Symbol symbol;
+        symbol.litlen = c;
+        symbol.distance = 0;
+        symbolList.push_back(symbol);
+        ++litlenCount[c];
+    }
+
+    inline void DeflateStream::AddMatch(size_t length, size_t distance)
+    {
+        const CodeTables& tables = GetCodeTables();
+        Symbol symbol;
+        symbol.litlen = static_cast<unsigned short>(length);
+        symbol.distance = static_cast<unsigned short>(distance);
+        symbolList.push_back(symbol);
+        ++litlenCount[257 + tables.lengthCode[length]];
+        ++distanceCount[tables.Distance(distance)];
+    }
+
+    inline void DeflateStream::PutBits(unsigned value, int count, std::vector<unsigned char>& out)
+    {
+        bitBuffer |= static_cast<unsigned long long>(value) << bitCount;
+        bitCount += count;
+        if (bitCount >= 32)
+        {
+            out.push_back(static_cast<unsigned char>(bitBuffer));
+            out.push_back(static_cast<unsigned char>(bitBuffer >> 8));
+            out.push_back(static_cast<unsigned char>(bitBuffer >> 16));
+            out.push_back(static_cast<unsigned char>(bitBuffer >> 24));
+            bitBuffer >>= 32;
+            bitCount -= 32;
+        }
+    }
+
+    void DeflateStream::AlignToByte(std::vector<unsigned char>& out)
+    {
+        while (bitCount > 0)
+        {
+            out.push_back(static_cast<unsigned char>(bitBuffer));
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+        bitBuffer = 0;
+        bitCount = 0;
+    }
+
+    // Writes the symbols collected so far as one block with Huffman
+    // codes made for them.
+    void DeflateStream::FlushBlock(bool final, std::vector<unsigned char>& out)
+    {
+        if (symbolList.empty())
+        {
+            if (final)
+            {
+                // An empty last block, with the fixed codes: the
+                // end-of-block code is 7 zero bits.
+                PutBits(1, 1, out);
+                PutBits(1, 2, out);
+                PutBits(0, 7, out);
+            }
+            return;
+        }
+
+        litlenCount[256] = 1;   // end of block
+
+        // Some decoders reject a distance code with fewer than two
+        // codes, so make sure there are two.
+        if (distanceCount[0] == 0)
+        {
+            distanceCount[0] = 1;
+        }
+        if (distanceCount[1] == 0)
+        {
+            distanceCount[1] = 1;
+        }
+
+        unsigned char litlenLength[286];
+        unsigned char distanceLength[30];
+        BuildCodeLengths(litlenCount, 286, 15, litlenLength);
+        BuildCodeLengths(distanceCount, 30, 15, distanceLength);
+
+        unsigned numLitlen = 286;
+        while (numLitlen > 257 && litlenLength[numLitlen-1] == 0)
+        {
+            --numLitlen;
+        }
+        unsigned numDistance = 30;
+        while (numDistance > 1 && distanceLength[numDistance-1] == 0)
+        {
+            --numDistance;
+        }
+
+        // Run-length encode both sets of lengths together with the
+        // code length alphabet: 16 repeats the last length 3-6 times,
+        // 17 and 18 give 3-10 and 11-138 zeros.
+        std::vector<unsigned char> lengthList(litlenLength, litlenLength + numLitlen);
+        lengthList.insert(lengthList.end(), distanceLength, distanceLength + numDistance);
+
+        std::vector<unsigned char> runSymbol;
+        std::vector<unsigned char> runExtra;
+        unsigned runCount[19] = {0};
+        for (size_t i=0; i < lengthList.size(); )
+        {
+            const unsigned char value = lengthList[i];
+            size_t run = 1;
+            while (i + run < lengthList.size() && lengthList[i + run] == value)
+            {
+                ++run;
+            }
+
+            if (value == 0 && run >= 3)
+            {
+                const size_t take = std::min<size_t>(run, 138);
+                runSymbol.push_back((take >= 11) ? 18 : 17);
+                runExtra.push_back(static_cast<unsigned char>((take >= 11) ? (take - 11) : (take - 3)));
+                ++runCount[runSymbol.back()];
+                i += take;
+            }
+            else if (value != 0 && run >= 4)
+            {
+                runSymbol.push_back(value);
+                runExtra.push_back(0);
+                ++runCount[value];
+                const size_t take = std::min<size_t>(run - 1, 6);
+                runSymbol.push_back(16);
+                runExtra.push_back(static_cast<unsigned char>(take - 3));
+                ++runCount[16];
+                i += 1 + take;
+            }
+            else
+            {
+                runSymbol.push_back(value);
+                runExtra.push_back(0);
+                ++runCount[value];
+                ++i;
+            }
+        }
+
+        // A code length code with only one code would be incomplete,
+        // which decoders reject.
+        size_t numRunSymbols = 0;
+        for (int s=0; s < 19; ++s)
+        {
+            if (runCount[s] > 0)
+            {
+                ++numRunSymbols;
+            }
+        }
+        if (numRunSymbols < 2)
+        {
+            ++runCount[(runCount[0] == 0) ? 0 : 1];
+        }
+
+        unsigned char runLength[19];
+        unsigned runCode[19];
+        BuildCodeLengths(runCount, 19, 7, runLength);
+        BuildCodes(runLength, 19, runCode);
+
+        unsigned numRunLengths = 19;
+        while (numRunLengths > 4 && runLength[CODE_LENGTH_ORDER[numRunLengths-1]] == 0)
+        {
+            --numRunLengths;
+        }
+
+        unsigned litlenCode[286];
+        unsigned distanceCode[30];
+        BuildCodes(litlenLength, 286, litlenCode);
+        BuildCodes(distanceLength, 30, distanceCode);
+
+        // Block header.
+        PutBits(final ? 1 : 0, 1, out);
+        PutBits(2, 2, out);     // dynamic Huffman codes
+        PutBits(numLitlen - 257, 5, out);
+        PutBits(numDistance - 1, 5, out);
+        PutBits(numRunLengths - 4, 4, out);
+        for (unsigned k=0; k < numRunLengths; ++k)
+        {
+            PutBits(runLength[CODE_LENGTH_ORDER[k]], 3, out);
+        }
+        static const int RUN_EXTRA_BITS[3] = { 2, 3, 7 };
+        for (size_t k=0; k < runSymbol.size(); ++k)
+        {
+            const unsigned s = runSymbol[k];
+            PutBits(runCode[s], runLength[s], out);
+            if (s >= 16)
+            {
+                PutBits(runExtra[k], RUN_EXTRA_BITS[s - 16], out);
+            }
+        }
+
+        // The symbols themselves.
+        const CodeTables& tables = GetCodeTables();
+        for (std::vector<Symbol>::const_iterator iter = symbolList.begin(); iter != symbolList.end(); ++iter)
+        {
+            if (iter->distance == 0)
+            {
+                PutBits(litlenCode[iter->litlen], litlenLength[iter->litlen], out);
+            }
+            else
+            {
+                const unsigned lcode = tables.lengthCode[iter->litlen];
+                PutBits(litlenCode[257 + lcode], litlenLength[257 + lcode], out);
+                PutBits(iter->litlen - LENGTH_BASE[lcode], LENGTH_EXTRA[lcode], out);
+
+                const unsigned dcode = tables.Distance(iter->distance);
+                PutBits(distanceCode[dcode], distanceLength[dcode], out);
+                PutBits(iter->distance - DISTANCE_BASE[dcode], DISTANCE_EXTRA[dcode], out);
+            }
+        }
+        PutBits(litlenCode[256], litlenLength[256], out);
+
+        symbolList.clear();
+        memset(litlenCount, 0, sizeof(litlenCount));
+        memset(distanceCount, 0, sizeof(distanceCount));
+    }
+
+
+    PngStreamEncoder::PngStreamEncoder(int _fd, size_t _pixelsWide, size_t _pixelsHigh, bool withAlpha)
+        : fd(_fd)
+        , pixelsWide(_pixelsWide)
+        , pixelsHigh(_pixelsHigh)
+        , bytesPerPixel(withAlpha ? 4 : 3)
+        , row(0)
+        , previous(_pixelsWide * (withAlpha ? 4 : 3), 0)
+        , current(_pixelsWide * (withAlpha ? 4 : 3))
+    {
+        if (pixelsWide == 0 || pixelsHigh == 0 ||
+            pixelsWide > 0x7FFFFFFF || pixelsHigh > 0x7FFFFFFF)
+        {
+            throw ImagerException("Invalid PNG image size.");
+        }
+
+        for (int type=0; type < 5; ++type)
+        {
+            attempt[type].resize(1 + current.size());
+            attempt[type][0] = static_cast<unsigned char>(type);
+        }
+        compressed.reserve(IDAT_BYTES + 1024);
+
+        static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+        if (!WriteAll(fd, signature, sizeof(signature)))
+        {
+            throw ImagerException("Cannot write PNG stream.");
+        }
+
+        unsigned char header[13];
+        PutBigEndian(header, static_cast<unsigned>(pixelsWide));
+        PutBigEndian(header + 4, static_cast<unsigned>(pixelsHigh));
+        header[8]  = 8;                     // bits per sample
+        header[9]  = withAlpha ? 6 : 2;     // RGBA or RGB
+        header[10] = 0;                     // deflate
+        header[11] = 0;                     // adaptive filtering
+        header[12] = 0;                     // not interlaced
+        WriteChunk("IHDR", header, sizeof(header));
+    }
+
+    void PngStreamEncoder::WriteRow(const unsigned char *rgba)
+    {
+        if (row >= pixelsHigh)
+        {
+            throw ImagerException("Too many rows written to PNG stream.");
+        }
+
+        if (bytesPerPixel == 4)
+        {
+            memcpy(&current[0], rgba, current.size());
+        }
+        else
+        {
+            for (size_t i=0; i < pixelsWide; ++i)
+            {
+                current[3*i + 0] = rgba[4*i + 0];
+                current[3*i + 1] = rgba[4*i + 1];
+                current[3*i + 2] = rgba[4*i + 2];
+            }
+        }
+
+        // Try all five filters and keep the one whose output has the
+        // smallest sum of magnitudes, sampling every third byte, as
+        // LodePNG does for its default heuristic.
+        const size_t n = current.size();
+        const size_t bpp = bytesPerPixel;
+        const unsigned char *x = &current[0];
+        const unsigned char *b = &previous[0];
+        unsigned char *none  = &attempt[0][1];
+        unsigned char *sub   = &attempt[1][1];
+        unsigned char *up    = &attempt[2][1];
+        unsigned char *avg   = &attempt[3][1];
+        unsigned char *paeth = &attempt[4][1];
+        for (size_t i=0; i < n; ++i)
+        {
+            const int a = (i >= bpp) ? x[i - bpp] : 0;
+            const int c = (i >= bpp) ? b[i - bpp] : 0;
+            const int p = a + b[i] - c;
+            const int pa = abs(p - a);
+            const int pb = abs(p - b[i]);
+            const int pc = abs(p - c);
+            const int predictor = (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b[i] : c);
+
+            none[i]  = x[i];
+            sub[i]   = static_cast<unsigned char>(x[i] - a);
+            up[i]    = static_cast<unsigned char>(x[i] - b[i]);
+            avg[i]   = static_cast<unsigned char>(x[i] - ((a + b[i]) >> 1));
+            paeth[i] = static_cast<unsigned char>(x[i] - predictor);
+        }
+
+        int bestType = 0;
+        size_t smallest = 0;
+        for (int type=0; type < 5; ++type)
+        {
+            const unsigned char *filtered = &attempt[type][1];
+            size_t sum = 0;
+            for (size_t i=0; i < n; i += 3)
+            {
+                if (type == 0)
+                {
+                    sum += filtered[i];
+                }
+                else
+                {
+                    const signed char s = static_cast<signed char>(filtered[i]);
+                    sum += (s < 0) ? -s : s;
+                }
+            }
+            if (type == 0 || sum < smallest)
+            {
+                bestType = type;
+                smallest = sum;
+            }
+        }
+
+        deflater.Write(&attempt[bestType][0], attempt[bestType].size(), compressed);
+        if (compressed.size() >= IDAT_BYTES)
+        {
+            WriteIdat();
+        }
+
+        previous.swap(current);
+        ++row;
+    }
+
+    void PngStreamEncoder::Finish()
+    {
+        if (row != pixelsHigh)
+        {
+            throw ImagerException("PNG stream is missing rows.");
+        }
+        deflater.Finish(compressed);
+        WriteIdat();
+        WriteChunk("IEND", NULL, 0);
+    }
+
+    void PngStreamEncoder::WriteIdat()
+    {
+        if (!compressed.empty())
+        {
+            WriteChunk("IDAT", &compressed[0], compressed.size());
+            compressed.clear();
+        }
+    }
+
+    void PngStreamEncoder::WriteChunk(const char *type, const unsigned char *data, size_t size)
+    {
+        unsigned char prefix[8];
+        PutBigEndian(prefix, static_cast<unsigned>(size));
+        memcpy(prefix + 4, type, 4);
+
+        unsigned crc = Crc32(0, prefix + 4, 4);
+        if (size > 0)
+        {
+            crc = Crc32(crc, data, size);
+        }
+        unsigned char suffix[4];
+        PutBigEndian(suffix, crc);
+
+        if (!WriteAll(fd, prefix, sizeof(prefix)) ||
+            (size > 0 && !WriteAll(fd, data, size)) ||
+            !WriteAll(fd, suffix, sizeof(suffix)))
+        {
+            throw ImagerException("Cannot write PNG stream.");
+        }
+    }
+}
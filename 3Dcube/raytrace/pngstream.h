@@ -0,0 +1,105 @@
+/*
+    pngstream.h
+
+    Encodes PNG images a row at a time, writing them to a file
+    descriptor as they go.  LodePNG wants the whole image in memory
+    and makes several more whole-image copies along the way (filtered
+    rows, deflated data, the finished file).  PngStreamEncoder instead
+    filters each row as it arrives, feeds it to a DeflateStream, and
+    writes IDAT chunks whenever enough compressed data has built up,
+    so its memory is a few rows plus the deflate window and one block
+    of pending symbols, whatever the size of the image.
+*/
+
+#ifndef __DDC_PNGSTREAM_H
+#define __DDC_PNGSTREAM_H
+
+#include <vector>
+
+namespace Imager
+{
+    // Compresses bytes into a zlib stream (RFC 1950 and 1951) as they
+    // arrive.  Matches are found by hash chains within a 32K window;
+    // every block uses Huffman codes built for its own symbols.
+    class DeflateStream
+    {
+    public:
+        DeflateStream();
+
+        // Compresses 'size' bytes, appending any output to 'out'.
+        void Write(const unsigned char *data, size_t size, std::vector<unsigned char>& out);
+
+        // Compresses whatever is left and ends the stream.
+        void Finish(std::vector<unsigned char>& out);
+
+    private:
+        struct Symbol
+        {
+            unsigned short litlen;      // a literal byte, or a match length
+            unsigned short distance;    // 0 for a literal
+        };
+
+        void Compress(bool flush, std::vector<unsigned char>& out);
+        void Slide();
+        unsigned Hash(size_t p) const;
+        void Insert(size_t p);
+        size_t LongestMatch(size_t p, size_t& distance) const;
+        void AddLiteral(unsigned char c);
+        void AddMatch(size_t length, size_t distance);
+        void FlushBlock(bool final, std::vector<unsigned char>& out);
+        void PutBits(unsigned value, int count, std::vector<unsigned char>& out);
+        void AlignToByte(std::vector<unsigned char>& out);
+
+        std::vector<unsigned char> window;  // the last 32K bytes seen, and those not compressed yet
+        std::vector<int> head;              // latest window position of each hash, or -1
+        std::vector<int> prev;              // earlier position with the same hash, by position mod 32K
+        size_t pos;                         // next window position to compress
+        size_t end;                         // window positions filled so far
+
+        std::vector<Symbol> symbolList;     // the current block
+        unsigned litlenCount[286];
+        unsigned distanceCount[30];
+
+        unsigned long long bitBuffer;
+        int bitCount;
+        unsigned adlerA;
+        unsigned adlerB;
+        bool started;
+    };
+
+    // Writes one PNG image to a file descriptor a row at a time.
+    // Throws ImagerException if writing fails.
+    class PngStreamEncoder
+    {
+    public:
+        // Writes the PNG signature and header to 'fd', which the caller
+        // keeps ownership of.  Rows are given as RGBA bytes; without
+        // 'withAlpha' the image is stored as RGB and the alpha bytes are
+        // ignored, which suits the always-opaque images Scene renders.
+        PngStreamEncoder(int _fd, size_t _pixelsWide, size_t _pixelsHigh, bool withAlpha);
+
+        // Adds the next row down, 4 bytes per pixel.
+        void WriteRow(const unsigned char *rgba);
+
+        // Writes the rest of the compressed data and the end chunk,
+        // after the last row.
+        void Finish();
+
+    private:
+        void WriteChunk(const char *type, const unsigned char *data, size_t size);
+        void WriteIdat();
+
+        const int fd;
+        const size_t pixelsWide;
+        const size_t pixelsHigh;
+        const size_t bytesPerPixel;
+        size_t row;
+        std::vector<unsigned char> previous;        // the row above, unfiltered
+        std::vector<unsigned char> current;         // this row, unfiltered
+        std::vector<unsigned char> attempt[5];      // this row with each filter, led by the filter type
+        std::vector<unsigned char> compressed;      // not yet written in an IDAT chunk
+        DeflateStream deflater;
+    };
+}
+
+#endif // __DDC_PNGSTREAM_H
@@ -28,14 +28,31 @@
     SolidObjects and LightSources that illuminate them.
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <fstream>
 #include <iostream>
 #include "imager.h"
+#include "fingerprint.h"
+#include "imagesink.h"
+#include "lights.h"
+#include "pixelorder.h"
 #include "../lodepng/lodepng.h"
 
 namespace Imager
 {
+    Scene::~Scene()
+    {
+        ClearSolidObjectList();
+
+        delete renderBuffer;
+        renderBuffer = NULL;
+
+        delete lightHierarchy;
+        lightHierarchy = NULL;
+    }
+
     // Empties out the solidObjectList and destroys/frees 
     // the SolidObjects that were in it.
     void Scene::ClearSolidObjectList()
@@ -50,37 +67,140 @@ namespace Imager
         solidObjectList.clear();
     }
 
-    // A limit to how deeply in recursion CalculateLighting may go
-    // before it gives up, so as to avoid call stack overflow.
-    const int MAX_OPTICAL_RECURSION_DEPTH = 20;
-
-    // A limit to how weak the red, green, or blue intensity of
-    // a light ray may be after recursive calls from multiple
-    // reflections and/or refractions before giving up.
-    // This intensity is deemed too weak to make a significant
-    // difference to the image.
-    const double MIN_OPTICAL_INTENSITY = 0.001;
+    // Stands in for the bound of a light hierarchy node whose box
+    // contains the point being lit, so that it is visited first.
+    const double UNBOUNDED_LIGHT = 1.0e+30;
 
-    inline bool IsSignificant(const Color& color)
+    inline bool Scene::IsSignificant(const Color& color) const
     {
+        const double minIntensity = renderLimits.minRayIntensity;
         return
-            (color.red   >= MIN_OPTICAL_INTENSITY) ||
-            (color.green >= MIN_OPTICAL_INTENSITY) ||
-            (color.blue  >= MIN_OPTICAL_INTENSITY);
+            (color.red   >= minIntensity) ||
+            (color.green >= minIntensity) ||
+            (color.blue  >= minIntensity);
+    }
+
+    // Charges a camera ray to a pixel that is about to be traced.
+    void Scene::StartPixelBudget(PixelBudget& budget) const
+    {
+        budget = PixelBudget();
+        budget.rays = 1;
+        ++renderStats.raysTraced;
+    }
+
+    // Decides which of the refracted and reflected rays a surface wants
+    // to trace the budget can pay for, and charges them to it.  With
+    // room for only one, the stronger ray takes on the intensity of
+    // both; with room for none, both are dropped, and their combined
+    // intensity is added to 'untracedIntensity', which the caller
+    // lights with the background color as if they had escaped.
+    void Scene::BudgetBranches(
+        PixelBudget& budget,
+        bool& traceRefraction,
+        Color& refractionIntensity,
+        bool& traceReflection,
+        Color& reflectionIntensity,
+        Color& untracedIntensity) const
+    {
+        const unsigned long numWanted = (traceRefraction ? 1 : 0) + (traceReflection ? 1 : 0);
+
+        unsigned long numAllowed = numWanted;
+        bool pixelLimited = false;
+        if (renderLimits.maxRaysPerPixel > 0)
+        {
+            const unsigned long left = (budget.rays < renderLimits.maxRaysPerPixel) ?
+                (renderLimits.maxRaysPerPixel - budget.rays) : 0;
+            if (left < numAllowed)
+            {
+                numAllowed = left;
+                pixelLimited = true;
+            }
+        }
+        if (renderLimits.maxRaysPerFrame > 0)
+        {
+            const unsigned long left = (renderStats.raysTraced < renderLimits.maxRaysPerFrame) ?
+                (renderLimits.maxRaysPerFrame - renderStats.raysTraced) : 0;
+            if (left < numAllowed)
+            {
+                numAllowed = left;
+                pixelLimited = false;
+            }
+        }
+
+        budget.rays += numAllowed;
+        renderStats.raysTraced += numAllowed;
+        if (numAllowed == numWanted)
+        {
+            return;
+        }
+
+        if (pixelLimited && !budget.overBudget)
+        {
+            budget.overBudget = true;
+            ++renderStats.pixelsOverBudget;
+        }
+        else if (!pixelLimited && !budget.overFrameBudget)
+        {
+            budget.overFrameBudget = true;
+            ++renderStats.pixelsOverFrameBudget;
+        }
+
+        if (numAllowed == 1)
+        {
+            // Both rays were wanted, so keep whichever is brighter.
+            ++renderStats.mergedRays;
+            const Color sum = refractionIntensity + reflectionIntensity;
+            if (BrightestComponent(refractionIntensity) >= BrightestComponent(reflectionIntensity))
+            {
+                refractionIntensity = sum;
+                traceReflection = false;
+            }
+            else
+            {
+                reflectionIntensity = sum;
+                traceRefraction = false;
+            }
+        }
+        else
+        {
+            renderStats.terminatedRays += numWanted;
+            if (traceRefraction)
+            {
+                untracedIntensity += refractionIntensity;
+            }
+            if (traceReflection)
+            {
+                untracedIntensity += reflectionIntensity;
+            }
+            traceRefraction = traceReflection = false;
+        }
+    }
+
+    // Find the direction of the reflected ray based on the incident ray 
+    // direction and the surface normal vector.  The reflected ray has
+    // the same angle with the normal vector as the incident ray, but
+    // on the opposite side of the cone centered at the normal vector
+    // that sweeps out the incident angle.
+    inline Vector ReflectedDirection(const Vector& incidentDir, const Vector& normal)
+    {
+        const double perp = 2.0 * DotProduct(incidentDir, normal);
+        return incidentDir - (perp * normal);
     }
 
     Color Scene::TraceRay(
         const Vector& vantage,
         const Vector& direction,
-        double refractiveIndex,
+        const MediumStack& media,
         Color rayIntensity,
         int recursionDepth) const
     {
         Intersection intersection;
+        size_t solidIndex;
         const int numClosest = FindClosestIntersection(
             vantage, 
             direction, 
-            intersection);
+            intersection,
+            solidIndex);
 
         switch (numClosest)
         {
@@ -95,8 +215,9 @@ namespace Imager
             // Determine the lighting using that single intersection.
             return CalculateLighting(
                 intersection,
+                solidIndex,
                 direction,
-                refractiveIndex,
+                media,
                 rayIntensity,
                 1 + recursionDepth);
 
@@ -109,13 +230,74 @@ namespace Imager
         }
     }
 
+    // Does the same job as TraceRay for a camera ray, but also records
+    // in 'hit' what the ray struck so that RelightImage can reuse it.
+    Color Scene::TraceRetainedPrimaryRay(
+        const Vector& vantage,
+        const Vector& direction,
+        const MediumStack& cameraMedia,
+        PrimaryHit& hit) const
+    {
+        const Color fullIntensity(1.0, 1.0, 1.0);
+
+        Intersection intersection;
+        size_t solidIndex;
+        const int numClosest = FindClosestIntersection(
+            vantage, 
+            direction, 
+            intersection,
+            solidIndex);
+
+        if (numClosest == 0)
+        {
+            hit.state = PRIMARY_MISS;
+            hit.solid = NULL;
+            return fullIntensity * backgroundColor;
+        }
+
+        if (numClosest > 1)
+        {
+            hit.state = PRIMARY_AMBIGUOUS;
+            hit.solid = NULL;
+            throw AmbiguousIntersectionException();
+        }
+
+        if (intersection.solid == NULL)
+        {
+            throw ImagerException("Undefined solid at intersection.");
+        }
+
+        hit.point = intersection.point;
+        hit.surfaceNormal = intersection.surfaceNormal;
+        hit.solid = intersection.solid;
+        hit.solidIndex = solidIndex;
+        hit.context = intersection.context;
+        hit.optics = intersection.solid->OpticsAt(
+            intersection.point, 
+            intersection.context,
+            hit.optics);
+        hit.state = PRIMARY_HIT;
+
+        // A camera ray has full intensity and recursion depth 1, so
+        // the stopping checks in CalculateLighting cannot apply.
+        return CalculateSurfaceLighting(
+            intersection,
+            solidIndex,
+            hit.optics,
+            direction,
+            cameraMedia,
+            fullIntensity,
+            1);
+    }
+
     // Determines the color of an intersection, 
     // based on illumination it receives via scattering,
     // glossy reflection, and refraction (lensing).
     Color Scene::CalculateLighting(
         const Intersection& intersection, 
+        size_t solidIndex,
         const Vector& direction, 
-        double refractiveIndex,
+        const MediumStack& media,
         Color rayIntensity,
         int recursionDepth) const
     {
@@ -137,7 +319,7 @@ namespace Imager
 
             Indent(cout, 1+recursionDepth);
             cout.precision(4);
-            cout << "refract=" << fixed << refractiveIndex;
+            cout << "refract=" << fixed << MediumRefractiveIndex(media);
             cout << ", intensity=" << rayIntensity << endl;
 
             Indent(cout, recursionDepth);
@@ -149,13 +331,21 @@ namespace Imager
         // The first is an absolute upper limit on recursion,
         // so as to avoid stack overflow crashes and to 
         // limit computation time due to recursive branching.
-        if (recursionDepth <= MAX_OPTICAL_RECURSION_DEPTH)
+        if (recursionDepth > renderLimits.maxRecursionDepth)
+        {
+            ++renderStats.depthCutoffs;
+        }
+        else
         {
             // The second limit is checking for the ray path
             // having been partially reflected/refracted until
             // it is too weak to matter significantly for
             // determining the associated pixel's color.
-            if (IsSignificant(rayIntensity))
+            if (!IsSignificant(rayIntensity))
+            {
+                ++renderStats.intensityCutoffs;
+            }
+            else
             {
                 if (intersection.solid == NULL)
                 {
@@ -168,101 +358,21 @@ namespace Imager
 
                 // Determine the optical properties at the specified
                 // point on whatever solid object the ray intersected with.
-                const Optics optics = solid.SurfaceOptics(
+                Optics scratch;
+                const Optics& optics = solid.OpticsAt(
                     intersection.point, 
-                    intersection.context
+                    intersection.context,
+                    scratch
                 );
 
-                // Opacity of a surface point is the fraction 0..1
-                // of the light ray available for matte and gloss.
-                // The remainder, transparency = 1-opacity, is
-                // available for refraction and refractive reflection.
-                const double opacity = optics.GetOpacity();
-                const double transparency = 1.0 - opacity;
-                if (opacity > 0.0)
-                {
-                    // This object is at least a little bit opaque,
-                    // so calculate the part of the color caused by
-                    // matte (scattered) reflection.
-                    const Color matteColor =
-                        opacity * 
-                        optics.GetMatteColor() *
-                        rayIntensity *
-                        CalculateMatte(intersection);
-
-                    colorSum += matteColor;
-
-#if RAYTRACE_DEBUG_POINTS
-                    if (activeDebugPoint)
-                    {
-                        using namespace std;
-
-                        Indent(cout, recursionDepth);
-                        cout << "matteColor=" << matteColor;
-                        cout << ", colorSum=" << colorSum;
-                        cout << endl;
-                    }
-#endif
-                }
-
-                double refractiveReflectionFactor = 0.0;
-                if (transparency > 0.0)
-                {
-                    // This object is at least a little bit transparent,
-                    // so calculate refraction of the ray passing through 
-                    // the point. The refraction calculation also tells us
-                    // how much reflection was caused by the interface 
-                    // between the current ray medium and the medium it
-                    // is now passing into.  This reflection factor will
-                    // be combined with glossy reflection to determine
-                    // total reflection below.
-                    // Note that only the 'transparent' part of the light
-                    // is available for refraction and refractive reflection.
-
-                    colorSum += CalculateRefraction(
-                        intersection, 
-                        direction,
-                        refractiveIndex,
-                        transparency * rayIntensity,
-                        recursionDepth,
-                        refractiveReflectionFactor  // output parameter
-                    );
-                }
-
-                // There are two sources of shiny reflection
-                // that need to be considered together:
-                // 1. Reflection caused by refraction.
-                // 2. The glossy part.
-
-                // The refractive part causes reflection of all
-                // colors equally.  Each color component is 
-                // diminished based on transparency (the part
-                // of the ray left available to refraction in 
-                // the first place).
-                Color reflectionColor (1.0, 1.0, 1.0);
-                reflectionColor *= transparency * refractiveReflectionFactor;
-
-                // Add in the glossy part of the reflection, which
-                // can be different for red, green, and blue.
-                // It is diminished to the part of the ray that
-                // was not available for refraction.
-                reflectionColor += opacity * optics.GetGlossColor();
-
-                // Multiply by the accumulated intensity of the 
-                // ray as it has traveled around the scene.
-                reflectionColor *= rayIntensity;
-
-                if (IsSignificant(reflectionColor))
-                {
-                    const Color matteColor = CalculateReflection(
-                        intersection,
-                        direction,
-                        refractiveIndex,
-                        reflectionColor,
-                        recursionDepth);
-
-                    colorSum += matteColor;
-                }
+                colorSum = CalculateSurfaceLighting(
+                    intersection,
+                    solidIndex,
+                    optics,
+                    direction,
+                    media,
+                    rayIntensity,
+                    recursionDepth);
             }
         }
 
@@ -280,11 +390,163 @@ namespace Imager
         return colorSum;
     }
 
+    // Determines the color of an intersection whose optical properties
+    // are already known.  This is the part of CalculateLighting that
+    // follows the recursion stopping checks, and it is also used to
+    // relight retained primary hits without tracing them again.
+    Color Scene::CalculateSurfaceLighting(
+        const Intersection& intersection, 
+        size_t solidIndex,
+        const Optics& optics,
+        const Vector& direction, 
+        const MediumStack& media,
+        Color rayIntensity,
+        int recursionDepth) const
+    {
+        Color colorSum(0.0, 0.0, 0.0);
+
+        // Opacity of a surface point is the fraction 0..1
+        // of the light ray available for matte and gloss.
+        // The remainder, transparency = 1-opacity, is
+        // available for refraction and refractive reflection.
+        const double opacity = optics.GetOpacity();
+        const double transparency = 1.0 - opacity;
+        if (opacity > 0.0)
+        {
+            // This object is at least a little bit opaque,
+            // so calculate the part of the color caused by
+            // matte (scattered) reflection.
+            const Color matteColor =
+                opacity * 
+                optics.GetMatteColor() *
+                rayIntensity *
+                CalculateMatte(intersection);
+
+            colorSum += matteColor;
+
+#if RAYTRACE_DEBUG_POINTS
+            if (activeDebugPoint)
+            {
+                using namespace std;
+
+                Indent(cout, recursionDepth);
+                cout << "matteColor=" << matteColor;
+                cout << ", colorSum=" << colorSum;
+                cout << endl;
+            }
+#endif
+        }
+
+        double refractiveReflectionFactor = 0.0;
+        bool traceRefraction = false;
+        Vector refractDir;
+        MediumStack refractMedia;
+        Color refractionIntensity;
+        if (transparency > 0.0)
+        {
+            // This object is at least a little bit transparent,
+            // so calculate refraction of the ray passing through 
+            // the point. The refraction calculation also tells us
+            // how much reflection was caused by the interface 
+            // between the current ray medium and the medium it
+            // is now passing into.  This reflection factor will
+            // be combined with glossy reflection to determine
+            // total reflection below.
+            // Note that only the 'transparent' part of the light
+            // is available for refraction and refractive reflection.
+            traceRefraction = RefractRay(
+                intersection, 
+                solidIndex,
+                direction,
+                media,
+                refractiveReflectionFactor,     // output parameter
+                refractDir,
+                refractMedia);
+
+            if (traceRefraction)
+            {
+                // Whatever fraction of the light is NOT reflected
+                // goes into refraction.  The incoming ray intensity
+                // is thus diminished by this fraction.
+                refractionIntensity = 
+                    (1.0 - refractiveReflectionFactor) * (transparency * rayIntensity);
+            }
+        }
+
+        // There are two sources of shiny reflection
+        // that need to be considered together:
+        // 1. Reflection caused by refraction.
+        // 2. The glossy part.
+
+        // The refractive part causes reflection of all
+        // colors equally.  Each color component is 
+        // diminished based on transparency (the part
+        // of the ray left available to refraction in 
+        // the first place).
+        Color reflectionColor (1.0, 1.0, 1.0);
+        reflectionColor *= transparency * refractiveReflectionFactor;
+
+        // Add in the glossy part of the reflection, which
+        // can be different for red, green, and blue.
+        // It is diminished to the part of the ray that
+        // was not available for refraction.
+        reflectionColor += opacity * optics.GetGlossColor();
+
+        // Multiply by the accumulated intensity of the 
+        // ray as it has traveled around the scene.
+        reflectionColor *= rayIntensity;
+        bool traceReflection = IsSignificant(reflectionColor);
+
+        // Trace only as many of the two rays as the budget allows.
+        Color untracedIntensity;
+        BudgetBranches(
+            recursiveBudget,
+            traceRefraction,
+            refractionIntensity,
+            traceReflection,
+            reflectionColor,
+            untracedIntensity);
+
+        if (traceRefraction)
+        {
+            // Follow the ray in the new direction from the intersection point.
+            colorSum += TraceRay(
+                intersection.point,
+                refractDir,
+                refractMedia,
+                refractionIntensity,
+                recursionDepth);
+        }
+
+        if (traceReflection)
+        {
+            const Color matteColor = CalculateReflection(
+                intersection,
+                direction,
+                media,
+                reflectionColor,
+                recursionDepth);
+
+            colorSum += matteColor;
+        }
+
+        // Rays the budget left out are counted as if they escaped
+        // to the background.
+        colorSum += untracedIntensity * backgroundColor;
+
+        return colorSum;
+    }
+
     // Determines the contribution of the illumination of a point
     // based on matte (scatter) reflection based on light incident
     // to a point on the surface of a solid object.
     Color Scene::CalculateMatte(const Intersection& intersection) const
     {
+        if (lightCulling)
+        {
+            return CalculateCulledMatte(intersection);
+        }
+
         // Start at the location where the camera ray hit 
         // a surface and trace toward all light sources.
         // Add up all the color components to create a 
@@ -296,41 +558,131 @@ namespace Imager
         LightSourceList::const_iterator end  = lightSourceList.end();
         for (; iter != end; ++iter)
         {
-            // Each time through the loop, 'source' 
-            // will refer to one of the light sources.
-            const LightSource& source = *iter;  
+            AddLightContribution(intersection, iter - lightSourceList.begin(), colorSum);
+        }
+
+        return colorSum;
+    }
 
+    // Adds the matte illumination that one light source gives
+    // the intersection point to 'colorSum'.
+    void Scene::AddLightContribution(
+        const Intersection& intersection,
+        size_t lightIndex,
+        Color& colorSum) const
+    {
+        const LightSource& source = lightSourceList[lightIndex];
+
+        // Calculate a direction vector from the intersection point 
+        // toward the light source point.
+        const Vector direction = source.location - intersection.point;
+
+        const double incidence = DotProduct(
+            intersection.surfaceNormal, 
+            direction.UnitVector()
+        );
+
+        // If the dot product of the surface normal vector and 
+        // the ray toward the light source is negative, it means 
+        // light is hitting the surface from the inside of the object.
+        // If the dot product is zero, it means the ray grazes
+        // the very edge of the object.  Only when the dot product
+        // is positive can this light source make the point brighter,
+        // so only then is it worth tracing a shadow ray.
+        if (incidence > 0.0)
+        {
             // See if we can draw a line from the intersection 
             // point toward the light source without hitting any surfaces.
-            if (HasClearLineOfSight(intersection.point, source.location))
+            if (HasClearLineOfSight(intersection.point, source.location, lightIndex))
             {
                 // Since there is nothing between this point on the object's 
                 // surface and the given light source, add this light source's 
                 // contribution based on the light's color, luminosity, 
                 // squared distance, and angle with the surface normal.
+                const double intensity = 
+                    incidence / direction.MagnitudeSquared();
 
-                // Calculate a direction vector from the intersection point 
-                // toward the light source point.
-                const Vector direction = source.location - intersection.point;
+                colorSum += intensity * source.color;
+            }
+        }
+    }
 
-                const double incidence = DotProduct(
-                    intersection.surfaceNormal, 
-                    direction.UnitVector()
-                );
+    // Does the same job as CalculateMatte, but visits the light sources
+    // in order of their unshadowed contribution using the light hierarchy,
+    // and skips lights too dim to matter without tracing shadow rays to
+    // them.  Because the final image is scaled by its brightest pixel,
+    // "too dim" is relative to the illumination already found at this
+    // point rather than an absolute level: a light is skipped when it
+    // could add less than the minRayIntensity of the render limits
+    // times that much.  A point that no light has reached yet keeps
+    // looking at them all.
+    //
+    // The hierarchy must already be built (see PrepareLights).
+    Color Scene::CalculateCulledMatte(const Intersection& intersection) const
+    {
+        Color colorSum(0.0, 0.0, 0.0);
+        if (lightSourceList.empty())
+        {
+            return colorSum;
+        }
+
+        const Vector& point = intersection.point;
+
+        // The candidates form a max-heap on their bounds, so once the
+        // top one is insignificant, every other one is too.  The heap
+        // is kept per thread so that its storage is reused from one
+        // point to the next.
+        static thread_local LightCandidateList heap;
+        heap.clear();
+        PushLightNode(heap, 0, point);
+
+        const double cutoff = renderLimits.minRayIntensity;
+        while (!heap.empty())
+        {
+            if (heap.front().bound < cutoff * BrightestComponent(colorSum))
+            {
+                break;
+            }
 
-                // If the dot product of the surface normal vector and 
-                // the ray toward the light source is negative, it means 
-                // light is hitting the surface from the inside of the object, 
-                // even though we thought we had a clear line of sight.  
-                // If the dot product is zero, it means the ray grazes
-                // the very edge of the object.  Only when the dot product
-                // is positive does this light source make the point brighter.
-                if (incidence > 0.0)
+            std::pop_heap(heap.begin(), heap.end());
+            const LightCandidate candidate = heap.back();
+            heap.pop_back();
+
+            if (candidate.isLight)
+            {
+                AddLightContribution(intersection, candidate.index, colorSum);
+            }
+            else
+            {
+                const BvhNode& node = lightHierarchy->Node(candidate.index);
+                if (node.count > 0)
                 {
-                    const double intensity = 
-                        incidence / direction.MagnitudeSquared();
+                    // Replace the leaf with its individual lights, each
+                    // bounded by its exact unshadowed contribution.
+                    for (uint32_t slot = node.offset; slot < node.offset + node.count; ++slot)
+                    {
+                        const size_t lightIndex = lightHierarchy->LightIndex(slot);
+                        const LightSource& source = lightSourceList[lightIndex];
+                        const Vector direction = source.location - point;
+                        const double incidence = DotProduct(
+                            intersection.surfaceNormal,
+                            direction.UnitVector());
+
+                        if (incidence > 0.0)
+                        {
+                            const double contribution =
+                                BrightestComponent(source.color) *
+                                incidence / direction.MagnitudeSquared();
 
-                    colorSum += intensity * source.color;
+                            heap.push_back(LightCandidate(contribution, lightIndex, true));
+                            std::push_heap(heap.begin(), heap.end());
+                        }
+                    }
+                }
+                else
+                {
+                    PushLightNode(heap, candidate.index + 1, point);
+                    PushLightNode(heap, node.offset, point);
                 }
             }
         }
@@ -338,39 +690,62 @@ namespace Imager
         return colorSum;
     }
 
+    void Scene::PushLightNode(
+        LightCandidateList& heap,
+        size_t nodeIndex,
+        const Vector& point) const
+    {
+        double bound = lightHierarchy->UpperBound(nodeIndex, point);
+        if (bound < 0.0)
+        {
+            bound = UNBOUNDED_LIGHT;
+        }
+        heap.push_back(LightCandidate(bound, nodeIndex, false));
+        std::push_heap(heap.begin(), heap.end());
+    }
+
+    void Scene::PrepareLights() const
+    {
+        if (lightHierarchyStale)
+        {
+            if (lightHierarchy == NULL)
+            {
+                lightHierarchy = new LightHierarchy;
+            }
+            lightHierarchy->Build(lightSourceList);
+            lightHierarchyStale = false;
+        }
+    }
+
 
     Color Scene::CalculateReflection(
         const Intersection& intersection, 
         const Vector& incidentDir, 
-        double refractiveIndex,
+        const MediumStack& media,
         Color rayIntensity,
         int recursionDepth) const
     {
-        // Find the direction of the reflected ray based on the incident ray 
-        // direction and the surface normal vector.  The reflected ray has
-        // the same angle with the normal vector as the incident ray, but
-        // on the opposite side of the cone centered at the normal vector
-        // that sweeps out the incident angle.
-        const Vector& normal = intersection.surfaceNormal;
-        const double perp = 2.0 * DotProduct(incidentDir, normal);
-        const Vector reflectDir = incidentDir - (perp * normal);
+        const Vector reflectDir = ReflectedDirection(
+            incidentDir, 
+            intersection.surfaceNormal);
 
         // Follow the ray in the new direction from the intersection point.
         return TraceRay(
             intersection.point,
             reflectDir,
-            refractiveIndex,
+            media,
             rayIntensity,
             recursionDepth);
     }
 
-    Color Scene::CalculateRefraction(
+    bool Scene::RefractRay(
         const Intersection& intersection, 
+        size_t solidIndex,
         const Vector& direction, 
-        double sourceRefractiveIndex,
-        Color rayIntensity,
-        int recursionDepth,
-        double& outReflectionFactor) const
+        const MediumStack& sourceMedia,
+        double& outReflectionFactor,
+        Vector& refractDir,
+        MediumStack& targetMedia) const
     {
         // Convert direction to a unit vector so that
         // relation between angle and dot product is simpler.
@@ -415,30 +790,75 @@ namespace Imager
             sin_a1 = sqrt(1.0 - cos_a1*cos_a1);
         }
 
-        // The parameter sourceRefractiveIndex passed to this function
-        // tells us the refractive index of the medium the light ray
-        // was passing through before striking this intersection.
+        // The parameter sourceMedia passed to this function lists the
+        // solids the light ray was inside of before striking this
+        // intersection, and so tells us the refractive index of the
+        // medium it was passing through.
         // We need to figure out what the target refractive index is,
         // i.e., the refractive index of whatever substance the ray 
-        // is about to pass into.  We determine this by pretending that
-        // the ray continues traveling in the same direction a tiny
-        // amount beyond the intersection point, then asking which
-        // solid object (if any) contains that test point.
-        // Ties are broken by insertion order: whichever solid was
-        // inserted into the scene first that contains a point is 
-        // considered the winner.  If a solid is found, its refractive
-        // index is used as the target refractive index; otherwise,
+        // is about to pass into.  A ray striking the surface against
+        // the normal vector is entering the solid it hit, so that solid
+        // joins the list; otherwise the ray is leaving it, so it is
+        // removed.  Ties are broken by insertion order: whichever solid
+        // was inserted into the scene first that contains the ray is
+        // considered the winner.  If the ray is inside no solid at all,
         // we use the scene's ambient refraction, which defaults to 
         // vacuum (but that can be overridden by a call to 
         // Scene::SetAmbientRefraction).
+        const double sourceRefractiveIndex = MediumRefractiveIndex(sourceMedia);
+
+        targetMedia = sourceMedia;
+        if (mediumTracking && targetMedia.valid)
+        {
+            size_t position = 0;
+            while (position < targetMedia.depth && targetMedia.solidIndex[position] != solidIndex)
+            {
+                ++position;
+            }
+
+            if (cos_a1 < 0.0)
+            {
+                // Entering a solid we are already inside of, or too
+                // many solids at once, means the list has lost track.
+                if (position < targetMedia.depth || targetMedia.depth == MediumStack::MAX_DEPTH)
+                {
+                    targetMedia.valid = false;
+                }
+                else
+                {
+                    targetMedia.solidIndex[targetMedia.depth++] = solidIndex;
+                }
+            }
+            else
+            {
+                // Likewise leaving a solid we were never inside of.
+                if (position == targetMedia.depth)
+                {
+                    targetMedia.valid = false;
+                }
+                else
+                {
+                    for (; position+1 < targetMedia.depth; ++position)
+                    {
+                        targetMedia.solidIndex[position] = targetMedia.solidIndex[position+1];
+                    }
+                    --targetMedia.depth;
+                }
+            }
+        }
+
+        if (!mediumTracking || !targetMedia.valid)
+        {
+            // Find the media the hard way, by pretending that the ray
+            // continues traveling in the same direction a tiny amount
+            // beyond the intersection point, then asking which solid
+            // objects contain that test point.
+            const double SMALL_SHIFT = 0.001;
+            const Vector testPoint = intersection.point + SMALL_SHIFT*dirUnit;
+            FindContainers(testPoint, targetMedia);
+        }
 
-        const double SMALL_SHIFT = 0.001;
-        const Vector testPoint = intersection.point + SMALL_SHIFT*dirUnit;
-        const SolidObject* container = PrimaryContainer(testPoint);
-        const double targetRefractiveIndex =
-            (container != NULL) ? 
-            container->GetRefractiveIndex() : 
-            ambientRefraction;
+        const double targetRefractiveIndex = MediumRefractiveIndex(targetMedia);
 
         const double ratio = sourceRefractiveIndex / targetRefractiveIndex;
 
@@ -455,7 +875,7 @@ namespace Imager
             // means that the ray experiences total internal reflection,
             // so that no refracted ray exists.
             outReflectionFactor = 1.0;      // complete reflection
-            return Color(0.0, 0.0, 0.0);    // no refraction at all
+            return false;
         }
 
         // Getting here means there is at least a little bit of
@@ -482,7 +902,6 @@ namespace Imager
         // than 90 degrees, so all valid dot products are 
         // positive numbers.
         double maxAlignment = -0.0001;  // any negative number works as a flag
-        Vector refractDir;
         for (int i=0; i < numSolutions; ++i)
         {
             Vector refractAttempt = dirUnit + k[i]*intersection.surfaceNormal;
@@ -533,20 +952,7 @@ namespace Imager
             cos_a1);
 
         outReflectionFactor = (Rs + Rp) / 2.0;
-
-        // Whatever fraction of the light is NOT reflected
-        // goes into refraction.  The incoming ray intensity
-        // is thus diminished by this fraction.
-        const Color nextRayIntensity = 
-            (1.0 - outReflectionFactor) * rayIntensity;
-
-        // Follow the ray in the new direction from the intersection point.
-        return TraceRay(
-            intersection.point,
-            refractDir,
-            targetRefractiveIndex,
-            nextRayIntensity,
-            recursionDepth);
+        return true;
     }
 
     double Scene::PolarizedReflection(
@@ -574,6 +980,53 @@ namespace Imager
         return reflection;
     }
 
+    namespace
+    {
+        // Finds the position in 'list' of the closest intersection and
+        // returns the number of intersections tied for first place,
+        // as described for PickClosestIntersection below.
+        int PickClosestIndex(
+            const IntersectionList& list, 
+            size_t& closestIndex)
+        {
+            const size_t count = list.size();
+            switch (count)
+            {
+            case 0:
+                return 0;
+
+            case 1:
+                closestIndex = 0;
+                return 1;
+
+            default:
+                // There are 2 or more intersections, so we need
+                // to find the closest one, and look for ties.
+                size_t closest = 0;
+                int tieCount = 1;
+                for (size_t index = 1; index < count; ++index)
+                {
+                    const double diff = list[index].distanceSquared - list[closest].distanceSquared;
+                    if (fabs(diff) < EPSILON)
+                    {
+                        // Within tolerance of the closest so far, 
+                        // so consider this a tie.
+                        ++tieCount;
+                    }
+                    else if (diff < 0.0)
+                    {
+                        // This new intersection is definitely closer 
+                        // to the vantage point.
+                        tieCount = 1;
+                        closest = index;
+                    }
+                }
+                closestIndex = closest;
+                return tieCount;
+            }
+        }
+    }
+
     int PickClosestIntersection(
         const IntersectionList& list, 
         Intersection& intersection)
@@ -582,54 +1035,16 @@ namespace Imager
         // the number of intersections tied for first place
         // in that contest.  This allows the caller to 
         // check for ambiguities in cases where that matters.
-
-        const size_t count = list.size();
-        switch (count)
+        // If there are none, we leave 'intersection' unmodified.
+        // The caller must check the return value to know to
+        // avoid using 'intersection'.
+        size_t closestIndex;
+        const int tieCount = PickClosestIndex(list, closestIndex);
+        if (tieCount > 0)
         {
-        case 0:
-            // No intersection is available.
-            // We leave 'intersection' unmodified.
-            // The caller must check the return value 
-            // to know to avoid using 'intersection'.
-            return 0;
-
-        case 1:
-            // There is exactly one intersection
-            // in the given direction, so there is 
-            // no need to think very hard; just use it!
-            intersection = list[0];
-            return 1;
-
-        default:
-            // There are 2 or more intersections, so we need
-            // to find the closest one, and look for ties.
-            IntersectionList::const_iterator iter = list.begin();
-            IntersectionList::const_iterator end  = list.end();
-            IntersectionList::const_iterator closest = iter;
-            int tieCount = 1;
-            for (++iter; iter != end; ++iter)
-            {
-                const double diff = iter->distanceSquared - closest->distanceSquared;
-                if (fabs(diff) < EPSILON)
-                {
-                    // Within tolerance of the closest so far, 
-                    // so consider this a tie.
-                    ++tieCount;
-                }
-                else if (diff < 0.0)
-                {
-                    // This new intersection is definitely closer 
-                    // to the vantage point.
-                    tieCount = 1;
-                    closest = iter;
-                }
-            }
-            intersection = *closest;
-
-            // The caller may need to know if there was an ambiguity,
-            // so report back the total number of closest intersections.
-            return tieCount;
+            intersection = list[closestIndex];
         }
+        return tieCount;
     }
 
     // Searches for an intersections with any solid in the scene from the
@@ -643,48 +1058,86 @@ namespace Imager
     // exactly at the corner of a cube could cause this function to
     // return 3).  If this function returns a value greater than zero,
     // it means the 'intersection' parameter has been filled in with the
-    // closest intersection (or one of the equally closest intersections).
+    // closest intersection (or one of the equally closest intersections),
+    // and 'solidIndex' with the position in solidObjectList of the solid
+    // it belongs to.
     int Scene::FindClosestIntersection(
         const Vector& vantage, 
         const Vector& direction, 
-        Intersection& intersection) const
+        Intersection& intersection,
+        size_t& solidIndex) const
     {
-        // Build a list of all intersections from all objects.
+        ++tracedRayCount;
+
+        // Build a list of all intersections from all objects,
+        // remembering which object each one came from.
         cachedIntersectionList.clear();     // empty any previous contents
-        SolidObjectList::const_iterator iter = solidObjectList.begin();
-        SolidObjectList::const_iterator end  = solidObjectList.end();
-        for (; iter != end; ++iter)
+        cachedSolidIndexList.clear();
+        const size_t numSolids = solidObjectList.size();
+        for (size_t index = 0; index < numSolids; ++index)
         {
-            const SolidObject& solid = *(*iter);
-            solid.AppendAllIntersections(
+            solidObjectList[index]->AppendAllIntersections(
                 vantage, 
                 direction, 
                 cachedIntersectionList);
+            cachedSolidIndexList.resize(cachedIntersectionList.size(), index);
+        }
+
+        size_t closestIndex;
+        const int tieCount = PickClosestIndex(cachedIntersectionList, closestIndex);
+        if (tieCount > 0)
+        {
+            intersection = cachedIntersectionList[closestIndex];
+            solidIndex = cachedSolidIndexList[closestIndex];
         }
-        return PickClosestIntersection(cachedIntersectionList, intersection);
+        return tieCount;
     }
 
 
     // Returns true if nothing blocks a line drawn between point1 and point2.
-    bool Scene::HasClearLineOfSight(
-        const Vector& point1, 
-        const Vector& point2) const
+    namespace
     {
-        // Subtract point2 from point1 to obtain the direction
-        // from point1 to point2, along with the square of
-        // the distance between the two points.
-        const Vector dir = point2 - point1;
-        const double gapDistanceSquared = dir.MagnitudeSquared();
-
-        // Iterate through all the solid objects in this scene.
-        SolidObjectList::const_iterator iter = solidObjectList.begin();
-        SolidObjectList::const_iterator end  = solidObjectList.end();
-        for (; iter != end; ++iter)
+        // The last solid found blocking a shadow ray toward each light,
+        // kept separately by every thread so that scenes rendered in
+        // parallel on different threads never share one.  The cache
+        // belongs to one scene at a time, identified by serial number;
+        // starting on another scene empties it.
+        struct OccluderCache
         {
-            // If any object blocks the line of sight, 
-            // we can return false immediately.
-            const SolidObject& solid = *(*iter);
+            unsigned long sceneSerialNumber;
+            std::vector<const SolidObject*> lastOccluder;   // indexed by light
+            ShadowRayStats stats;
+
+            OccluderCache()
+                : sceneSerialNumber(0)
+                , lastOccluder()
+                , stats()
+            {
+            }
+        };
+
+        thread_local OccluderCache occluderCache;
+
+        OccluderCache& OccluderCacheFor(unsigned long sceneSerialNumber)
+        {
+            OccluderCache& cache = occluderCache;
+            if (cache.sceneSerialNumber != sceneSerialNumber)
+            {
+                cache.sceneSerialNumber = sceneSerialNumber;
+                cache.lastOccluder.clear();
+                cache.stats = ShadowRayStats();
+            }
+            return cache;
+        }
 
+        // Returns true if 'solid' has a surface between point1 and
+        // point1 + dir, where gapDistanceSquared is the square of |dir|.
+        bool BlocksLineOfSight(
+            const SolidObject& solid,
+            const Vector& point1,
+            const Vector& dir,
+            double gapDistanceSquared)
+        {
             // Find the closest intersection from point1
             // in the direction toward point2.
             Intersection closest;
@@ -695,24 +1148,166 @@ namespace Imager
                 // If the closest intersection is farther away than
                 // point2, there is nothing on this object blocking
                 // the line of sight.
+                return closest.distanceSquared < gapDistanceSquared;
+            }
+            return false;
+        }
+    }
+
+    unsigned long Scene::NextSerialNumber()
+    {
+        static std::atomic<unsigned long> counter(0);
+        return ++counter;
+    }
+
+    ShadowRayStats Scene::GetShadowRayStats() const
+    {
+        return OccluderCacheFor(serialNumber).stats;
+    }
+
+    void Scene::ResetShadowRayStats() const
+    {
+        OccluderCacheFor(serialNumber).stats = ShadowRayStats();
+    }
+
+    // 'lightIndex' says which light source point2 belongs to,
+    // so that the solid which last blocked it can be tried first.
+    bool Scene::HasClearLineOfSight(
+        const Vector& point1, 
+        const Vector& point2,
+        size_t lightIndex) const
+    {
+        // Subtract point2 from point1 to obtain the direction
+        // from point1 to point2, along with the square of
+        // the distance between the two points.
+        const Vector dir = point2 - point1;
+        const double gapDistanceSquared = dir.MagnitudeSquared();
+
+        OccluderCache& cache = OccluderCacheFor(serialNumber);
+        ++cache.stats.shadowRays;
+
+        const SolidObject* cached = NULL;
+        if (occluderCaching)
+        {
+            if (lightIndex >= cache.lastOccluder.size())
+            {
+                cache.lastOccluder.resize(lightSourceList.size(), NULL);
+            }
 
-                if (closest.distanceSquared < gapDistanceSquared)
+            cached = cache.lastOccluder[lightIndex];
+            if (cached != NULL)
+            {
+                ++cache.stats.intersectionTests;
+                if (BlocksLineOfSight(*cached, point1, dir, gapDistanceSquared))
                 {
-                    // We found a surface that is definitely blocking
-                    // the line of sight.  No need to keep looking!
+                    ++cache.stats.blockedRays;
+                    ++cache.stats.occluderHits;
                     return false;
                 }
             }
         }
 
+        // Iterate through all the solid objects in this scene.
+        SolidObjectList::const_iterator iter = solidObjectList.begin();
+        SolidObjectList::const_iterator end  = solidObjectList.end();
+        for (; iter != end; ++iter)
+        {
+            // If any object blocks the line of sight, 
+            // we can return false immediately.
+            const SolidObject& solid = *(*iter);
+            if (&solid == cached)
+            {
+                continue;   // already tested above
+            }
+
+            ++cache.stats.intersectionTests;
+            if (BlocksLineOfSight(solid, point1, dir, gapDistanceSquared))
+            {
+                // We found a surface that is definitely blocking
+                // the line of sight.  No need to keep looking!
+                ++cache.stats.blockedRays;
+                if (occluderCaching)
+                {
+                    cache.lastOccluder[lightIndex] = &solid;
+                }
+                return false;
+            }
+        }
+
         // We would not find any solid object that blocks the line of sight.
         return true;  
     }
 
+    // Returns the oversampled image buffer for a render, reusing
+    // the one left over from the previous render when the
+    // dimensions have not changed.
+    ImageBuffer& Scene::PrepareRenderBuffer(
+        size_t pixelsWide,
+        size_t pixelsHigh) const
+    {
+        if ((renderBuffer == NULL) ||
+            (renderBuffer->GetPixelsWide() != pixelsWide) ||
+            (renderBuffer->GetPixelsHigh() != pixelsHigh))
+        {
+            delete renderBuffer;
+            renderBuffer = NULL;
+            renderBuffer = new ImageBuffer(pixelsWide, pixelsHigh, backgroundColor);
+        }
+        return *renderBuffer;
+    }
+
     // Generate an image of the scene and write it to the 
-    // specified output PNG file.
-    // outPngFileName is the name of the PNG file to write the image to.
-    // pixelsWide, pixelsHigh are the pixel dimensions of the output file.
+    // specified output file.
+    // outFileName is the name of the file to write the image to;
+    // its extension picks the format (see ImageFileFormatFromName).
+    // The remaining parameters are as described for RenderImage below.
+    void Scene::SaveImage(
+        const char *outFileName, 
+        size_t pixelsWide, 
+        size_t pixelsHigh, 
+        double zoom, 
+        size_t antiAliasFactor) const
+    {
+        ImageFileSink sink(outFileName);
+        SaveImage(sink, pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+    }
+
+    // Generate an image of the scene and hand it to 'sink'.
+    // The remaining parameters are as described for RenderImage below.
+    void Scene::SaveImage(
+        ImageSink& sink, 
+        size_t pixelsWide, 
+        size_t pixelsHigh, 
+        double zoom, 
+        size_t antiAliasFactor) const
+    {
+        // Keep the float image for this render if the sink wants it,
+        // even when float output is not enabled.
+        floatRequested = sink.WantsFloatRows();
+        try
+        {
+            RenderImage(pixelsWide, pixelsHigh, zoom, antiAliasFactor);
+        }
+        catch (...)
+        {
+            floatRequested = false;
+            throw;
+        }
+        floatRequested = false;
+
+        WriteImage(
+            sink, 
+            pixelsWide, 
+            pixelsHigh, 
+            &rgbaBuffer[0], 
+            sink.WantsFloatRows() ? &floatBuffer[0] : NULL);
+    }
+
+    // Generate an image of the scene as an array of RGBA bytes,
+    // 4 bytes per pixel, row by row from the top of the image.
+    // The returned buffer belongs to the scene and is overwritten
+    // by the next call to RenderImage or SaveImage.
+    // pixelsWide, pixelsHigh are the pixel dimensions of the image.
     // The zoom is a positive number that controls the magnification of
     // the image: smaller values magnify the image more (zoom in),
     // and larger values shrink all the scenery to fit more objects
@@ -721,8 +1316,7 @@ namespace Imager
     // to make smoother (less jagged) looking images.
     // Generally, antiAliasFactor should be between 1 (fastest, but jagged)
     // and 4 (16 times slower, but very smooth looking).
-    void Scene::SaveImage(
-        const char *outPngFileName, 
+    const std::vector<unsigned char>& Scene::RenderImage(
         size_t pixelsWide, 
         size_t pixelsHigh, 
         double zoom, 
@@ -735,7 +1329,8 @@ namespace Imager
             ((pixelsWide < pixelsHigh) ? pixelsWide : pixelsHigh);
 
         const double largeZoom  = antiAliasFactor * zoom * smallerDim;
-        ImageBuffer buffer(largePixelsWide, largePixelsHigh, backgroundColor);
+        ImageBuffer& buffer = PrepareRenderBuffer(largePixelsWide, largePixelsHigh);
+        PrepareLights();
 
         // The camera is located at the origin.
         Vector camera(0.0, 0.0, 0.0);
@@ -745,18 +1340,36 @@ namespace Imager
         // and the +y direction to be upward.
         Vector direction(0.0, 0.0, -1.0);
 
-        const Color fullIntensity(1.0, 1.0, 1.0);
+        // Every camera ray starts out inside the same solids.
+        MediumStack cameraMedia;
+        FindContainers(camera, cameraMedia);
 
         // We keep a list of (i,j) screen coordinates for pixels
         // we are not able to trace definitive rays for.
         // Later we will come back and fix these pixels.
         PixelList ambiguousPixelList;
 
-        for (size_t i=0; i < largePixelsWide; ++i)
+        renderStats = RenderStats();
+
+        // Any hits retained by an earlier render are about to be
+        // overwritten, so they are invalid until this one completes.
+        hasRetainedHits = false;
+        if (retainPrimaryHits)
         {
-            direction.x = (i - largePixelsWide/2.0) / largeZoom;
-            for (size_t j=0; j < largePixelsHigh; ++j)
+            primaryHitList.resize(largePixelsWide * largePixelsHigh);
+        }
+
+        if (wavefrontTracing)
+        {
+            RenderWavefront(buffer, largeZoom, cameraMedia, ambiguousPixelList);
+        }
+        else
+        {
+            PixelWalk walk(pixelOrder, largePixelsWide, largePixelsHigh);
+            size_t i, j;
+            while (walk.Next(i, j))
             {
+                direction.x = (i - largePixelsWide/2.0) / largeZoom;
                 direction.y = (largePixelsHigh/2.0 - j) / largeZoom;
 
 #if RAYTRACE_DEBUG_POINTS
@@ -783,30 +1396,14 @@ namespace Imager
 #endif
 
                 PixelData& pixel = buffer.Pixel(i,j);
-                try
-                {
-                    // Trace a ray from the camera toward the given direction
-                    // to figure out what color to assign to this pixel.
-                    pixel.color = TraceRay(
-                        camera,
-                        direction,
-                        ambientRefraction,
-                        fullIntensity,
-                        0);
-                }
-                catch (AmbiguousIntersectionException)
-                {
-                    // Getting here means that somewhere in the recursive 
-                    // code for tracing rays, there were multiple 
-                    // intersections that had minimum distance from a 
-                    // vantage point.  This can be really bad, 
-                    // for example causing a ray of light to reflect 
-                    // inward into a solid.
-
-                    // Mark the pixel as ambiguous, so that any other
-                    // ambiguous pixels nearby know not to use it.
-                    pixel.isAmbiguous = true;
+                TracePixel(
+                    pixel, 
+                    direction, 
+                    cameraMedia, 
+                    retainPrimaryHits ? &primaryHitList[j*largePixelsWide + i] : NULL);
 
+                if (pixel.isAmbiguous)
+                {
                     // Keep a list of all ambiguous pixel coordinates
                     // so that we can rapidly enumerate through them
                     // in the disambiguation pass.
@@ -820,6 +1417,668 @@ namespace Imager
         activeDebugPoint = NULL;
 #endif
 
+        if (retainPrimaryHits)
+        {
+            retainedPixelsWide = pixelsWide;
+            retainedPixelsHigh = pixelsHigh;
+            retainedZoom = zoom;
+            retainedAntiAliasFactor = antiAliasFactor;
+            hasRetainedHits = true;
+
+            Fingerprint solids;
+            hasRetainedSolids = AppendSolidsFingerprint(solids);
+            retainedSolids = solids.Value();
+        }
+
+        return FinishImage(
+            buffer, 
+            ambiguousPixelList, 
+            pixelsWide, 
+            pixelsHigh, 
+            antiAliasFactor);
+    }
+
+    // The side, in oversampled pixels, of the square tiles that
+    // wavefront tracing works through one at a time.  A tile's
+    // queues hold a few rays per pixel at most, so memory stays
+    // bounded no matter how large the image is.
+    const size_t WAVEFRONT_TILE_SIZE = 32;
+
+    // Renders the oversampled buffer a tile at a time, and each tile a
+    // generation of rays at a time: camera rays first, then the rays
+    // they reflect and refract, then the rays those give rise to, and
+    // so on.  Every ray adds what it finds, scaled by its intensity,
+    // to the pixel it came from, which is what the recursion in
+    // TraceRay adds up on the way back out.
+    void Scene::RenderWavefront(
+        ImageBuffer& buffer,
+        double largeZoom,
+        const MediumStack& cameraMedia,
+        PixelList& ambiguousPixelList) const
+    {
+        const size_t largePixelsWide = buffer.GetPixelsWide();
+        const size_t largePixelsHigh = buffer.GetPixelsHigh();
+        const Vector camera(0.0, 0.0, 0.0);
+
+        WavefrontQueue queue;
+        WavefrontQueue nextQueue[NUM_WAVEFRONT_RAY_TYPES];
+        WavefrontQueue scratch;
+        WavefrontHitList hitList;
+        pixelBudgetList.resize(largePixelsWide * largePixelsHigh);
+
+        for (size_t jTile=0; jTile < largePixelsHigh; jTile += WAVEFRONT_TILE_SIZE)
+        {
+            const size_t jEnd = std::min(jTile + WAVEFRONT_TILE_SIZE, largePixelsHigh);
+            for (size_t iTile=0; iTile < largePixelsWide; iTile += WAVEFRONT_TILE_SIZE)
+            {
+                const size_t iEnd = std::min(iTile + WAVEFRONT_TILE_SIZE, largePixelsWide);
+
+                // The camera rays of this tile are the first generation.
+                queue.clear();
+                for (size_t j=jTile; j < jEnd; ++j)
+                {
+                    for (size_t i=iTile; i < iEnd; ++i)
+                    {
+                        PixelData& pixel = buffer.Pixel(i,j);
+                        pixel.color = Color(0.0, 0.0, 0.0);
+                        pixel.isAmbiguous = false;
+
+                        WavefrontRay ray;
+                        ray.vantage = camera;
+                        ray.direction = Vector(
+                            (i - largePixelsWide/2.0) / largeZoom,
+                            (largePixelsHigh/2.0 - j) / largeZoom,
+                            -1.0);
+                        ray.intensity = Color(1.0, 1.0, 1.0);
+                        ray.media = cameraMedia;
+                        ray.pixel = &pixel;
+                        ray.pixelIndex = j*largePixelsWide + i;
+                        ray.depth = 1;
+                        queue.push_back(ray);
+                        StartPixelBudget(pixelBudgetList[ray.pixelIndex]);
+                    }
+                }
+
+                IntersectWavefront(queue, hitList);
+                if (retainPrimaryHits)
+                {
+                    RetainWavefrontHits(queue, hitList);
+                }
+                ShadeWavefront(queue, hitList, nextQueue);
+
+                // Keep going until no generation leaves anything
+                // behind.  Reflected and refracted rays are traced in
+                // separate batches, since rays of one kind tend to
+                // head the same way and strike the same solids.
+                bool pending = true;
+                while (pending)
+                {
+                    pending = false;
+                    for (int type=0; type < NUM_WAVEFRONT_RAY_TYPES; ++type)
+                    {
+                        if (!nextQueue[type].empty())
+                        {
+                            queue.swap(nextQueue[type]);
+                            nextQueue[type].clear();
+                            if (reorderBatchSize > 0)
+                            {
+                                ReorderWavefront(queue, scratch);
+                            }
+                            IntersectWavefront(queue, hitList);
+                            ShadeWavefront(queue, hitList, nextQueue);
+                            pending = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Gather the ambiguous pixels in the same order the recursive
+        // renderer finds them.
+        for (size_t i=0; i < largePixelsWide; ++i)
+        {
+            for (size_t j=0; j < largePixelsHigh; ++j)
+            {
+                if (buffer.Pixel(i,j).isAmbiguous)
+                {
+                    ambiguousPixelList.push_back(PixelCoordinates(i, j));
+                }
+            }
+        }
+    }
+
+    // Finds the closest intersection of every ray in the queue.
+    void Scene::IntersectWavefront(
+        const WavefrontQueue& queue,
+        WavefrontHitList& hitList) const
+    {
+        hitList.resize(queue.size());
+        for (size_t k=0; k < queue.size(); ++k)
+        {
+            WavefrontHit& hit = hitList[k];
+            hit.numClosest = FindClosestIntersection(
+                queue[k].vantage,
+                queue[k].direction,
+                hit.intersection,
+                hit.solidIndex);
+        }
+    }
+
+    // Does for each ray in the queue what TraceRay and
+    // CalculateSurfaceLighting do for one ray, except that the
+    // reflected and refracted rays are queued for the next
+    // generation instead of being traced right away.
+    void Scene::ShadeWavefront(
+        const WavefrontQueue& queue,
+        const WavefrontHitList& hitList,
+        WavefrontQueue nextQueue[NUM_WAVEFRONT_RAY_TYPES]) const
+    {
+        for (size_t k=0; k < queue.size(); ++k)
+        {
+            const WavefrontRay& ray = queue[k];
+            const WavefrontHit& hit = hitList[k];
+            PixelData& pixel = *ray.pixel;
+
+            // An ambiguous pixel will be airbrushed over later,
+            // so nothing more that its rays find matters.
+            if (pixel.isAmbiguous)
+            {
+                continue;
+            }
+
+            if (hit.numClosest == 0)
+            {
+                pixel.color += ray.intensity * backgroundColor;
+                continue;
+            }
+
+            if (hit.numClosest > 1)
+            {
+                pixel.isAmbiguous = true;
+                continue;
+            }
+
+            // The same stopping conditions as CalculateLighting.
+            if (ray.depth > renderLimits.maxRecursionDepth)
+            {
+                ++renderStats.depthCutoffs;
+                continue;
+            }
+            if (!IsSignificant(ray.intensity))
+            {
+                ++renderStats.intensityCutoffs;
+                continue;
+            }
+
+            const Intersection& intersection = hit.intersection;
+            if (intersection.solid == NULL)
+            {
+                throw ImagerException("Undefined solid at intersection.");
+            }
+
+            Optics scratch;
+            const Optics& optics = intersection.solid->OpticsAt(
+                intersection.point, 
+                intersection.context,
+                scratch);
+
+            const double opacity = optics.GetOpacity();
+            const double transparency = 1.0 - opacity;
+            if (opacity > 0.0)
+            {
+                pixel.color +=
+                    opacity * 
+                    optics.GetMatteColor() *
+                    ray.intensity *
+                    CalculateMatte(intersection);
+            }
+
+            double refractiveReflectionFactor = 0.0;
+            bool traceRefraction = false;
+            WavefrontRay refracted;
+            if (transparency > 0.0)
+            {
+                traceRefraction = RefractRay(
+                    intersection,
+                    hit.solidIndex,
+                    ray.direction,
+                    ray.media,
+                    refractiveReflectionFactor,
+                    refracted.direction,
+                    refracted.media);
+
+                if (traceRefraction)
+                {
+                    refracted.intensity = 
+                        (1.0 - refractiveReflectionFactor) * (transparency * ray.intensity);
+                }
+            }
+
+            Color reflectionColor (1.0, 1.0, 1.0);
+            reflectionColor *= transparency * refractiveReflectionFactor;
+            reflectionColor += opacity * optics.GetGlossColor();
+            reflectionColor *= ray.intensity;
+            bool traceReflection = IsSignificant(reflectionColor);
+
+            Color untracedIntensity;
+            BudgetBranches(
+                pixelBudgetList[ray.pixelIndex],
+                traceRefraction,
+                refracted.intensity,
+                traceReflection,
+                reflectionColor,
+                untracedIntensity);
+
+            if (traceRefraction)
+            {
+                refracted.vantage = intersection.point;
+                refracted.pixel = ray.pixel;
+                refracted.pixelIndex = ray.pixelIndex;
+                refracted.depth = 1 + ray.depth;
+                nextQueue[WAVEFRONT_REFRACTION].push_back(refracted);
+            }
+
+            if (traceReflection)
+            {
+                WavefrontRay reflected;
+                reflected.vantage = intersection.point;
+                reflected.direction = ReflectedDirection(
+                    ray.direction, 
+                    intersection.surfaceNormal);
+                reflected.intensity = reflectionColor;
+                reflected.media = ray.media;
+                reflected.pixel = ray.pixel;
+                reflected.pixelIndex = ray.pixelIndex;
+                reflected.depth = 1 + ray.depth;
+                nextQueue[WAVEFRONT_REFLECTION].push_back(reflected);
+            }
+
+            pixel.color += untracedIntensity * backgroundColor;
+        }
+    }
+
+    // Traces the camera ray for one oversampled pixel, in 'direction'
+    // from the camera at the origin, and stores its color in 'pixel'.
+    // If 'retainedHit' is not NULL, what the ray struck is kept there.
+    void Scene::TracePixel(
+        PixelData& pixel,
+        const Vector& direction,
+        const MediumStack& cameraMedia,
+        PrimaryHit* retainedHit) const
+    {
+        const Vector camera(0.0, 0.0, 0.0);
+        const Color fullIntensity(1.0, 1.0, 1.0);
+
+        StartPixelBudget(recursiveBudget);
+        try
+        {
+            // Trace a ray from the camera toward the given direction
+            // to figure out what color to assign to this pixel.
+            if (retainedHit != NULL)
+            {
+                pixel.color = TraceRetainedPrimaryRay(
+                    camera,
+                    direction,
+                    cameraMedia,
+                    *retainedHit);
+            }
+            else
+            {
+                pixel.color = TraceRay(
+                    camera,
+                    direction,
+                    cameraMedia,
+                    fullIntensity,
+                    0);
+            }
+
+            // Clear any flag left over from a previous render.
+            pixel.isAmbiguous = false;
+        }
+        catch (AmbiguousIntersectionException)
+        {
+            // Getting here means that somewhere in the recursive 
+            // code for tracing rays, there were multiple 
+            // intersections that had minimum distance from a 
+            // vantage point.  This can be really bad, 
+            // for example causing a ray of light to reflect 
+            // inward into a solid.
+
+            // Mark the pixel as ambiguous, so that any other
+            // ambiguous pixels nearby know not to use it.
+            pixel.isAmbiguous = true;
+        }
+    }
+
+    // Traces one rectangle of the oversampled image that RenderImage
+    // would trace for the same arguments, into 'tile', whose size is
+    // the size of the rectangle.  Its upper left pixel is pixel
+    // (iFirst, jFirst) of the whole oversampled image.  Ambiguous
+    // pixels are only marked, since healing them needs their
+    // neighbors in other tiles; FinishTiledImage does that once the
+    // tiles have been put together.
+    void Scene::RenderTile(
+        size_t pixelsWide, 
+        size_t pixelsHigh, 
+        double zoom, 
+        size_t antiAliasFactor,
+        size_t iFirst,
+        size_t jFirst,
+        ImageBuffer& tile) const
+    {
+        const size_t largePixelsWide = antiAliasFactor * pixelsWide;
+        const size_t largePixelsHigh = antiAliasFactor * pixelsHigh;
+        const size_t smallerDim = 
+            ((pixelsWide < pixelsHigh) ? pixelsWide : pixelsHigh);
+        const double largeZoom  = antiAliasFactor * zoom * smallerDim;
+
+        if (iFirst + tile.GetPixelsWide() > largePixelsWide ||
+            jFirst + tile.GetPixelsHigh() > largePixelsHigh)
+        {
+            throw ImagerException("Tile extends outside the image.");
+        }
+
+        if (lightCulling && lightHierarchyStale)
+        {
+            throw ImagerException("Call PrepareLights before rendering tiles.");
+        }
+
+        MediumStack cameraMedia;
+        FindContainers(Vector(0.0, 0.0, 0.0), cameraMedia);
+        renderStats = RenderStats();
+
+        Vector direction(0.0, 0.0, -1.0);
+        for (size_t j=0; j < tile.GetPixelsHigh(); ++j)
+        {
+            direction.y = (largePixelsHigh/2.0 - (jFirst + j)) / largeZoom;
+            for (size_t i=0; i < tile.GetPixelsWide(); ++i)
+            {
+                direction.x = ((iFirst + i) - largePixelsWide/2.0) / largeZoom;
+                TracePixel(tile.Pixel(i,j), direction, cameraMedia, NULL);
+            }
+        }
+    }
+
+    // Heals the ambiguous pixels in an oversampled image assembled
+    // from tiles made by RenderTile, and converts it to RGBA bytes
+    // just as RenderImage does.
+    const std::vector<unsigned char>& Scene::FinishTiledImage(
+        ImageBuffer& buffer,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        size_t antiAliasFactor) const
+    {
+        if (buffer.GetPixelsWide() != antiAliasFactor * pixelsWide ||
+            buffer.GetPixelsHigh() != antiAliasFactor * pixelsHigh)
+        {
+            throw ImagerException("Tiled image buffer has the wrong size.");
+        }
+
+        // Gather the ambiguous pixels in the same order RenderImage
+        // finds them by columns; the result does not depend on it.
+        PixelList ambiguousPixelList;
+        for (size_t i=0; i < buffer.GetPixelsWide(); ++i)
+        {
+            for (size_t j=0; j < buffer.GetPixelsHigh(); ++j)
+            {
+                if (buffer.Pixel(i,j).isAmbiguous)
+                {
+                    ambiguousPixelList.push_back(PixelCoordinates(i, j));
+                }
+            }
+        }
+
+        return FinishImage(
+            buffer, 
+            ambiguousPixelList, 
+            pixelsWide, 
+            pixelsHigh, 
+            antiAliasFactor);
+    }
+
+    namespace
+    {
+        // Spreads the low 4 bits of 'n' out to every third bit,
+        // so that three of them can be interleaved.
+        inline unsigned SpreadBits(unsigned n)
+        {
+            return (n & 1) | ((n & 2) << 2) | ((n & 4) << 4) | ((n & 8) << 6);
+        }
+
+        // Which of 16 slices between 'low' and 'high' a coordinate lies in.
+        inline unsigned GridSlice(double x, double low, double high)
+        {
+            if (high <= low)
+            {
+                return 0;
+            }
+            const int slice = static_cast<int>(16.0 * (x - low) / (high - low));
+            return (slice < 0) ? 0 : ((slice > 15) ? 15 : slice);
+        }
+    }
+
+    // Sorts each batch of rays in the queue by the octant of its
+    // direction, then by the grid cell of its vantage point, visiting
+    // the cells in Morton order so that neighboring cells stay close
+    // in the sorted list too.  Rays with the same key keep their
+    // order, so the result does not depend on the sort algorithm.
+    void Scene::ReorderWavefront(
+        WavefrontQueue& queue,
+        WavefrontQueue& scratch) const
+    {
+        const size_t count = queue.size();
+        scratch.resize(count);
+        for (size_t first = 0; first < count; first += reorderBatchSize)
+        {
+            const size_t last = std::min(first + reorderBatchSize, count);
+
+            Vector low = queue[first].vantage;
+            Vector high = low;
+            for (size_t k = first+1; k < last; ++k)
+            {
+                const Vector& v = queue[k].vantage;
+                low.x = std::min(low.x, v.x);   high.x = std::max(high.x, v.x);
+                low.y = std::min(low.y, v.y);   high.y = std::max(high.y, v.y);
+                low.z = std::min(low.z, v.z);   high.z = std::max(high.z, v.z);
+            }
+
+            // Each key holds the octant in bits 12..14 and the cell in
+            // bits 0..11, shifted above the ray's position in the batch.
+            reorderKeyList.resize(last - first);
+            for (size_t k = first; k < last; ++k)
+            {
+                const WavefrontRay& ray = queue[k];
+                const unsigned octant =
+                    ((ray.direction.x < 0.0) ? 1 : 0) |
+                    ((ray.direction.y < 0.0) ? 2 : 0) |
+                    ((ray.direction.z < 0.0) ? 4 : 0);
+                const unsigned cell =
+                    SpreadBits(GridSlice(ray.vantage.x, low.x, high.x)) |
+                    (SpreadBits(GridSlice(ray.vantage.y, low.y, high.y)) << 1) |
+                    (SpreadBits(GridSlice(ray.vantage.z, low.z, high.z)) << 2);
+                const unsigned long long key = (octant << 12) | cell;
+                reorderKeyList[k - first] = (key << 32) | (k - first);
+            }
+            std::sort(reorderKeyList.begin(), reorderKeyList.end());
+
+            for (size_t k = first; k < last; ++k)
+            {
+                scratch[k] = queue[first + (reorderKeyList[k - first] & 0xffffffffULL)];
+            }
+        }
+        queue.swap(scratch);
+    }
+
+    // Records what each camera ray in the queue struck, as
+    // TraceRetainedPrimaryRay does, so that RelightImage works
+    // after a wavefront render too.
+    void Scene::RetainWavefrontHits(
+        const WavefrontQueue& queue,
+        const WavefrontHitList& hitList) const
+    {
+        for (size_t k=0; k < queue.size(); ++k)
+        {
+            const Intersection& intersection = hitList[k].intersection;
+            PrimaryHit& hit = primaryHitList[queue[k].pixelIndex];
+            if (hitList[k].numClosest == 0)
+            {
+                hit.state = PRIMARY_MISS;
+                hit.solid = NULL;
+            }
+            else if (hitList[k].numClosest > 1)
+            {
+                hit.state = PRIMARY_AMBIGUOUS;
+                hit.solid = NULL;
+            }
+            else
+            {
+                if (intersection.solid == NULL)
+                {
+                    throw ImagerException("Undefined solid at intersection.");
+                }
+
+                hit.point = intersection.point;
+                hit.surfaceNormal = intersection.surfaceNormal;
+                hit.solid = intersection.solid;
+                hit.solidIndex = hitList[k].solidIndex;
+                hit.context = intersection.context;
+                hit.optics = intersection.solid->OpticsAt(
+                    intersection.point, 
+                    intersection.context,
+                    hit.optics);
+                hit.state = PRIMARY_HIT;
+            }
+        }
+    }
+
+    const std::vector<unsigned char>& Scene::RelightImage() const
+    {
+        if (!hasRetainedHits)
+        {
+            throw ImagerException("No primary hits retained for relighting.");
+        }
+
+        if (hasRetainedSolids)
+        {
+            Fingerprint solids;
+            AppendSolidsFingerprint(solids);
+            if (solids.Value() != retainedSolids)
+            {
+                hasRetainedHits = false;
+                throw ImagerException("Solids have changed since the primary hits were retained.");
+            }
+        }
+
+        const size_t pixelsWide = retainedPixelsWide;
+        const size_t pixelsHigh = retainedPixelsHigh;
+        const size_t antiAliasFactor = retainedAntiAliasFactor;
+        const size_t largePixelsWide = antiAliasFactor * pixelsWide;
+        const size_t largePixelsHigh = antiAliasFactor * pixelsHigh;
+        const size_t smallerDim = 
+            ((pixelsWide < pixelsHigh) ? pixelsWide : pixelsHigh);
+
+        const double largeZoom  = antiAliasFactor * retainedZoom * smallerDim;
+        ImageBuffer& buffer = PrepareRenderBuffer(largePixelsWide, largePixelsHigh);
+        PrepareLights();
+
+        // The direction of every camera ray must be computed exactly as
+        // RenderImage did, because reflection and refraction depend on it.
+        Vector direction(0.0, 0.0, -1.0);
+        const Color fullIntensity(1.0, 1.0, 1.0);
+        PixelList ambiguousPixelList;
+
+        MediumStack cameraMedia;
+        FindContainers(Vector(0.0, 0.0, 0.0), cameraMedia);
+
+        renderStats = RenderStats();
+        PixelWalk walk(pixelOrder, largePixelsWide, largePixelsHigh);
+        size_t i, j;
+        while (walk.Next(i, j))
+        {
+            direction.x = (i - largePixelsWide/2.0) / largeZoom;
+            direction.y = (largePixelsHigh/2.0 - j) / largeZoom;
+
+            const PrimaryHit& hit = primaryHitList[j*largePixelsWide + i];
+            PixelData& pixel = buffer.Pixel(i,j);
+            pixel.isAmbiguous = false;
+            StartPixelBudget(recursiveBudget);
+
+            switch (hit.state)
+            {
+            case PRIMARY_MISS:
+                pixel.color = fullIntensity * backgroundColor;
+                break;
+
+            case PRIMARY_HIT:
+                try
+                {
+                    Intersection intersection;
+                    intersection.point = hit.point;
+                    intersection.surfaceNormal = hit.surfaceNormal;
+                    intersection.solid = hit.solid;
+                    intersection.context = hit.context;
+
+                    pixel.color = CalculateSurfaceLighting(
+                        intersection,
+                        hit.solidIndex,
+                        hit.optics,
+                        direction,
+                        cameraMedia,
+                        fullIntensity,
+                        1);
+                }
+                catch (AmbiguousIntersectionException)
+                {
+                    // A shadow, reflection, or refraction ray
+                    // was ambiguous, just as it would have been
+                    // in a full render.
+                    pixel.isAmbiguous = true;
+                    ambiguousPixelList.push_back(PixelCoordinates(i, j));
+                }
+                break;
+
+            default:
+                pixel.isAmbiguous = true;
+                ambiguousPixelList.push_back(PixelCoordinates(i, j));
+                break;
+            }
+        }
+
+        return FinishImage(
+            buffer, 
+            ambiguousPixelList, 
+            pixelsWide, 
+            pixelsHigh, 
+            antiAliasFactor);
+    }
+
+    void Scene::SaveRelitImage(const char *outPngFileName) const
+    {
+        RelightImage();
+
+        const unsigned error = lodepng::encode(
+            outPngFileName, 
+            rgbaBuffer, 
+            retainedPixelsWide, 
+            retainedPixelsHigh);
+
+        if (error != 0)
+        {
+            std::string message = "PNG encoder error: ";
+            message += lodepng_error_text(error);
+            throw ImagerException(message.c_str());
+        }
+    }
+
+    // Heals the ambiguous pixels in an oversampled buffer, then scales
+    // and downsamples it into rgbaBuffer, which is returned.
+    const std::vector<unsigned char>& Scene::FinishImage(
+        ImageBuffer& buffer,
+        const PixelList& ambiguousPixelList,
+        size_t pixelsWide,
+        size_t pixelsHigh,
+        size_t antiAliasFactor) const
+    {
         // Go back and "heal" ambiguous pixels as best we can.
         PixelList::const_iterator iter = ambiguousPixelList.begin();
         PixelList::const_iterator end  = ambiguousPixelList.end();
@@ -845,8 +2104,13 @@ namespace Imager
         const unsigned RGBA_BUFFER_SIZE = 
             pixelsWide * pixelsHigh * BYTES_PER_PIXEL;
 
-        std::vector<unsigned char> rgbaBuffer(RGBA_BUFFER_SIZE);
+        rgbaBuffer.resize(RGBA_BUFFER_SIZE);
         unsigned rgbaIndex = 0;
+        const bool keepFloat = floatOutput || floatRequested;
+        if (keepFloat)
+        {
+            floatBuffer.resize(RGBA_BUFFER_SIZE);
+        }
         const double patchSize = antiAliasFactor * antiAliasFactor;
         for (size_t j=0; j < pixelsHigh; ++j)
         {
@@ -866,6 +2130,14 @@ namespace Imager
 
                 // Convert to integer red, green, blue, alpha values,
                 // all of which must be in the range 0..255.
+                if (keepFloat)
+                {
+                    floatBuffer[rgbaIndex + 0] = static_cast<float>(sum.red);
+                    floatBuffer[rgbaIndex + 1] = static_cast<float>(sum.green);
+                    floatBuffer[rgbaIndex + 2] = static_cast<float>(sum.blue);
+                    floatBuffer[rgbaIndex + 3] = 1.0f;
+                }
+
                 rgbaBuffer[rgbaIndex++] = ConvertPixelValue(sum.red,   max);
                 rgbaBuffer[rgbaIndex++] = ConvertPixelValue(sum.green, max);
                 rgbaBuffer[rgbaIndex++] = ConvertPixelValue(sum.blue,  max);
@@ -873,43 +2145,113 @@ namespace Imager
             }
         }
 
-        // Write the PNG file
-        const unsigned error = lodepng::encode(
-            outPngFileName, 
-            rgbaBuffer, 
-            pixelsWide, 
-            pixelsHigh);
+        return rgbaBuffer;
+    }
 
-        // If there was an encoding error, throw an exception.
-        if (error != 0)
+    bool Scene::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        fingerprint.AddColor(backgroundColor);
+        fingerprint.AddDouble(ambientRefraction);
+
+        // Render settings that change the image.  They are added only
+        // when they differ from the defaults, so that fingerprints of
+        // ordinary scenes stay the same as before they existed.
+        if (!lightCulling)
         {
-            std::string message = "PNG encoder error: ";
-            message += lodepng_error_text(error);
-            throw ImagerException(message.c_str());
+            fingerprint.AddString("all lights");
+        }
+        if (!mediumTracking)
+        {
+            fingerprint.AddString("no medium tracking");
         }
+        const RenderLimits defaultLimits;
+        if (renderLimits.maxRecursionDepth != defaultLimits.maxRecursionDepth ||
+            renderLimits.minRayIntensity != defaultLimits.minRayIntensity ||
+            renderLimits.maxRaysPerPixel != defaultLimits.maxRaysPerPixel ||
+            renderLimits.maxRaysPerFrame != defaultLimits.maxRaysPerFrame)
+        {
+            fingerprint.AddString("limits");
+            fingerprint.AddInteger(renderLimits.maxRecursionDepth);
+            fingerprint.AddDouble(renderLimits.minRayIntensity);
+            fingerprint.AddInteger(renderLimits.maxRaysPerPixel);
+            fingerprint.AddInteger(renderLimits.maxRaysPerFrame);
+        }
+
+        fingerprint.AddInteger(lightSourceList.size());
+        LightSourceList::const_iterator liter = lightSourceList.begin();
+        LightSourceList::const_iterator lend  = lightSourceList.end();
+        for (; liter != lend; ++liter)
+        {
+            fingerprint.AddVector(liter->location);
+            fingerprint.AddColor(liter->color);
+        }
+
+        return AppendSolidsFingerprint(fingerprint);
     }
 
-    // The following function searches through all solid objects
-    // for the first solid (if any) that contains the given point.
-    // In the case of ties, the solid that was inserted into the
-    // scene first wins.  This arbitrary convention allows the
-    // composer of a scene to decide which of multiple overlapping
-    // objects should control the index of refraction for any
-    // overlapping volumes of space.
-    const SolidObject* Scene::PrimaryContainer(const Vector& point) const
+    bool Scene::AppendSolidsFingerprint(Fingerprint& fingerprint) const
     {
+        // Insertion order matters, because it decides which of
+        // several overlapping solids controls refraction.
+        fingerprint.AddInteger(solidObjectList.size());
         SolidObjectList::const_iterator iter = solidObjectList.begin();
         SolidObjectList::const_iterator end  = solidObjectList.end();
         for (; iter != end; ++iter)
         {
-            const SolidObject* solid = *iter;
-            if (solid->Contains(point))
+            if (!(*iter)->AppendFingerprint(fingerprint))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Lists every solid that contains the given point, in scene order.
+    // Where solids overlap, the one inserted into the scene first
+    // controls the index of refraction (see MediumRefractiveIndex).
+    // This arbitrary convention allows the composer of a scene to decide
+    // which of multiple overlapping objects should control the index of
+    // refraction for any overlapping volumes of space.
+    // Should there be more than MediumStack::MAX_DEPTH of them, only the
+    // first ones are kept, which are the only ones that matter for
+    // refraction; the list is then marked invalid so that it will be
+    // found again at the next surface rather than trusted.
+    void Scene::FindContainers(const Vector& point, MediumStack& media) const
+    {
+        media.depth = 0;
+        media.valid = true;
+        const size_t numSolids = solidObjectList.size();
+        for (size_t index = 0; index < numSolids; ++index)
+        {
+            ++containmentQueryCount;
+            if (solidObjectList[index]->Contains(point))
             {
-                return solid;
+                if (media.depth == MediumStack::MAX_DEPTH)
+                {
+                    media.valid = false;
+                    break;
+                }
+                media.solidIndex[media.depth++] = index;
             }
         }
+    }
+
+    double Scene::MediumRefractiveIndex(const MediumStack& media) const
+    {
+        if (media.depth == 0)
+        {
+            return ambientRefraction;
+        }
 
-        return NULL;
+        size_t first = media.solidIndex[0];
+        for (size_t position = 1; position < media.depth; ++position)
+        {
+            if (media.solidIndex[position] < first)
+            {
+                first = media.solidIndex[position];
+            }
+        }
+        return solidObjectList[first]->GetRefractiveIndex();
     }
 
     void Scene::ResolveAmbiguousPixel(
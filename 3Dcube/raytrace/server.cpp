@@ -0,0 +1,349 @@
+/*
+    server.cpp
+
+    Implements the render server described in server.h.
+*/
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cache.h"
+#include "describe.h"
+#include "fdio.h"
+#include "server.h"
+#include "threadpool.h"
+#include "timer.h"
+#include "../lodepng/lodepng.h"
+
+namespace Imager
+{
+    namespace
+    {
+        // Bytes of rendered images the server keeps in memory for repeated requests.
+        const size_t SERVER_CACHE_CAPACITY = 256 << 20;
+
+        // The longest scene description the server will accept.
+        const size_t MAX_DESCRIPTION_SIZE = 16 << 20;
+
+        // Clients served at once over the socket.  Each has its own
+        // thread, so further clients wait to be accepted until one of
+        // these hangs up, rather than each costing another thread.
+        const size_t MAX_CONNECTIONS = 64;
+
+        inline long Microseconds(double seconds)
+        {
+            return static_cast<long>(seconds * 1.0e+6);
+        }
+
+        // Writes an error response; returns false if the client has gone away.
+        // The message may come from an exception, so any line breaks in it
+        // are turned into spaces to keep the response on one line.
+        bool SendError(int fd, const std::string& message)
+        {
+            std::string response = "error " + message;
+            for (size_t k = 0; k < response.size(); ++k)
+            {
+                if (response[k] == '\n' || response[k] == '\r')
+                {
+                    response[k] = ' ';
+                }
+            }
+            response += '\n';
+            return WriteAll(fd, response.data(), response.size());
+        }
+
+        // Renders one scene description on a pool thread.
+        class RenderTask: public Task
+        {
+        public:
+            RenderTask(const std::string& _description, RenderCache* _cache, bool _allowFiles)
+                : description(_description)
+                , cache(_cache)
+                , allowFiles(_allowFiles)
+                , submitTime(WallClockSeconds())
+                , isOk(false)
+                , queueSeconds(0.0)
+                , parseSeconds(0.0)
+                , renderSeconds(0.0)
+                , encodeSeconds(0.0)
+            {
+            }
+
+            virtual void Run()
+            {
+                double start = WallClockSeconds();
+                queueSeconds = start - submitTime;
+                try
+                {
+                    Scene scene;
+                    ParseSceneDescription(description, scene, request, allowFiles);
+                    parseSeconds = WallClockSeconds() - start;
+
+                    // A repeated request is answered straight from the cache.
+                    FingerprintDigest key;
+                    const bool isCacheable = RenderCache::MakeKey(
+                        scene,
+                        request.pixelsWide,
+                        request.pixelsHigh,
+                        request.zoom,
+                        request.antiAliasFactor,
+                        (request.format == IMAGE_FORMAT_PNG) ? "png" : "rgba",
+                        key);
+
+                    if (!isCacheable)
+                    {
+                        cache->CountUncacheable();
+                    }
+                    else if (cache->Lookup(key, imageData))
+                    {
+                        isOk = true;
+                        return;
+                    }
+
+                    start = WallClockSeconds();
+                    const std::vector<unsigned char>& rgba = scene.RenderImage(
+                        request.pixelsWide,
+                        request.pixelsHigh,
+                        request.zoom,
+                        request.antiAliasFactor);
+                    renderSeconds = WallClockSeconds() - start;
+
+                    start = WallClockSeconds();
+                    if (request.format == IMAGE_FORMAT_PNG)
+                    {
+                        const unsigned error = lodepng::encode(
+                            imageData,
+                            rgba,
+                            request.pixelsWide,
+                            request.pixelsHigh);
+
+                        if (error != 0)
+                        {
+                            errorMessage = lodepng_error_text(error);
+                            return;
+                        }
+                    }
+                    else
+                    {
+                        imageData = rgba;
+                    }
+                    encodeSeconds = WallClockSeconds() - start;
+                    isOk = true;
+
+                    if (isCacheable)
+                    {
+                        cache->Store(key, imageData);
+                    }
+                }
+                catch (const ImagerException& ex)
+                {
+                    errorMessage = ex.GetMessage();
+                }
+                catch (const std::exception& ex)
+                {
+                    errorMessage = ex.what();
+                }
+            }
+
+            // Writes the response to the client; returns false if it has gone away.
+            bool Respond(int fd) const
+            {
+                if (isOk)
+                {
+                    char header[256];
+                    snprintf(header, sizeof(header),
+                        "ok %s %u %u %lu parse_us=%ld queue_us=%ld render_us=%ld encode_us=%ld\n",
+                        (request.format == IMAGE_FORMAT_PNG) ? "png" : "rgba",
+                        static_cast<unsigned>(request.pixelsWide),
+                        static_cast<unsigned>(request.pixelsHigh),
+                        static_cast<unsigned long>(imageData.size()),
+                        Microseconds(parseSeconds),
+                        Microseconds(queueSeconds),
+                        Microseconds(renderSeconds),
+                        Microseconds(encodeSeconds));
+
+                    return
+                        WriteAll(fd, header, strlen(header)) &&
+                        WriteAll(fd, imageData.data(), imageData.size());
+                }
+
+                return SendError(fd, errorMessage);
+            }
+
+        private:
+            const std::string description;
+            RenderCache* const cache;
+            const bool allowFiles;
+            const double submitTime;
+            RenderRequest request;
+            std::vector<unsigned char> imageData;
+            std::string errorMessage;
+            bool isOk;
+            double queueSeconds;
+            double parseSeconds;
+            double renderSeconds;
+            double encodeSeconds;
+        };
+
+        // Serves one client until it closes its end of the connection.
+        // Only a client on standard input, who could read the files
+        // anyway, may load baked scenes by name.
+        void ServeClient(ThreadPool* pool, RenderCache* cache, int inputFd, int outputFd, bool allowFiles)
+        {
+            LineReader reader(inputFd);
+            std::string description;
+            std::string line;
+            while (reader.ReadLine(line))
+            {
+                if (line == "stats" && description.empty())
+                {
+                    std::ostringstream report;
+                    report << "stats " << cache->GetStats() << "\n";
+                    if (!WriteAll(outputFd, report.str().data(), report.str().size()))
+                    {
+                        break;
+                    }
+                    continue;
+                }
+
+                if (description.size() + line.size() >= MAX_DESCRIPTION_SIZE)
+                {
+                    // The rest of the description cannot be skipped reliably,
+                    // so the connection is dropped after the error.
+                    SendError(outputFd, "Scene description is too long.");
+                    return;
+                }
+
+                description += line;
+                description += '\n';
+
+                if (line == "end")
+                {
+                    RenderTask task(description, cache, allowFiles);
+                    pool->Submit(&task);
+                    task.Wait();
+                    if (!task.Respond(outputFd))
+                    {
+                        break;
+                    }
+                    description.clear();
+                }
+            }
+
+            if (reader.LineTooLong())
+            {
+                SendError(outputFd, "Line in scene description is too long.");
+            }
+        }
+
+        // Counts the connections being served, so the accept loop
+        // can wait while there are already MAX_CONNECTIONS of them.
+        class ConnectionLimit
+        {
+        public:
+            ConnectionLimit()
+                : count(0)
+            {
+            }
+
+            void Acquire()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (count >= MAX_CONNECTIONS)
+                {
+                    condition.wait(lock);
+                }
+                ++count;
+            }
+
+            void Release()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --count;
+                condition.notify_one();
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable condition;
+            size_t count;
+        };
+
+        void ServeConnection(ThreadPool* pool, RenderCache* cache, ConnectionLimit* limit, int fd)
+        {
+            ServeClient(pool, cache, fd, fd, false);
+            close(fd);
+            limit->Release();
+        }
+    }
+
+    void RunRenderServer(const char *socketPath, size_t numThreads)
+    {
+        // A client hanging up mid-response must not terminate the server.
+        signal(SIGPIPE, SIG_IGN);
+
+        ThreadPool pool(numThreads);
+        RenderCache cache(SERVER_CACHE_CAPACITY);
+
+        if (strcmp(socketPath, "-") == 0)
+        {
+            ServeClient(&pool, &cache, 0, 1, true);
+            return;
+        }
+
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(socketPath) >= sizeof(address.sun_path))
+        {
+            throw ImagerException("Server socket path is too long.");
+        }
+        strcpy(address.sun_path, socketPath);
+
+        const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            throw ImagerException("Cannot create server socket.");
+        }
+
+        unlink(socketPath);     // remove any socket left by an earlier server
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listener, 64) != 0)
+        {
+            close(listener);
+            throw ImagerException("Cannot listen on server socket.");
+        }
+
+        ConnectionLimit limit;
+        for(;;)
+        {
+            limit.Acquire();
+            int fd;
+            do
+            {
+                fd = accept(listener, NULL, NULL);
+            }
+            while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+            if (fd < 0)
+            {
+                close(listener);
+                throw ImagerException("Cannot accept client connection.");
+            }
+
+            // Each connection gets a light thread that only reads requests
+            // and writes responses; all rendering happens in the pool.
+            std::thread(ServeConnection, &pool, &cache, &limit, fd).detach();
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*
+    server.h
+
+    A long-running render server.  Clients send scene descriptions
+    (see describe.h) and receive rendered images, so that each image
+    avoids the cost of process start-up and thread creation.
+
+    Each response begins with one text line.  On success it is
+
+        ok <png|rgba> <width> <height> <byteCount> parse_us=<n> queue_us=<n> render_us=<n> encode_us=<n>
+
+    followed by exactly byteCount bytes of image data.  On failure it is
+
+        error <message>
+
+    and no data follows.  A client may send any number of descriptions
+    over one connection; responses come back in the same order.  A
+    description longer than 16 MB, or with a line longer than 64 KB,
+    is answered with an error, after which the server closes the
+    connection.
+    Descriptions from socket clients may not use the "baked" statement,
+    so that a client cannot make the server open files.
+
+    Rendered images are kept in a memory cache (see cache.h), so a
+    repeated description is answered without tracing.  A line "stats"
+    sent between descriptions is answered with one line of cache
+    hit/miss counters.
+*/
+
+#ifndef __DDC_SERVER_H
+#define __DDC_SERVER_H
+
+#include <cstddef>
+
+namespace Imager
+{
+    // Serves render requests until the input is exhausted.
+    // If 'socketPath' is "-", a single client is served over
+    // standard input and output.  Otherwise the server listens on
+    // a Unix domain socket at that path and serves up to 64
+    // concurrent clients, never returning unless the socket fails.
+    // A thread count of zero means one per hardware thread.
+    void RunRenderServer(const char *socketPath, size_t numThreads);
+}
+
+#endif // __DDC_SERVER_H
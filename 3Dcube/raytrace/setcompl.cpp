@@ -0,0 +1,53 @@
+/*
+    setcompl.cpp
+
+    Implements class SetComplement: a solid made of every point
+    that is NOT inside another solid.
+*/
+
+#include "imager.h"
+
+namespace Imager
+{
+    void SetComplement::AppendAllIntersections(
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList) const
+    {
+        // The complement has the same surface as the other solid,
+        // but inside and outside are swapped, so every surface
+        // normal must point the opposite way.
+        const size_t sizeBeforeAppend = intersectionList.size();
+
+        other->AppendAllIntersections(vantage, direction, intersectionList);
+
+        for (size_t index = sizeBeforeAppend; index < intersectionList.size(); ++index)
+        {
+            intersectionList[index].surfaceNormal *= -1.0;
+        }
+    }
+
+    bool SetComplement::FindInsideSpans(
+        const Vector& vantage,
+        const Vector& direction,
+        SpanList& spanList) const
+    {
+        // The ray is inside the complement wherever it is
+        // outside the other solid.
+        CollectInsideSpans(*other, vantage, direction, otherSpanList, otherCrossingList);
+        ComplementSpans(otherSpanList, spanList);
+        return true;
+    }
+
+    void SetComplement::ContainsEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray) const
+    {
+        other->ContainsEach(pointArray, count, insideArray);
+        for (size_t k=0; k < count; ++k)
+        {
+            insideArray[k] = !insideArray[k];
+        }
+    }
+}
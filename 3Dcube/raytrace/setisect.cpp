@@ -0,0 +1,42 @@
+/*
+    setisect.cpp
+
+    Implements class SetIntersection: a solid made of every point
+    that is inside both of two other solids.
+*/
+
+#include "imager.h"
+
+namespace Imager
+{
+    void SetIntersection::AppendAllIntersections(
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList) const
+    {
+        // The surface of the intersection is wherever the ray passes
+        // between being inside both solids and being outside either one.
+        FindInsideSpans(vantage, direction, resultSpanList);
+        AppendSpanBoundaries(resultSpanList, intersectionList);
+    }
+
+    bool SetIntersection::FindInsideSpans(
+        const Vector& vantage,
+        const Vector& direction,
+        SpanList& spanList) const
+    {
+        CombineOperandSpans(vantage, direction, SPAN_INTERSECTION, spanList);
+        return true;
+    }
+
+    void SetIntersection::ContainsEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray) const
+    {
+        Left().ContainsEach(pointArray, count, insideArray);
+
+        // Only points inside the left solid need the right one tested.
+        RightDecidesEach(pointArray, count, insideArray, true);
+    }
+}
@@ -0,0 +1,43 @@
+/*
+    setunion.cpp
+
+    Implements class SetUnion: a solid made of every point
+    that is inside either of two other solids.
+*/
+
+#include "imager.h"
+
+namespace Imager
+{
+    void SetUnion::AppendAllIntersections(
+        const Vector& vantage, 
+        const Vector& direction, 
+        IntersectionList& intersectionList) const
+    {
+        // The surface of the union is wherever the ray passes
+        // between being inside either solid and being inside neither.
+        FindInsideSpans(vantage, direction, resultSpanList);
+        AppendSpanBoundaries(resultSpanList, intersectionList);
+    }
+
+    bool SetUnion::FindInsideSpans(
+        const Vector& vantage,
+        const Vector& direction,
+        SpanList& spanList) const
+    {
+        CombineOperandSpans(vantage, direction, SPAN_UNION, spanList);
+        return true;
+    }
+
+    void SetUnion::ContainsEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray) const
+    {
+        Left().ContainsEach(pointArray, count, insideArray);
+
+        // Only points outside the left solid can be inside the union
+        // because of the right one.
+        RightDecidesEach(pointArray, count, insideArray, false);
+    }
+}
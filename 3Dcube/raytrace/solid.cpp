@@ -5,32 +5,45 @@
 */
 
 #include "imager.h"
+#include "fingerprint.h"
 
 namespace Imager
 {
-    bool SolidObject::Contains(const Vector& point) const
+    namespace
     {
-
-        if (isFullyEnclosed)
+        // Directions for the containment probe ray.  The first is the
+        // original +z direction; the others point away from every axis,
+        // so when a ray along +z merely grazes an edge or a face of a
+        // box-like solid, one of them can settle the question instead.
+        const Vector ProbeDirectionList[] =
         {
+            Vector(0.0, 0.0, 1.0),
+            Vector(0.2672612419124244, 0.5345224838248488, 0.8017837257372732),
+            Vector(-0.6030226891555273, 0.3015113445777636, -0.7385489458759964),
+            Vector(0.4364357804719848, -0.8728715609439696, 0.2182178902359924)
+        };
 
-            const Vector direction(0.0, 0.0, 1.0);
+        const size_t NUM_PROBE_DIRECTIONS = sizeof(ProbeDirectionList) / sizeof(ProbeDirectionList[0]);
 
-            enclosureList.clear();
-            AppendAllIntersections(point, direction, enclosureList);
+        enum ProbeResult
+        {
+            PROBE_OUTSIDE,
+            PROBE_INSIDE,
+            PROBE_UNDECIDED
+        };
 
+        ProbeResult CountCrossings(const IntersectionList& list, const Vector& direction)
+        {
             int enterCount = 0;     
             int exitCount  = 0;     
 
-            IntersectionList::const_iterator iter = enclosureList.begin();
-            IntersectionList::const_iterator end  = enclosureList.end();
+            IntersectionList::const_iterator iter = list.begin();
+            IntersectionList::const_iterator end  = list.end();
             for (; iter != end; ++iter)
             {
-                const Intersection& intersection = *iter;
- 
                 const double dotprod = DotProduct(
                     direction, 
-                    intersection.surfaceNormal);
+                    iter->surfaceNormal);
   
                 if (dotprod > EPSILON)
                 {
@@ -42,24 +55,54 @@ namespace Imager
                 }
                 else
                 {
-
-                    throw ImagerException("Ambiguous transition.");
+                    return PROBE_UNDECIDED;     // the ray grazes a surface
                 }
             }
 
-
             switch (exitCount - enterCount)
             {
             case 0:
-                return false;   
+                return PROBE_OUTSIDE;   
 
             case 1:
-                return true;    
+                return PROBE_INSIDE;    
 
             default:
+                return PROBE_UNDECIDED;     // e.g. a ray through an edge
+            }
+        }
+    }
+
+    bool SolidObject::Contains(const Vector& point) const
+    {
 
-                throw ImagerException("Cannot determine containment.");
+        if (isFullyEnclosed)
+        {
+            // Every solid in this library has its own exact test; this
+            // is only for solids that do not.  A ray leaving a point
+            // inside a closed solid crosses its surface outward once
+            // more than it crosses inward.
+            for (size_t k=0; k < NUM_PROBE_DIRECTIONS; ++k)
+            {
+                const Vector& direction = ProbeDirectionList[k];
+
+                enclosureList.clear();
+                AppendAllIntersections(point, direction, enclosureList);
+
+                switch (CountCrossings(enclosureList, direction))
+                {
+                case PROBE_OUTSIDE:
+                    return false;
+
+                case PROBE_INSIDE:
+                    return true;
+
+                case PROBE_UNDECIDED:
+                    break;      // try the next direction
+                }
             }
+
+            throw ImagerException("Cannot determine containment.");
         }
         else
         {
@@ -67,4 +110,26 @@ namespace Imager
             return false;
         }
     }
+
+    void SolidObject::ContainsEach(
+        const Vector* pointArray, 
+        size_t count, 
+        bool* insideArray) const
+    {
+        for (size_t k=0; k < count; ++k)
+        {
+            insideArray[k] = Contains(pointArray[k]);
+        }
+    }
+
+    void SolidObject::AppendCommonFingerprint(Fingerprint& fingerprint) const
+    {
+        fingerprint.AddString(GetTag());
+        fingerprint.AddVector(center);
+        const Optics& optics = GetUniformOptics();
+        fingerprint.AddColor(optics.GetMatteColor());
+        fingerprint.AddColor(optics.GetGlossColor());
+        fingerprint.AddDouble(optics.GetOpacity());
+        fingerprint.AddDouble(refractiveIndex);
+    }
 }
@@ -0,0 +1,292 @@
+/*
+    spans.cpp
+
+    Ray spans for the set operators.  Instead of filtering each operand's
+    surface crossings by asking the other operand whether it contains the
+    crossing point, which for a general solid casts yet another ray, each
+    operand reports the sorted spans of the ray inside it.  A union or an
+    intersection is then a single merge of two sorted lists, and a
+    complement is the gaps between spans, so a whole tree of set
+    operators costs time in proportion to its total number of crossings.
+*/
+
+#include <algorithm>
+#include "imager.h"
+
+namespace Imager
+{
+    namespace
+    {
+        bool CloserIntersection(const Intersection& a, const Intersection& b)
+        {
+            return a.distanceSquared < b.distanceSquared;
+        }
+
+        inline SpanEnd CrossingEnd(const Intersection& crossing)
+        {
+            SpanEnd end;
+            end.distanceSquared = crossing.distanceSquared;
+            end.crossing = &crossing;
+            end.flipped = false;
+            return end;
+        }
+
+        // The start of a span whose ray begins inside the solid.
+        inline SpanEnd OpenStart()
+        {
+            SpanEnd end;
+            end.distanceSquared = 0.0;
+            end.crossing = NULL;
+            end.flipped = false;
+            return end;
+        }
+
+        // The end of a span whose ray never leaves the solid.
+        inline SpanEnd OpenEnd()
+        {
+            SpanEnd end;
+            end.distanceSquared = 1.0e+20;
+            end.crossing = NULL;
+            end.flipped = false;
+            return end;
+        }
+
+        inline SpanEnd Flipped(const SpanEnd& end)
+        {
+            SpanEnd flipped = end;
+            flipped.flipped = !end.flipped;
+            return flipped;
+        }
+
+        // Each span contributes two events to a merge: its entry at
+        // index 2k and its exit at index 2k+1.
+        inline const SpanEnd& SpanEvent(const SpanList& spanList, size_t index)
+        {
+            const RaySpan& span = spanList[index >> 1];
+            return (index & 1) ? span.exit : span.enter;
+        }
+    }
+
+    void SpansFromCrossings(
+        IntersectionList& crossingList,
+        const Vector& direction,
+        SpanList& spanList)
+    {
+        // A convex solid is crossed at most twice, which is
+        // common enough to be worth skipping the general sort.
+        if (crossingList.size() == 2)
+        {
+            if (crossingList[1].distanceSquared < crossingList[0].distanceSquared)
+            {
+                std::swap(crossingList[0], crossingList[1]);
+            }
+        }
+        else if (crossingList.size() > 2)
+        {
+            std::sort(crossingList.begin(), crossingList.end(), CloserIntersection);
+        }
+
+        spanList.clear();
+        bool inside = false;
+        RaySpan span;
+
+        IntersectionList::const_iterator iter = crossingList.begin();
+        IntersectionList::const_iterator end  = crossingList.end();
+        for (; iter != end; ++iter)
+        {
+            // The surface normal points out of the solid, so the ray
+            // enters where it runs against the normal and exits
+            // where it runs with it.  Crossings the ray only grazes
+            // say nothing either way, and a second crossing in the
+            // same direction (a ray through an edge hits both faces)
+            // is ignored.
+            const double dotprod = DotProduct(direction, iter->surfaceNormal);
+            if (dotprod < -EPSILON)
+            {
+                if (!inside)
+                {
+                    span.enter = CrossingEnd(*iter);
+                    inside = true;
+                }
+            }
+            else if (dotprod > EPSILON)
+            {
+                if (inside)
+                {
+                    span.exit = CrossingEnd(*iter);
+                    spanList.push_back(span);
+                    inside = false;
+                }
+                else if (spanList.empty())
+                {
+                    // Leaving before ever entering: the ray
+                    // started inside the solid.
+                    span.enter = OpenStart();
+                    span.exit = CrossingEnd(*iter);
+                    spanList.push_back(span);
+                }
+            }
+        }
+
+        if (inside)
+        {
+            span.exit = OpenEnd();
+            spanList.push_back(span);
+        }
+    }
+
+    void CollectInsideSpans(
+        const SolidObject& solid,
+        const Vector& vantage,
+        const Vector& direction,
+        SpanList& spanList,
+        IntersectionList& scratch)
+    {
+        if (!solid.FindInsideSpans(vantage, direction, spanList))
+        {
+            scratch.clear();
+            solid.AppendAllIntersections(vantage, direction, scratch);
+            SpansFromCrossings(scratch, direction, spanList);
+        }
+    }
+
+    void CombineSpans(
+        const SpanList& aList,
+        const SpanList& bList,
+        SpanOperator op,
+        SpanList& result)
+    {
+        // Most rays miss at least one operand entirely.
+        if (aList.empty() || bList.empty())
+        {
+            if (op == SPAN_UNION)
+            {
+                result = aList.empty() ? bList : aList;
+            }
+            else
+            {
+                result.clear();
+            }
+            return;
+        }
+
+        result.clear();
+
+        const size_t aCount = 2 * aList.size();
+        const size_t bCount = 2 * bList.size();
+        size_t aIndex = 0;
+        size_t bIndex = 0;
+        bool insideA = false;
+        bool insideB = false;
+        bool inside = false;
+        RaySpan span;
+
+        while (aIndex < aCount || bIndex < bCount)
+        {
+            // Take the nearer of the next events from each list.  On a
+            // tie, a union takes the entry first and an intersection
+            // takes the exit first, so touching spans neither leave a
+            // gap of zero length nor make a span of zero length.
+            bool takeA;
+            if (bIndex == bCount)
+            {
+                takeA = true;
+            }
+            else if (aIndex == aCount)
+            {
+                takeA = false;
+            }
+            else
+            {
+                const double aDistance = SpanEvent(aList, aIndex).distanceSquared;
+                const double bDistance = SpanEvent(bList, bIndex).distanceSquared;
+                if (aDistance != bDistance)
+                {
+                    takeA = (aDistance < bDistance);
+                }
+                else
+                {
+                    const bool aIsEntry = ((aIndex & 1) == 0);
+                    takeA = (aIsEntry == (op == SPAN_UNION));
+                }
+            }
+
+            const SpanEnd* event;
+            if (takeA)
+            {
+                event = &SpanEvent(aList, aIndex++);
+                insideA = !insideA;
+            }
+            else
+            {
+                event = &SpanEvent(bList, bIndex++);
+                insideB = !insideB;
+            }
+
+            const bool nowInside = (op == SPAN_UNION) ?
+                (insideA || insideB) :
+                (insideA && insideB);
+
+            if (nowInside && !inside)
+            {
+                span.enter = *event;
+            }
+            else if (inside && !nowInside)
+            {
+                span.exit = *event;
+                result.push_back(span);
+            }
+            inside = nowInside;
+        }
+    }
+
+    void ComplementSpans(const SpanList& spanList, SpanList& result)
+    {
+        result.clear();
+
+        RaySpan gap;
+        gap.enter = OpenStart();
+
+        SpanList::const_iterator iter = spanList.begin();
+        SpanList::const_iterator end  = spanList.end();
+        for (; iter != end; ++iter)
+        {
+            if (iter->enter.crossing != NULL)
+            {
+                gap.exit = Flipped(iter->enter);
+                result.push_back(gap);
+            }
+
+            if (iter->exit.crossing == NULL)
+            {
+                return;     // the ray never comes back out
+            }
+
+            gap.enter = Flipped(iter->exit);
+        }
+
+        gap.exit = OpenEnd();
+        result.push_back(gap);
+    }
+
+    void AppendSpanBoundaries(const SpanList& spanList, IntersectionList& intersectionList)
+    {
+        SpanList::const_iterator iter = spanList.begin();
+        SpanList::const_iterator end  = spanList.end();
+        for (; iter != end; ++iter)
+        {
+            const SpanEnd* boundary[2] = { &iter->enter, &iter->exit };
+            for (int k=0; k < 2; ++k)
+            {
+                if (boundary[k]->crossing != NULL)
+                {
+                    intersectionList.push_back(*boundary[k]->crossing);
+                    if (boundary[k]->flipped)
+                    {
+                        intersectionList.back().surfaceNormal *= -1.0;
+                    }
+                }
+            }
+        }
+    }
+}
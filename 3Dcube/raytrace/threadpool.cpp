@@ -0,0 +1,100 @@
+/*
+    threadpool.cpp
+
+    Implements the worker thread pool declared in threadpool.h.
+*/
+
+#include "threadpool.h"
+
+namespace Imager
+{
+    void Task::Wait()
+    {
+        std::unique_lock<std::mutex> lock(doneMutex);
+        while (!isDone)
+        {
+            doneCondition.wait(lock);
+        }
+    }
+
+    void Task::MarkDone()
+    {
+        std::lock_guard<std::mutex> lock(doneMutex);
+        isDone = true;
+        doneCondition.notify_all();
+    }
+
+    ThreadPool::ThreadPool(size_t numThreads)
+        : isShuttingDown(false)
+    {
+        if (numThreads == 0)
+        {
+            numThreads = std::thread::hardware_concurrency();
+            if (numThreads == 0)
+            {
+                numThreads = 1;     // the count is not always knowable
+            }
+        }
+
+        for (size_t i=0; i < numThreads; ++i)
+        {
+            threadList.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            isShuttingDown = true;
+        }
+        queueCondition.notify_all();
+
+        for (size_t i=0; i < threadList.size(); ++i)
+        {
+            threadList[i].join();
+        }
+    }
+
+    void ThreadPool::Submit(Task* task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            taskQueue.push_back(task);
+        }
+        queueCondition.notify_one();
+    }
+
+    void ThreadPool::WorkerLoop()
+    {
+        for(;;)
+        {
+            Task* task = NULL;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                while (taskQueue.empty() && !isShuttingDown)
+                {
+                    queueCondition.wait(lock);
+                }
+
+                if (taskQueue.empty())
+                {
+                    return;     // shutting down with no work left
+                }
+
+                task = taskQueue.front();
+                taskQueue.pop_front();
+            }
+
+            // A task reports its own failures; the pool must keep running.
+            try
+            {
+                task->Run();
+            }
+            catch (...)
+            {
+            }
+            task->MarkDone();
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    threadpool.h
+
+    A fixed set of worker threads that run submitted tasks.
+    The threads are started once and stay warm for the life
+    of the pool, so short jobs pay no thread start-up cost.
+*/
+
+#ifndef __DDC_THREADPOOL_H
+#define __DDC_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Imager
+{
+    // A unit of work for the pool.  Derived classes implement Run;
+    // whoever submitted the task may block in Wait until it is done.
+    class Task
+    {
+    public:
+        Task()
+            : isDone(false)
+        {
+        }
+
+        virtual ~Task()
+        {
+        }
+
+        virtual void Run() = 0;
+
+        void Wait();
+
+    private:
+        friend class ThreadPool;
+        void MarkDone();
+
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+        bool isDone;
+    };
+
+    class ThreadPool
+    {
+    public:
+        // A thread count of zero means one thread per hardware thread.
+        explicit ThreadPool(size_t numThreads = 0);
+        ~ThreadPool();
+
+        // Queues a task.  The caller keeps ownership of it, and must
+        // not destroy it before its Wait function has returned.
+        void Submit(Task* task);
+
+        size_t NumThreads() const { return threadList.size(); }
+
+    private:
+        ThreadPool(const ThreadPool&);              // not copyable
+        ThreadPool& operator= (const ThreadPool&);
+
+        void WorkerLoop();
+
+        std::vector<std::thread> threadList;
+        std::deque<Task*> taskQueue;
+        std::mutex queueMutex;
+        std::condition_variable queueCondition;
+        bool isShuttingDown;
+    };
+}
+
+#endif // __DDC_THREADPOOL_H
@@ -0,0 +1,773 @@
+/*
+    tiles.cpp
+
+    Implements the tile coordinator and tile workers declared in tiles.h.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fdio.h"
+#include "tiles.h"
+#include "timer.h"
+
+namespace Imager
+{
+    namespace
+    {
+        // Splits "host:port" into its parts.  Anything without a colon
+        // is taken to be the path of a Unix domain socket.
+        bool SplitHostPort(const char *address, std::string& host, std::string& port)
+        {
+            const char *colon = strrchr(address, ':');
+            if (colon == NULL)
+            {
+                return false;
+            }
+            host.assign(address, colon);
+            port.assign(colon + 1);
+            return true;
+        }
+
+        // Tile requests and replies are short exchanges, which Nagle's
+        // algorithm would hold up waiting for acknowledgements.
+        // Fails harmlessly on Unix domain sockets.
+        void DisableNagle(int fd)
+        {
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        bool MakeUnixAddress(const char *path, sockaddr_un& address)
+        {
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (strlen(path) >= sizeof(address.sun_path))
+            {
+                return false;
+            }
+            strcpy(address.sun_path, path);
+            return true;
+        }
+
+        // Returns a socket listening at 'address', or throws.
+        int ListenAt(const char *address)
+        {
+            std::string host, port;
+            if (!SplitHostPort(address, host, port))
+            {
+                sockaddr_un unixAddress;
+                if (!MakeUnixAddress(address, unixAddress))
+                {
+                    throw ImagerException("Coordinator socket path is too long.");
+                }
+                const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0)
+                {
+                    throw ImagerException("Cannot create coordinator socket.");
+                }
+                unlink(address);    // remove any socket left by an earlier coordinator
+                if (bind(fd, reinterpret_cast<sockaddr*>(&unixAddress), sizeof(unixAddress)) != 0 ||
+                    listen(fd, 16) != 0)
+                {
+                    close(fd);
+                    throw ImagerException("Cannot listen on coordinator socket.");
+                }
+                return fd;
+            }
+
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo *list = NULL;
+            if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &list) != 0)
+            {
+                throw ImagerException("Cannot resolve coordinator address.");
+            }
+
+            int fd = -1;
+            for (const addrinfo *info = list; info != NULL; info = info->ai_next)
+            {
+                fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+                if (fd >= 0)
+                {
+                    const int reuse = 1;
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                    if (bind(fd, info->ai_addr, info->ai_addrlen) == 0 && listen(fd, 16) == 0)
+                    {
+                        break;
+                    }
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(list);
+
+            if (fd < 0)
+            {
+                throw ImagerException("Cannot listen on coordinator address.");
+            }
+            return fd;
+        }
+
+        // Returns a socket connected to 'address', or throws.
+        int ConnectTo(const char *address)
+        {
+            std::string host, port;
+            if (!SplitHostPort(address, host, port))
+            {
+                sockaddr_un unixAddress;
+                if (!MakeUnixAddress(address, unixAddress))
+                {
+                    throw ImagerException("Coordinator socket path is too long.");
+                }
+                const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0)
+                {
+                    throw ImagerException("Cannot create worker socket.");
+                }
+                if (connect(fd, reinterpret_cast<sockaddr*>(&unixAddress), sizeof(unixAddress)) != 0)
+                {
+                    close(fd);
+                    throw ImagerException("Cannot connect to coordinator.");
+                }
+                return fd;
+            }
+
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *list = NULL;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &list) != 0)
+            {
+                throw ImagerException("Cannot resolve coordinator address.");
+            }
+
+            int fd = -1;
+            for (const addrinfo *info = list; info != NULL; info = info->ai_next)
+            {
+                fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+                if (fd >= 0)
+                {
+                    if (connect(fd, info->ai_addr, info->ai_addrlen) == 0)
+                    {
+                        DisableNagle(fd);
+                        break;
+                    }
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(list);
+
+            if (fd < 0)
+            {
+                throw ImagerException("Cannot connect to coordinator.");
+            }
+            return fd;
+        }
+
+        bool WriteLine(int fd, const std::string& line)
+        {
+            const std::string text = line + "\n";
+            return WriteAll(fd, text.data(), text.size());
+        }
+
+        // One rectangle of the oversampled image and its progress.
+        struct TileJob
+        {
+            size_t iFirst;
+            size_t jFirst;
+            size_t wide;
+            size_t high;
+            int    copies;      // workers tracing it right now
+            bool   done;
+            double startTime;   // when the first copy was handed out
+
+            TileJob(size_t _iFirst, size_t _jFirst, size_t _wide, size_t _high)
+                : iFirst(_iFirst)
+                , jFirst(_jFirst)
+                , wide(_wide)
+                , high(_high)
+                , copies(0)
+                , done(false)
+                , startTime(0.0)
+            {
+            }
+        };
+
+        typedef std::vector<TileJob> TileJobList;
+
+        // Hands out tiles to worker connections, each served by its own
+        // thread with blocking I/O, and collects their pixels into one
+        // oversampled image buffer.
+        class TileCoordinator
+        {
+        public:
+            TileCoordinator(
+                const std::string& _description,
+                const TileRenderOptions& _options,
+                ImageBuffer& _buffer,
+                TileRenderStats& _stats)
+                    : description(_description)
+                    , options(_options)
+                    , buffer(_buffer)
+                    , stats(_stats)
+                    , numDone(0)
+                    , doneSeconds(0.0)
+                    , numConnected(0)
+                    , listener(-1)
+            {
+            }
+
+            // Splits the image into tiles 'side' oversampled pixels square,
+            // smaller along the right and bottom edges.
+            void MakeTiles(size_t side)
+            {
+                for (size_t j=0; j < buffer.GetPixelsHigh(); j += side)
+                {
+                    const size_t high = std::min(side, buffer.GetPixelsHigh() - j);
+                    for (size_t i=0; i < buffer.GetPixelsWide(); i += side)
+                    {
+                        const size_t wide = std::min(side, buffer.GetPixelsWide() - i);
+                        pending.push_back(jobList.size());
+                        jobList.push_back(TileJob(i, j, wide, high));
+                    }
+                }
+                stats.numTiles = jobList.size();
+            }
+
+            // Starts a thread to serve the worker connected by 'fd'.
+            void AddWorker(int fd)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (numDone == jobList.size())
+                {
+                    close(fd);      // too late to help
+                    return;
+                }
+                ++numConnected;
+                fdList.push_back(fd);
+                threadList.push_back(std::thread(&TileCoordinator::ServeWorker, this, fd));
+            }
+
+            // Accepts outside workers at 'address' until Shutdown.
+            void Listen(const char *address)
+            {
+                listener = ListenAt(address);
+                acceptThread = std::thread(&TileCoordinator::AcceptWorkers, this);
+            }
+
+            // Waits for every tile to come back.  Returns false if every
+            // worker failed first and no more can connect.
+            bool Wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (numDone < jobList.size() && (numConnected > 0 || listener >= 0))
+                {
+                    changed.wait(lock);
+                }
+                return numDone == jobList.size();
+            }
+
+            // Hangs up on all workers and waits for their threads.
+            // A worker still tracing a duplicate tile finds its
+            // connection closed and quits.
+            void Shutdown()
+            {
+                if (listener >= 0)
+                {
+                    // Closing a listening socket does not wake a thread
+                    // blocked in accept; shutting it down does.
+                    shutdown(listener, SHUT_RDWR);
+                    acceptThread.join();
+                    close(listener);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    listener = -1;
+                }
+
+                std::vector<std::thread> joinList;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (std::vector<int>::const_iterator iter = fdList.begin(); iter != fdList.end(); ++iter)
+                    {
+                        shutdown(*iter, SHUT_RDWR);
+                    }
+                    joinList.swap(threadList);
+                }
+
+                for (std::vector<std::thread>::iterator iter = joinList.begin(); iter != joinList.end(); ++iter)
+                {
+                    iter->join();
+                }
+
+                for (std::vector<int>::const_iterator iter = fdList.begin(); iter != fdList.end(); ++iter)
+                {
+                    close(*iter);
+                }
+                fdList.clear();
+            }
+
+        private:
+            void AcceptWorkers()
+            {
+                for(;;)
+                {
+                    const int fd = accept(listener, NULL, NULL);
+                    if (fd >= 0)
+                    {
+                        DisableNagle(fd);
+                        AddWorker(fd);
+                    }
+                    else if (errno != EINTR && errno != ECONNABORTED)
+                    {
+                        return;     // Shutdown was called
+                    }
+                }
+            }
+
+            void ServeWorker(int fd)
+            {
+                LineReader reader(fd);
+                std::string line;
+
+                std::ostringstream header;
+                header << "scene " << description.size();
+                bool ok =
+                    WriteLine(fd, header.str()) &&
+                    WriteAll(fd, description.data(), description.size()) &&
+                    reader.ReadLine(line) &&
+                    (line == "ready");
+
+                if (ok)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++stats.numWorkers;
+                }
+                else
+                {
+                    ReportWorkerError(line);
+                }
+
+                size_t index;
+                while (ok && NextTile(index))
+                {
+                    const TileJob& job = jobList[index];    // only its 'copies', 'done', and 'startTime' change
+                    std::ostringstream request;
+                    request << "tile " << index << ' ' << job.iFirst << ' ' << job.jFirst << ' ' << job.wide << ' ' << job.high;
+                    std::ostringstream expected;
+                    expected << "tile " << index;
+
+                    ImageBuffer tile(job.wide, job.high, Color());
+                    ok =
+                        WriteLine(fd, request.str()) &&
+                        reader.ReadLine(line) &&
+                        (line == expected.str()) &&
+                        ReadTile(reader, tile);
+
+                    if (ok)
+                    {
+                        FinishTile(index, tile);
+                    }
+                    else
+                    {
+                        ReportWorkerError(line);
+                        AbandonTile(index);
+                    }
+                }
+
+                // Losing the connection after the last tile came in is
+                // just Shutdown hanging up on a worker tracing a copy.
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ok && numDone < jobList.size())
+                {
+                    ++stats.failedWorkers;
+                }
+                --numConnected;
+                changed.notify_all();
+            }
+
+            static void ReportWorkerError(const std::string& line)
+            {
+                if (line.compare(0, 6, "error ") == 0)
+                {
+                    fprintf(stderr, "Tile worker: %s\n", line.c_str() + 6);
+                }
+            }
+
+            static bool ReadTile(LineReader& reader, ImageBuffer& tile)
+            {
+                const size_t count = tile.GetPixelsWide() * tile.GetPixelsHigh();
+                std::vector<double> colorList(3 * count);
+                std::vector<unsigned char> flagList(count);
+                if (!reader.ReadBytes(&colorList[0], colorList.size() * sizeof(double)) ||
+                    !reader.ReadBytes(&flagList[0], flagList.size()))
+                {
+                    return false;
+                }
+
+                size_t k = 0;
+                for (size_t j=0; j < tile.GetPixelsHigh(); ++j)
+                {
+                    for (size_t i=0; i < tile.GetPixelsWide(); ++i)
+                    {
+                        PixelData& pixel = tile.Pixel(i, j);
+                        pixel.color = Color(colorList[3*k], colorList[3*k + 1], colorList[3*k + 2]);
+                        pixel.isAmbiguous = (flagList[k] != 0);
+                        ++k;
+                    }
+                }
+                return true;
+            }
+
+            // Picks the next tile for a worker: one never handed out or
+            // abandoned by a failed worker if there is any, otherwise a
+            // copy of a tile that is taking too long.  Waits while there
+            // is neither; returns false once all tiles are done.
+            bool NextTile(size_t& index)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                for(;;)
+                {
+                    if (numDone == jobList.size())
+                    {
+                        return false;
+                    }
+
+                    const double now = WallClockSeconds();
+                    if (!pending.empty())
+                    {
+                        index = pending.front();
+                        pending.pop_front();
+                        TileJob& job = jobList[index];
+                        if (job.copies == 0)
+                        {
+                            job.startTime = now;
+                        }
+                        ++job.copies;
+                        return true;
+                    }
+
+                    double limit = options.minSlowSeconds;
+                    if (numDone > 0)
+                    {
+                        const double slow = options.slowTileFactor * (doneSeconds / numDone);
+                        if (slow > limit)
+                        {
+                            limit = slow;
+                        }
+                    }
+
+                    for (size_t k=0; k < jobList.size(); ++k)
+                    {
+                        TileJob& job = jobList[k];
+                        if (!job.done && job.copies == 1 && now - job.startTime > limit)
+                        {
+                            ++job.copies;
+                            ++stats.duplicatedTiles;
+                            index = k;
+                            return true;
+                        }
+                    }
+
+                    // Wake up now and then to look for slow tiles.
+                    changed.wait_for(lock, std::chrono::milliseconds(50));
+                }
+            }
+
+            void FinishTile(size_t index, const ImageBuffer& tile)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                TileJob& job = jobList[index];
+                --job.copies;
+                if (job.done)
+                {
+                    ++stats.discardedTiles;
+                    return;
+                }
+
+                for (size_t j=0; j < job.high; ++j)
+                {
+                    for (size_t i=0; i < job.wide; ++i)
+                    {
+                        buffer.Pixel(job.iFirst + i, job.jFirst + j) = tile.Pixel(i, j);
+                    }
+                }
+                job.done = true;
+                ++numDone;
+                doneSeconds += WallClockSeconds() - job.startTime;
+                changed.notify_all();
+            }
+
+            void AbandonTile(size_t index)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                TileJob& job = jobList[index];
+                --job.copies;
+                if (!job.done && job.copies == 0)
+                {
+                    pending.push_front(index);
+                    ++stats.reassignedTiles;
+                    changed.notify_all();
+                }
+            }
+
+            const std::string& description;
+            const TileRenderOptions& options;
+            ImageBuffer& buffer;
+            TileRenderStats& stats;
+
+            std::mutex mutex;               // guards everything below
+            std::condition_variable changed;
+            TileJobList jobList;
+            std::deque<size_t> pending;     // tiles waiting for a worker
+            size_t numDone;
+            double doneSeconds;             // total time taken by finished tiles
+            size_t numConnected;
+            std::vector<int> fdList;
+            std::vector<std::thread> threadList;
+            int listener;
+            std::thread acceptThread;
+        };
+    }
+
+
+    void RenderTiled(
+        const std::string& description,
+        const TileRenderOptions& options,
+        RenderRequest& request,
+        std::vector<unsigned char>& rgba,
+        TileRenderStats& stats)
+    {
+        // The coordinator parses the description too: for the image
+        // size, to catch mistakes before starting any workers, and to
+        // finish the image at the end.
+        Scene scene;
+        ParseSceneDescription(description, scene, request);
+        if (options.tileSize == 0)
+        {
+            throw ImagerException("Tile size must be positive.");
+        }
+
+        // A worker hanging up must not terminate the coordinator.
+        signal(SIGPIPE, SIG_IGN);
+
+        // Fork the local workers before starting any threads.  Each
+        // child inherits the coordinator's ends of earlier workers'
+        // connections, which is harmless: a connection breaks when its
+        // worker's end is closed.
+        std::vector<int> localFdList;
+        std::vector<pid_t> childList;
+        for (size_t w=0; w < options.numLocalWorkers; ++w)
+        {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+            {
+                throw ImagerException("Cannot create worker socket pair.");
+            }
+
+            fflush(stdout);     // or the child would print buffered output again
+            const pid_t pid = fork();
+            if (pid < 0)
+            {
+                close(pair[0]);
+                close(pair[1]);
+                throw ImagerException("Cannot fork tile worker.");
+            }
+
+            if (pid == 0)
+            {
+                close(pair[0]);
+                if (w == 0)
+                {
+                    RunTileWorker(pair[1], options.crashAfterTiles, options.stallSeconds);
+                }
+                else
+                {
+                    RunTileWorker(pair[1]);
+                }
+                _exit(0);
+            }
+
+            close(pair[1]);
+            localFdList.push_back(pair[0]);
+            childList.push_back(pid);
+        }
+
+        const size_t aa = request.antiAliasFactor;
+        ImageBuffer buffer(aa * request.pixelsWide, aa * request.pixelsHigh, Color());
+        stats = TileRenderStats();
+
+        bool complete;
+        {
+            TileCoordinator coordinator(description, options, buffer, stats);
+            coordinator.MakeTiles(aa * options.tileSize);
+            for (std::vector<int>::const_iterator iter = localFdList.begin(); iter != localFdList.end(); ++iter)
+            {
+                coordinator.AddWorker(*iter);
+            }
+            if (!options.listenAddress.empty())
+            {
+                coordinator.Listen(options.listenAddress.c_str());
+            }
+
+            complete = coordinator.Wait();
+            coordinator.Shutdown();
+        }
+
+        for (std::vector<pid_t>::const_iterator iter = childList.begin(); iter != childList.end(); ++iter)
+        {
+            waitpid(*iter, NULL, 0);
+        }
+
+        if (!complete)
+        {
+            throw ImagerException("All tile workers failed.");
+        }
+
+        rgba = scene.FinishTiledImage(buffer, request.pixelsWide, request.pixelsHigh, aa);
+    }
+
+
+    void RunTileWorker(int fd, size_t crashAfterTiles, double stallSeconds)
+    {
+        LineReader reader(fd);
+        RenderRequest request;
+        Scene *scene = NULL;
+        size_t numTiles = 0;
+        std::string line;
+        while (reader.ReadLine(line))
+        {
+            std::istringstream input(line);
+            std::string keyword;
+            input >> keyword;
+
+            if (keyword == "scene")
+            {
+                size_t size = 0;
+                input >> size;
+                std::string description(size, '\0');
+                if (input.fail() || (size > 0 && !reader.ReadBytes(&description[0], size)))
+                {
+                    break;
+                }
+
+                delete scene;
+                scene = new Scene;
+                request = RenderRequest();
+                try
+                {
+                    ParseSceneDescription(description, *scene, request);
+                    scene->PrepareLights();
+                }
+                catch (const ImagerException& ex)
+                {
+                    WriteLine(fd, std::string("error ") + ex.GetMessage());
+                    break;
+                }
+
+                if (!WriteLine(fd, "ready"))
+                {
+                    break;
+                }
+            }
+            else if (keyword == "tile" && scene != NULL)
+            {
+                size_t index, iFirst, jFirst, wide, high;
+                input >> index >> iFirst >> jFirst >> wide >> high;
+                if (input.fail() || wide == 0 || high == 0)
+                {
+                    WriteLine(fd, "error Malformed tile request.");
+                    break;
+                }
+
+                if (crashAfterTiles > 0 && numTiles == crashAfterTiles)
+                {
+                    break;      // pretend to die in the middle of a tile
+                }
+                ++numTiles;
+                if (stallSeconds > 0.0)
+                {
+                    usleep(static_cast<useconds_t>(stallSeconds * 1.0e+6));
+                }
+
+                ImageBuffer tile(wide, high, Color());
+                try
+                {
+                    scene->RenderTile(
+                        request.pixelsWide,
+                        request.pixelsHigh,
+                        request.zoom,
+                        request.antiAliasFactor,
+                        iFirst,
+                        jFirst,
+                        tile);
+                }
+                catch (const ImagerException& ex)
+                {
+                    WriteLine(fd, std::string("error ") + ex.GetMessage());
+                    break;
+                }
+
+                const size_t count = wide * high;
+                std::vector<double> colorList;
+                std::vector<unsigned char> flagList;
+                colorList.reserve(3 * count);
+                flagList.reserve(count);
+                for (size_t j=0; j < high; ++j)
+                {
+                    for (size_t i=0; i < wide; ++i)
+                    {
+                        const PixelData& pixel = tile.Pixel(i, j);
+                        colorList.push_back(pixel.color.red);
+                        colorList.push_back(pixel.color.green);
+                        colorList.push_back(pixel.color.blue);
+                        flagList.push_back(pixel.isAmbiguous ? 1 : 0);
+                    }
+                }
+
+                std::ostringstream reply;
+                reply << "tile " << index;
+                if (!WriteLine(fd, reply.str()) ||
+                    !WriteAll(fd, &colorList[0], colorList.size() * sizeof(double)) ||
+                    !WriteAll(fd, &flagList[0], flagList.size()))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                WriteLine(fd, "error Unexpected request: " + line);
+                break;
+            }
+        }
+
+        delete scene;
+        close(fd);
+    }
+
+
+    void ConnectTileWorker(const char *address)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        RunTileWorker(ConnectTo(address));
+    }
+}
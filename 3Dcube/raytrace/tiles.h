@@ -0,0 +1,112 @@
+/*
+    tiles.h
+
+    Renders one image with several worker processes.  A coordinator
+    splits the oversampled image into square tiles and hands them out,
+    one at a time, to workers that each build their own copy of the
+    scene from a scene description (see describe.h).  The coordinator
+    can fork workers itself, and it can also listen on a socket for
+    workers started by hand anywhere that can reach it.
+
+    Every message over a worker's connection begins with a text line.
+    The coordinator sends
+
+        scene <byteCount>                   followed by a scene description
+        tile <id> <i> <j> <wide> <high>     trace this oversampled rectangle
+
+    and the worker answers
+
+        ready                               once it has built the scene
+        tile <id>                           followed by the tile's pixels
+        error <message>
+
+    A tile's pixels are wide*high colors, row by row, each as three
+    doubles (red, green, blue) in the sender's byte order, followed by
+    wide*high bytes that are 1 for ambiguous pixels and 0 otherwise.
+    Workers therefore need the same floating-point format and byte
+    order as the coordinator.
+
+    A worker whose connection breaks has its tile handed to another.
+    A tile that takes much longer than the tiles finished so far is
+    also handed to an idle worker, and whichever copy comes back first
+    is kept.  Once every tile is in, the coordinator heals ambiguous
+    pixels across tile edges and converts the image exactly as
+    Scene::RenderImage would, so the result is the same image.
+*/
+
+#ifndef __DDC_TILES_H
+#define __DDC_TILES_H
+
+#include <string>
+#include <vector>
+#include "describe.h"
+
+namespace Imager
+{
+    struct TileRenderOptions
+    {
+        size_t tileSize;            // side of a tile in image (not oversampled) pixels
+        size_t numLocalWorkers;     // worker processes to fork
+        std::string listenAddress;  // if not empty, where outside workers may connect
+        double slowTileFactor;      // a tile this many times slower than average is duplicated...
+        double minSlowSeconds;      // ...once it has taken at least this long
+
+        // For testing recovery: the first local worker hangs up after
+        // this many tiles (0 for never), and waits this long before
+        // tracing each tile.
+        size_t crashAfterTiles;
+        double stallSeconds;
+
+        TileRenderOptions()
+            : tileSize(32)
+            , numLocalWorkers(2)
+            , slowTileFactor(4.0)
+            , minSlowSeconds(0.5)
+            , crashAfterTiles(0)
+            , stallSeconds(0.0)
+        {
+        }
+    };
+
+    struct TileRenderStats
+    {
+        size_t numTiles;
+        size_t numWorkers;          // workers that built the scene
+        size_t failedWorkers;       // workers whose connection broke
+        size_t reassignedTiles;     // tiles handed out again after a failure
+        size_t duplicatedTiles;     // slow tiles handed to a second worker
+        size_t discardedTiles;      // duplicate results that came back second
+
+        TileRenderStats()
+            : numTiles(0)
+            , numWorkers(0)
+            , failedWorkers(0)
+            , reassignedTiles(0)
+            , duplicatedTiles(0)
+            , discardedTiles(0)
+        {
+        }
+    };
+
+    // Renders a scene description with worker processes into 'rgba',
+    // 4 bytes per pixel as from Scene::RenderImage, and fills in
+    // 'request' from the description.  Throws ImagerException if the
+    // description is malformed, or if every worker fails before the
+    // image is done and no more can connect.
+    void RenderTiled(
+        const std::string& description,
+        const TileRenderOptions& options,
+        RenderRequest& request,
+        std::vector<unsigned char>& rgba,
+        TileRenderStats& stats);
+
+    // Serves a coordinator over 'fd' until it hangs up.  The last two
+    // parameters are the testing options of TileRenderOptions.
+    void RunTileWorker(int fd, size_t crashAfterTiles = 0, double stallSeconds = 0.0);
+
+    // Connects to a coordinator listening at 'address', either a Unix
+    // domain socket path or host:port for TCP, and serves it.
+    void ConnectTileWorker(const char *address);
+}
+
+#endif // __DDC_TILES_H
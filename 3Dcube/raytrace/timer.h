@@ -0,0 +1,23 @@
+/*
+    timer.h
+
+    Wall-clock time stamps for measuring how long rendering steps take.
+*/
+
+#ifndef __DDC_TIMER_H
+#define __DDC_TIMER_H
+
+#include <sys/time.h>
+
+namespace Imager
+{
+    // Returns the current time in seconds since an arbitrary epoch.
+    inline double WallClockSeconds()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + (tv.tv_usec / 1.0e+6);
+    }
+}
+
+#endif // __DDC_TIMER_H
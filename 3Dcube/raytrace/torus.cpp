@@ -0,0 +1,136 @@
+/*
+    torus.cpp
+
+    Implements class Torus, declared in imager.h.
+*/
+
+#include <cmath>
+#include "algebra.h"
+#include "imager.h"
+#include "fingerprint.h"
+
+namespace Imager
+{
+    void Torus::RayQuartic(
+        const Vector& vantage,
+        const Vector& direction,
+        double& a, double& b, double& c, double& d, double& e) const
+    {
+        // A point P is on the surface when
+        //     (P.P + R^2 - r^2)^2 = 4 R^2 (Px^2 + Py^2).
+        // Substituting P = E + uD for the vantage E and direction D
+        // and collecting powers of u gives the quartic below.
+        const Vector& E = vantage;
+        const Vector& D = direction;
+        const double G = DotProduct(D, D);
+        const double H = 2.0 * DotProduct(E, D);
+        const double I = DotProduct(E, E) + R*R - r*r;
+        const double J = 4.0 * R*R * (D.x*D.x + D.y*D.y);
+        const double K = 8.0 * R*R * (E.x*D.x + E.y*D.y);
+        const double L = 4.0 * R*R * (E.x*E.x + E.y*E.y);
+
+        a = G*G;
+        b = 2.0*G*H;
+        c = 2.0*G*I + H*H - J;
+        d = 2.0*H*I - K;
+        e = I*I - L;
+    }
+
+    Vector Torus::SurfaceNormal(const Vector& point) const
+    {
+        // The gradient of (P.P + R^2 - r^2)^2 - 4 R^2 (Px^2 + Py^2),
+        // divided by 4, points away from the tube.
+        const double S = point.MagnitudeSquared() + R*R - r*r;
+        const double w = S - 2.0*R*R;
+        return Vector(point.x * w, point.y * w, point.z * S).UnitVector();
+    }
+
+    void Torus::ObjectSpace_AppendAllIntersections(
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList) const
+    {
+        double a, b, c, d, e;
+        RayQuartic(vantage, direction, a, b, c, d, e);
+
+        double u[4];
+        const int numRoots = Algebra::SolveQuarticEquation(a, b, c, d, e, u);
+        for (int i=0; i < numRoots; ++i)
+        {
+            if (u[i] > EPSILON)
+            {
+                const Vector displacement = u[i] * direction;
+
+                Intersection intersection;
+                intersection.point = vantage + displacement;
+                intersection.distanceSquared = displacement.MagnitudeSquared();
+                intersection.surfaceNormal = SurfaceNormal(intersection.point);
+                intersection.solid = this;
+                intersectionList.push_back(intersection);
+            }
+        }
+    }
+
+    bool Torus::ObjectSpace_Contains(const Vector& point) const
+    {
+        // Distance from the circle through the center of the tube.
+        const double radial = sqrt(point.x*point.x + point.y*point.y) - R;
+        return sqrt(radial*radial + point.z*point.z) <= r + EPSILON;
+    }
+
+    void Torus::ClosestHitEach(
+        const Vector& vantage,
+        const Vector* directionArray,
+        size_t count,
+        double* hitArray) const
+    {
+        // Rays are taken a chunk at a time so the coefficients and
+        // roots can live on the stack.
+        enum { CHUNK = 64 };
+        double a[CHUNK], b[CHUNK], c[CHUNK], d[CHUNK], e[CHUNK];
+        double roots[4*CHUNK];
+        int numRoots[CHUNK];
+
+        const Vector objectVantage = ObjectPointFromCameraPoint(vantage);
+        for (size_t first = 0; first < count; first += CHUNK)
+        {
+            const size_t chunk = (count - first < CHUNK) ? (count - first) : CHUNK;
+            for (size_t k=0; k < chunk; ++k)
+            {
+                RayQuartic(
+                    objectVantage,
+                    ObjectDirFromCameraDir(directionArray[first + k]),
+                    a[k], b[k], c[k], d[k], e[k]);
+            }
+
+            Algebra::SolveQuarticEquations(chunk, a, b, c, d, e, roots, numRoots);
+
+            // The roots come back in ascending order, padded with HUGE_VAL,
+            // so the first one in front of the vantage is the closest hit.
+            for (size_t k=0; k < chunk; ++k)
+            {
+                const double* u = &roots[4*k];
+                int i = 0;
+                while (i < 3 && u[i] <= EPSILON)
+                {
+                    ++i;
+                }
+                hitArray[first + k] = (u[i] > EPSILON) ? u[i] : HUGE_VAL;
+            }
+        }
+    }
+
+    bool Torus::AppendFingerprint(Fingerprint& fingerprint) const
+    {
+        Vector rDir, sDir, tDir;
+        GetOrientation(rDir, sDir, tDir);
+
+        AppendCommonFingerprint(fingerprint);
+        fingerprint.AddVector(rDir);
+        fingerprint.AddVector(sDir);
+        fingerprint.AddVector(tDir);
+        fingerprint.AddDouble(R);
+        fingerprint.AddDouble(r);
+        return true;
+    }
+}